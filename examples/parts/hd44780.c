@@ -267,8 +267,8 @@ hd44780_process_read(
 	// now send the prepared output pins to send as IRQs
 	if (done) {
 		avr_raise_irq(b->irq + IRQ_HD44780_ALL, b->readpins >> 4);
-		for (int i = four ? 4 : 0; i < 8; i++)
-			avr_raise_irq(b->irq + IRQ_HD44780_D0 + i, (b->readpins >> i) & 1);
+		avr_raise_irq_mask(b->irq + IRQ_HD44780_D0,
+				b->pinstate >> IRQ_HD44780_D0, b->readpins, four ? 0xf0 : 0xff);
 	}
 	return delay;
 }
@@ -77,6 +77,21 @@
 # define MCU_STATUS_REG MCUSR
 #endif
 
+/*
+ * Optional instructions the core lacks, the decoder traps them as invalid.
+ * The jumps and extended loads depend on the flash size; cores without the
+ * hardware multiplier define SIM_CORE_NO_MUL before including this file.
+ */
+#ifdef SIM_CORE_NO_MUL
+# define _ISA_MUL_HELPER AVR_ISA_MUL
+#else
+# define _ISA_MUL_HELPER 0
+#endif
+#define _ISA_HELPER (_ISA_MUL_HELPER | \
+	(FLASHEND <= 0x1fff ? AVR_ISA_JMP : 0) | \
+	(FLASHEND <= 0xffff ? AVR_ISA_ELPM : 0) | \
+	(FLASHEND <= 0x1ffff ? AVR_ISA_EIND : 0))
+
 #ifdef SIGNATURE_0
 #define DEFAULT_CORE(_vector_size) \
 	.ioend  = RAMSTART - 1, \
@@ -84,6 +99,7 @@
 	.flashend = FLASHEND, \
 	.e2end = E2END, \
 	.vector_size = _vector_size, \
+	.isa_missing = _ISA_HELPER, \
 	.fuse = _FUSE_HELPER, \
 	.signature = { SIGNATURE_0,SIGNATURE_1,SIGNATURE_2 }, \
 	.lockbits = 0xFF, \
@@ -100,6 +116,7 @@
 	.ramend = RAMEND, \
 	.flashend = FLASHEND, \
 	.e2end = E2END, \
-	.vector_size = _vector_size
+	.vector_size = _vector_size, \
+	.isa_missing = _ISA_HELPER
 #endif
 #endif /* __SIM_CORE_DECLARE_H__ */
@@ -33,6 +33,7 @@
 #define __ASSEMBLER__
 #include "avr/iotn13.h"
 
+#define SIM_CORE_NO_MUL
 #include "sim_core_declare.h"
 
 static void init(struct avr_t * avr);
@@ -59,6 +60,7 @@ static const struct mcu_t {
 		.flashend = FLASHEND,
 		.e2end = E2END,
 		.vector_size = 2,
+		.isa_missing = _ISA_HELPER,
 // Disable signature when using an old avr toolchain
 #ifdef SIGNATURE_0
 		.signature = { SIGNATURE_0,SIGNATURE_1,SIGNATURE_2 },
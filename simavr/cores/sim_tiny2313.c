@@ -34,6 +34,7 @@ static void reset(struct avr_t * avr);
 #define __ASSEMBLER__
 #include "avr/iotn2313.h"
 
+#define SIM_CORE_NO_MUL
 #include "sim_core_declare.h"
 
 /*
@@ -24,6 +24,7 @@
 #ifndef __SIM_TINYX5_H__
 #define __SIM_TINYX5_H__
 
+#define SIM_CORE_NO_MUL
 #include "sim_core_declare.h"
 #include "avr_eeprom.h"
 #include "avr_watchdog.h"
@@ -39,6 +39,7 @@ void usb162_reset(struct avr_t * avr);
 #define __ASSEMBLER__
 #include "avr/iousb162.h"
 
+#define SIM_CORE_NO_MUL
 #include "sim_core_declare.h"
 
 const struct mcu_t {
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "avr_acomp.h"
 #include "avr_timer.h"
+#include "sim_snapshot.h"
 
 static uint8_t
 avr_acomp_get_state(
@@ -219,10 +220,22 @@ static const char * irq_names[ACOMP_IRQ_COUNT] = {
 	[ACOMP_IRQ_OUT] = ">out"
 };
 
+static void
+avr_acomp_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_acomp_t * p = (avr_acomp_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->adc_values);
+	AVR_SNAPSHOT_FIELD(s, p->ain_values);
+}
+
 static avr_io_t _io = {
 	.kind = "ac",
 	.reset = avr_acomp_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_acomp_snapshot,
 };
 
 void
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "sim_time.h"
 #include "avr_adc.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t
 avr_adc_int_raise(
@@ -329,10 +330,25 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_OUT_TRIGGER] = ">trigger_out",
 };
 
+static void
+avr_adc_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_adc_t * p = (avr_adc_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->adts_mode);
+	AVR_SNAPSHOT_FIELD(s, p->adc_values);
+	AVR_SNAPSHOT_FIELD(s, p->temp);
+	AVR_SNAPSHOT_FIELD(s, p->first);
+	AVR_SNAPSHOT_FIELD(s, p->read_status);
+}
+
 static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_adc_snapshot,
 };
 
 void avr_adc_init(avr_t * avr, avr_adc_t * p)
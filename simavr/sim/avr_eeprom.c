@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -68,6 +69,7 @@ static void avr_eeprom_write(avr_t * avr, avr_io_addr_t addr, uint8_t v, void *
 	if (eempe && avr_regbit_get(avr, p->eepe)) {	// write operation
 		//	printf("eeprom write %04x <- %02x\n", addr, avr->data[p->r_eedr]);
 		p->eeprom[ee_addr] = avr->data[p->r_eedr];
+		avr_snapshot_dirty(p->dirty, ee_addr, 1);
 		// Automatically clears that bit (?)
 		avr_regbit_clear(avr, p->eempe);
 
@@ -97,6 +99,7 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 				return -2;
 			}
 			memcpy(p->eeprom + desc->offset, desc->ee, desc->size);
+			avr_snapshot_dirty(p->dirty, desc->offset, desc->size);
 			AVR_LOG(port->avr, LOG_TRACE, "EEPROM: %s: AVR_IOCTL_EEPROM_SET Loaded %d at offset %d\n",
 					__FUNCTION__, desc->size, desc->offset);
 		}	break;
@@ -123,12 +126,25 @@ static void avr_eeprom_dealloc(struct avr_io_t * port)
 	if (p->eeprom)
 		free(p->eeprom);
 	p->eeprom = NULL;
+	free(p->dirty);
+	p->dirty = NULL;
+}
+
+static void
+avr_eeprom_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)io;
+
+	avr_snapshot_memory(s, p->eeprom, p->size, &p->dirty);
 }
 
 static	avr_io_t	_io = {
 	.kind = "eeprom",
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.snapshot = avr_eeprom_snapshot,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
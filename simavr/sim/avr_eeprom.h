@@ -32,6 +32,7 @@ typedef struct avr_eeprom_t {
 	avr_io_t	io;
 
 	uint8_t *	eeprom;	// actual bytes
+	uint8_t *	dirty;	// chunks written, for incremental snapshots
 	uint16_t	size;	// size for this MCU
 	
 	uint8_t r_eearh;
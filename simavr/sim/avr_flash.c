@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -73,11 +74,15 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		if (avr_regbit_get(avr, p->pgers)) {
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_decode_invalidate(avr, z, p->spm_pagesize);
+			avr->flash_written = 1;
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
 			z &= ~(p->spm_pagesize - 1);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_decode_invalidate(avr, z, p->spm_pagesize);
+			avr->flash_written = 1;
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
 				avr->flash[z++] = p->tmppage[i];
 				avr->flash[z++] = p->tmppage[i] >> 8;
@@ -120,11 +125,23 @@ avr_flash_dealloc(struct avr_io_t * port)
 		free(p->tmppage_used);
 }
 
+static void
+avr_flash_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_flash_t * p = (avr_flash_t *)io;
+
+	avr_snapshot_field(s, p->tmppage, p->spm_pagesize);
+	avr_snapshot_field(s, p->tmppage_used, p->spm_pagesize / 2);
+}
+
 static	avr_io_t	_io = {
 	.kind = "flash",
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.snapshot = avr_flash_snapshot,
 };
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p)
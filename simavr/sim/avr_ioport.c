@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
 #define D(_w)
 
@@ -48,18 +49,18 @@ avr_ioport_update_irqs(
 {
 	avr_t * avr = p->io.avr;
 	uint8_t ddr = avr->data[p->r_ddr];
+	uint8_t port = avr->data[p->r_port];
+	uint8_t pull = p->external.pull_mask & ~ddr;
 	// Set the PORT value if the pin is marked as output
 	// otherwise, if there is an 'external' pullup, set it
 	// otherwise, if the PORT pin was 1 to indicate an
 	// internal pullup, set that.
-	for (int i = 0; i < 8; i++) {
-		if (ddr & (1 << i))
-			avr_raise_irq(p->io.irq + i, (avr->data[p->r_port] >> i) & 1);
-		else if (p->external.pull_mask & (1 << i))
-			avr_raise_irq(p->io.irq + i, (p->external.pull_value >> i) & 1);
-		else if ((avr->data[p->r_port] >> i) & 1)
-			avr_raise_irq(p->io.irq + i, 1);
-	}
+	uint8_t raised = 0;
+	for (int i = 0; i < 8; i++)
+		raised |= (p->io.irq[i].value & 1) << i;
+	avr_raise_irq_mask(p->io.irq, raised,
+			(port & ddr) | (p->external.pull_value & pull) | (port & ~ddr & ~pull),
+			ddr | pull | port);
 	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (avr->data[p->r_port] & ddr);
 	pin = (pin & ~p->external.pull_mask) | p->external.pull_value;
 	avr_raise_irq(p->io.irq + IOPORT_IRQ_PIN_ALL, pin);
@@ -68,9 +69,9 @@ avr_ioport_update_irqs(
 	// those as well
 	avr_io_addr_t port_io = AVR_DATA_TO_IO(p->r_port);
 	if (avr->io[port_io].irq) {
+		uint8_t old = avr->io[port_io].irq[AVR_IOMEM_IRQ_ALL].value;
 		avr_raise_irq(avr->io[port_io].irq + AVR_IOMEM_IRQ_ALL, avr->data[p->r_port]);
-		for (int i = 0; i < 8; i++)
-			avr_raise_irq(avr->io[port_io].irq + i, (avr->data[p->r_port] >> i) & 1);
+		avr_raise_irq_mask(avr->io[port_io].irq, old, avr->data[p->r_port], 0xff);
  	}
 }
 
@@ -258,11 +259,22 @@ static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_REG_PIN] = "8>pin",
 };
 
+static void
+avr_ioport_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_ioport_t * p = (avr_ioport_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->external);
+}
+
 static	avr_io_t	_io = {
 	.kind = "port",
 	.reset = avr_ioport_reset,
 	.ioctl = avr_ioport_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_ioport_snapshot,
 };
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include "avr_spi.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -99,10 +100,21 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_OUTPUT] = "8<out",
 };
 
+static void
+avr_spi_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_spi_t * p = (avr_spi_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->input_data_register);
+}
+
 static	avr_io_t	_io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_spi_snapshot,
 };
 
 void avr_spi_init(avr_t * avr, avr_spi_t * p)
@@ -30,6 +30,7 @@
 #include "avr_timer.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
+#include "sim_snapshot.h"
 
 /*
  * The timers are /always/ 16 bits here, if the higher byte register
@@ -863,11 +864,34 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_COMP + 2] = ">compc",
 };
 
+static void
+avr_timer_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_timer_t * p = (avr_timer_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->mode);
+	AVR_SNAPSHOT_FIELD(s, p->wgm_op_mode_kind);
+	AVR_SNAPSHOT_FIELD(s, p->wgm_op_mode_size);
+	AVR_SNAPSHOT_FIELD(s, p->cs_div_value);
+	AVR_SNAPSHOT_FIELD(s, p->ext_clock_flags);
+	AVR_SNAPSHOT_FIELD(s, p->ext_clock);
+	for (int i = 0; i < AVR_TIMER_COMP_COUNT; i++)
+		AVR_SNAPSHOT_FIELD(s, p->comp[i].comp_cycles);
+	AVR_SNAPSHOT_FIELD(s, p->tov_cycles);
+	AVR_SNAPSHOT_FIELD(s, p->tov_cycles_fract);
+	AVR_SNAPSHOT_FIELD(s, p->phase_accumulator);
+	AVR_SNAPSHOT_FIELD(s, p->tov_base);
+	AVR_SNAPSHOT_FIELD(s, p->tov_top);
+}
+
 static	avr_io_t	_io = {
 	.kind = "timer",
 	.irq_names = irq_names,
 	.reset = avr_timer_reset,
 	.ioctl = avr_timer_ioctl,
+	.snapshot = avr_timer_snapshot,
 };
 
 void
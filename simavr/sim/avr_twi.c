@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_twi.h"
+#include "sim_snapshot.h"
 
 /*
  * This block respectfully nicked straight out from the Atmel sample
@@ -483,10 +484,23 @@ static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_STATUS] = "8>status",
 };
 
+static void
+avr_twi_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_twi_t * p = (avr_twi_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->state);
+	AVR_SNAPSHOT_FIELD(s, p->peer_addr);
+	AVR_SNAPSHOT_FIELD(s, p->next_twstate);
+}
+
 static	avr_io_t	_io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
 	.irq_names = irq_names,
+	.snapshot = avr_twi_snapshot,
 };
 
 void avr_twi_init(avr_t * avr, avr_twi_t * p)
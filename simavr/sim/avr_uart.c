@@ -39,6 +39,7 @@
 #include "sim_hex.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
+#include "sim_snapshot.h"
 
 //#define TRACE(_w) _w
 #ifndef TRACE
@@ -498,11 +499,26 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
+static void
+avr_uart_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+
+	AVR_SNAPSHOT_FIELD(s, p->input);
+	AVR_SNAPSHOT_FIELD(s, p->tx_cnt);
+	AVR_SNAPSHOT_FIELD(s, p->rx_cnt);
+	AVR_SNAPSHOT_FIELD(s, p->cycles_per_byte);
+	AVR_SNAPSHOT_FIELD(s, p->rxc_raise_time);
+}
+
 static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_uart_snapshot,
 };
 
 void
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_snapshot.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -52,6 +53,7 @@ static avr_cycle_count_t avr_watchdog_timer(
 		 * the previous callback can be restored and safely resume.
 		 */
 		avr->run = avr_watchdog_run_callback_software_reset;
+		avr_raise_irq(p->io.irq + WATCHDOG_IRQ_RESET, 1);
 	}
 
 	return 0;
@@ -211,10 +213,39 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static void
+avr_watchdog_snapshot(
+		struct avr_io_t * io,
+		struct avr_snapshot_t * s)
+{
+	avr_watchdog_t * p = (avr_watchdog_t *)io;
+	avr_t * avr = p->io.avr;
+	// what runs the avr, once any reset due now is done
+	avr_run_t run = avr->run == avr_watchdog_run_callback_software_reset ?
+			p->reset_context.avr_run : avr->run;
+
+	AVR_SNAPSHOT_FIELD(s, p->cycle_count);
+	AVR_SNAPSHOT_FIELD(s, p->reset_context);
+	// a reset that was due then is due again, one due since is not
+	if (s->restoring) {
+		if (p->reset_context.wdrf) {
+			p->reset_context.avr_run = run;
+			avr->run = avr_watchdog_run_callback_software_reset;
+		} else
+			avr->run = run;
+	}
+}
+
+static const char * irq_names[WATCHDOG_IRQ_COUNT] = {
+	[WATCHDOG_IRQ_RESET] = ">reset",
+};
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.snapshot = avr_watchdog_snapshot,
+	.irq_names = irq_names,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
@@ -223,6 +254,7 @@ void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->watchdog);
+	avr_io_setirqs(&p->io, AVR_IOCTL_WATCHDOG_GETIRQ, WATCHDOG_IRQ_COUNT, NULL);
 
 	avr_register_io_write(avr, p->wdce.reg, avr_watchdog_write, p);
 
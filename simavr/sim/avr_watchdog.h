@@ -29,6 +29,13 @@ extern "C" {
 
 #include "sim_avr.h"
 
+enum {
+	WATCHDOG_IRQ_RESET = 0,	// raised when the watchdog resets the avr
+	WATCHDOG_IRQ_COUNT
+};
+
+#define AVR_IOCTL_WATCHDOG_GETIRQ	AVR_IOCTL_DEF('w','d','t','i')
+
 typedef struct avr_watchdog_t {
 	avr_io_t	io;
 
@@ -28,7 +28,11 @@
 #include "sim_elf.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_jit.h"
 #include "sim_hex.h"
+#include "sim_lcov.h"
+#include "sim_profile.h"
+#include "sim_trace.h"
 #include "sim_vcd_file.h"
 
 #include "sim_core_decl.h"
@@ -44,16 +48,28 @@ display_usage(
 			"       [--help|-h]         Display this usage message and exit\n"
 			"       [--trace, -t]       Run full scale decoder trace\n"
 			"       [-ti <vector>]      Add traces for IRQ vector <vector>\n"
+			"       [--trace-file <file>] Record every instruction to a binary trace\n"
+			"                           file, to print with run_avr_trace_dump\n"
 			"       [--gdb|-g [<port>]] Listen for gdb connection on <port> (default 1234)\n"
+			"       [--jit]             Translate hot code to host code (x86-64 only)\n"
+			"       [--jit-cache <MB>]  Size of the translated code cache (default %d)\n"
+			"       [--speed[=]max|realtime|<factor>]\n"
+			"                           Pace of simulated time when sleeping: as fast\n"
+			"                           as possible, real time (default), or scaled\n"
 			"       [-ff <.hex file>]   Load next .hex file as flash\n"
 			"       [-ee <.hex file>]   Load next .hex file as eeprom\n"
+			"       [--lcov <file>]     Write the code coverage as an lcov tracefile\n"
+			"                           (the ELF file needs debug information)\n"
+			"       [--profile <file>]  Write the cycles of each call stack, folded for\n"
+			"                           flamegraph.pl, and a table by function to stderr\n"
 			"       [--input|-i <file>] A vcd file to use as input signals\n"
 			"       [--output|-o <file>] A vcd file to save the traced signals\n"
 			"       [--add-trace|-at <name=kind@addr/mask>] Add signal to be traced\n"
 			"       [-v]                Raise verbosity level\n"
 			"                           (can be passed more than once)\n"
 			"       <firmware>          A .hex or an ELF file. ELF files are\n"
-			"                           prefered, and can include debugging syms\n");
+			"                           prefered, and can include debugging syms\n",
+			AVR_JIT_DEFAULT_CACHE_MB);
 	exit(1);
 }
 
@@ -70,16 +86,14 @@ list_cores()
 	exit(1);
 }
 
-static avr_t * avr = NULL;
+// the main loop terminates the avr when it sees this
+static volatile sig_atomic_t signal_caught = 0;
 
 static void
 sig_int(
 		int sign)
 {
-	printf("signal caught, simavr terminating\n");
-	if (avr)
-		avr_terminate(avr);
-	exit(0);
+	signal_caught = 1;
 }
 
 int
@@ -93,11 +107,18 @@ main(
 	int gdb = 0;
 	int log = 1;
 	int port = 1234;
+	int jit = 0;
+	uint32_t jit_cache = 0;
+	int time_policy = AVR_TIME_REALTIME;
+	double time_scale = 1;
 	char name[24] = "";
 	uint32_t loadBase = AVR_SEGMENT_OFFSET_FLASH;
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
 	const char *vcd_input = NULL;
+	const char *lcov = NULL;
+	const char *profile = NULL;
+	const char *trace_file = NULL;
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
@@ -194,6 +215,55 @@ main(
 			gdb++;
 			if (pi < (argc-2) && argv[pi+1][0] != '-' )
 				port = atoi(argv[++pi]);
+		} else if (!strcmp(argv[pi], "--jit")) {
+			jit++;
+		} else if (!strcmp(argv[pi], "--jit-cache")) {
+			if (pi < argc-1) {
+				jit++;
+				jit_cache = atoi(argv[++pi]);
+			} else {
+				fprintf(stderr, "%s: missing mandatory argument for %s.\n", argv[0], argv[pi]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[pi], "--lcov")) {
+			if (pi < argc-1)
+				lcov = argv[++pi];
+			else {
+				fprintf(stderr, "%s: missing mandatory argument for %s.\n", argv[0], argv[pi]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[pi], "--trace-file")) {
+			if (pi < argc-1)
+				trace_file = argv[++pi];
+			else {
+				fprintf(stderr, "%s: missing mandatory argument for %s.\n", argv[0], argv[pi]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[pi], "--profile")) {
+			if (pi < argc-1)
+				profile = argv[++pi];
+			else {
+				fprintf(stderr, "%s: missing mandatory argument for %s.\n", argv[0], argv[pi]);
+				exit(1);
+			}
+		} else if (!strcmp(argv[pi], "--speed") || !strncmp(argv[pi], "--speed=", 8)) {
+			const char * speed = argv[pi][7] == '=' ? argv[pi] + 8 :
+					pi < argc-1 ? argv[++pi] : NULL;
+			if (speed) {
+				if (!strcmp(speed, "max"))
+					time_policy = AVR_TIME_MAX;
+				else if (!strcmp(speed, "realtime"))
+					time_policy = AVR_TIME_REALTIME;
+				else if ((time_scale = atof(speed)) > 0)
+					time_policy = AVR_TIME_SCALED;
+				else {
+					fprintf(stderr, "%s: invalid speed '%s'.\n", argv[0], speed);
+					exit(1);
+				}
+			} else {
+				fprintf(stderr, "%s: missing mandatory argument for %s.\n", argv[0], argv[pi]);
+				exit(1);
+			}
 		} else if (!strcmp(argv[pi], "-v")) {
 			log++;
 		} else if (!strcmp(argv[pi], "-ee")) {
@@ -245,7 +315,7 @@ main(
 	if (f_cpu)
 		f.frequency = f_cpu;
 
-	avr = avr_make_mcu_by_name(f.mmcu);
+	avr_t * avr = avr_make_mcu_by_name(f.mmcu);
 	if (!avr) {
 		fprintf(stderr, "%s: AVR '%s' not known\n", argv[0], f.mmcu);
 		exit(1);
@@ -253,6 +323,8 @@ main(
 	avr_init(avr);
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
 	avr->trace = trace;
+	avr->time_policy = time_policy;
+	avr->time_scale = time_scale;
 	avr_load_firmware(avr, &f);
 	if (f.flashbase) {
 		printf("Attempted to load a bootloader at %04x\n", f.flashbase);
@@ -263,13 +335,34 @@ main(
 			if (avr->interrupts.vector[vi]->vector == trace_vectors[ti])
 				avr->interrupts.vector[vi]->trace = 1;
 	}
+	avr_vcd_t input;
 	if (vcd_input) {
-		static avr_vcd_t input;
 		if (avr_vcd_init_input(avr, vcd_input, &input)) {
 			fprintf(stderr, "%s: Warning: VCD input file %s failed\n", argv[0], vcd_input);
 		}
 	}
 
+	if (jit && avr_jit_init(avr, jit_cache))
+		fprintf(stderr, "%s: Warning: JIT not available, running without\n", argv[0]);
+
+	if (lcov) {
+		if (!f.lines.count)
+			fprintf(stderr, "%s: Warning: no line information in the firmware for %s\n",
+					argv[0], lcov);
+		avr_exec_count_init(avr);
+	}
+	if (profile) {
+		if (!f.symbolcount)
+			fprintf(stderr, "%s: Warning: no symbols in the firmware for %s\n",
+					argv[0], profile);
+		if (avr_profile_init(avr, f.symbol, f.symbolcount))
+			fprintf(stderr, "%s: Unable to profile\n", argv[0]);
+	}
+	if (trace_file && avr_trace_start(avr, trace_file)) {
+		fprintf(stderr, "%s: Unable to write %s\n", argv[0], trace_file);
+		exit(1);
+	}
+
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = port;
 	if (gdb) {
@@ -284,7 +377,29 @@ main(
 		int state = avr_run(avr);
 		if (state == cpu_Done || state == cpu_Crashed)
 			break;
+		if (signal_caught) {
+			printf("signal caught, simavr terminating\n");
+			break;
+		}
 	}
 
+	if (lcov) {
+		FILE * o = fopen(lcov, "w");
+		if (!o || avr_lcov_write(avr, &f.lines, NULL, o) < 0)
+			fprintf(stderr, "%s: Unable to write %s\n", argv[0], lcov);
+		if (o)
+			fclose(o);
+	}
+	if (trace_file && avr_trace_stop(avr) < 0)
+		fprintf(stderr, "%s: Unable to write %s\n", argv[0], trace_file);
+	if (profile && avr->profile) {
+		FILE * o = fopen(profile, "w");
+		if (!o || avr_profile_write_folded(avr, o) < 0)
+			fprintf(stderr, "%s: Unable to write %s\n", argv[0], profile);
+		if (o)
+			fclose(o);
+		avr_profile_write_table(avr, stderr);
+		avr_profile_free(avr);
+	}
 	avr_terminate(avr);
 }
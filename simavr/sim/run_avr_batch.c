@@ -0,0 +1,542 @@
+/*
+	run_avr_batch.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs a whole list of firmwares in one process, spread over a pool of
+ * threads, and prints the results as JSON. Each firmware file is only
+ * read once, however many jobs use it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_core.h"
+#include "sim_vcd_file.h"
+#include "avr_uart.h"
+
+static void
+display_usage(
+	const char * app)
+{
+	printf("Usage: %s [...] <manifest>\n", app);
+	printf( "       [--jobs|-j <n>]     Number of threads (default, one per CPU)\n"
+			"       [--help|-h]         Display this usage message and exit\n"
+			"       [-v]                Raise verbosity level of the avrs\n"
+			"       <manifest>          The jobs, one per line, or '-' for stdin:\n"
+			"           <firmware> [mcu=<device>] [freq=<hz>] [cycles=<n>]\n"
+			"               [input=<.vcd file>] [uart=<n>] [expect=\"<output>\"]\n"
+			"         <firmware> is an ELF file, or a .hex with mcu and freq.\n"
+			"         A job runs until the firmware stops, or for 'cycles', and\n"
+			"         passes if it didn't crash and, with 'expect', if it sent\n"
+			"         exactly that on UART 'uart' (default 0). 'expect' takes\n"
+			"         C escapes. Empty lines and lines starting with # are skipped\n");
+	exit(1);
+}
+
+// a firmware file, as read once for all the jobs using it
+typedef struct batch_firmware_t {
+	struct batch_firmware_t * next;
+	char *			filename;
+	char			mmcu[64];
+	uint32_t		frequency;
+	elf_firmware_t	f;
+	int				error;
+} batch_firmware_t;
+
+typedef struct batch_job_t {
+	int				line;
+	char *			filename;
+	char			mmcu[64];
+	uint32_t		frequency;
+	avr_cycle_count_t budget;	// zero runs until the firmware stops
+	char *			input;		// vcd input file
+	char			uart;
+	char *			expect;
+	int				expect_len;
+	batch_firmware_t * fw;
+
+	// results
+	avr_cycle_count_t cycle;
+	double			wall;		// seconds
+	int				state;
+	int				over_budget;
+	char *			output;		// what came out of the uart
+	int				output_len, output_size;
+	int				pass;
+	const char *	error;
+} batch_job_t;
+
+typedef struct batch_t {
+	batch_job_t *	job;
+	int				count, size;
+	int				next;		// next job to pick, shared by the threads
+	int				log;
+	batch_firmware_t * firmware;
+} batch_t;
+
+static double
+_batch_time(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/*
+ * Reads a manifest value, with C escapes and optional double quotes;
+ * returns the next unparsed character
+ */
+static char *
+_batch_parse_value(
+		char * src,
+		char ** value,
+		int * len)
+{
+	char * dst = src;
+	int quoted = *src == '"';
+	*value = dst;
+	if (quoted)
+		src++;
+	while (*src && (quoted ? *src != '"' : !isspace((unsigned char)*src))) {
+		if (*src != '\\' || !src[1]) {
+			*dst++ = *src++;
+			continue;
+		}
+		src++;
+		switch (*src) {
+			case 'n': *dst++ = '\n'; src++; break;
+			case 'r': *dst++ = '\r'; src++; break;
+			case 't': *dst++ = '\t'; src++; break;
+			case '0': *dst++ = 0; src++; break;
+			case 'x': {
+				char hex[3] = { 0 };
+				src++;
+				for (int i = 0; i < 2 && isxdigit((unsigned char)*src); i++)
+					hex[i] = *src++;
+				*dst++ = strtol(hex, NULL, 16);
+			}	break;
+			default: *dst++ = *src++; break;
+		}
+	}
+	if (quoted && *src == '"')
+		src++;
+	if (len)
+		*len = dst - *value;
+	if (*src)
+		*src++ = 0;
+	*dst = 0;
+	return src;
+}
+
+static int
+_batch_parse_job(
+		batch_job_t * job,
+		char * line)
+{
+	job->uart = '0';
+	while (*line) {
+		while (isspace((unsigned char)*line))
+			line++;
+		if (!*line)
+			break;
+		char * key = line;
+		char * eq = line;
+		while (*eq && *eq != '=' && !isspace((unsigned char)*eq))
+			eq++;
+		if (*eq != '=') {	// the firmware
+			line = _batch_parse_value(line, &job->filename, NULL);
+			continue;
+		}
+		*eq = 0;
+		char * value;
+		int len;
+		line = _batch_parse_value(eq + 1, &value, &len);
+		if (!strcmp(key, "mcu"))
+			snprintf(job->mmcu, sizeof(job->mmcu), "%s", value);
+		else if (!strcmp(key, "freq"))
+			job->frequency = strtoul(value, NULL, 0);
+		else if (!strcmp(key, "cycles"))
+			job->budget = strtoull(value, NULL, 0);
+		else if (!strcmp(key, "input"))
+			job->input = strdup(value);
+		else if (!strcmp(key, "uart"))
+			job->uart = value[0];
+		else if (!strcmp(key, "expect")) {
+			job->expect = malloc(len + 1);
+			memcpy(job->expect, value, len + 1);
+			job->expect_len = len;
+		} else {
+			fprintf(stderr, "line %d: unknown key '%s'\n", job->line, key);
+			return -1;
+		}
+	}
+	if (!job->filename) {
+		fprintf(stderr, "line %d: no firmware\n", job->line);
+		return -1;
+	}
+	job->filename = strdup(job->filename);
+	return 0;
+}
+
+static int
+_batch_read_manifest(
+		batch_t * b,
+		const char * filename)
+{
+	FILE * file = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if (!file) {
+		perror(filename);
+		return -1;
+	}
+	char line[4096];
+	int lineno = 0, res = 0;
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		char * l = line;
+		while (isspace((unsigned char)*l))
+			l++;
+		if (!*l || *l == '#')
+			continue;
+		if (b->count == b->size) {
+			b->size = b->size ? b->size * 2 : 64;
+			b->job = realloc(b->job, b->size * sizeof(b->job[0]));
+		}
+		batch_job_t * job = &b->job[b->count];
+		memset(job, 0, sizeof(*job));
+		job->line = lineno;
+		if (_batch_parse_job(job, l)) {
+			res = -1;
+			break;
+		}
+		b->count++;
+	}
+	if (file != stdin)
+		fclose(file);
+	return res;
+}
+
+/*
+ * Reads each firmware once, for all the jobs wanting it with the same
+ * mcu and frequency; it is only read from then on
+ */
+static batch_firmware_t *
+_batch_get_firmware(
+		batch_t * b,
+		batch_job_t * job)
+{
+	for (batch_firmware_t * fw = b->firmware; fw; fw = fw->next)
+		if (!strcmp(fw->filename, job->filename) &&
+				!strcmp(fw->mmcu, job->mmcu) && fw->frequency == job->frequency)
+			return fw;
+
+	batch_firmware_t * fw = calloc(1, sizeof(*fw));
+	fw->filename = job->filename;
+	strcpy(fw->mmcu, job->mmcu);
+	fw->frequency = job->frequency;
+	fw->next = b->firmware;
+	b->firmware = fw;
+
+	char * suffix = strrchr(job->filename, '.');
+	if (suffix && !strcasecmp(suffix, ".hex")) {
+		if (!job->mmcu[0] || !job->frequency) {
+			fprintf(stderr, "line %d: mcu and freq are mandatory for .hex files\n",
+					job->line);
+			fw->error = 1;
+			return fw;
+		}
+		ihex_chunk_p chunk = NULL;
+		int cnt = read_ihex_chunks(job->filename, &chunk);
+		if (cnt <= 0) {
+			fprintf(stderr, "line %d: unable to load IHEX file %s\n",
+					job->line, job->filename);
+			fw->error = 1;
+			return fw;
+		}
+		for (int ci = 0; ci < cnt; ci++) {
+			if (chunk[ci].baseaddr < (1*1024*1024)) {
+				fw->f.flash = chunk[ci].data;
+				fw->f.flashsize = chunk[ci].size;
+				fw->f.flashbase = chunk[ci].baseaddr;
+			} else if (chunk[ci].baseaddr >= AVR_SEGMENT_OFFSET_EEPROM) {
+				fw->f.eeprom = chunk[ci].data;
+				fw->f.eesize = chunk[ci].size;
+			}
+		}
+	} else if (elf_read_firmware(job->filename, &fw->f) == -1) {
+		fprintf(stderr, "line %d: unable to load firmware from file %s\n",
+				job->line, job->filename);
+		fw->error = 1;
+		return fw;
+	}
+	if (job->mmcu[0])
+		strcpy(fw->f.mmcu, job->mmcu);
+	if (job->frequency)
+		fw->f.frequency = job->frequency;
+	// the jobs would all write the same file
+	fw->f.tracecount = 0;
+	return fw;
+}
+
+static void
+_batch_logger(
+		avr_t * avr,
+		const int level,
+		const char * format,
+		va_list ap)
+{
+	batch_job_t * job = avr->custom.data;
+	if (avr->log < level)
+		return;
+	flockfile(stderr);
+	fprintf(stderr, "line %d: ", job->line);
+	vfprintf(stderr, format, ap);
+	funlockfile(stderr);
+}
+
+static void
+_batch_uart_output(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	batch_job_t * job = param;
+	if (job->output_len + 1 >= job->output_size) {
+		job->output_size = job->output_size ? job->output_size * 2 : 128;
+		job->output = realloc(job->output, job->output_size);
+	}
+	job->output[job->output_len++] = value;
+	job->output[job->output_len] = 0;
+}
+
+static avr_cycle_count_t
+_batch_budget_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	batch_job_t * job = param;
+	job->over_budget = 1;
+	return 0;
+}
+
+static void
+_batch_run_job(
+		batch_t * b,
+		batch_job_t * job)
+{
+	if (job->fw->error) {
+		job->error = "firmware not loaded";
+		return;
+	}
+	avr_t * avr = avr_make_mcu_by_name(job->fw->f.mmcu);
+	if (!avr) {
+		job->error = "AVR not known";
+		return;
+	}
+	avr->custom.data = job;
+	avr->logger = _batch_logger;
+	avr_init(avr);
+	avr->log = b->log;
+	avr->time_policy = AVR_TIME_MAX;
+	avr_load_firmware(avr, &job->fw->f);
+	if (job->fw->f.flashbase)
+		avr->pc = job->fw->f.flashbase;
+
+	// no sleeping on the UART polls, the threads have better to do
+	for (char u = '0'; u <= '3'; u++) {
+		uint32_t flags = 0;
+		if (avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(u), &flags) == 0) {
+			flags &= ~AVR_UART_FLAG_POLL_SLEEP;
+			avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(u), &flags);
+		}
+	}
+	avr_irq_t * uart = avr_io_getirq(avr,
+			AVR_IOCTL_UART_GETIRQ(job->uart), UART_IRQ_OUTPUT);
+	if (uart)
+		avr_irq_register_notify(uart, _batch_uart_output, job);
+	else if (job->expect)
+		job->error = "no such UART";
+
+	avr_vcd_t input = { 0 };
+	if (job->input && avr_vcd_init_input(avr, job->input, &input))
+		job->error = "VCD input failed";
+
+	if (job->budget)
+		avr_cycle_timer_register(avr, job->budget, _batch_budget_timer, job);
+
+	double start = _batch_time();
+	int state = avr->state;
+	while (!job->error && !job->over_budget) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+			break;
+	}
+	job->wall = _batch_time() - start;
+	job->cycle = avr->cycle;
+	job->state = state;
+	job->pass = !job->error && state != cpu_Crashed &&
+			(!job->expect || (job->output_len == job->expect_len &&
+				!memcmp(job->output, job->expect, job->expect_len)));
+
+	if (job->input)
+		avr_vcd_close(&input);
+	avr_terminate(avr);
+}
+
+static void *
+_batch_thread(
+		void * param)
+{
+	batch_t * b = param;
+	for (;;) {
+		int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if (i >= b->count)
+			break;
+		_batch_run_job(b, &b->job[i]);
+	}
+	return NULL;
+}
+
+static void
+_batch_json_string(
+		FILE * o,
+		const char * s,
+		int len)
+{
+	fputc('"', o);
+	for (int i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(o, "\\%c", c);
+		else if (c == '\n')
+			fprintf(o, "\\n");
+		else if (c < ' ' || c >= 0x7f)
+			fprintf(o, "\\u%04x", c);
+		else
+			fputc(c, o);
+	}
+	fputc('"', o);
+}
+
+static void
+_batch_json(
+		batch_t * b,
+		FILE * o)
+{
+	static const char * states[] = {
+		[cpu_Limbo] = "limbo", [cpu_Stopped] = "stopped",
+		[cpu_Running] = "running", [cpu_Sleeping] = "sleeping",
+		[cpu_Step] = "step", [cpu_StepDone] = "stepdone",
+		[cpu_Done] = "done", [cpu_Crashed] = "crashed",
+	};
+	fprintf(o, "[\n");
+	for (int i = 0; i < b->count; i++) {
+		batch_job_t * job = &b->job[i];
+		fprintf(o, "  { \"line\": %d, \"firmware\": ", job->line);
+		_batch_json_string(o, job->filename, strlen(job->filename));
+		const char * mmcu = job->fw->f.mmcu[0] ? job->fw->f.mmcu : job->mmcu;
+		fprintf(o, ", \"mcu\": ");
+		_batch_json_string(o, mmcu, strlen(mmcu));
+		// "mcps", millions of simulated cycles per wall clock second
+		fprintf(o, ", \"cycles\": %" PRI_avr_cycle_count
+				", \"wall\": %.6f, \"mcps\": %.2f, \"state\": \"%s\"",
+				job->cycle, job->wall,
+				job->wall > 0 ? job->cycle / job->wall / 1e6 : 0,
+				job->over_budget ? "budget" :
+					job->state < ARRAY_SIZE(states) && states[job->state] ?
+						states[job->state] : "unknown");
+		fprintf(o, ", \"uart\": ");
+		_batch_json_string(o, job->output ? job->output : "", job->output_len);
+		if (job->error) {
+			fprintf(o, ", \"error\": ");
+			_batch_json_string(o, job->error, strlen(job->error));
+		}
+		fprintf(o, ", \"pass\": %s }%s\n", job->pass ? "true" : "false",
+				i < b->count - 1 ? "," : "");
+	}
+	fprintf(o, "]\n");
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	batch_t b = { 0 };
+	const char * manifest = NULL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	b.log = LOG_ERROR;
+
+	for (int pi = 1; pi < argc; pi++) {
+		if (!strcmp(argv[pi], "-h") || !strcmp(argv[pi], "--help")) {
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-j") || !strcmp(argv[pi], "--jobs")) {
+			if (pi < argc-1)
+				threads = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-v")) {
+			b.log++;
+		} else if (argv[pi][0] != '-' || !strcmp(argv[pi], "-")) {
+			manifest = argv[pi];
+		} else
+			display_usage(basename(argv[0]));
+	}
+	if (!manifest)
+		display_usage(basename(argv[0]));
+	if (b.log > LOG_TRACE)
+		b.log = LOG_TRACE;
+	if (threads < 1)
+		threads = 1;
+
+	if (_batch_read_manifest(&b, manifest))
+		exit(1);
+	for (int i = 0; i < b.count; i++)
+		b.job[i].fw = _batch_get_firmware(&b, &b.job[i]);
+	if (threads > b.count)
+		threads = b.count ? b.count : 1;
+
+	// the threads pick the next job as soon as they are done with one
+	pthread_t thread[threads];
+	for (int i = 1; i < threads; i++)
+		if (pthread_create(&thread[i], NULL, _batch_thread, &b)) {
+			fprintf(stderr, "%s: only %d threads started\n", argv[0], i);
+			threads = i;
+			break;
+		}
+	_batch_thread(&b);
+	for (int i = 1; i < threads; i++)
+		pthread_join(thread[i], NULL);
+
+	_batch_json(&b, stdout);
+
+	int failed = 0;
+	for (int i = 0; i < b.count; i++)
+		failed += !b.job[i].pass;
+	return failed ? 1 : 0;
+}
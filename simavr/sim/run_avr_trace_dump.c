@@ -0,0 +1,154 @@
+/*
+	run_avr_trace_dump.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prints a binary instruction trace (see sim_trace.h), one instruction per
+ * line: the cycle it ended on, its pc, function, opcode, disassembly, and
+ * the registers it changed. The symbols come from the firmware, if it's given.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_trace.h"
+#include "sim_disasm.h"
+
+static void
+display_usage(
+	const char * app)
+{
+	printf("Usage: %s [...] <trace file>\n", app);
+	printf( "       [--elf|-e <file>]   The firmware the trace was made with, for\n"
+			"                           its symbols\n"
+			"       [--skip|-s <count>] Skip the first <count> instructions\n"
+			"       [--count|-n <count>] Print at most <count> instructions\n"
+			"       [--help|-h]         Display this usage message and exit\n");
+	exit(1);
+}
+
+// the code symbol 'pc' is in, NULL if none
+static avr_symbol_t *
+find_symbol(
+		elf_firmware_t * f,
+		uint32_t flashend,
+		uint32_t pc)
+{
+	avr_symbol_t * res = NULL;
+#if ELF_SYMBOLS
+	int lo = 0, hi = f->symbolcount;
+	// the symbols are sorted by address, find the last one at or before pc
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (f->symbol[mid]->addr <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && f->symbol[lo - 1]->addr <= flashend)
+		res = f->symbol[lo - 1];
+#endif
+	return res;
+}
+
+int
+main(
+		int argc,
+		char *argv[])
+{
+	elf_firmware_t f = {{0}};
+	const char * elf = NULL, * trace = NULL;
+	uint64_t skip = 0, count = ~0ULL;
+
+	for (int pi = 1; pi < argc; pi++) {
+		if (!strcmp(argv[pi], "-h") || !strcmp(argv[pi], "--help")) {
+			display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-e") || !strcmp(argv[pi], "--elf")) {
+			if (pi < argc-1)
+				elf = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-s") || !strcmp(argv[pi], "--skip")) {
+			if (pi < argc-1)
+				skip = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-n") || !strcmp(argv[pi], "--count")) {
+			if (pi < argc-1)
+				count = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (argv[pi][0] != '-' && !trace) {
+			trace = argv[pi];
+		} else
+			display_usage(basename(argv[0]));
+	}
+	if (!trace)
+		display_usage(basename(argv[0]));
+
+	if (elf && elf_read_firmware(elf, &f) == -1) {
+		fprintf(stderr, "%s: Unable to load firmware from file %s\n",
+				argv[0], elf);
+		exit(1);
+	}
+	FILE * in = fopen(trace, "rb");
+	avr_trace_reader_t r;
+	if (!in || avr_trace_open(&r, in)) {
+		fprintf(stderr, "%s: %s is not a simavr trace file\n", argv[0], trace);
+		exit(1);
+	}
+	printf("; %s at %uHz, from cycle %llu\n", r.mmcu, r.frequency,
+			(unsigned long long)r.cycle);
+
+	avr_trace_record_t rec;
+	uint64_t index = 0;
+	int res = 0;
+	while (count && (res = avr_trace_read(&r, &rec)) == 1) {
+		if (index++ < skip)
+			continue;
+		count--;
+		char dis[64], where[96] = "";
+		int words = avr_disassemble(rec.pc, rec.opcode[0], rec.opcode[1],
+				dis, sizeof(dis));
+		avr_symbol_t * s = find_symbol(&f, r.flashend, rec.pc);
+		if (s)
+			snprintf(where, sizeof(where), "%s+0x%x", s->symbol, rec.pc - s->addr);
+		char op[16];
+		if (words == 2)
+			sprintf(op, "%04x %04x", rec.opcode[0], rec.opcode[1]);
+		else
+			sprintf(op, "%04x     ", rec.opcode[0]);
+		printf("%12llu %06x %-24s %s  %-28s", (unsigned long long)r.cycle,
+				rec.pc, where, op, dis);
+		if (rec.changed & 1)
+			printf(" r%d=%02x", rec.reg, rec.value[0]);
+		if (rec.changed & 2)
+			printf(" r%d=%02x", rec.reg + 1, rec.value[1]);
+		printf("\n");
+	}
+	if (count && res < 0)
+		fprintf(stderr, "%s: %s is corrupt after %llu instructions\n",
+				argv[0], trace, (unsigned long long)index);
+	avr_trace_close(&r);
+	fclose(in);
+	return count && res < 0;
+}
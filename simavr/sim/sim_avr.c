@@ -19,6 +19,7 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,8 @@
 #include "sim_core.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
+#include "sim_io.h"
+#include "sim_jit.h"
 #include "avr_uart.h"
 #include "sim_vcd_file.h"
 #include "avr/avr_mcu_section.h"
@@ -54,7 +57,9 @@ avr_global_logger(
 {
 	va_list args;
 	va_start(args, format);
-	if (_avr_global_logger)
+	if (avr && avr->logger)
+		avr->logger(avr, level, format, args);
+	else if (_avr_global_logger)
 		_avr_global_logger(avr, level, format, args);
 	va_end(args);
 }
@@ -72,20 +77,32 @@ avr_global_logger_get(void)
 	return _avr_global_logger;
 }
 
+/*
+ * Clock for avr_get_time_stamp(). When the host can also sleep until a
+ * deadline on it, avr_callback_sleep_raw() does, so the time spent
+ * running the core between sleeps doesn't add up to a drift.
+ */
+#if defined(CLOCK_MONOTONIC) && defined(TIMER_ABSTIME)
+# define AVR_TIME_CLOCK		CLOCK_MONOTONIC
+# define AVR_TIME_DEADLINE	1
+#elif defined(CLOCK_MONOTONIC_RAW)
+# define AVR_TIME_CLOCK		CLOCK_MONOTONIC_RAW
+#endif
+
 uint64_t
 avr_get_time_stamp(
 		avr_t * avr )
 {
 	uint64_t stamp;
-#ifndef CLOCK_MONOTONIC_RAW
-	/* CLOCK_MONOTONIC_RAW isn't portable, here is the POSIX alternative.
+#ifndef AVR_TIME_CLOCK
+	/* CLOCK_MONOTONIC isn't portable, here is the POSIX alternative.
 	 * Only downside is that it will drift if the system clock changes */
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	stamp = (((uint64_t)tv.tv_sec) * 1E9) + (tv.tv_usec * 1000);
 #else
 	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	clock_gettime(AVR_TIME_CLOCK, &tp);
 	stamp = (tp.tv_sec * 1E9) + tp.tv_nsec;
 #endif
 	if (!avr->time_base)
@@ -101,6 +118,8 @@ avr_init(
 	memset(avr->flash, 0xff, avr->flashend + 1);
 	*((uint16_t*)&avr->flash[avr->flashend + 1]) = AVR_OVERFLOW_OPCODE;
 	avr->codeend = avr->flashend;
+	// one extra, never decoded entry stops basic blocks running off the flash
+	avr->decoded = calloc((avr->flashend + 1) / 2 + 1, sizeof(avr_decoded_t));
 	avr->data = malloc(avr->ramend + 1);
 	memset(avr->data, 0, avr->ramend + 1);
 #ifdef CONFIG_SIMAVR_TRACE
@@ -112,6 +131,8 @@ avr_init(
 	// cpu is in limbo before init is finished.
 	avr->state = cpu_Limbo;
 	avr->frequency = 1000000;	// can be overridden via avr_mcu_section
+	for (int i = 0; i < MAX_IOs; i++)
+		avr_io_plain_update(avr, AVR_IO_TO_DATA(i));
 	avr_cmd_init(avr);
 	avr_interrupt_init(avr);
 	if (avr->custom.init)
@@ -123,6 +144,8 @@ avr_init(
 	avr->sleep = avr_callback_sleep_raw;
 	// number of address bytes to push/pull on/off the stack
 	avr->address_size = avr->eind ? 3 : 2;
+	if (!avr->run_cycle_limit)
+		avr->run_cycle_limit = DEFAULT_RUN_CYCLE_LIMIT;
 	avr->log = 1;
 	avr_reset(avr);
 	avr_regbit_set(avr, avr->reset_flags.porf);		// by  default set to power-on reset
@@ -147,6 +170,11 @@ avr_terminate(
 
 	if (avr->flash) free(avr->flash);
 	if (avr->data) free(avr->data);
+	if (avr->decoded) free(avr->decoded);
+	free(avr->flash_dirty);
+	free(avr->data_dirty);
+	avr_jit_terminate(avr);
+	avr_cycle_timer_terminate(avr);
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
@@ -154,6 +182,7 @@ avr_terminate(
 		avr->io_console_buffer.buf = NULL;
 	}
 	avr->flash = avr->data = NULL;
+	avr->decoded = NULL;
 }
 
 void
@@ -169,6 +198,7 @@ avr_reset(
 	avr->pc = avr->reset_pc;	// Likely to be zero
 	for (int i = 0; i < 8; i++)
 		avr->sreg[i] = 0;
+	avr->flags.op = 0;
 	avr_interrupt_reset(avr);
 	avr_cycle_timer_reset(avr);
 	if (avr->reset)
@@ -251,6 +281,7 @@ avr_loadcode(
 		abort();
 	}
 	memcpy(avr->flash + address, code, size);
+	avr_decode_invalidate(avr, address, size);
 }
 
 /**
@@ -278,6 +309,11 @@ avr_callback_sleep_gdb(
 		avr_cycle_count_t howLong)
 {
 	uint32_t usec = avr_pending_sleep_usec(avr, howLong);
+	// gdb is still polled, but only waited on as long as avr->time_policy says
+	if (avr->time_policy == AVR_TIME_MAX)
+		usec = 0;
+	else if (avr->time_policy == AVR_TIME_SCALED && avr->time_scale > 0)
+		usec /= avr->time_scale;
 	while (avr_gdb_processor(avr, usec))
 		;
 }
@@ -338,21 +374,34 @@ avr_callback_run_gdb(
 To avoid simulated time and wall clock time to diverge over time
 this function tries to keep them in sync (roughly) by sleeping
 for the time required to match the expected sleep deadline
-in wall clock time.
+in wall clock time. avr->time_policy can scale that wall clock
+time, or not wait at all; the core then jumps straight to the
+next timer.
 */
 void
 avr_callback_sleep_raw(
 		avr_t *avr,
 		avr_cycle_count_t how_long)
 {
+	if (avr->time_policy == AVR_TIME_MAX)
+		return;
 	/* figure out how long we should wait to match the sleep deadline */
 	uint64_t deadline_ns = avr_cycles_to_nsec(avr, avr->cycle + how_long);
+	if (avr->time_policy == AVR_TIME_SCALED && avr->time_scale > 0)
+		deadline_ns /= avr->time_scale;
 	uint64_t runtime_ns = avr_get_time_stamp(avr);
 	if (runtime_ns >= deadline_ns)
 		return;
+#ifdef AVR_TIME_DEADLINE
+	uint64_t at = avr->time_base + deadline_ns;
+	struct timespec ts = {
+		.tv_sec = at / 1000000000, .tv_nsec = at % 1000000000 };
+	while (clock_nanosleep(AVR_TIME_CLOCK, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#else
 	uint64_t sleep_us = (deadline_ns - runtime_ns) / 1000;
 	usleep(sleep_us);
-	return;
+#endif
 }
 
 void
@@ -406,6 +455,41 @@ avr_run(
 	return avr->state;
 }
 
+/*
+ * This timer does nothing; being registered is what makes avr_run_one()
+ * leave its inner loop exactly when the deadline is reached
+ */
+static avr_cycle_count_t
+_avr_run_until_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+int
+avr_run_until(
+		avr_t * avr,
+		avr_cycle_count_t cycle)
+{
+	if (cycle > avr->cycle)
+		avr_cycle_timer_register(avr, cycle - avr->cycle, _avr_run_until_timer, NULL);
+	while (avr->cycle < cycle &&
+			(avr->state == cpu_Running || avr->state == cpu_Sleeping))
+		avr->run(avr);
+	avr_cycle_timer_cancel(avr, _avr_run_until_timer, NULL);
+	return avr->state;
+}
+
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t count)
+{
+	return avr_run_until(avr, avr->cycle + count);
+}
+
 avr_t *
 avr_core_allocate(
 		const avr_t * core,
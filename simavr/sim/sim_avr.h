@@ -36,6 +36,7 @@ extern "C" {
 	#define FALLTHROUGH
 #endif
 
+#include <stdarg.h>
 #include "sim_irq.h"
 #include "sim_interrupts.h"
 #include "sim_cmds.h"
@@ -72,6 +73,21 @@ enum {
 #define AVR_DATA_TO_IO(v) ((v) - 32)
 #define AVR_IO_TO_DATA(v) ((v) + 32)
 
+/*
+ * avr->io_plain[] bits: reading/writing that IO register has no side
+ * effect (no callback, no IRQ), so the core can use avr->data directly.
+ */
+#define AVR_IO_PLAIN_R	(1 << 0)
+#define AVR_IO_PLAIN_W	(1 << 1)
+
+/*
+ * avr->isa_missing bits, for the optional instructions a core may lack
+ */
+#define AVR_ISA_MUL		(1 << 0)	// MUL, MULS, MULSU, FMUL*
+#define AVR_ISA_JMP		(1 << 1)	// JMP, CALL
+#define AVR_ISA_ELPM	(1 << 2)	// ELPM
+#define AVR_ISA_EIND	(1 << 3)	// EIJMP, EICALL
+
 /**
  * Logging macros and associated log levels.
  * The current log level is kept in avr->log.
@@ -112,6 +128,17 @@ enum {
 	cpu_Crashed,    // avr software crashed (watchdog fired)
 };
 
+/*
+ * How simulated time is paced against the wall clock when the core
+ * sleeps, avr->time_policy (see avr_callback_sleep_raw(), and
+ * avr_callback_sleep_gdb() when gdb is attached).
+ */
+enum {
+	AVR_TIME_REALTIME = 0,	// wait for the wall clock to catch up (default)
+	AVR_TIME_MAX,			// never wait, run as fast as possible
+	AVR_TIME_SCALED,		// wall clock, sped up by avr->time_scale
+};
+
 // this is only ever used if CONFIG_SIMAVR_TRACE is defined
 struct avr_trace_data_t {
 	struct avr_symbol_t ** codeline;
@@ -143,6 +170,7 @@ struct avr_trace_data_t {
 	// keeps track of which registers gets touched by instructions
 	// reset before each new instructions. Allows meaningful traces
 	uint32_t	touched[256 / 32];	// debug
+	int			dont_trace;	// in a function not worth tracing
 };
 
 typedef void (*avr_run_t)(
@@ -155,6 +183,12 @@ typedef void (*avr_run_t)(
 /*
  * Main AVR instance. Some of these fields are set by the AVR "Core" definition files
  * the rest is runtime data (as little as possible)
+ *
+ * An avr_t, and everything attached to it, belongs to the thread running
+ * it: the library has no other state than the global logger, so any number
+ * of them can run on as many threads, as long as each one is only touched
+ * by one thread at a time. The global logger is set once, before starting
+ * them; each instance can also have its own.
  */
 typedef struct avr_t {
 	const char * 		mmcu;	// name of the AVR
@@ -170,6 +204,7 @@ typedef struct avr_t {
 	avr_io_addr_t		rampz;	// optional, only for ELPM/SPM on >64Kb cores
 	avr_io_addr_t		eind;	// optional, only for EIJMP/EICALL on >64Kb cores
 	uint8_t				address_size;	// 2, or 3 for cores >128KB in flash
+	uint8_t				isa_missing;	// AVR_ISA_* instructions this core lacks
 	struct {
 		avr_regbit_t		porf;
 		avr_regbit_t		extrf;
@@ -192,6 +227,8 @@ typedef struct avr_t {
 
 	// these next two allow the core to freely run between cycle timers and also allows
 	// for a maximum run cycle limit... run_cycle_count is set during cycle timer processing.
+	// run_cycle_limit defaults to DEFAULT_RUN_CYCLE_LIMIT, can be changed after avr_init(),
+	// and is forced to 1 (one instruction per avr_run()) when gdb is attached.
 	avr_cycle_count_t	run_cycle_count;	// cycles to run before next timer
 	avr_cycle_count_t	run_cycle_limit;	// maximum run cycle interval limit
 
@@ -202,6 +239,8 @@ typedef struct avr_t {
 	 */
 	uint32_t 			sleep_usec;
 	uint64_t			time_base;	// for avr_get_time_stamp()
+	int					time_policy;	// AVR_TIME_*
+	double				time_scale;		// for AVR_TIME_SCALED, 2.0 is twice real time
 
 	// called at init time
 	void (*init)(struct avr_t * avr);
@@ -218,6 +257,10 @@ typedef struct avr_t {
 		void *data;
 	} custom;
 
+	// logger for this instance, the global one when NULL
+	void (*logger)(struct avr_t * avr, const int level,
+			const char * format, va_list ap);
+
 	/*!
 	 * Default AVR core run function.
 	 * Two modes are available, a "raw" run that goes as fast as
@@ -243,6 +286,13 @@ typedef struct avr_t {
 	// in the opcode decoder.
 	// This array is re-synthesized back/forth when SREG changes
 	uint8_t		sreg[8];
+	// Last ALU operation, its C, Z, N, V, S and H flags are only worked
+	// out into sreg[] when read, see avr_flags_sync()
+	struct {
+		uint8_t		op;		// zero when sreg[] is up to date
+		uint8_t		z;		// Z before it, for SBC, SBCI and CPC
+		uint16_t	res, rd, rr;
+	} flags;
 
 	/* Interrupt state:
 		00: idle (no wait, no pending interrupts) or disabled
@@ -284,6 +334,8 @@ typedef struct avr_t {
 			avr_io_write_t c;
 		} w;
 	} io[MAX_IOs];
+	// AVR_IO_PLAIN_* bits for each io[], see avr_io_plain_update()
+	uint8_t		io_plain[MAX_IOs];
 
 	/*
 	 * This block allows sharing of the IO write/read on addresses between
@@ -305,6 +357,28 @@ typedef struct avr_t {
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *		flash;
+	// the firmware (or gdb) changed the flash since it was loaded
+	uint8_t			flash_written;
+	// chunks written since the last incremental snapshot, see sim_snapshot.h
+	uint8_t *		flash_dirty;
+	uint8_t *		data_dirty;	// SRAM, from ioend + 1
+	// pre-decoded instructions, one per flash word, filled on first execution
+	struct avr_decoded_t * decoded;
+	// host translation of the hot basic blocks, if enabled, see sim_jit.h
+	struct avr_jit_t * jit;
+	// edge coverage and faults, while fuzzing, see sim_fuzz.h
+	struct avr_coverage_t * coverage;
+	// instructions run per flash word, if enabled, see sim_lcov.h
+	struct avr_exec_count_t * exec_count;
+	// cycles run per function and call stack, if enabled, see sim_profile.h
+	struct avr_profile_t * profile;
+	// binary instruction trace, if enabled, see sim_trace.h
+	struct avr_trace_t * trace_ring;
+	// last polling loop branch taken in this avr_run_one(), see sim_core.c
+	struct {
+		struct avr_decoded_t * dc;
+		avr_cycle_count_t	cycle;
+	} idle;
 	// this is the general purpose registers, IO registers, and SRAM
 	uint8_t *		data;
 
@@ -383,6 +457,18 @@ avr_reset(
 int
 avr_run(
 		avr_t * avr);
+// run the AVR until avr->cycle reaches 'cycle' (the last instruction might
+// overshoot it by a few cycles), or the core stops, crashes or is done.
+// Returns the core state
+int
+avr_run_until(
+		avr_t * avr,
+		avr_cycle_count_t cycle);
+// same as avr_run_until(), for 'count' cycles from now
+int
+avr_run_cycles(
+		avr_t * avr,
+		avr_cycle_count_t count);
 // finish any pending operations
 void
 avr_terminate(
@@ -409,6 +495,13 @@ avr_loadcode(
 		uint8_t * code,
 		uint32_t size,
 		avr_flashaddr_t address);
+// flash was modified behind the core's back (bootloader, gdb, custom
+// loader...); forget any pre-decoded instruction covering that range
+void
+avr_decode_invalidate(
+		avr_t * avr,
+		avr_flashaddr_t address,
+		uint32_t size);
 
 /*
  * These are accessors for avr->data but allows watchpoints to be set for gdb
@@ -449,7 +542,10 @@ avr_global_logger(
  */
 typedef void (*avr_logger_p)(struct avr_t* avr, const int level, const char * format, va_list ap);
 
-/* Sets a global logging function in place of the default */
+/*
+ * Sets a global logging function in place of the default, for the avr_t
+ * without their own 'logger'. Not thread safe, call it before starting any
+ */
 void
 avr_global_logger_set(
 		avr_logger_p logger);
@@ -0,0 +1,429 @@
+/*
+	sim_board.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "sim_avr.h"
+#include "sim_cycle_timers.h"
+#include "sim_board.h"
+
+void
+avr_board_init(
+		avr_board_t * board,
+		avr_board_time_t quantum)
+{
+	memset(board, 0, sizeof(*board));
+	board->quantum = quantum ? quantum : AVR_BOARD_QUANTUM;
+}
+
+int
+avr_board_add(
+		avr_board_t * board,
+		avr_t * avr)
+{
+	if (board->node_count == AVR_BOARD_MAX_NODES || !avr->frequency)
+		return -1;
+	avr_board_node_t * node = &board->node[board->node_count];
+	memset(node, 0, sizeof(*node));
+	node->avr = avr;
+	node->board = board;
+	node->now = board->now;
+	avr_board_time_t margin = avr_board_cycle_to_time(avr->frequency,
+			AVR_BOARD_OVERSHOOT);
+	if (margin > board->margin)
+		board->margin = margin;
+	return board->node_count++;
+}
+
+static avr_board_node_t *
+_avr_board_node(
+		avr_board_t * board,
+		avr_t * avr)
+{
+	for (int i = 0; i < board->node_count; i++)
+		if (board->node[i].avr == avr)
+			return &board->node[i];
+	return NULL;
+}
+
+static void
+_avr_board_queue_push(
+		avr_board_queue_t * q,
+		avr_board_msg_t * msg)
+{
+	if (q->head + q->count == q->size) {
+		if (q->head) {	// reuse the room of the ones already popped
+			memmove(q->msg, q->msg + q->head, q->count * sizeof(q->msg[0]));
+			q->head = 0;
+		} else {
+			q->size = q->size ? q->size * 2 : 16;
+			q->msg = realloc(q->msg, q->size * sizeof(q->msg[0]));
+		}
+	}
+	q->msg[q->head + q->count++] = *msg;
+}
+
+// only called by the source avr's thread
+static void
+_avr_board_fifo_push(
+		avr_board_fifo_t * f,
+		avr_board_msg_t * msg)
+{
+	avr_board_chunk_t * c = f->tail;
+	uint32_t w = c->write;
+	if (w == AVR_BOARD_CHUNK) {
+		avr_board_chunk_t * n = calloc(1, sizeof(*n));
+		n->msg[0] = *msg;
+		n->write = 1;
+		__atomic_store_n(&c->next, n, __ATOMIC_RELEASE);
+		f->tail = n;
+		return;
+	}
+	c->msg[w] = *msg;
+	__atomic_store_n(&c->write, w + 1, __ATOMIC_RELEASE);
+}
+
+// only called by the destination avr's thread, NULL when empty
+static avr_board_msg_t *
+_avr_board_fifo_peek(
+		avr_board_fifo_t * f)
+{
+	for (;;) {
+		avr_board_chunk_t * c = f->head;
+		if (f->read < __atomic_load_n(&c->write, __ATOMIC_ACQUIRE))
+			return &c->msg[f->read];
+		if (f->read < AVR_BOARD_CHUNK)
+			return NULL;
+		avr_board_chunk_t * n = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
+		if (!n)
+			return NULL;
+		// the source moved on to the next chunk, it's done with this one
+		free(c);
+		f->head = n;
+		f->read = 0;
+	}
+}
+
+// source side: timestamps what the IRQ was raised with
+static void
+_avr_board_link_send(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_board_link_t * link = param;
+	avr_t * avr = link->src->avr;
+	avr_board_msg_t msg = {
+		.when = avr_board_cycle_to_time(avr->frequency, avr->cycle) + link->latency,
+		.value = value,
+	};
+	// too short a latency, the destination can't see it before
+	if (msg.when < link->src->end + link->board->margin)
+		msg.when = link->src->end + link->board->margin;
+	_avr_board_fifo_push(&link->out, &msg);
+}
+
+// destination side: raises what is due, and waits for the next one
+static avr_cycle_count_t
+_avr_board_link_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_board_link_t * link = param;
+	avr_board_queue_t * q = &link->in;
+	while (q->count) {
+		avr_board_msg_t * msg = &q->msg[q->head];
+		avr_cycle_count_t due = avr_board_time_to_cycle(avr->frequency, msg->when);
+		if (due > when)
+			return due;
+		q->head++;
+		q->count--;
+		avr_raise_irq(link->dst_irq, msg->value);
+	}
+	q->head = 0;
+	return 0;
+}
+
+/*
+ * Start of a quantum: the destination takes what is due before its end
+ * (and the margin), and sets its timer for the first one if it isn't set
+ * already; a reset of the destination drops it, with bytes still queued.
+ * Anything sent during the quantum is due after that, so it doesn't
+ * matter whether the source got there yet.
+ */
+static void
+_avr_board_link_receive(
+		avr_board_link_t * link,
+		avr_board_time_t end)
+{
+	avr_t * avr = link->dst->avr;
+	avr_board_msg_t * msg;
+	end += link->board->margin;
+	while ((msg = _avr_board_fifo_peek(&link->out)) && msg->when < end) {
+		_avr_board_queue_push(&link->in, msg);
+		link->out.read++;
+	}
+	if (!link->in.count ||
+			avr_cycle_timer_status(avr, _avr_board_link_timer, link))
+		return;
+	avr_cycle_count_t due = avr_board_time_to_cycle(avr->frequency,
+			link->in.msg[link->in.head].when);
+	avr_cycle_timer_register(avr,
+			due > avr->cycle ? due - avr->cycle : 0, _avr_board_link_timer, link);
+}
+
+avr_board_link_t *
+avr_board_connect(
+		avr_board_t * board,
+		avr_t * src,
+		avr_irq_t * src_irq,
+		avr_t * dst,
+		avr_irq_t * dst_irq,
+		avr_board_time_t latency)
+{
+	avr_board_node_t * s = _avr_board_node(board, src);
+	avr_board_node_t * d = _avr_board_node(board, dst);
+	if (!s || !d || !src_irq || !dst_irq)
+		return NULL;
+	avr_board_link_t * link = calloc(1, sizeof(*link));
+	link->board = board;
+	link->src = s;
+	link->dst = d;
+	link->src_irq = src_irq;
+	link->dst_irq = dst_irq;
+	link->latency = latency;
+	link->out.head = link->out.tail = calloc(1, sizeof(avr_board_chunk_t));
+	if (!board->link_count || latency < board->lookahead)
+		board->lookahead = latency;
+	board->link = realloc(board->link,
+			(board->link_count + 1) * sizeof(board->link[0]));
+	board->link[board->link_count++] = link;
+	d->input = realloc(d->input, (d->input_count + 1) * sizeof(d->input[0]));
+	d->input[d->input_count++] = link;
+	avr_irq_register_notify(src_irq, _avr_board_link_send, link);
+	return link;
+}
+
+static avr_cycle_count_t
+_avr_board_quantum_end(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+static int
+_avr_board_node_running(
+		avr_board_node_t * node)
+{
+	int state = node->avr->state;
+	return state != cpu_Done && state != cpu_Crashed && state != cpu_Stopped;
+}
+
+/*
+ * Runs 'node' for the quantum ending at 'end'; the timer makes the core
+ * come back right there instead of running on to its next event
+ */
+static void
+_avr_board_node_run(
+		avr_board_node_t * node,
+		avr_board_time_t end)
+{
+	avr_t * avr = node->avr;
+	node->end = end;
+	if (_avr_board_node_running(node)) {
+		for (int i = 0; i < node->input_count; i++)
+			_avr_board_link_receive(node->input[i], end);
+		avr_cycle_count_t cycle = avr_board_time_to_cycle(avr->frequency, end);
+		if (cycle > avr->cycle) {
+			avr_cycle_timer_register(avr, cycle - avr->cycle, _avr_board_quantum_end, node);
+			while (avr->cycle < cycle && _avr_board_node_running(node))
+				avr_run(avr);
+			avr_cycle_timer_cancel(avr, _avr_board_quantum_end, node);
+		}
+	}
+	node->now = end;
+}
+
+static avr_board_time_t
+_avr_board_quantum(
+		avr_board_t * board)
+{
+	if (board->lookahead > board->margin &&
+			board->lookahead - board->margin < board->quantum)
+		return board->lookahead - board->margin;
+	return board->quantum;
+}
+
+static int
+_avr_board_running(
+		avr_board_t * board)
+{
+	int running = 0;
+	for (int i = 0; i < board->node_count; i++)
+		running += _avr_board_node_running(&board->node[i]);
+	return running;
+}
+
+/*
+ * Sense reversing barrier, that also adds up the 'value' of each thread.
+ * The quanta are short, so it spins a little before giving the CPU away
+ */
+static int
+_avr_board_barrier(
+		avr_board_barrier_t * b,
+		int value,
+		int * sense)
+{
+	*sense = !*sense;
+	__atomic_add_fetch(&b->sum, value, __ATOMIC_ACQ_REL);
+	if (__atomic_add_fetch(&b->waiting, 1, __ATOMIC_ACQ_REL) == b->count) {
+		b->result = b->sum;
+		b->sum = 0;
+		b->waiting = 0;
+		__atomic_store_n(&b->sense, *sense, __ATOMIC_RELEASE);
+	} else {
+		for (int spin = 0; __atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != *sense; spin++)
+			if (spin > 1000)
+				sched_yield();
+	}
+	return b->result;
+}
+
+/*
+ * One thread of a threaded run: its node, and for the main thread, the
+ * first node and any that didn't get a thread
+ */
+static void
+_avr_board_thread_run(
+		avr_board_node_t * node)
+{
+	avr_board_t * board = node->board;
+	int first = node == &board->node[0];
+	int sense = board->barrier.sense;
+	int running = board->barrier.result;
+	avr_board_time_t now = board->now;
+	avr_board_time_t quantum = _avr_board_quantum(board);
+
+	while (running && now < board->until) {
+		avr_board_time_t next = now + quantum;
+		if (next > board->until)
+			next = board->until;
+		int mine = 0;
+		for (int i = 0; i < board->node_count; i++) {
+			avr_board_node_t * n = &board->node[i];
+			if (n == node || (first && !n->threaded)) {
+				_avr_board_node_run(n, next);
+				mine += _avr_board_node_running(n);
+			}
+		}
+		running = _avr_board_barrier(&board->barrier, mine, &sense);
+		now = next;
+	}
+}
+
+static void *
+_avr_board_thread(
+		void * param)
+{
+	avr_board_node_t * node = param;
+	avr_board_t * board = node->board;
+	for (int spin = 0; !__atomic_load_n(&board->start, __ATOMIC_ACQUIRE); spin++)
+		if (spin > 1000)
+			sched_yield();
+	_avr_board_thread_run(node);
+	return NULL;
+}
+
+static int
+_avr_board_run_threads(
+		avr_board_t * board,
+		avr_board_time_t until)
+{
+	pthread_t thread[AVR_BOARD_MAX_NODES];
+	int count = 1;
+
+	board->until = until;
+	board->barrier.result = _avr_board_running(board);
+	board->start = 0;
+	// the ones that fail to start are run by this thread
+	for (int i = 1; i < board->node_count; i++) {
+		avr_board_node_t * node = &board->node[i];
+		node->threaded = pthread_create(&thread[i], NULL,
+				_avr_board_thread, node) == 0;
+		count += node->threaded;
+	}
+	board->barrier.count = count;
+	__atomic_store_n(&board->start, 1, __ATOMIC_RELEASE);
+	_avr_board_thread_run(&board->node[0]);
+	for (int i = 1; i < board->node_count; i++)
+		if (board->node[i].threaded)
+			pthread_join(thread[i], NULL);
+	board->now = board->node[0].now;
+	return _avr_board_running(board);
+}
+
+int
+avr_board_run(
+		avr_board_t * board,
+		avr_board_time_t until)
+{
+	if (board->threads && board->node_count > 1)
+		return _avr_board_run_threads(board, until);
+
+	int running = _avr_board_running(board);
+	avr_board_time_t quantum = _avr_board_quantum(board);
+	while (running && board->now < until) {
+		avr_board_time_t next = board->now + quantum;
+		if (next > until)
+			next = until;
+		for (int i = 0; i < board->node_count; i++)
+			_avr_board_node_run(&board->node[i], next);
+		board->now = next;
+		running = _avr_board_running(board);
+	}
+	return running;
+}
+
+void
+avr_board_free(
+		avr_board_t * board)
+{
+	for (int i = 0; i < board->link_count; i++) {
+		avr_board_link_t * link = board->link[i];
+		avr_irq_unregister_notify(link->src_irq, _avr_board_link_send, link);
+		avr_cycle_timer_cancel(link->dst->avr, _avr_board_link_timer, link);
+		for (avr_board_chunk_t * c = link->out.head, * n; c; c = n) {
+			n = c->next;
+			free(c);
+		}
+		free(link->in.msg);
+		free(link);
+	}
+	for (int i = 0; i < board->node_count; i++)
+		free(board->node[i].input);
+	free(board->link);
+	memset(board, 0, sizeof(*board));
+}
@@ -0,0 +1,215 @@
+/*
+	sim_board.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A board runs several avr_t, at their own frequencies, on one timebase
+ * in picoseconds. They are advanced one quantum at a time, one after the
+ * other or each on its own thread, and only ever see each other through
+ * the board links.
+ *
+ * A link carries the values raised on an IRQ of one avr to an IRQ of
+ * another, 'latency' later. The values are raised on the destination by
+ * a cycle timer, on the first of its cycles at or after the time they
+ * were sent plus the latency.
+ *
+ * An avr stops at the end of a quantum once its current instruction (or
+ * interrupt) is done, up to AVR_BOARD_OVERSHOOT cycles past it; the
+ * 'margin' is that time for the slowest avr. The destination takes the
+ * values from the link at the start of the quantum they are due in, or
+ * within the margin after it, so it didn't go past them already; and the
+ * quantum is kept shorter than the shortest latency minus the margin, so
+ * they were always sent in an earlier quantum. A run then only depends on
+ * the firmwares and their inputs, not on the quantum, the order the avrs
+ * run in, or whether they run on their own threads. Links with less
+ * latency than that deliver one quantum (and the margin) later.
+ *
+ * With 'threads' set, each avr runs on its own thread, and they wait for
+ * each other at the end of every quantum: the latency of the links is the
+ * lookahead, and is worth making as long as they allow (a bit time for a
+ * UART, or more).
+ *
+ * The avrs are still owned, and terminated, by the caller; it's best to
+ * have them run with AVR_TIME_MAX, since they are paced by the board.
+ */
+#ifndef __SIM_BOARD_H__
+#define __SIM_BOARD_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint64_t avr_board_time_t;		// picoseconds
+
+#define AVR_BOARD_PSEC			1000000000000ULL
+#define AVR_BOARD_MAX_NODES		32
+// default quantum, before any link makes it shorter
+#define AVR_BOARD_QUANTUM		(AVR_BOARD_PSEC / 10000)	// 100us
+// most cycles an avr runs past where it was asked to stop: the end of a
+// 5 cycles instruction, and an interrupt entry
+#define AVR_BOARD_OVERSHOOT		10
+
+// when 'cycle' starts, at 'freq'
+static inline avr_board_time_t
+avr_board_cycle_to_time(
+		uint32_t freq,
+		avr_cycle_count_t cycle)
+{
+	// split so it can't overflow for any 32 bits frequency
+	uint64_t r = (cycle % freq) * 1000000ULL;
+	return (cycle / freq) * AVR_BOARD_PSEC +
+			(r / freq) * 1000000ULL + (r % freq) * 1000000ULL / freq;
+}
+
+// the first cycle, at 'freq', that starts at or after 'time'
+static inline avr_cycle_count_t
+avr_board_time_to_cycle(
+		uint32_t freq,
+		avr_board_time_t time)
+{
+	uint64_t rem = time % AVR_BOARD_PSEC;
+	uint64_t hi = (rem / 1000000ULL) * freq;
+	uint64_t small = (hi % 1000000ULL) * 1000000ULL + (rem % 1000000ULL) * freq;
+	return (time / AVR_BOARD_PSEC) * freq + hi / 1000000ULL +
+			(small + AVR_BOARD_PSEC - 1) / AVR_BOARD_PSEC;
+}
+
+typedef struct avr_board_msg_t {
+	avr_board_time_t	when;	// time it reaches the destination
+	uint32_t			value;
+} avr_board_msg_t;
+
+// the destination's pending messages
+typedef struct avr_board_queue_t {
+	avr_board_msg_t *	msg;
+	int					head, count, size;
+} avr_board_queue_t;
+
+#define AVR_BOARD_CHUNK			256
+
+typedef struct avr_board_chunk_t {
+	struct avr_board_chunk_t *	next;
+	uint32_t					write;	// messages in it so far
+	avr_board_msg_t				msg[AVR_BOARD_CHUNK];
+} avr_board_chunk_t;
+
+/*
+ * What is in flight on a link, a lock free single producer, single
+ * consumer queue: the source pushes at the tail, the destination pops
+ * from the head, and frees the chunks it's done with
+ */
+typedef struct avr_board_fifo_t {
+	avr_board_chunk_t *	head;
+	uint32_t			read;
+	avr_board_chunk_t *	tail;
+} avr_board_fifo_t;
+
+struct avr_board_t;
+
+typedef struct avr_board_node_t {
+	avr_t *				avr;
+	avr_board_time_t	now;	// time it has run to
+	avr_board_time_t	end;	// end of the quantum it is running
+	struct avr_board_t *	board;
+	int					threaded;	// has a thread of its own
+	int					input_count;
+	struct avr_board_link_t ** input;	// the links to this avr
+} avr_board_node_t;
+
+typedef struct avr_board_link_t {
+	struct avr_board_t *	board;
+	avr_board_node_t *		src;
+	avr_board_node_t *		dst;
+	avr_irq_t *				src_irq;
+	avr_irq_t *				dst_irq;
+	avr_board_time_t		latency;
+	avr_board_fifo_t		out;		// sent, not taken yet
+	avr_board_queue_t		in;			// taken, not raised yet
+} avr_board_link_t;
+
+// all the threads meet there at the end of each quantum
+typedef struct avr_board_barrier_t {
+	int					count;
+	int					waiting;
+	int					sense;
+	int					sum, result;
+} avr_board_barrier_t;
+
+typedef struct avr_board_t {
+	avr_board_time_t	now;		// all the avrs have run to there
+	avr_board_time_t	quantum;	// longest one, the links make it shorter
+	avr_board_time_t	lookahead;	// shortest link latency, zero without links
+	avr_board_time_t	margin;		// AVR_BOARD_OVERSHOOT of the slowest avr
+	int					threads;	// one thread per avr
+	avr_board_barrier_t	barrier;
+	int					start;		// the threads can go
+	avr_board_time_t	until;		// of the threaded run
+	int					node_count;
+	avr_board_node_t	node[AVR_BOARD_MAX_NODES];
+	int					link_count;
+	avr_board_link_t **	link;
+} avr_board_t;
+
+// Sets up an empty 'board', with AVR_BOARD_QUANTUM if 'quantum' is zero
+void
+avr_board_init(
+		avr_board_t * board,
+		avr_board_time_t quantum);
+/*
+ * Adds 'avr', which needs its frequency set, starting at the board time.
+ * Returns its node index, or -1 if the board is full
+ */
+int
+avr_board_add(
+		avr_board_t * board,
+		avr_t * avr);
+/*
+ * Raises on 'dst_irq' of 'dst' what is raised on 'src_irq' of 'src',
+ * 'latency' picoseconds later. Returns NULL if either avr isn't on the
+ * board
+ */
+avr_board_link_t *
+avr_board_connect(
+		avr_board_t * board,
+		avr_t * src,
+		avr_irq_t * src_irq,
+		avr_t * dst,
+		avr_irq_t * dst_irq,
+		avr_board_time_t latency);
+/*
+ * Runs all the avrs to 'until'. Returns the number of avrs still
+ * running; the ones that are done, crashed or stopped are left behind.
+ */
+int
+avr_board_run(
+		avr_board_t * board,
+		avr_board_time_t until);
+// Removes the links, and frees the board. The avrs are left alone
+void
+avr_board_free(
+		avr_board_t * board);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_BOARD_H__ */
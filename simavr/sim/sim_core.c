@@ -26,6 +26,12 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_jit.h"
+#include "sim_snapshot.h"
+#include "sim_fuzz.h"
+#include "sim_lcov.h"
+#include "sim_profile.h"
+#include "sim_trace.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
 
@@ -60,24 +66,23 @@ int dont_trace(const char * name)
 		!strcmp(name, "__epilogue_restores__"));
 }
 
-int donttrace = 0;
-
 #define STATE(_f, args...) { \
 	if (avr->trace) {\
 		if (avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {\
 			const char * symn = avr->trace_data->codeline[avr->pc>>1]->symbol; \
 			int dont = 0 && dont_trace(symn);\
-			if (dont!=donttrace) { \
-				donttrace = dont;\
+			if (dont != avr->trace_data->dont_trace) { \
+				avr->trace_data->dont_trace = dont;\
 				DUMP_REG();\
 			}\
-			if (donttrace==0)\
+			if (avr->trace_data->dont_trace == 0)\
 				printf("%04x: %-25s " _f, avr->pc, symn, ## args);\
 		} else \
 			printf("%s: %04x: " _f, __FUNCTION__, avr->pc, ## args);\
 		}\
 	}
-#define SREG() if (avr->trace && donttrace == 0) {\
+#define SREG() if (avr->trace && avr->trace_data->dont_trace == 0) {\
+	avr_flags_sync(avr); \
 	printf("%04x: \t\t\t\t\t\t\t\t\tSREG = ", avr->pc); \
 	for (int _sbi = 0; _sbi < 8; _sbi++)\
 		printf("%c", avr->sreg[_sbi] ? toupper(_sreg_bit_name[_sbi]) : '.');\
@@ -154,6 +159,8 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
 
+	if (avr->data_dirty && addr > avr->ioend)
+		avr_snapshot_dirty(avr->data_dirty, addr - avr->ioend - 1, 1);
 	avr->data[addr] = v;
 }
 
@@ -192,14 +199,18 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 	}
 	if (r > 31) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(r);
+		if (io < MAX_IOs && (avr->io_plain[io] & AVR_IO_PLAIN_W)) {
+			avr->data[r] = v;
+			return;
+		}
 		if (avr->io[io].w.c)
 			avr->io[io].w.c(avr, r, v, avr->io[io].w.param);
 		else
 			avr->data[r] = v;
 		if (avr->io[io].irq) {
+			uint8_t old = avr->io[io].irq[AVR_IOMEM_IRQ_ALL].value;
 			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
+			avr_raise_irq_mask(avr->io[io].irq, old, v, 0xff);
 		}
 	} else
 		avr->data[r] = v;
@@ -264,14 +275,17 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 	} else if (addr > 31 && addr < 31 + MAX_IOs) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
 
+		// no callback, no IRQ, and no gdb watchpoint to check
+		if ((avr->io_plain[io] & AVR_IO_PLAIN_R) && !avr->gdb)
+			return avr->data[addr];
 		if (avr->io[io].r.c)
 			avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
 
 		if (avr->io[io].irq) {
 			uint8_t v = avr->data[addr];
+			uint8_t old = avr->io[io].irq[AVR_IOMEM_IRQ_ALL].value;
 			avr_raise_irq(avr->io[io].irq + AVR_IOMEM_IRQ_ALL, v);
-			for (int i = 0; i < 8; i++)
-				avr_raise_irq(avr->io[io].irq + i, (v >> i) & 1);
+			avr_raise_irq_mask(avr->io[io].irq, old, v, 0xff);
 		}
 	}
 	return avr_core_watch_read(avr, addr);
@@ -319,27 +333,45 @@ avr_flashaddr_t _avr_pop_addr(avr_t * avr)
 }
 
 /*
- * "Pretty" register names
+ * "Pretty" register names, all of them, so they can be shared by threads
  */
-const char * reg_names[255] = {
-		[R_XH] = "XH", [R_XL] = "XL",
-		[R_YH] = "YH", [R_YL] = "YL",
-		[R_ZH] = "ZH", [R_ZL] = "ZL",
-		[R_SPH] = "SPH", [R_SPL] = "SPL",
-		[R_SREG] = "SREG",
+static const char * const reg_names[256] = {
+		"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23",
+		"r24", "r25", "XL", "XH", "YL", "YH", "ZL", "ZH",
+		"io:20", "io:21", "io:22", "io:23", "io:24", "io:25", "io:26", "io:27",
+		"io:28", "io:29", "io:2a", "io:2b", "io:2c", "io:2d", "io:2e", "io:2f",
+		"io:30", "io:31", "io:32", "io:33", "io:34", "io:35", "io:36", "io:37",
+		"io:38", "io:39", "io:3a", "io:3b", "io:3c", "io:3d", "io:3e", "io:3f",
+		"io:40", "io:41", "io:42", "io:43", "io:44", "io:45", "io:46", "io:47",
+		"io:48", "io:49", "io:4a", "io:4b", "io:4c", "io:4d", "io:4e", "io:4f",
+		"io:50", "io:51", "io:52", "io:53", "io:54", "io:55", "io:56", "io:57",
+		"io:58", "io:59", "io:5a", "io:5b", "io:5c", "SPL", "SPH", "SREG",
+		"io:60", "io:61", "io:62", "io:63", "io:64", "io:65", "io:66", "io:67",
+		"io:68", "io:69", "io:6a", "io:6b", "io:6c", "io:6d", "io:6e", "io:6f",
+		"io:70", "io:71", "io:72", "io:73", "io:74", "io:75", "io:76", "io:77",
+		"io:78", "io:79", "io:7a", "io:7b", "io:7c", "io:7d", "io:7e", "io:7f",
+		"io:80", "io:81", "io:82", "io:83", "io:84", "io:85", "io:86", "io:87",
+		"io:88", "io:89", "io:8a", "io:8b", "io:8c", "io:8d", "io:8e", "io:8f",
+		"io:90", "io:91", "io:92", "io:93", "io:94", "io:95", "io:96", "io:97",
+		"io:98", "io:99", "io:9a", "io:9b", "io:9c", "io:9d", "io:9e", "io:9f",
+		"io:a0", "io:a1", "io:a2", "io:a3", "io:a4", "io:a5", "io:a6", "io:a7",
+		"io:a8", "io:a9", "io:aa", "io:ab", "io:ac", "io:ad", "io:ae", "io:af",
+		"io:b0", "io:b1", "io:b2", "io:b3", "io:b4", "io:b5", "io:b6", "io:b7",
+		"io:b8", "io:b9", "io:ba", "io:bb", "io:bc", "io:bd", "io:be", "io:bf",
+		"io:c0", "io:c1", "io:c2", "io:c3", "io:c4", "io:c5", "io:c6", "io:c7",
+		"io:c8", "io:c9", "io:ca", "io:cb", "io:cc", "io:cd", "io:ce", "io:cf",
+		"io:d0", "io:d1", "io:d2", "io:d3", "io:d4", "io:d5", "io:d6", "io:d7",
+		"io:d8", "io:d9", "io:da", "io:db", "io:dc", "io:dd", "io:de", "io:df",
+		"io:e0", "io:e1", "io:e2", "io:e3", "io:e4", "io:e5", "io:e6", "io:e7",
+		"io:e8", "io:e9", "io:ea", "io:eb", "io:ec", "io:ed", "io:ee", "io:ef",
+		"io:f0", "io:f1", "io:f2", "io:f3", "io:f4", "io:f5", "io:f6", "io:f7",
+		"io:f8", "io:f9", "io:fa", "io:fb", "io:fc", "io:fd", "io:fe", "io:ff",
 };
 
-
 const char * avr_regname(uint8_t reg)
 {
-	if (!reg_names[reg]) {
-		char tt[16];
-		if (reg < 32)
-			sprintf(tt, "r%d", reg);
-		else
-			sprintf(tt, "io:%02x", reg);
-		reg_names[reg] = strdup(tt);
-	}
 	return reg_names[reg];
 }
 
@@ -355,6 +387,10 @@ static void _avr_invalid_opcode(avr_t * avr)
 	AVR_LOG(avr, LOG_ERROR, FONT_RED "CORE: *** %04x: Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
 			avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
 #endif
+	if (avr->coverage) {
+		avr->coverage->fault = AVR_FUZZ_INVALID_OPCODE;
+		avr_sadly_crashed(avr, 0);
+	}
 }
 
 #if CONFIG_SIMAVR_TRACE
@@ -363,7 +399,7 @@ static void _avr_invalid_opcode(avr_t * avr)
  */
 void avr_dump_state(avr_t * avr)
 {
-	if (!avr->trace || donttrace)
+	if (!avr->trace || avr->trace_data->dont_trace)
 		return;
 
 	int doit = 0;
@@ -389,73 +425,77 @@ void avr_dump_state(avr_t * avr)
 }
 #endif
 
+/*
+ * Operand extraction from an opcode, used by the decoder
+ */
 #define get_d5(o) \
 		const uint8_t d = (o >> 4) & 0x1f;
 
-#define get_vd5(o) \
-		get_d5(o) \
-		const uint8_t vd = avr->data[d];
-
 #define get_r5(o) \
 		const uint8_t r = ((o >> 5) & 0x10) | (o & 0xf);
 
-#define get_d5_a6(o) \
+#define get_d5_r5(o) \
 		get_d5(o); \
-		const uint8_t A = ((((o >> 9) & 3) << 4) | ((o) & 0xf)) + 32;
+		get_r5(o);
 
-#define get_vd5_s3(o) \
-		get_vd5(o); \
-		const uint8_t s = o & 7;
-
-#define get_vd5_s3_mask(o) \
-		get_vd5_s3(o); \
-		const uint8_t mask = 1 << s;
-
-#define get_vd5_vr5(o) \
-		get_r5(o); \
+#define get_d5_a6(o) \
 		get_d5(o); \
-		const uint8_t vd = avr->data[d], vr = avr->data[r];
+		const uint8_t A = ((((o >> 9) & 3) << 4) | ((o) & 0xf)) + 32;
 
-#define get_d5_vr5(o) \
+#define get_d5_s3(o) \
 		get_d5(o); \
-		get_r5(o); \
-		const uint8_t vr = avr->data[r];
+		const uint8_t s = o & 7;
 
 #define get_h4_k8(o) \
 		const uint8_t h = 16 + ((o >> 4) & 0xf); \
 		const uint8_t k = ((o & 0x0f00) >> 4) | (o & 0xf);
 
-#define get_vh4_k8(o) \
-		get_h4_k8(o) \
-		const uint8_t vh = avr->data[h];
-
 #define get_d5_q6(o) \
 		get_d5(o) \
 		const uint8_t q = ((o & 0x2000) >> 8) | ((o & 0x0c00) >> 7) | (o & 0x7);
 
-#define get_io5(o) \
-		const uint8_t io = ((o >> 3) & 0x1f) + 32;
-
-#define get_io5_b3(o) \
-		get_io5(o); \
-		const uint8_t b = o & 0x7;
-
 #define get_io5_b3mask(o) \
-		get_io5(o); \
+		const uint8_t io = ((o >> 3) & 0x1f) + 32; \
 		const uint8_t mask = 1 << (o & 0x7);
 
 //	const int16_t o = ((int16_t)(op << 4)) >> 3; // CLANG BUG!
 #define get_o12(op) \
 		const int16_t o = ((int16_t)((op << 4) & 0xffff)) >> 3;
 
-#define get_vp2_k6(o) \
+#define get_p2_k6(o) \
 		const uint8_t p = 24 + ((o >> 3) & 0x6); \
-		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf); \
-		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
+		const uint8_t k = ((o & 0x00c0) >> 2) | (o & 0xf);
 
 #define get_sreg_bit(o) \
 		const uint8_t b = (o >> 4) & 7;
 
+/*
+ * Operand fetch from a pre-decoded instruction, used by avr_run_one
+ */
+#define get_vd(dc) \
+		const uint8_t d = (dc)->d, vd = avr->data[d];
+
+#define get_vd_vr(dc) \
+		get_vd(dc); \
+		const uint8_t r = (dc)->r, vr = avr->data[r];
+
+#define get_d_vr(dc) \
+		const uint8_t d = (dc)->d, r = (dc)->r, vr = avr->data[r];
+
+#define get_vh_k(dc) \
+		const uint8_t h = (dc)->d, k = (dc)->k, vh = avr->data[h];
+
+#define get_vd_mask(dc) \
+		get_vd(dc); \
+		const uint8_t mask = (dc)->r;
+
+#define get_io_mask(dc) \
+		const uint8_t io = (dc)->d, mask = (dc)->r;
+
+#define get_vp_k(dc) \
+		const uint8_t p = (dc)->d, k = (dc)->k; \
+		const uint16_t vp = avr->data[p] | (avr->data[p + 1] << 8);
+
 /*
  * Add a "jump" address to the jump trace buffer
  */
@@ -588,17 +628,226 @@ _avr_flags_znv0s (struct avr_t * avr, uint8_t res)
 	_avr_flags_zns(avr, res);
 }
 
+/*
+ * Lazy flags: the ALU opcodes record the kind of operation they did,
+ * and the helpers above only run when the flags are read, which most of
+ * the time is never, as the next ALU opcode overwrites them.
+ */
+enum {
+	AVR_FLAGS_NONE = 0,
+	AVR_FLAGS_ADD,		// ADD, ADC
+	AVR_FLAGS_SUB,		// SUB, SUBI, CP, CPI
+	AVR_FLAGS_SUBC,		// SBC, SBCI, CPC: Z can only be cleared
+	AVR_FLAGS_LOGIC,	// AND, ANDI, OR, ORI, EOR
+	AVR_FLAGS_COM,
+	AVR_FLAGS_NEG,
+	AVR_FLAGS_INC,
+	AVR_FLAGS_DEC,
+	AVR_FLAGS_SHIFT,	// ASR, ROR
+	AVR_FLAGS_LSR,
+	AVR_FLAGS_ADIW,
+	AVR_FLAGS_SBIW,
+	AVR_FLAGS_MUL,		// all the multiplies, C is in 'rr'
+};
+
+#define _F(_f) (1 << S_##_f)
+// flags set by each kind of operation
+static const uint8_t _avr_flags_set[] = {
+	[AVR_FLAGS_ADD] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S) | _F(H),
+	[AVR_FLAGS_SUB] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S) | _F(H),
+	[AVR_FLAGS_SUBC] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S) | _F(H),
+	[AVR_FLAGS_LOGIC] = _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_COM] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_NEG] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S) | _F(H),
+	[AVR_FLAGS_INC] = _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_DEC] = _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_SHIFT] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_LSR] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_ADIW] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_SBIW] = _F(C) | _F(Z) | _F(N) | _F(V) | _F(S),
+	[AVR_FLAGS_MUL] = _F(C) | _F(Z),
+};
+#undef _F
+
+void _avr_flags_resolve(avr_t * avr)
+{
+	const uint16_t res = avr->flags.res, rd = avr->flags.rd, rr = avr->flags.rr;
+
+	switch (avr->flags.op) {
+		case AVR_FLAGS_ADD:
+			_avr_flags_add_zns(avr, res, rd, rr);
+			break;
+		case AVR_FLAGS_SUB:
+			_avr_flags_sub_zns(avr, res, rd, rr);
+			break;
+		case AVR_FLAGS_SUBC:
+			avr->sreg[S_Z] = avr->flags.z;
+			_avr_flags_sub_Rzns(avr, res, rd, rr);
+			break;
+		case AVR_FLAGS_LOGIC:
+			_avr_flags_znv0s(avr, res);
+			break;
+		case AVR_FLAGS_COM:
+			_avr_flags_znv0s(avr, res);
+			avr->sreg[S_C] = 1;
+			break;
+		case AVR_FLAGS_NEG:
+			avr->sreg[S_H] = ((res >> 3) | (rd >> 3)) & 1;
+			avr->sreg[S_V] = res == 0x80;
+			avr->sreg[S_C] = res != 0;
+			_avr_flags_zns(avr, res);
+			break;
+		case AVR_FLAGS_INC:
+			avr->sreg[S_V] = res == 0x80;
+			_avr_flags_zns(avr, res);
+			break;
+		case AVR_FLAGS_DEC:
+			avr->sreg[S_V] = res == 0x7f;
+			_avr_flags_zns(avr, res);
+			break;
+		case AVR_FLAGS_SHIFT:
+			_avr_flags_zcnvs(avr, res, rd);
+			break;
+		case AVR_FLAGS_LSR:
+			avr->sreg[S_N] = 0;
+			_avr_flags_zcvs(avr, res, rd);
+			break;
+		case AVR_FLAGS_ADIW:
+			avr->sreg[S_V] = ((~rd & res) >> 15) & 1;
+			avr->sreg[S_C] = ((~res & rd) >> 15) & 1;
+			_avr_flags_zns16(avr, res);
+			break;
+		case AVR_FLAGS_SBIW:
+			avr->sreg[S_V] = ((rd & ~res) >> 15) & 1;
+			avr->sreg[S_C] = ((res & ~rd) >> 15) & 1;
+			_avr_flags_zns16(avr, res);
+			break;
+		case AVR_FLAGS_MUL:
+			avr->sreg[S_C] = rr;
+			avr->sreg[S_Z] = res == 0;
+			break;
+	}
+	avr->flags.op = AVR_FLAGS_NONE;
+}
+
+/*
+ * Records an ALU operation; the pending one is resolved first if it
+ * sets flags this one doesn't.
+ */
+static inline void
+_avr_flags_lazy(avr_t * avr, uint8_t op, uint16_t res, uint16_t rd, uint16_t rr)
+{
+	if (avr->flags.op && (_avr_flags_set[avr->flags.op] & ~_avr_flags_set[op]))
+		_avr_flags_resolve(avr);
+	avr->flags.op = op;
+	avr->flags.res = res;
+	avr->flags.rd = rd;
+	avr->flags.rr = rr;
+}
+
+/*
+ * C and Z, straight from the pending operation, for the carry chains
+ * and the branches, so these don't need all the flags resolved.
+ */
+static inline uint8_t
+_avr_flags_c(avr_t * avr)
+{
+	const uint16_t res = avr->flags.res, rd = avr->flags.rd, rr = avr->flags.rr;
+
+	switch (avr->flags.op) {
+		case AVR_FLAGS_ADD:
+			return (((rd & rr) | (rr & ~res) | (~res & rd)) >> 7) & 1;
+		case AVR_FLAGS_SUB:
+		case AVR_FLAGS_SUBC:
+			return (((~rd & rr) | (rr & res) | (res & ~rd)) >> 7) & 1;
+		case AVR_FLAGS_COM:
+			return 1;
+		case AVR_FLAGS_NEG:
+			return res != 0;
+		case AVR_FLAGS_SHIFT:
+		case AVR_FLAGS_LSR:
+			return rd & 1;
+		case AVR_FLAGS_ADIW:
+			return ((~res & rd) >> 15) & 1;
+		case AVR_FLAGS_SBIW:
+			return ((res & ~rd) >> 15) & 1;
+		case AVR_FLAGS_MUL:
+			return rr;
+		default:	// not changed by the pending operation
+			return avr->sreg[S_C];
+	}
+}
+
+static inline uint8_t
+_avr_flags_z(avr_t * avr)
+{
+	switch (avr->flags.op) {
+		case AVR_FLAGS_NONE:
+			return avr->sreg[S_Z];
+		case AVR_FLAGS_SUBC:
+			return avr->flags.z && avr->flags.res == 0;
+		default:
+			return avr->flags.res == 0;
+	}
+}
+
 static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 {
-	uint16_t o = _avr_flash_read16le(avr, pc) & 0xfe0f;
-	return	o == 0x9200 || // STS ! Store Direct to Data Space
-			o == 0x9000 || // LDS Load Direct from Data Space
-			o == 0x940c || // JMP Long Jump
-			o == 0x940d || // JMP Long Jump
-			o == 0x940e ||  // CALL Long Call to sub
-			o == 0x940f; // CALL Long Call to sub
+	return avr_opcode_is_32_bits(_avr_flash_read16le(avr, pc));
 }
 
+/*
+ * Maximum number of instructions in a basic block, see avr_decoded_t
+ */
+#define AVR_BLOCK_MAX	32
+/*
+ * Maximum number of words in a polling loop, see avr_decoded_t
+ */
+#define AVR_LOOP_MAX	8
+
+void avr_decode_invalidate(avr_t * avr, avr_flashaddr_t address, uint32_t size)
+{
+	avr_snapshot_dirty(avr->flash_dirty, address, size);
+	if (!avr->decoded || !size)
+		return;
+	uint32_t words = (avr->flashend + 1) >> 1;
+	uint32_t first = address >> 1;
+	uint32_t last = (address + size - 1) >> 1;
+	/*
+	 * The words before the range go too: one could be a 32 bits instruction
+	 * or a skip whose decoded form depends on the first word of the range,
+	 * and the basic blocks starting up to AVR_BLOCK_MAX words before might
+	 * run into it. So do the polling loops ending up to AVR_LOOP_MAX after.
+	 */
+	first = first > AVR_BLOCK_MAX ? first - AVR_BLOCK_MAX : 0;
+	last += AVR_LOOP_MAX;
+	if (last >= words)
+		last = words - 1;
+	if (first <= last) {
+		memset(avr->decoded + first, 0, (last - first + 1) * sizeof(avr_decoded_t));
+		avr_jit_invalidate(avr, first, last);
+	}
+}
+
+/*
+ * The AVR_ISA_* feature each optional instruction needs
+ */
+static const uint8_t _avr_op_isa[AVR_OP_COUNT] = {
+	[AVR_OP_MUL] = AVR_ISA_MUL, [AVR_OP_MULS] = AVR_ISA_MUL,
+	[AVR_OP_MULSU] = AVR_ISA_MUL, [AVR_OP_FMUL] = AVR_ISA_MUL,
+	[AVR_OP_FMULS] = AVR_ISA_MUL, [AVR_OP_FMULSU] = AVR_ISA_MUL,
+	[AVR_OP_JMP] = AVR_ISA_JMP, [AVR_OP_CALL] = AVR_ISA_JMP,
+	[AVR_OP_ELPM_R0] = AVR_ISA_ELPM, [AVR_OP_ELPM] = AVR_ISA_ELPM,
+	[AVR_OP_EIJMP] = AVR_ISA_EIND, [AVR_OP_EICALL] = AVR_ISA_EIND,
+};
+
+#define DECODED(_op, _cycles, _d, _r, _k) { \
+		*dc = (avr_decoded_t) { .op = _op, .cycles = _cycles, \
+				.d = _d, .r = _r, .k = _k }; \
+	}
+
+static uint8_t _avr_decode_loop(avr_t * avr, avr_flashaddr_t pc, avr_decoded_t * b);
+
 /*
  * Main opcode decoder
  *
@@ -607,137 +856,66 @@ static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
  * However, a lot of these only became apparent later on, so SOME instructions
  * (skip of bit set etc) are compact, and some could use some refactoring (the ALU
  * ones scream to be factored).
- * I assume that the decoder could easily be 2/3 of it's current size.
+ *
+ * The decoder only runs once per flash word; it extracts the operands and
+ * the base cycle count into avr->decoded, and avr_run_one() executes from there.
  *
  * + It lacks the "extended" XMega jumps.
- * + It also doesn't check whether the core it's
- *   emulating is supposed to have the fancy instructions, like multiply and such.
+ * + The optional instructions the core doesn't have (avr->isa_missing, and
+ *   ELPM/EIJMP without a RAMPZ/EIND register) decode as invalid, so the
+ *   executor doesn't need to check for them.
  *
  * The number of cycles taken by instruction has been added, but might not be
  * entirely accurate.
  */
-avr_flashaddr_t avr_run_one(avr_t * avr)
+static avr_decoded_t * _avr_decode_one(avr_t * avr, avr_flashaddr_t pc)
 {
-run_one_again:
-#if CONFIG_SIMAVR_TRACE
-	/*
-	 * this traces spurious reset or bad jumps
-	 */
-	if ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend) {
-//		avr->trace = 1;
-		STATE("RESET\n");
-		crash(avr);
-	}
-	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
-#endif
-
-	/* Ensure we don't crash simavr due to a bad instruction reading past
-	 * the end of the flash.
-	 */
-	if (unlikely(avr->pc >= avr->flashend)) {
-		STATE("CRASH\n");
-		crash(avr);
-		return 0;
-	}
+	avr_decoded_t * dc = &avr->decoded[pc >> 1];
+	uint16_t opcode = _avr_flash_read16le(avr, pc);
+	avr_flashaddr_t new_pc = pc + 2;
+	// number of words a skip instruction would skip
+	uint8_t skip = _avr_is_instruction_32_bits(avr, new_pc) ? 2 : 1;
 
-	uint32_t		opcode = _avr_flash_read16le(avr, avr->pc);
-	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
-	int 			cycle = 1;
+	DECODED(AVR_OP_INVALID, 1, 0, 0, 0);
 
 	switch (opcode & 0xf000) {
 		case 0x0000: {
 			switch (opcode) {
-				case 0x0000: {	// NOP
-					STATE("nop\n");
-				}	break;
+				case 0x0000:	// NOP
+					DECODED(AVR_OP_NOP, 1, 0, 0, 0);
+					break;
 				default: {
 					switch (opcode & 0xfc00) {
 						case 0x0400: {	// CPC -- Compare with carry -- 0000 01rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
+							get_d5_r5(opcode);
+							DECODED(AVR_OP_CPC, 1, d, r, 0);
 						}	break;
 						case 0x0c00: {	// ADD -- Add without carry -- 0000 11rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd + vr;
-							if (r == d) {
-								STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
-							} else {
-								STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-							}
-							_avr_set_r(avr, d, res);
-							_avr_flags_add_zns(avr, res, vd, vr);
-							SREG();
+							get_d5_r5(opcode);
+							DECODED(AVR_OP_ADD, 1, d, r, 0);
 						}	break;
 						case 0x0800: {	// SBC -- Subtract with carry -- 0000 10rd dddd rrrr
-							get_vd5_vr5(opcode);
-							uint8_t res = vd - vr - avr->sreg[S_C];
-							STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_sub_Rzns(avr, res, vd, vr);
-							SREG();
+							get_d5_r5(opcode);
+							DECODED(AVR_OP_SBC, 1, d, r, 0);
 						}	break;
 						default:
 							switch (opcode & 0xff00) {
-								case 0x0100: {	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
-									uint8_t d = ((opcode >> 4) & 0xf) << 1;
-									uint8_t r = ((opcode) & 0xf) << 1;
-									STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
-									uint16_t vr = avr->data[r] | (avr->data[r + 1] << 8);
-									_avr_set_r16le(avr, d, vr);
-								}	break;
-								case 0x0200: {	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
-									int8_t r = 16 + (opcode & 0xf);
-									int8_t d = 16 + ((opcode >> 4) & 0xf);
-									int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-									STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r16le(avr, 0, res);
-									avr->sreg[S_C] = (res >> 15) & 1;
-									avr->sreg[S_Z] = res == 0;
-									cycle++;
-									SREG();
-								}	break;
+								case 0x0100:	// MOVW -- Copy Register Word -- 0000 0001 dddd rrrr
+									DECODED(AVR_OP_MOVW, 1, ((opcode >> 4) & 0xf) << 1, (opcode & 0xf) << 1, 0);
+									break;
+								case 0x0200:	// MULS -- Multiply Signed -- 0000 0010 dddd rrrr
+									DECODED(AVR_OP_MULS, 2, 16 + ((opcode >> 4) & 0xf), 16 + (opcode & 0xf), 0);
+									break;
 								case 0x0300: {	// MUL -- Multiply -- 0000 0011 fddd frrr
-									int8_t r = 16 + (opcode & 0x7);
-									int8_t d = 16 + ((opcode >> 4) & 0x7);
-									int16_t res = 0;
-									uint8_t c = 0;
-									T(const char * name = "";)
-									switch (opcode & 0x88) {
-										case 0x00: 	// MULSU -- Multiply Signed Unsigned -- 0000 0011 0ddd 0rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											T(name = "mulsu";)
-											break;
-										case 0x08: 	// FMUL -- Fractional Multiply Unsigned -- 0000 0011 0ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmul";)
-											break;
-										case 0x80: 	// FMULS -- Multiply Signed -- 0000 0011 1ddd 0rrr
-											res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmuls";)
-											break;
-										case 0x88: 	// FMULSU -- Multiply Signed Unsigned -- 0000 0011 1ddd 1rrr
-											res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
-											c = (res >> 15) & 1;
-											res <<= 1;
-											T(name = "fmulsu";)
-											break;
-									}
-									cycle++;
-									STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
-									_avr_set_r16le(avr, 0, res);
-									avr->sreg[S_C] = c;
-									avr->sreg[S_Z] = res == 0;
-									SREG();
+									static const uint8_t ops[4] = {
+										AVR_OP_MULSU,	// 0000 0011 0ddd 0rrr
+										AVR_OP_FMUL,	// 0000 0011 0ddd 1rrr
+										AVR_OP_FMULS,	// 0000 0011 1ddd 0rrr
+										AVR_OP_FMULSU,	// 0000 0011 1ddd 1rrr
+									};
+									DECODED(ops[((opcode >> 6) & 2) | ((opcode >> 3) & 1)], 2,
+											16 + ((opcode >> 4) & 0x7), 16 + (opcode & 0x7), 0);
 								}	break;
-								default: _avr_invalid_opcode(avr);
 							}
 					}
 				}
@@ -745,136 +923,51 @@ run_one_again:
 		}	break;
 
 		case 0x1000: {
+			get_d5_r5(opcode);
 			switch (opcode & 0xfc00) {
-				case 0x1800: {	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1000: {	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint16_t res = vd == vr;
-					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
-					if (res) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
-					}
-				}	break;
-				case 0x1400: {	// CP -- Compare -- 0001 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd - vr;
-					STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_flags_sub_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				case 0x1c00: {	// ADD -- Add with carry -- 0001 11rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd + vr + avr->sreg[S_C];
-					if (r == d) {
-						STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
-					} else {
-						STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_add_zns(avr, res, vd, vr);
-					SREG();
-				}	break;
-				default: _avr_invalid_opcode(avr);
+				case 0x1800:	// SUB -- Subtract without carry -- 0001 10rd dddd rrrr
+					DECODED(AVR_OP_SUB, 1, d, r, 0);
+					break;
+				case 0x1000:	// CPSE -- Compare, skip if equal -- 0001 00rd dddd rrrr
+					DECODED(AVR_OP_CPSE, 1, d, r, skip);
+					break;
+				case 0x1400:	// CP -- Compare -- 0001 01rd dddd rrrr
+					DECODED(AVR_OP_CP, 1, d, r, 0);
+					break;
+				case 0x1c00:	// ADD -- Add with carry -- 0001 11rd dddd rrrr
+					DECODED(AVR_OP_ADC, 1, d, r, 0);
+					break;
 			}
 		}	break;
 
 		case 0x2000: {
+			get_d5_r5(opcode);
 			switch (opcode & 0xfc00) {
-				case 0x2000: {	// AND -- Logical AND -- 0010 00rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd & vr;
-					if (r == d) {
-						STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2400: {	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd ^ vr;
-					if (r==d) {
-						STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
-					} else {
-						STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					}
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2800: {	// OR -- Logical OR -- 0010 10rd dddd rrrr
-					get_vd5_vr5(opcode);
-					uint8_t res = vd | vr;
-					STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-					_avr_flags_znv0s(avr, res);
-					SREG();
-				}	break;
-				case 0x2c00: {	// MOV -- 0010 11rd dddd rrrr
-					get_d5_vr5(opcode);
-					uint8_t res = vr;
-					STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
-					_avr_set_r(avr, d, res);
-				}	break;
-				default: _avr_invalid_opcode(avr);
+				case 0x2000:	// AND -- Logical AND -- 0010 00rd dddd rrrr
+					DECODED(AVR_OP_AND, 1, d, r, 0);
+					break;
+				case 0x2400:	// EOR -- Logical Exclusive OR -- 0010 01rd dddd rrrr
+					DECODED(AVR_OP_EOR, 1, d, r, 0);
+					break;
+				case 0x2800:	// OR -- Logical OR -- 0010 10rd dddd rrrr
+					DECODED(AVR_OP_OR, 1, d, r, 0);
+					break;
+				case 0x2c00:	// MOV -- 0010 11rd dddd rrrr
+					DECODED(AVR_OP_MOV, 1, d, r, 0);
+					break;
 			}
 		}	break;
 
-		case 0x3000: {	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
-
-		case 0x4000: {	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k - avr->sreg[S_C];
-			STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_Rzns(avr, res, vh, k);
-			SREG();
-		}	break;
-
-		case 0x5000: {	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh - k;
-			STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
-			_avr_set_r(avr, h, res);
-			_avr_flags_sub_zns(avr, res, vh, k);
-			SREG();
-		}	break;
-
-		case 0x6000: {	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh | k;
-			STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
-		}	break;
-
+		case 0x3000:	// CPI -- Compare Immediate -- 0011 kkkk hhhh kkkk
+		case 0x4000:	// SBCI -- Subtract Immediate With Carry -- 0100 kkkk hhhh kkkk
+		case 0x5000:	// SUBI -- Subtract Immediate -- 0101 kkkk hhhh kkkk
+		case 0x6000:	// ORI aka SBR -- Logical OR with Immediate -- 0110 kkkk hhhh kkkk
 		case 0x7000: {	// ANDI	-- Logical AND with Immediate -- 0111 kkkk hhhh kkkk
-			get_vh4_k8(opcode);
-			uint8_t res = vh & k;
-			STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
-			_avr_set_r(avr, h, res);
-			_avr_flags_znv0s(avr, res);
-			SREG();
+			static const uint8_t ops[5] = {
+				AVR_OP_CPI, AVR_OP_SBCI, AVR_OP_SUBI, AVR_OP_ORI, AVR_OP_ANDI
+			};
+			get_h4_k8(opcode);
+			DECODED(ops[(opcode >> 12) - 3], 1, h, 0, k);
 		}	break;
 
 		case 0xa000:
@@ -887,34 +980,17 @@ run_one_again:
 			 * y = 16 bits register index, 1 = Y, 0 = X
 			 * q = 6 bit displacement
 			 */
+			get_d5_q6(opcode);
+			int store = (opcode & 0x0200) != 0;
 			switch (opcode & 0xd008) {
 				case 0xa000:
-				case 0x8000: {	// LD (LDD) -- Load Indirect using Z -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
+				case 0x8000:	// LD (LDD) -- Load Indirect using Z -- 10q0 qqsd dddd yqqq
+					DECODED(store ? AVR_OP_STD_Z : AVR_OP_LDD_Z, 2, d, 0, q); // 2 cycles, 3 for tinyavr
+					break;
 				case 0xa008:
-				case 0x8008: {	// LD (LDD) -- Load Indirect using Y -- 10q0 qqsd dddd yqqq
-					uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
-					get_d5_q6(opcode);
-					if (opcode & 0x0200) {
-						STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
-						_avr_set_ram(avr, v+q, avr->data[d]);
-					} else {
-						STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[d+q]);
-						_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
-					}
-					cycle += 1; // 2 cycles, 3 for tinyavr
-				}	break;
-				default: _avr_invalid_opcode(avr);
+				case 0x8008:	// LD (LDD) -- Load Indirect using Y -- 10q0 qqsd dddd yqqq
+					DECODED(store ? AVR_OP_STD_Y : AVR_OP_LDD_Y, 2, d, 0, q); // 2 cycles, 3 for tinyavr
+					break;
 			}
 		}	break;
 
@@ -922,120 +998,58 @@ run_one_again:
 			/* this is an annoying special case, but at least these lines handle all the SREG set/clear opcodes */
 			if ((opcode & 0xff0f) == 0x9408) {
 				get_sreg_bit(opcode);
-				STATE("%s%c\n", opcode & 0x0080 ? "cl" : "se", _sreg_bit_name[b]);
-				avr_sreg_set(avr, b, (opcode & 0x0080) == 0);
-				SREG();
+				DECODED(AVR_OP_SREG, 1, b, (opcode & 0x0080) == 0, 0);
 			} else switch (opcode) {
-				case 0x9588: { // SLEEP -- 1001 0101 1000 1000
-					STATE("sleep\n");
-					/* Don't sleep if there are interrupts about to be serviced.
-					 * Without this check, it was possible to incorrectly enter a state
-					 * in which the cpu was sleeping and interrupts were disabled. For more
-					 * details, see the commit message. */
-					if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
-						avr->state = cpu_Sleeping;
-				}	break;
-				case 0x9598: { // BREAK -- 1001 0101 1001 1000
-					STATE("break\n");
-					if (avr->gdb) {
-						// if gdb is on, we break here as in here
-						// and we do so until gdb restores the instruction
-						// that was here before
-						avr->state = cpu_StepDone;
-						new_pc = avr->pc;
-						cycle = 0;
-					}
-				}	break;
-				case 0x95a8: { // WDR -- Watchdog Reset -- 1001 0101 1010 1000
-					STATE("wdr\n");
-					avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
-				}	break;
-				case 0x95e8: { // SPM -- Store Program Memory -- 1001 0101 1110 1000
-					STATE("spm\n");
-					avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
-				}	break;
-				case 0x9409:   // IJMP -- Indirect jump -- 1001 0100 0000 1001
-				case 0x9419:   // EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
-				case 0x9509:   // ICALL -- Indirect Call to Subroutine -- 1001 0101 0000 1001
-				case 0x9519: { // EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
-					int e = opcode & 0x10;
-					int p = opcode & 0x100;
-					if (e && !avr->eind)
-						_avr_invalid_opcode(avr);
-					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					if (e)
-						z |= avr->data[avr->eind] << 16;
-					STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
-					if (p)
-						cycle += _avr_push_addr(avr, new_pc) - 1;
-					new_pc = z << 1;
-					cycle++;
-					TRACE_JUMP();
-				}	break;
-				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
-					avr_sreg_set(avr, S_I, 1);
-					avr_interrupt_reti(avr);
-					FALLTHROUGH
-				case 0x9508: {	// RET -- Return -- 1001 0101 0000 1000
-					new_pc = _avr_pop_addr(avr);
-					cycle += 1 + avr->address_size;
-					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
-					TRACE_JUMP();
-					STACK_FRAME_POP();
-				}	break;
-				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
-					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-					STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
-					cycle += 2; // 3 cycles
-					_avr_set_r(avr, 0, avr->flash[z]);
-				}	break;
-				case 0x95d8: {	// ELPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1101 1000
-					if (!avr->rampz)
-						_avr_invalid_opcode(avr);
-					uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
-					STATE("elpm %s, (Z[%02x:%04x])\n", avr_regname(0), z >> 16, z & 0xffff);
-					_avr_set_r(avr, 0, avr->flash[z]);
-					cycle += 2; // 3 cycles
-				}	break;
+				case 0x9588:	// SLEEP -- 1001 0101 1000 1000
+					DECODED(AVR_OP_SLEEP, 1, 0, 0, 0);
+					break;
+				case 0x9598:	// BREAK -- 1001 0101 1001 1000
+					DECODED(AVR_OP_BREAK, 1, 0, 0, 0);
+					break;
+				case 0x95a8:	// WDR -- Watchdog Reset -- 1001 0101 1010 1000
+					DECODED(AVR_OP_WDR, 1, 0, 0, 0);
+					break;
+				case 0x95e8:	// SPM -- Store Program Memory -- 1001 0101 1110 1000
+					DECODED(AVR_OP_SPM, 1, 0, 0, 0);
+					break;
+				case 0x9409:	// IJMP -- Indirect jump -- 1001 0100 0000 1001
+					DECODED(AVR_OP_IJMP, 2, 0, 0, 0);
+					break;
+				case 0x9419:	// EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
+					DECODED(AVR_OP_EIJMP, 2, 0, 0, 0);
+					break;
+				case 0x9509:	// ICALL -- Indirect Call to Subroutine -- 1001 0101 0000 1001
+					DECODED(AVR_OP_ICALL, 1 + avr->address_size, 0, 0, 0);
+					break;
+				case 0x9519:	// EICALL -- Indirect Call to Subroutine -- 1001 0101 0001 1001   bit 8 is "push pc"
+					DECODED(AVR_OP_EICALL, 1 + avr->address_size, 0, 0, 0);
+					break;
+				case 0x9518:	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
+					DECODED(AVR_OP_RETI, 2 + avr->address_size, 0, 0, 0);
+					break;
+				case 0x9508:	// RET -- Return -- 1001 0101 0000 1000
+					DECODED(AVR_OP_RET, 2 + avr->address_size, 0, 0, 0);
+					break;
+				case 0x95c8:	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
+					DECODED(AVR_OP_LPM_R0, 3, 0, 0, 0);
+					break;
+				case 0x95d8:	// ELPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1101 1000
+					DECODED(AVR_OP_ELPM_R0, 3, 0, 0, 0);
+					break;
 				default:  {
+					get_d5(opcode);
 					switch (opcode & 0xfe0f) {
-						case 0x9000: {	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
-							get_d5(opcode);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							new_pc += 2;
-							STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
-							_avr_set_r(avr, d, _avr_get_ram(avr, x));
-							cycle++; // 2 cycles
-						}	break;
+						case 0x9000:	// LDS -- Load Direct from Data Space, 32 bits -- 1001 0000 0000 0000
+							DECODED(AVR_OP_LDS, 2, d, 0, _avr_flash_read16le(avr, new_pc));
+							break;
 						case 0x9005:
-						case 0x9004: {	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
-							get_d5(opcode);
-							uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-							int op = opcode & 1;
-							STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r16le_hl(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
+						case 0x9004:	// LPM -- Load Program Memory -- 1001 000d dddd 01oo
+							DECODED(AVR_OP_LPM, 3, d, opcode & 1, 0);
+							break;
 						case 0x9006:
-						case 0x9007: {	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
-							if (!avr->rampz)
-								_avr_invalid_opcode(avr);
-							uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
-							get_d5(opcode);
-							int op = opcode & 1;
-							STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
-							_avr_set_r(avr, d, avr->flash[z]);
-							if (op) {
-								z++;
-								_avr_set_r(avr, avr->rampz, z >> 16);
-								_avr_set_r16le_hl(avr, R_ZL, z);
-							}
-							cycle += 2; // 3 cycles
-						}	break;
+						case 0x9007:	// ELPM -- Extended Load Program Memory -- 1001 000d dddd 01oo
+							DECODED(AVR_OP_ELPM, 3, d, opcode & 1, 0);
+							break;
 						/*
 						 * Load store instructions
 						 *
@@ -1046,270 +1060,108 @@ run_one_again:
 						 */
 						case 0x900c:
 						case 0x900d:
-						case 0x900e: {	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
-							cycle++; // 2 cycles (1 for tinyavr, except with inc/dec 2)
-							if (op == 2) x--;
-							uint8_t vd = _avr_get_ram(avr, x);
-							if (op == 1) x++;
-							_avr_set_r16le_hl(avr, R_XL, x);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x900e:	// LD -- Load Indirect from Data using X -- 1001 000d dddd 11oo
+							DECODED(AVR_OP_LD_X, 2, d, opcode & 3, 0); // 2 cycles (1 for tinyavr, except with inc/dec 2)
+							break;
 						case 0x920c:
 						case 0x920d:
-						case 0x920e: {	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
-							STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) x--;
-							_avr_set_ram(avr, x, vd);
-							if (op == 1) x++;
-							_avr_set_r16le_hl(avr, R_XL, x);
-						}	break;
+						case 0x920e:	// ST -- Store Indirect Data Space X -- 1001 001d dddd 11oo
+							DECODED(AVR_OP_ST_X, 2, d, opcode & 3, 0); // 2 cycles, except tinyavr
+							break;
 						case 0x9009:
-						case 0x900a: {	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) y--;
-							uint8_t vd = _avr_get_ram(avr, y);
-							if (op == 1) y++;
-							_avr_set_r16le_hl(avr, R_YL, y);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x900a:	// LD -- Load Indirect from Data using Y -- 1001 000d dddd 10oo
+							DECODED(AVR_OP_LD_Y, 2, d, opcode & 3, 0);
+							break;
 						case 0x9209:
-						case 0x920a: {	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
-							STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++;
-							if (op == 2) y--;
-							_avr_set_ram(avr, y, vd);
-							if (op == 1) y++;
-							_avr_set_r16le_hl(avr, R_YL, y);
-						}	break;
-						case 0x9200: {	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
-							get_vd5(opcode);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							new_pc += 2;
-							STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
-							cycle++;
-							_avr_set_ram(avr, x, vd);
-						}	break;
+						case 0x920a:	// ST -- Store Indirect Data Space Y -- 1001 001d dddd 10oo
+							DECODED(AVR_OP_ST_Y, 2, d, opcode & 3, 0);
+							break;
+						case 0x9200:	// STS -- Store Direct to Data Space, 32 bits -- 1001 0010 0000 0000
+							DECODED(AVR_OP_STS, 2, d, 0, _avr_flash_read16le(avr, new_pc));
+							break;
 						case 0x9001:
-						case 0x9002: {	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
-							int op = opcode & 3;
-							get_d5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
-							cycle++;; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							uint8_t vd = _avr_get_ram(avr, z);
-							if (op == 1) z++;
-							_avr_set_r16le_hl(avr, R_ZL, z);
-							_avr_set_r(avr, d, vd);
-						}	break;
+						case 0x9002:	// LD -- Load Indirect from Data using Z -- 1001 000d dddd 00oo
+							DECODED(AVR_OP_LD_Z, 2, d, opcode & 3, 0);
+							break;
 						case 0x9201:
-						case 0x9202: {	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
-							int op = opcode & 3;
-							get_vd5(opcode);
-							uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
-							STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
-							cycle++; // 2 cycles, except tinyavr
-							if (op == 2) z--;
-							_avr_set_ram(avr, z, vd);
-							if (op == 1) z++;
-							_avr_set_r16le_hl(avr, R_ZL, z);
-						}	break;
-						case 0x900f: {	// POP -- 1001 000d dddd 1111
-							get_d5(opcode);
-							_avr_set_r(avr, d, _avr_pop8(avr));
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
-							cycle++;
-						}	break;
-						case 0x920f: {	// PUSH -- 1001 001d dddd 1111
-							get_vd5(opcode);
-							_avr_push8(avr, vd);
-							T(uint16_t sp = _avr_sp_get(avr);)
-							STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
-							cycle++;
-						}	break;
-						case 0x9400: {	// COM -- One's Complement -- 1001 010d dddd 0000
-							get_vd5(opcode);
-							uint8_t res = 0xff - vd;
-							STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							_avr_flags_znv0s(avr, res);
-							avr->sreg[S_C] = 1;
-							SREG();
-						}	break;
-						case 0x9401: {	// NEG -- Two's Complement -- 1001 010d dddd 0001
-							get_vd5(opcode);
-							uint8_t res = 0x00 - vd;
-							STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
-							avr->sreg[S_V] = res == 0x80;
-							avr->sreg[S_C] = res != 0;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9402: {	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
-							get_vd5(opcode);
-							uint8_t res = (vd >> 4) | (vd << 4) ;
-							STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-						}	break;
-						case 0x9403: {	// INC -- Increment -- 1001 010d dddd 0011
-							get_vd5(opcode);
-							uint8_t res = vd + 1;
-							STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x80;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
-						case 0x9405: {	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
-							get_vd5(opcode);
-							uint8_t res = (vd >> 1) | (vd & 0x80);
-							STATE("asr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9406: {	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
-							get_vd5(opcode);
-							uint8_t res = vd >> 1;
-							STATE("lsr %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_N] = 0;
-							_avr_flags_zcvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x9407: {	// ROR -- Rotate Right -- 1001 010d dddd 0111
-							get_vd5(opcode);
-							uint8_t res = (avr->sreg[S_C] ? 0x80 : 0) | vd >> 1;
-							STATE("ror %s[%02x]\n", avr_regname(d), vd);
-							_avr_set_r(avr, d, res);
-							_avr_flags_zcnvs(avr, res, vd);
-							SREG();
-						}	break;
-						case 0x940a: {	// DEC -- Decrement -- 1001 010d dddd 1010
-							get_vd5(opcode);
-							uint8_t res = vd - 1;
-							STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
-							_avr_set_r(avr, d, res);
-							avr->sreg[S_V] = res == 0x7f;
-							_avr_flags_zns(avr, res);
-							SREG();
-						}	break;
+						case 0x9202:	// ST -- Store Indirect Data Space Z -- 1001 001d dddd 00oo
+							DECODED(AVR_OP_ST_Z, 2, d, opcode & 3, 0);
+							break;
+						case 0x900f:	// POP -- 1001 000d dddd 1111
+							DECODED(AVR_OP_POP, 2, d, 0, 0);
+							break;
+						case 0x920f:	// PUSH -- 1001 001d dddd 1111
+							DECODED(AVR_OP_PUSH, 2, d, 0, 0);
+							break;
+						case 0x9400:	// COM -- One's Complement -- 1001 010d dddd 0000
+							DECODED(AVR_OP_COM, 1, d, 0, 0);
+							break;
+						case 0x9401:	// NEG -- Two's Complement -- 1001 010d dddd 0001
+							DECODED(AVR_OP_NEG, 1, d, 0, 0);
+							break;
+						case 0x9402:	// SWAP -- Swap Nibbles -- 1001 010d dddd 0010
+							DECODED(AVR_OP_SWAP, 1, d, 0, 0);
+							break;
+						case 0x9403:	// INC -- Increment -- 1001 010d dddd 0011
+							DECODED(AVR_OP_INC, 1, d, 0, 0);
+							break;
+						case 0x9405:	// ASR -- Arithmetic Shift Right -- 1001 010d dddd 0101
+							DECODED(AVR_OP_ASR, 1, d, 0, 0);
+							break;
+						case 0x9406:	// LSR -- Logical Shift Right -- 1001 010d dddd 0110
+							DECODED(AVR_OP_LSR, 1, d, 0, 0);
+							break;
+						case 0x9407:	// ROR -- Rotate Right -- 1001 010d dddd 0111
+							DECODED(AVR_OP_ROR, 1, d, 0, 0);
+							break;
+						case 0x940a:	// DEC -- Decrement -- 1001 010d dddd 1010
+							DECODED(AVR_OP_DEC, 1, d, 0, 0);
+							break;
 						case 0x940c:
 						case 0x940d: {	// JMP -- Long Call to sub, 32 bits -- 1001 010a aaaa 110a
 							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							a = (a << 16) | x;
-							STATE("jmp 0x%06x\n", a);
-							new_pc = a << 1;
-							cycle += 2;
-							TRACE_JUMP();
+							a = (a << 16) | _avr_flash_read16le(avr, new_pc);
+							DECODED(AVR_OP_JMP, 3, 0, 0, a << 1);
 						}	break;
 						case 0x940e:
 						case 0x940f: {	// CALL -- Long Call to sub, 32 bits -- 1001 010a aaaa 111a
 							avr_flashaddr_t a = ((opcode & 0x01f0) >> 3) | (opcode & 1);
-							uint16_t x = _avr_flash_read16le(avr, new_pc);
-							a = (a << 16) | x;
-							STATE("call 0x%06x\n", a);
-							new_pc += 2;
-							cycle += 1 + _avr_push_addr(avr, new_pc);
-							new_pc = a << 1;
-							TRACE_JUMP();
-							STACK_FRAME_PUSH();
+							a = (a << 16) | _avr_flash_read16le(avr, new_pc);
+							DECODED(AVR_OP_CALL, 2 + avr->address_size, 0, 0, a << 1);
 						}	break;
 
 						default: {
 							switch (opcode & 0xff00) {
 								case 0x9600: {	// ADIW -- Add Immediate to Word -- 1001 0110 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp + k;
-									STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r16le_hl(avr, p, res);
-									avr->sreg[S_V] = ((~vp & res) >> 15) & 1;
-									avr->sreg[S_C] = ((~res & vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
+									get_p2_k6(opcode);
+									DECODED(AVR_OP_ADIW, 2, p, 0, k);
 								}	break;
 								case 0x9700: {	// SBIW -- Subtract Immediate from Word -- 1001 0111 KKpp KKKK
-									get_vp2_k6(opcode);
-									uint16_t res = vp - k;
-									STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
-									_avr_set_r16le_hl(avr, p, res);
-									avr->sreg[S_V] = ((vp & ~res) >> 15) & 1;
-									avr->sreg[S_C] = ((res & ~vp) >> 15) & 1;
-									_avr_flags_zns16(avr, res);
-									SREG();
-									cycle++;
+									get_p2_k6(opcode);
+									DECODED(AVR_OP_SBIW, 2, p, 0, k);
 								}	break;
 								case 0x9800: {	// CBI -- Clear Bit in I/O Register -- 1001 1000 AAAA Abbb
 									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & ~mask;
-									STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
+									DECODED(AVR_OP_CBI, 2, io, mask, 0);
 								}	break;
 								case 0x9900: {	// SBIC -- Skip if Bit in I/O Register is Cleared -- 1001 1001 AAAA Abbb
 									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
-									if (!res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
-									}
+									DECODED(AVR_OP_SBIC, 1, io, mask, skip);
 								}	break;
 								case 0x9a00: {	// SBI -- Set Bit in I/O Register -- 1001 1010 AAAA Abbb
 									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) | mask;
-									STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
-									_avr_set_ram(avr, io, res);
-									cycle++;
+									DECODED(AVR_OP_SBI, 2, io, mask, 0);
 								}	break;
 								case 0x9b00: {	// SBIS -- Skip if Bit in I/O Register is Set -- 1001 1011 AAAA Abbb
 									get_io5_b3mask(opcode);
-									uint8_t res = _avr_get_ram(avr, io) & mask;
-									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
-									if (res) {
-										if (_avr_is_instruction_32_bits(avr, new_pc)) {
-											new_pc += 4; cycle += 2;
-										} else {
-											new_pc += 2; cycle++;
-										}
-									}
+									DECODED(AVR_OP_SBIS, 1, io, mask, skip);
 								}	break;
 								default:
 									switch (opcode & 0xfc00) {
 										case 0x9c00: {	// MUL -- Multiply Unsigned -- 1001 11rd dddd rrrr
-											get_vd5_vr5(opcode);
-											uint16_t res = vd * vr;
-											STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
-											cycle++;
-											_avr_set_r16le(avr, 0, res);
-											avr->sreg[S_Z] = res == 0;
-											avr->sreg[S_C] = (res >> 15) & 1;
-											SREG();
+											get_r5(opcode);
+											DECODED(AVR_OP_MUL, 2, d, r, 0);
 										}	break;
-										default: _avr_invalid_opcode(avr);
 									}
 							}
 						}	break;
@@ -1319,56 +1171,39 @@ run_one_again:
 		}	break;
 
 		case 0xb000: {
+			get_d5_a6(opcode);
 			switch (opcode & 0xf800) {
-				case 0xb800: {	// OUT A,Rr -- 1011 1AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
-					_avr_set_ram(avr, A, avr->data[d]);
-				}	break;
-				case 0xb000: {	// IN Rd,A -- 1011 0AAd dddd AAAA
-					get_d5_a6(opcode);
-					STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
-					_avr_set_r(avr, d, _avr_get_ram(avr, A));
-				}	break;
-				default: _avr_invalid_opcode(avr);
+				case 0xb800:	// OUT A,Rr -- 1011 1AAd dddd AAAA
+					DECODED(AVR_OP_OUT, 1, d, 0, A);
+					break;
+				case 0xb000:	// IN Rd,A -- 1011 0AAd dddd AAAA
+					DECODED(AVR_OP_IN, 1, d, 0, A);
+					break;
 			}
 		}	break;
 
 		case 0xc000: {	// RJMP -- 1100 kkkk kkkk kkkk
 			get_o12(opcode);
-			STATE("rjmp .%d [%04x]\n", o >> 1, new_pc + o);
-			new_pc = (new_pc + o) % (avr->flashend+1);
-			cycle++;
-			TRACE_JUMP();
+			DECODED(AVR_OP_RJMP, 2, 0, 0, (new_pc + o) % (avr->flashend+1));
 		}	break;
 
 		case 0xd000: {	// RCALL -- 1101 kkkk kkkk kkkk
 			get_o12(opcode);
-			STATE("rcall .%d [%04x]\n", o >> 1, new_pc + o);
-			cycle += _avr_push_addr(avr, new_pc);
-			new_pc = (new_pc + o) % (avr->flashend+1);
-			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
-			if (o != 0) {
-				TRACE_JUMP();
-				STACK_FRAME_PUSH();
-			}
+			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack",
+			// 'r' tells if this is a real call
+			DECODED(AVR_OP_RCALL, 1 + avr->address_size, 0, o != 0, (new_pc + o) % (avr->flashend+1));
 		}	break;
 
 		case 0xe000: {	// LDI Rd, K aka SER (LDI r, 0xff) -- 1110 kkkk dddd kkkk
 			get_h4_k8(opcode);
-			STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
-			_avr_set_r(avr, h, k);
+			DECODED(AVR_OP_LDI, 1, h, 0, k);
 		}	break;
 
 		case 0xf000: {
 			switch (opcode & 0xfe00) {
-				case 0xf100: {	/* simavr special opcodes */
-					if (opcode == 0xf1f1) { // AVR_OVERFLOW_OPCODE
-						printf("FLASH overflow, soft reset\n");
-						new_pc = 0;
-						TRACE_JUMP();
-					}
-				}	break;
+				case 0xf100:	/* simavr special opcodes */
+					DECODED(opcode == AVR_OVERFLOW_OPCODE ? AVR_OP_OVERFLOW : AVR_OP_NOP, 1, 0, 0, 0);
+					break;
 				case 0xf000:
 				case 0xf200:
 				case 0xf400:
@@ -1376,57 +1211,1107 @@ run_one_again:
 					int16_t o = ((int16_t)(opcode << 6)) >> 9; // offset
 					uint8_t s = opcode & 7;
 					int set = (opcode & 0x0400) == 0;		// this bit means BRXC otherwise BRXS
-					int branch = (avr->sreg[s] && set) || (!avr->sreg[s] && !set);
-					const char *names[2][8] = {
-							{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
-							{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
-					};
-					if (names[set][s]) {
-						STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, new_pc + (o << 1), branch ? "":" not");
-					} else {
-						STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
-					}
-					if (branch) {
-						cycle++; // 2 cycles if taken, 1 otherwise
-						new_pc = new_pc + (o << 1);
-					}
+					DECODED(set ? AVR_OP_BRBS : AVR_OP_BRBC, 1, s, 0, new_pc + (o << 1));
 				}	break;
 				case 0xf800:
 				case 0xf900: {	// BLD -- Bit Store from T into a Bit in Register -- 1111 100d dddd 0bbb
-					get_vd5_s3_mask(opcode);
-					uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
-					STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
-					_avr_set_r(avr, d, v);
+					get_d5_s3(opcode);
+					DECODED(AVR_OP_BLD, 1, d, 1 << s, 0);
 				}	break;
 				case 0xfa00:
 				case 0xfb00:{	// BST -- Bit Store into T from bit in Register -- 1111 101d dddd 0bbb
-					get_vd5_s3(opcode)
-					STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
-					avr->sreg[S_T] = (vd >> s) & 1;
-					SREG();
+					get_d5_s3(opcode);
+					DECODED(AVR_OP_BST, 1, d, s, 0);
 				}	break;
 				case 0xfc00:
 				case 0xfe00: {	// SBRS/SBRC -- Skip if Bit in Register is Set/Clear -- 1111 11sd dddd 0bbb
-					get_vd5_s3_mask(opcode)
+					get_d5_s3(opcode);
 					int set = (opcode & 0x0200) != 0;
-					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
-					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
-					if (branch) {
-						if (_avr_is_instruction_32_bits(avr, new_pc)) {
-							new_pc += 4; cycle += 2;
-						} else {
-							new_pc += 2; cycle++;
-						}
-					}
+					DECODED(set ? AVR_OP_SBRS : AVR_OP_SBRC, 1, d, 1 << s, skip);
 				}	break;
-				default: _avr_invalid_opcode(avr);
 			}
 		}	break;
+	}
+	uint8_t missing = avr->isa_missing |
+			(avr->rampz ? 0 : AVR_ISA_ELPM) | (avr->eind ? 0 : AVR_ISA_EIND);
+	if (_avr_op_isa[dc->op] & missing)
+		DECODED(AVR_OP_INVALID, 1, 0, 0, 0);
+	if (dc->op == AVR_OP_RJMP || dc->op == AVR_OP_BRBS || dc->op == AVR_OP_BRBC)
+		dc->loop_cycles = _avr_decode_loop(avr, pc, dc);
+	return dc;
+}
+
+/*
+ * Instructions that only touch the general purpose registers and SREG
+ * (but not the I bit, that changes the interrupt state), and that always
+ * continue with the next instruction. A run of those can be executed
+ * without any of the per-instruction checks.
+ */
+static int _avr_decoded_is_pure(avr_decoded_t * dc)
+{
+	switch (dc->op) {
+		case AVR_OP_NOP:
+		case AVR_OP_CPC: case AVR_OP_ADD: case AVR_OP_SBC: case AVR_OP_MOVW:
+		case AVR_OP_MULS: case AVR_OP_MULSU: case AVR_OP_FMUL: case AVR_OP_FMULS: case AVR_OP_FMULSU:
+		case AVR_OP_SUB: case AVR_OP_CP: case AVR_OP_ADC:
+		case AVR_OP_AND: case AVR_OP_EOR: case AVR_OP_OR: case AVR_OP_MOV:
+		case AVR_OP_CPI: case AVR_OP_SBCI: case AVR_OP_SUBI: case AVR_OP_ORI: case AVR_OP_ANDI:
+		case AVR_OP_COM: case AVR_OP_NEG: case AVR_OP_SWAP: case AVR_OP_INC: case AVR_OP_ASR:
+		case AVR_OP_LSR: case AVR_OP_ROR: case AVR_OP_DEC:
+		case AVR_OP_ADIW: case AVR_OP_SBIW: case AVR_OP_MUL:
+		case AVR_OP_LDI: case AVR_OP_BLD: case AVR_OP_BST:
+			return 1;
+		case AVR_OP_SREG:
+			return dc->d != S_I;
+	}
+	return 0;
+}
+
+/*
+ * Registers read and written by an instruction that can be part of a
+ * polling loop: it may only read IO or memory, and work on registers
+ * and the flags, without using the carry in. Returns 0 for the others.
+ */
+static int _avr_decoded_loop_regs(avr_decoded_t * dc, uint32_t * rd, uint32_t * wr)
+{
+	*rd = *wr = 0;
+	switch (dc->op) {
+		case AVR_OP_NOP:
+		case AVR_OP_SBIC: case AVR_OP_SBIS:
+			break;
+		case AVR_OP_LDS:
+			if (dc->k < 32)
+				return 0;
+			FALLTHROUGH
+		case AVR_OP_IN: case AVR_OP_LDI:
+			*wr = 1u << dc->d;
+			break;
+		case AVR_OP_CPI: case AVR_OP_SBRC: case AVR_OP_SBRS:
+			*rd = 1u << dc->d;
+			break;
+		case AVR_OP_SUBI: case AVR_OP_ORI: case AVR_OP_ANDI:
+		case AVR_OP_COM: case AVR_OP_NEG: case AVR_OP_SWAP: case AVR_OP_INC:
+		case AVR_OP_ASR: case AVR_OP_LSR: case AVR_OP_DEC:
+			*rd = *wr = 1u << dc->d;
+			break;
+		case AVR_OP_CP:
+			*rd = (1u << dc->d) | (1u << dc->r);
+			break;
+		case AVR_OP_ADD: case AVR_OP_SUB:
+		case AVR_OP_AND: case AVR_OP_EOR: case AVR_OP_OR:
+			*rd = (1u << dc->d) | (1u << dc->r);
+			*wr = 1u << dc->d;
+			break;
+		case AVR_OP_MOV:
+			*rd = 1u << dc->r;
+			*wr = 1u << dc->d;
+			break;
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check whether the branch at 'pc' closes a polling loop, like
+ * "1: sbis UCSR0A, RXC0; rjmp 1b" or "1: lds r24, flag; tst r24; breq 1b".
+ * This is done for every branch _avr_decode_one() decodes, including the
+ * ones a basic block scan or another loop check decodes ahead of time.
+ * The instructions from its target to it must run straight, with the only
+ * way out being a skip of the branch or not taking it, and no register may
+ * be read in the loop before the loop writes it. Every iteration then does
+ * exactly the same thing, until what it reads changes.
+ * Returns the cycles of one iteration, or zero.
+ */
+static uint8_t _avr_decode_loop(avr_t * avr, avr_flashaddr_t pc, avr_decoded_t * b)
+{
+	avr_flashaddr_t at = b->k;
+	if (at > pc || pc - at > (AVR_LOOP_MAX << 1))
+		return 0;
+	uint32_t read = 0, written = 0;
+	uint8_t cycles = 2;	// the branch, taken
+	while (at < pc) {
+		avr_decoded_t * dc = &avr->decoded[at >> 1];
+		if (dc->op == AVR_OP_UNDECODED)
+			_avr_decode_one(avr, at);
+		uint32_t rd, wr;
+		if (!_avr_decoded_loop_regs(dc, &rd, &wr))
+			return 0;
+		int skip = dc->op == AVR_OP_SBIC || dc->op == AVR_OP_SBIS ||
+				dc->op == AVR_OP_SBRC || dc->op == AVR_OP_SBRS;
+		if (skip && at + 2 != pc)
+			return 0;
+		read |= rd & ~written;
+		written |= wr;
+		cycles += dc->cycles;
+		at += dc->op == AVR_OP_LDS ? 4 : 2;
+	}
+	if (at != pc || (read & written))
+		return 0;
+	return cycles;
+}
+
+/*
+ * Decode the instruction at 'pc', and if it starts a basic block, decode
+ * the rest of the block and fill in the block length and cycles of every
+ * instruction in it
+ */
+static avr_decoded_t * _avr_decode(avr_t * avr, avr_flashaddr_t pc)
+{
+	avr_decoded_t * dc = _avr_decode_one(avr, pc);
+
+	if (!_avr_decoded_is_pure(dc))
+		return dc;
+
+	int len = 1;
+	while (len < AVR_BLOCK_MAX && pc + (len << 1) < avr->flashend) {
+		avr_decoded_t * next = dc + len;
+		if (next->op == AVR_OP_UNDECODED)
+			_avr_decode_one(avr, pc + (len << 1));
+		if (!_avr_decoded_is_pure(next))
+			break;
+		len++;
+	}
+	uint8_t cycles = 0;
+	for (int i = len - 1; i >= 0; i--) {
+		cycles += dc[i].cycles;
+		dc[i].block_len = len - i;
+		dc[i].block_cycles = cycles;
+	}
+	return dc;
+}
+
+/*
+ * Whether all the IO a polling loop reads is plain (see avr->io_plain),
+ * so reading it again has no side effect.
+ */
+static int _avr_loop_is_plain(avr_t * avr, avr_decoded_t * b)
+{
+	for (avr_decoded_t * dc = &avr->decoded[b->k >> 1]; dc < b;
+			dc += dc->op == AVR_OP_LDS ? 2 : 1) {
+		uint16_t addr;
+		switch (dc->op) {
+			case AVR_OP_IN: case AVR_OP_LDS:
+				addr = dc->k;
+				break;
+			case AVR_OP_SBIC: case AVR_OP_SBIS:
+				addr = dc->d;
+				break;
+			default:
+				continue;
+		}
+		if (addr < 32 + MAX_IOs &&
+				!(avr->io_plain[AVR_DATA_TO_IO(addr)] & AVR_IO_PLAIN_R))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Called when the branch closing a polling loop is taken. Once the loop
+ * has run a whole iteration in this avr_run_one() (the branch is taken
+ * again exactly loop_cycles later), nothing can change what it reads
+ * until the next timer or interrupt, so the iterations left before the
+ * end of the run (avr->run_cycle_count) are skipped, the way SLEEP would.
+ */
+#ifdef __GNUC__
+__attribute__((noinline))	// keep it out of the instruction handlers
+#endif
+static void _avr_loop_skip(avr_t * avr, avr_decoded_t * dc, int cycle)
+{
+	avr_cycle_count_t now = avr->cycle + cycle;
+
+	if (avr->idle.dc != dc || now - avr->idle.cycle != dc->loop_cycles) {
+		avr->idle.dc = dc;
+		avr->idle.cycle = now;
+		return;
+	}
+	avr->idle.cycle = now;
+	if (avr->run_cycle_count <= (avr_cycle_count_t)cycle + dc->loop_cycles ||
+			avr->state != cpu_Running || avr->interrupt_state ||
+			avr->trace || avr->trace_ring || avr->exec_count ||
+			!_avr_loop_is_plain(avr, dc))
+		return;
+	avr_cycle_count_t skip = (avr->run_cycle_count - cycle - 1) /
+			dc->loop_cycles * dc->loop_cycles;
+	avr->cycle += skip;
+	avr->run_cycle_count -= skip;
+	avr->idle.cycle += skip;
+}
 
-		default: _avr_invalid_opcode(avr);
+/*
+ * Threaded dispatch: every instruction handler ends with its own indirect
+ * jump to the next handler (GCC "labels as values"), rather than all of them
+ * going through the one switch() jump. It needs GCC (or clang), and is
+ * disabled with the trace code, which wants to run its checks on every
+ * instruction. -DCONFIG_SIMAVR_THREADED=0 disables it too.
+ */
+#ifndef CONFIG_SIMAVR_THREADED
+#if defined(__GNUC__) && !CONFIG_SIMAVR_TRACE
+#define CONFIG_SIMAVR_THREADED 1
+#else
+#define CONFIG_SIMAVR_THREADED 0
+#endif
+#endif
 
+#if CONFIG_SIMAVR_THREADED
+#define OPCODE(_op) \
+		case AVR_OP_##_op: _avr_op_##_op:
+/*
+ * Same as the end of _avr_run_one(), followed by the start of the next
+ * instruction. The slow cases (crash checks...) go back to the top.
+ */
+#define END_OP \
+		if (!threaded) break; \
+		avr->cycle += cycle; \
+		if (unlikely(avr->state != cpu_Running || \
+				avr->run_cycle_count <= cycle || avr->interrupt_state)) \
+			return new_pc; \
+		avr->run_cycle_count -= cycle; \
+		avr->pc = new_pc; \
+		if (unlikely(avr->pc >= avr->flashend)) \
+			goto run_one_again; \
+		dc = &avr->decoded[avr->pc >> 1]; \
+		new_pc = avr->pc + 2; \
+		cycle = dc->cycles; \
+		if (dc->block_len > 1 && avr->run_cycle_count > dc->block_cycles) \
+			BLOCK_ENTER(); \
+		goto *_avr_op_labels[dc->op];
+/*
+ * A basic block (see avr_decoded_t) only runs when the core would have run
+ * all of it anyway: no interrupt pending, and no timer due before its end.
+ * Its cycles are accounted for upfront, then the instructions of the block
+ * chain to each other without any check; or the host translation of the
+ * whole block runs instead, if there is one.
+ */
+#define BLOCK_ENTER() { \
+			avr->cycle += dc->block_cycles; \
+			avr->run_cycle_count -= dc->block_cycles; \
+			avr_jit_block_t jb = avr->jit ? \
+					avr_jit_lookup(avr, avr->jit, avr->pc) : NULL; \
+			if (jb) { \
+				avr_flags_sync(avr); \
+				jb(avr->data, avr->sreg); \
+				avr->pc += dc->block_len << 1; \
+				dc += dc->block_len; \
+				new_pc = avr->pc + 2; \
+				cycle = dc->cycles; \
+			} else \
+				block_left = dc->block_len; \
+		}
+#define END_PURE \
+		if (block_left) { \
+			block_left--; \
+			avr->pc = new_pc; \
+			dc++; \
+			new_pc += 2; \
+			cycle = dc->cycles; \
+			goto *_avr_op_labels[dc->op]; \
+		} \
+		END_OP
+#else
+#define OPCODE(_op) \
+		case AVR_OP_##_op:
+#define END_OP \
+		break;
+#define END_PURE \
+		break;
+#endif
+
+/*
+ * While fuzzing, records the transfers of control -- anything but going
+ * on to the next instruction -- and stops on a stack overflow
+ */
+static void _avr_coverage_step(avr_t * avr, avr_flashaddr_t new_pc)
+{
+	avr_coverage_t * c = avr->coverage;
+	if (new_pc != avr->pc + 2 &&
+			!(new_pc == avr->pc + 4 && _avr_is_instruction_32_bits(avr, avr->pc)))
+		avr_coverage_edge(c, new_pc);
+	if (c->stack_limit && _avr_sp_get(avr) < c->stack_limit &&
+			avr->state != cpu_Crashed) {
+		c->fault = AVR_FUZZ_STACK_OVERFLOW;
+		avr_sadly_crashed(avr, 0);
+	}
+}
+
+/*
+ * While profiling, tells the calls and returns from the other instructions;
+ * 'rcall .+0' only makes room on the stack
+ */
+static void _avr_profile_step(avr_t * avr, avr_decoded_t * dc, avr_flashaddr_t new_pc)
+{
+	int flow = AVR_PROFILE_NEXT;
+
+	switch (dc->op) {
+		case AVR_OP_RCALL:
+			if (new_pc == avr->pc + 2)
+				break;
+			FALLTHROUGH
+		case AVR_OP_CALL:
+		case AVR_OP_ICALL:
+		case AVR_OP_EICALL:
+			flow = AVR_PROFILE_CALL;
+			break;
+		case AVR_OP_RET:
+		case AVR_OP_RETI:
+			flow = AVR_PROFILE_RET;
+			break;
+	}
+	avr_profile_step(avr->profile, avr, flow, new_pc);
+}
+
+/*
+ * While tracing, the register each instruction writes: its 'd', or r0
+ * (and r1) for the multiplies and LPM; the pair is always in the record.
+ * The pointer increments of LD/ST aren't.
+ */
+enum { _AVR_TRACE_NONE = 0, _AVR_TRACE_D, _AVR_TRACE_R0 };
+static const uint8_t _avr_trace_dest[AVR_OP_COUNT] = {
+	[AVR_OP_ADD] = _AVR_TRACE_D, [AVR_OP_ADC] = _AVR_TRACE_D,
+	[AVR_OP_SUB] = _AVR_TRACE_D, [AVR_OP_SBC] = _AVR_TRACE_D,
+	[AVR_OP_AND] = _AVR_TRACE_D, [AVR_OP_OR] = _AVR_TRACE_D,
+	[AVR_OP_EOR] = _AVR_TRACE_D, [AVR_OP_MOV] = _AVR_TRACE_D,
+	[AVR_OP_MOVW] = _AVR_TRACE_D,
+	[AVR_OP_MUL] = _AVR_TRACE_R0, [AVR_OP_MULS] = _AVR_TRACE_R0,
+	[AVR_OP_MULSU] = _AVR_TRACE_R0, [AVR_OP_FMUL] = _AVR_TRACE_R0,
+	[AVR_OP_FMULS] = _AVR_TRACE_R0, [AVR_OP_FMULSU] = _AVR_TRACE_R0,
+	[AVR_OP_SBCI] = _AVR_TRACE_D, [AVR_OP_SUBI] = _AVR_TRACE_D,
+	[AVR_OP_ORI] = _AVR_TRACE_D, [AVR_OP_ANDI] = _AVR_TRACE_D,
+	[AVR_OP_LDI] = _AVR_TRACE_D,
+	[AVR_OP_LDD_Z] = _AVR_TRACE_D, [AVR_OP_LDD_Y] = _AVR_TRACE_D,
+	[AVR_OP_LD_X] = _AVR_TRACE_D, [AVR_OP_LD_Y] = _AVR_TRACE_D,
+	[AVR_OP_LD_Z] = _AVR_TRACE_D, [AVR_OP_LDS] = _AVR_TRACE_D,
+	[AVR_OP_POP] = _AVR_TRACE_D, [AVR_OP_IN] = _AVR_TRACE_D,
+	[AVR_OP_LPM_R0] = _AVR_TRACE_R0, [AVR_OP_ELPM_R0] = _AVR_TRACE_R0,
+	[AVR_OP_LPM] = _AVR_TRACE_D, [AVR_OP_ELPM] = _AVR_TRACE_D,
+	[AVR_OP_COM] = _AVR_TRACE_D, [AVR_OP_NEG] = _AVR_TRACE_D,
+	[AVR_OP_SWAP] = _AVR_TRACE_D, [AVR_OP_INC] = _AVR_TRACE_D,
+	[AVR_OP_ASR] = _AVR_TRACE_D, [AVR_OP_LSR] = _AVR_TRACE_D,
+	[AVR_OP_ROR] = _AVR_TRACE_D, [AVR_OP_DEC] = _AVR_TRACE_D,
+	[AVR_OP_ADIW] = _AVR_TRACE_D, [AVR_OP_SBIW] = _AVR_TRACE_D,
+	[AVR_OP_BLD] = _AVR_TRACE_D,
+};
+
+static void _avr_trace_step(avr_t * avr, avr_decoded_t * dc)
+{
+	uint8_t dest = _avr_trace_dest[dc->op];
+
+	avr_trace_record(avr->trace_ring, avr,
+			dest == _AVR_TRACE_D ? dc->d :
+			dest == _AVR_TRACE_R0 ? 0 : AVR_TRACE_NO_REG);
+}
+
+/*
+ * Run one pre-decoded instruction, decoding it first if needed.
+ * As long as the core has cycles left to run before the next timer
+ * (avr->run_cycle_count) and no interrupt is pending, it loops here
+ * rather than returning to the main loop.
+ */
+static avr_flashaddr_t _avr_run_one(avr_t * avr, int threaded)
+{
+	avr_decoded_t *	dc;
+	avr_flashaddr_t	new_pc;
+	int 			cycle;
+#if CONFIG_SIMAVR_THREADED
+	int				block_left = 0;	// instructions left in the current basic block
+	static const void * const _avr_op_labels[AVR_OP_COUNT] = {
+#define _AVR_OP_LABEL(_n) [AVR_OP_##_n] = &&_avr_op_##_n,
+		AVR_DECODED_OPS(_AVR_OP_LABEL)
+#undef _AVR_OP_LABEL
+	};
+#endif
+
+	avr->idle.dc = NULL;
+run_one_again:
+#if CONFIG_SIMAVR_TRACE
+	/*
+	 * this traces spurious reset or bad jumps
+	 */
+	if ((avr->pc == 0 && avr->cycle > 0) || avr->pc >= avr->codeend || _avr_sp_get(avr) > avr->ramend) {
+//		avr->trace = 1;
+		STATE("RESET\n");
+		crash(avr);
+	}
+	avr->trace_data->touched[0] = avr->trace_data->touched[1] = avr->trace_data->touched[2] = 0;
+#endif
+
+	/* Ensure we don't crash simavr due to a bad instruction reading past
+	 * the end of the flash.
+	 */
+	if (unlikely(avr->pc >= avr->flashend)) {
+		STATE("CRASH\n");
+		crash(avr);
+		return 0;
+	}
+
+	dc = &avr->decoded[avr->pc >> 1];
+	if (unlikely(dc->op == AVR_OP_UNDECODED))
+		_avr_decode(avr, avr->pc);
+
+	new_pc = avr->pc + 2;	// future "default" pc
+	cycle = dc->cycles;
+
+#if CONFIG_SIMAVR_THREADED
+	if (threaded) {
+		if (dc->block_len > 1 && avr->run_cycle_count > dc->block_cycles &&
+				avr->state == cpu_Running && avr->interrupt_state == 0)
+			BLOCK_ENTER();
+		goto *_avr_op_labels[dc->op];
+	}
+#endif
+	switch (dc->op) {
+		OPCODE(UNDECODED) {	// only reached by the threaded dispatch
+			goto run_one_again;
+		}
+		OPCODE(NOP) {
+			STATE("nop\n");
+		}	END_PURE
+		OPCODE(CPC) {	// CPC -- Compare with carry
+			get_vd_vr(dc);
+			const uint8_t z = _avr_flags_z(avr);
+			uint8_t res = vd - vr - _avr_flags_c(avr);
+			STATE("cpc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUBC, res, vd, vr);
+			avr->flags.z = z;
+			SREG();
+		}	END_PURE
+		OPCODE(ADD) {	// ADD -- Add without carry
+			get_vd_vr(dc);
+			uint8_t res = vd + vr;
+			if (r == d) {
+				STATE("lsl %s[%02x] = %02x\n", avr_regname(d), vd, res & 0xff);
+			} else {
+				STATE("add %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			}
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_ADD, res, vd, vr);
+			SREG();
+		}	END_PURE
+		OPCODE(SBC) {	// SBC -- Subtract with carry
+			get_vd_vr(dc);
+			const uint8_t z = _avr_flags_z(avr);
+			uint8_t res = vd - vr - _avr_flags_c(avr);
+			STATE("sbc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUBC, res, vd, vr);
+			avr->flags.z = z;
+			SREG();
+		}	END_PURE
+		OPCODE(MOVW) {	// MOVW -- Copy Register Word
+			const uint8_t d = dc->d, r = dc->r;
+			STATE("movw %s:%s, %s:%s[%02x%02x]\n", avr_regname(d), avr_regname(d+1), avr_regname(r), avr_regname(r+1), avr->data[r+1], avr->data[r]);
+			uint16_t vr = avr->data[r] | (avr->data[r + 1] << 8);
+			_avr_set_r16le(avr, d, vr);
+		}	END_PURE
+		OPCODE(MULS) {	// MULS -- Multiply Signed
+			const uint8_t d = dc->d, r = dc->r;
+			int16_t res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+			STATE("muls %s[%d], %s[%02x] = %d\n", avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+			_avr_set_r16le(avr, 0, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_MUL, res, 0, (res >> 15) & 1);
+			SREG();
+		}	END_PURE
+		OPCODE(MULSU)
+		OPCODE(FMUL)
+		OPCODE(FMULS)
+		OPCODE(FMULSU) {	// MUL -- Multiply
+			const uint8_t d = dc->d, r = dc->r;
+			int16_t res = 0;
+			uint8_t c = 0;
+			T(const char * name = "";)
+			switch (dc->op) {
+				case AVR_OP_MULSU: 	// MULSU -- Multiply Signed Unsigned
+					res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+					c = (res >> 15) & 1;
+					T(name = "mulsu";)
+					break;
+				case AVR_OP_FMUL: 	// FMUL -- Fractional Multiply Unsigned
+					res = ((uint8_t)avr->data[r]) * ((uint8_t)avr->data[d]);
+					c = (res >> 15) & 1;
+					res <<= 1;
+					T(name = "fmul";)
+					break;
+				case AVR_OP_FMULS: 	// FMULS -- Multiply Signed
+					res = ((int8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+					c = (res >> 15) & 1;
+					res <<= 1;
+					T(name = "fmuls";)
+					break;
+				case AVR_OP_FMULSU: 	// FMULSU -- Multiply Signed Unsigned
+					res = ((uint8_t)avr->data[r]) * ((int8_t)avr->data[d]);
+					c = (res >> 15) & 1;
+					res <<= 1;
+					T(name = "fmulsu";)
+					break;
+			}
+			STATE("%s %s[%d], %s[%02x] = %d\n", name, avr_regname(d), ((int8_t)avr->data[d]), avr_regname(r), ((int8_t)avr->data[r]), res);
+			_avr_set_r16le(avr, 0, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_MUL, res, 0, c);
+			SREG();
+		}	END_PURE
+		OPCODE(SUB) {	// SUB -- Subtract without carry
+			get_vd_vr(dc);
+			uint8_t res = vd - vr;
+			STATE("sub %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUB, res, vd, vr);
+			SREG();
+		}	END_PURE
+		OPCODE(CPSE) {	// CPSE -- Compare, skip if equal
+			get_vd_vr(dc);
+			uint16_t res = vd == vr;
+			STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
+			if (res) {
+				new_pc += dc->k << 1;
+				cycle += dc->k;
+			}
+		}	END_OP
+		OPCODE(CP) {	// CP -- Compare
+			get_vd_vr(dc);
+			uint8_t res = vd - vr;
+			STATE("cp %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUB, res, vd, vr);
+			SREG();
+		}	END_PURE
+		OPCODE(ADC) {	// ADD -- Add with carry
+			get_vd_vr(dc);
+			uint8_t res = vd + vr + _avr_flags_c(avr);
+			if (r == d) {
+				STATE("rol %s[%02x] = %02x\n", avr_regname(d), avr->data[d], res);
+			} else {
+				STATE("addc %s[%02x], %s[%02x] = %02x\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res);
+			}
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_ADD, res, vd, vr);
+			SREG();
+		}	END_PURE
+		OPCODE(AND) {	// AND -- Logical AND
+			get_vd_vr(dc);
+			uint8_t res = vd & vr;
+			if (r == d) {
+				STATE("tst %s[%02x]\n", avr_regname(d), avr->data[d]);
+			} else {
+				STATE("and %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			}
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LOGIC, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(EOR) {	// EOR -- Logical Exclusive OR
+			get_vd_vr(dc);
+			uint8_t res = vd ^ vr;
+			if (r==d) {
+				STATE("clr %s[%02x]\n", avr_regname(d), avr->data[d]);
+			} else {
+				STATE("eor %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			}
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LOGIC, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(OR) {	// OR -- Logical OR
+			get_vd_vr(dc);
+			uint8_t res = vd | vr;
+			STATE("or %s[%02x], %s[%02x] = %02x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LOGIC, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(MOV) {	// MOV
+			get_d_vr(dc);
+			uint8_t res = vr;
+			STATE("mov %s, %s[%02x] = %02x\n", avr_regname(d), avr_regname(r), vr, res);
+			_avr_set_r(avr, d, res);
+		}	END_PURE
+		OPCODE(CPI) {	// CPI -- Compare Immediate
+			get_vh_k(dc);
+			uint8_t res = vh - k;
+			STATE("cpi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUB, res, vh, k);
+			SREG();
+		}	END_PURE
+		OPCODE(SBCI) {	// SBCI -- Subtract Immediate With Carry
+			get_vh_k(dc);
+			const uint8_t z = _avr_flags_z(avr);
+			uint8_t res = vh - k - _avr_flags_c(avr);
+			STATE("sbci %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+			_avr_set_r(avr, h, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUBC, res, vh, k);
+			avr->flags.z = z;
+			SREG();
+		}	END_PURE
+		OPCODE(SUBI) {	// SUBI -- Subtract Immediate
+			get_vh_k(dc);
+			uint8_t res = vh - k;
+			STATE("subi %s[%02x], 0x%02x = %02x\n", avr_regname(h), vh, k, res);
+			_avr_set_r(avr, h, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SUB, res, vh, k);
+			SREG();
+		}	END_PURE
+		OPCODE(ORI) {	// ORI aka SBR -- Logical OR with Immediate
+			get_vh_k(dc);
+			uint8_t res = vh | k;
+			STATE("ori %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+			_avr_set_r(avr, h, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LOGIC, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(ANDI) {	// ANDI	-- Logical AND with Immediate
+			get_vh_k(dc);
+			uint8_t res = vh & k;
+			STATE("andi %s[%02x], 0x%02x\n", avr_regname(h), vh, k);
+			_avr_set_r(avr, h, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LOGIC, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(LDD_Z) {	// LD (LDD) -- Load Indirect using Z
+			uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			const uint8_t d = dc->d, q = dc->k;
+			STATE("ld %s, (Z+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
+			_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
+		}	END_OP
+		OPCODE(STD_Z) {	// ST (STD) -- Store Indirect using Z
+			uint16_t v = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			const uint8_t d = dc->d, q = dc->k;
+			STATE("st (Z+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+			_avr_set_ram(avr, v+q, avr->data[d]);
+		}	END_OP
+		OPCODE(LDD_Y) {	// LD (LDD) -- Load Indirect using Y
+			uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+			const uint8_t d = dc->d, q = dc->k;
+			STATE("ld %s, (Y+%d[%04x])=[%02x]\n", avr_regname(d), q, v+q, avr->data[v+q]);
+			_avr_set_r(avr, d, _avr_get_ram(avr, v+q));
+		}	END_OP
+		OPCODE(STD_Y) {	// ST (STD) -- Store Indirect using Y
+			uint16_t v = avr->data[R_YL] | (avr->data[R_YH] << 8);
+			const uint8_t d = dc->d, q = dc->k;
+			STATE("st (Y+%d[%04x]), %s[%02x]\n", q, v+q, avr_regname(d), avr->data[d]);
+			_avr_set_ram(avr, v+q, avr->data[d]);
+		}	END_OP
+		OPCODE(SREG) {	// BSET/BCLR -- all the SREG set/clear opcodes
+			const uint8_t b = dc->d;
+			STATE("%s%c\n", dc->r ? "se" : "cl", _sreg_bit_name[b]);
+			avr_sreg_set(avr, b, dc->r);
+			SREG();
+		}	END_PURE
+		OPCODE(SLEEP) {	// SLEEP
+			STATE("sleep\n");
+			/* Don't sleep if there are interrupts about to be serviced.
+			 * Without this check, it was possible to incorrectly enter a state
+			 * in which the cpu was sleeping and interrupts were disabled. For more
+			 * details, see the commit message. */
+			if (!avr_has_pending_interrupts(avr) || !avr->sreg[S_I])
+				avr->state = cpu_Sleeping;
+		}	END_OP
+		OPCODE(BREAK) {	// BREAK
+			STATE("break\n");
+			if (avr->gdb) {
+				// if gdb is on, we break here as in here
+				// and we do so until gdb restores the instruction
+				// that was here before
+				avr->state = cpu_StepDone;
+				new_pc = avr->pc;
+				cycle = 0;
+			}
+		}	END_OP
+		OPCODE(WDR) {	// WDR -- Watchdog Reset
+			STATE("wdr\n");
+			avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+		}	END_OP
+		OPCODE(SPM) {	// SPM -- Store Program Memory
+			STATE("spm\n");
+			avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
+		}	END_OP
+		OPCODE(IJMP)	// IJMP -- Indirect jump
+		OPCODE(EIJMP)	// EIJMP -- Indirect jump
+		OPCODE(ICALL)	// ICALL -- Indirect Call to Subroutine
+		OPCODE(EICALL) {	// EICALL -- Indirect Call to Subroutine
+			int e = dc->op == AVR_OP_EIJMP || dc->op == AVR_OP_EICALL;
+			int p = dc->op == AVR_OP_ICALL || dc->op == AVR_OP_EICALL;
+			uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			if (e)
+				z |= avr->data[avr->eind] << 16;
+			STATE("%si%s Z[%04x]\n", e?"e":"", p?"call":"jmp", z << 1);
+			if (p)
+				_avr_push_addr(avr, new_pc);
+			new_pc = z << 1;
+			TRACE_JUMP();
+		}	END_OP
+		OPCODE(RETI) 	// RETI -- Return from Interrupt
+			avr_sreg_set(avr, S_I, 1);
+			avr_interrupt_reti(avr);
+			FALLTHROUGH
+		OPCODE(RET) {	// RET -- Return
+			new_pc = _avr_pop_addr(avr);
+			STATE("ret%s\n", dc->op == AVR_OP_RETI ? "i" : "");
+			TRACE_JUMP();
+			STACK_FRAME_POP();
+		}	END_OP
+		OPCODE(LPM_R0) {	// LPM -- Load Program Memory R0 <- (Z)
+			uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			STATE("lpm %s, (Z[%04x])\n", avr_regname(0), z);
+			_avr_set_r(avr, 0, avr->flash[z]);
+		}	END_OP
+		OPCODE(ELPM_R0) {	// ELPM -- Load Program Memory R0 <- (Z)
+			uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+			STATE("elpm %s, (Z[%02x:%04x])\n", avr_regname(0), z >> 16, z & 0xffff);
+			_avr_set_r(avr, 0, avr->flash[z]);
+		}	END_OP
+		OPCODE(LDS) {	// LDS -- Load Direct from Data Space, 32 bits
+			const uint8_t d = dc->d;
+			uint16_t x = dc->k;
+			new_pc += 2;
+			STATE("lds %s[%02x], 0x%04x\n", avr_regname(d), avr->data[d], x);
+			_avr_set_r(avr, d, _avr_get_ram(avr, x));
+		}	END_OP
+		OPCODE(LPM) {	// LPM -- Load Program Memory
+			const uint8_t d = dc->d;
+			uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+			int op = dc->r;
+			STATE("lpm %s, (Z[%04x]%s)\n", avr_regname(d), z, op ? "+" : "");
+			_avr_set_r(avr, d, avr->flash[z]);
+			if (op) {
+				z++;
+				_avr_set_r16le_hl(avr, R_ZL, z);
+			}
+		}	END_OP
+		OPCODE(ELPM) {	// ELPM -- Extended Load Program Memory
+			uint32_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8) | (avr->data[avr->rampz] << 16);
+			const uint8_t d = dc->d;
+			int op = dc->r;
+			STATE("elpm %s, (Z[%02x:%04x]%s)\n", avr_regname(d), z >> 16, z & 0xffff, op ? "+" : "");
+			_avr_set_r(avr, d, avr->flash[z]);
+			if (op) {
+				z++;
+				_avr_set_r(avr, avr->rampz, z >> 16);
+				_avr_set_r16le_hl(avr, R_ZL, z);
+			}
+		}	END_OP
+		/*
+		 * Load store instructions, 'r' is the mode:
+		 * 1) post increment, 2) pre-decrement
+		 */
+		OPCODE(LD_X) {	// LD -- Load Indirect from Data using X
+			int op = dc->r;
+			const uint8_t d = dc->d;
+			uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+			STATE("ld %s, %sX[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", x, op == 1 ? "++" : "");
+			if (op == 2) x--;
+			uint8_t vd = _avr_get_ram(avr, x);
+			if (op == 1) x++;
+			_avr_set_r16le_hl(avr, R_XL, x);
+			_avr_set_r(avr, d, vd);
+		}	END_OP
+		OPCODE(ST_X) {	// ST -- Store Indirect Data Space X
+			int op = dc->r;
+			get_vd(dc);
+			uint16_t x = (avr->data[R_XH] << 8) | avr->data[R_XL];
+			STATE("st %sX[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", x, op == 1 ? "++" : "", avr_regname(d), vd);
+			if (op == 2) x--;
+			_avr_set_ram(avr, x, vd);
+			if (op == 1) x++;
+			_avr_set_r16le_hl(avr, R_XL, x);
+		}	END_OP
+		OPCODE(LD_Y) {	// LD -- Load Indirect from Data using Y
+			int op = dc->r;
+			const uint8_t d = dc->d;
+			uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+			STATE("ld %s, %sY[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", y, op == 1 ? "++" : "");
+			if (op == 2) y--;
+			uint8_t vd = _avr_get_ram(avr, y);
+			if (op == 1) y++;
+			_avr_set_r16le_hl(avr, R_YL, y);
+			_avr_set_r(avr, d, vd);
+		}	END_OP
+		OPCODE(ST_Y) {	// ST -- Store Indirect Data Space Y
+			int op = dc->r;
+			get_vd(dc);
+			uint16_t y = (avr->data[R_YH] << 8) | avr->data[R_YL];
+			STATE("st %sY[%04x]%s, %s[%02x]\n", op == 2 ? "--" : "", y, op == 1 ? "++" : "", avr_regname(d), vd);
+			if (op == 2) y--;
+			_avr_set_ram(avr, y, vd);
+			if (op == 1) y++;
+			_avr_set_r16le_hl(avr, R_YL, y);
+		}	END_OP
+		OPCODE(STS) {	// STS -- Store Direct to Data Space, 32 bits
+			get_vd(dc);
+			uint16_t x = dc->k;
+			new_pc += 2;
+			STATE("sts 0x%04x, %s[%02x]\n", x, avr_regname(d), vd);
+			_avr_set_ram(avr, x, vd);
+		}	END_OP
+		OPCODE(LD_Z) {	// LD -- Load Indirect from Data using Z
+			int op = dc->r;
+			const uint8_t d = dc->d;
+			uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+			STATE("ld %s, %sZ[%04x]%s\n", avr_regname(d), op == 2 ? "--" : "", z, op == 1 ? "++" : "");
+			if (op == 2) z--;
+			uint8_t vd = _avr_get_ram(avr, z);
+			if (op == 1) z++;
+			_avr_set_r16le_hl(avr, R_ZL, z);
+			_avr_set_r(avr, d, vd);
+		}	END_OP
+		OPCODE(ST_Z) {	// ST -- Store Indirect Data Space Z
+			int op = dc->r;
+			get_vd(dc);
+			uint16_t z = (avr->data[R_ZH] << 8) | avr->data[R_ZL];
+			STATE("st %sZ[%04x]%s, %s[%02x] \n", op == 2 ? "--" : "", z, op == 1 ? "++" : "", avr_regname(d), vd);
+			if (op == 2) z--;
+			_avr_set_ram(avr, z, vd);
+			if (op == 1) z++;
+			_avr_set_r16le_hl(avr, R_ZL, z);
+		}	END_OP
+		OPCODE(POP) {	// POP
+			const uint8_t d = dc->d;
+			_avr_set_r(avr, d, _avr_pop8(avr));
+			T(uint16_t sp = _avr_sp_get(avr);)
+			STATE("pop %s (@%04x)[%02x]\n", avr_regname(d), sp, avr->data[sp]);
+		}	END_OP
+		OPCODE(PUSH) {	// PUSH
+			get_vd(dc);
+			_avr_push8(avr, vd);
+			T(uint16_t sp = _avr_sp_get(avr);)
+			STATE("push %s[%02x] (@%04x)\n", avr_regname(d), vd, sp);
+		}	END_OP
+		OPCODE(COM) {	// COM -- One's Complement
+			get_vd(dc);
+			uint8_t res = 0xff - vd;
+			STATE("com %s[%02x] = %02x\n", avr_regname(d), vd, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_COM, res, 0, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(NEG) {	// NEG -- Two's Complement
+			get_vd(dc);
+			uint8_t res = 0x00 - vd;
+			STATE("neg %s[%02x] = %02x\n", avr_regname(d), vd, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_NEG, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(SWAP) {	// SWAP -- Swap Nibbles
+			get_vd(dc);
+			uint8_t res = (vd >> 4) | (vd << 4) ;
+			STATE("swap %s[%02x] = %02x\n", avr_regname(d), vd, res);
+			_avr_set_r(avr, d, res);
+		}	END_PURE
+		OPCODE(INC) {	// INC -- Increment
+			get_vd(dc);
+			uint8_t res = vd + 1;
+			STATE("inc %s[%02x] = %02x\n", avr_regname(d), vd, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_INC, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(ASR) {	// ASR -- Arithmetic Shift Right
+			get_vd(dc);
+			uint8_t res = (vd >> 1) | (vd & 0x80);
+			STATE("asr %s[%02x]\n", avr_regname(d), vd);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SHIFT, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(LSR) {	// LSR -- Logical Shift Right
+			get_vd(dc);
+			uint8_t res = vd >> 1;
+			STATE("lsr %s[%02x]\n", avr_regname(d), vd);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_LSR, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(ROR) {	// ROR -- Rotate Right
+			get_vd(dc);
+			uint8_t res = (_avr_flags_c(avr) ? 0x80 : 0) | vd >> 1;
+			STATE("ror %s[%02x]\n", avr_regname(d), vd);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SHIFT, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(DEC) {	// DEC -- Decrement
+			get_vd(dc);
+			uint8_t res = vd - 1;
+			STATE("dec %s[%02x] = %02x\n", avr_regname(d), vd, res);
+			_avr_set_r(avr, d, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_DEC, res, vd, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(JMP) {	// JMP -- Long Call to sub, 32 bits
+			STATE("jmp 0x%06x\n", dc->k >> 1);
+			new_pc = dc->k;
+			TRACE_JUMP();
+		}	END_OP
+		OPCODE(CALL) {	// CALL -- Long Call to sub, 32 bits
+			STATE("call 0x%06x\n", dc->k >> 1);
+			new_pc += 2;
+			_avr_push_addr(avr, new_pc);
+			new_pc = dc->k;
+			TRACE_JUMP();
+			STACK_FRAME_PUSH();
+		}	END_OP
+		OPCODE(ADIW) {	// ADIW -- Add Immediate to Word
+			get_vp_k(dc);
+			uint16_t res = vp + k;
+			STATE("adiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+			_avr_set_r16le_hl(avr, p, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_ADIW, res, vp, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(SBIW) {	// SBIW -- Subtract Immediate from Word
+			get_vp_k(dc);
+			uint16_t res = vp - k;
+			STATE("sbiw %s:%s[%04x], 0x%02x\n", avr_regname(p), avr_regname(p + 1), vp, k);
+			_avr_set_r16le_hl(avr, p, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_SBIW, res, vp, 0);
+			SREG();
+		}	END_PURE
+		OPCODE(CBI) {	// CBI -- Clear Bit in I/O Register
+			get_io_mask(dc);
+			uint8_t res = _avr_get_ram(avr, io) & ~mask;
+			STATE("cbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+			_avr_set_ram(avr, io, res);
+		}	END_OP
+		OPCODE(SBIC) {	// SBIC -- Skip if Bit in I/O Register is Cleared
+			get_io_mask(dc);
+			uint8_t res = _avr_get_ram(avr, io) & mask;
+			STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
+			if (!res) {
+				new_pc += dc->k << 1;
+				cycle += dc->k;
+			}
+		}	END_OP
+		OPCODE(SBI) {	// SBI -- Set Bit in I/O Register
+			get_io_mask(dc);
+			uint8_t res = _avr_get_ram(avr, io) | mask;
+			STATE("sbi %s[%04x], 0x%02x = %02x\n", avr_regname(io), avr->data[io], mask, res);
+			_avr_set_ram(avr, io, res);
+		}	END_OP
+		OPCODE(SBIS) {	// SBIS -- Skip if Bit in I/O Register is Set
+			get_io_mask(dc);
+			uint8_t res = _avr_get_ram(avr, io) & mask;
+			STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
+			if (res) {
+				new_pc += dc->k << 1;
+				cycle += dc->k;
+			}
+		}	END_OP
+		OPCODE(MUL) {	// MUL -- Multiply Unsigned
+			get_vd_vr(dc);
+			uint16_t res = vd * vr;
+			STATE("mul %s[%02x], %s[%02x] = %04x\n", avr_regname(d), vd, avr_regname(r), vr, res);
+			_avr_set_r16le(avr, 0, res);
+			_avr_flags_lazy(avr, AVR_FLAGS_MUL, res, 0, (res >> 15) & 1);
+			SREG();
+		}	END_PURE
+		OPCODE(OUT) {	// OUT A,Rr
+			const uint8_t d = dc->d, A = dc->k;
+			STATE("out %s, %s[%02x]\n", avr_regname(A), avr_regname(d), avr->data[d]);
+			_avr_set_ram(avr, A, avr->data[d]);
+		}	END_OP
+		OPCODE(IN) {	// IN Rd,A
+			const uint8_t d = dc->d, A = dc->k;
+			STATE("in %s, %s[%02x]\n", avr_regname(d), avr_regname(A), avr->data[A]);
+			_avr_set_r(avr, d, _avr_get_ram(avr, A));
+		}	END_OP
+		OPCODE(RJMP) {	// RJMP
+			STATE("rjmp .%d [%04x]\n", (int)(dc->k - new_pc) >> 1, dc->k);
+			new_pc = dc->k;
+			if (unlikely(dc->loop_cycles))
+				_avr_loop_skip(avr, dc, cycle);
+			TRACE_JUMP();
+		}	END_OP
+		OPCODE(RCALL) {	// RCALL
+			STATE("rcall .%d [%04x]\n", (int)(dc->k - new_pc) >> 1, dc->k);
+			_avr_push_addr(avr, new_pc);
+			new_pc = dc->k;
+			// 'rcall .1' is used as a cheap "push 16 bits of room on the stack"
+			if (dc->r) {
+				TRACE_JUMP();
+				STACK_FRAME_PUSH();
+			}
+		}	END_OP
+		OPCODE(LDI) {	// LDI Rd, K aka SER (LDI r, 0xff)
+			const uint8_t h = dc->d, k = dc->k;
+			STATE("ldi %s, 0x%02x\n", avr_regname(h), k);
+			_avr_set_r(avr, h, k);
+		}	END_PURE
+		OPCODE(OVERFLOW) {	/* simavr special opcodes */
+			printf("FLASH overflow, soft reset\n");
+			new_pc = 0;
+			TRACE_JUMP();
+		}	END_OP
+		OPCODE(BRBS)
+		OPCODE(BRBC) {	// BRXC/BRXS -- All the SREG branches
+			const uint8_t s = dc->d;
+			int set = dc->op == AVR_OP_BRBS;
+			uint8_t v;
+			if (s == S_C)
+				v = _avr_flags_c(avr);
+			else if (s == S_Z)
+				v = _avr_flags_z(avr);
+			else {
+				avr_flags_sync(avr);
+				v = avr->sreg[s];
+			}
+			int branch = (v && set) || (!v && !set);
+#if CONFIG_SIMAVR_TRACE
+			const char *names[2][8] = {
+					{ "brcc", "brne", "brpl", "brvc", NULL, "brhc", "brtc", "brid"},
+					{ "brcs", "breq", "brmi", "brvs", NULL, "brhs", "brts", "brie"},
+			};
+			int o = (int)(dc->k - new_pc) >> 1;
+			if (names[set][s]) {
+				STATE("%s .%d [%04x]\t; Will%s branch\n", names[set][s], o, dc->k, branch ? "":" not");
+			} else {
+				STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, dc->k, branch ? "":" not");
+			}
+#endif
+			if (branch) {
+				cycle++; // 2 cycles if taken, 1 otherwise
+				new_pc = dc->k;
+				if (unlikely(dc->loop_cycles))
+					_avr_loop_skip(avr, dc, cycle);
+			}
+		}	END_OP
+		OPCODE(BLD) {	// BLD -- Bit Store from T into a Bit in Register
+			get_vd_mask(dc);
+			uint8_t v = (vd & ~mask) | (avr->sreg[S_T] ? mask : 0);
+			STATE("bld %s[%02x], 0x%02x = %02x\n", avr_regname(d), vd, mask, v);
+			_avr_set_r(avr, d, v);
+		}	END_PURE
+		OPCODE(BST) {	// BST -- Bit Store into T from bit in Register
+			get_vd(dc);
+			const uint8_t s = dc->r;
+			STATE("bst %s[%02x], 0x%02x\n", avr_regname(d), vd, 1 << s);
+			avr->sreg[S_T] = (vd >> s) & 1;
+			SREG();
+		}	END_PURE
+		OPCODE(SBRC)
+		OPCODE(SBRS) {	// SBRS/SBRC -- Skip if Bit in Register is Set/Clear
+			get_vd_mask(dc);
+			int set = dc->op == AVR_OP_SBRS;
+			int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
+			STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
+			if (branch) {
+				new_pc += dc->k << 1;
+				cycle += dc->k;
+			}
+		}	END_OP
+
+		default:
+		OPCODE(INVALID) {
+			_avr_invalid_opcode(avr);
+		}	END_OP
 	}
 	avr->cycle += cycle;
+	if (unlikely(avr->coverage))
+		_avr_coverage_step(avr, new_pc);
+	if (unlikely(avr->exec_count))
+		avr_exec_count(avr->exec_count, avr->pc, new_pc);
+	if (unlikely(avr->profile))
+		_avr_profile_step(avr, dc, new_pc);
+	if (unlikely(avr->trace_ring))
+		_avr_trace_step(avr, dc);
 
 	if ((avr->state == cpu_Running) &&
 		(avr->run_cycle_count > cycle) &&
@@ -1439,3 +2324,16 @@ run_one_again:
 
 	return new_pc;
 }
+
+avr_flashaddr_t avr_run_one(avr_t * avr)
+{
+	if (unlikely(avr->coverage || avr->exec_count || avr->profile ||
+			avr->trace_ring))
+		return avr_run_one_switch(avr);
+	return _avr_run_one(avr, CONFIG_SIMAVR_THREADED);
+}
+
+avr_flashaddr_t avr_run_one_switch(avr_t * avr)
+{
+	return _avr_run_one(avr, 0);
+}
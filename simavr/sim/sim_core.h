@@ -37,9 +37,92 @@ extern "C" {
 #endif
 
 /*
- * Instruction decoder, run ONE instruction
+ * Instruction decoder, runs instructions until avr->run_cycle_count is
+ * spent (the next cycle timer is due) or an interrupt is pending, and
+ * returns the new pc. avr->run_cycle_limit caps the batch; set it to 1
+ * to run ONE instruction per call.
+ * While an instruction hook is on (avr->coverage, exec_count, profile or
+ * trace_ring) it takes the switch() dispatch, without the basic blocks or
+ * the JIT, and calls the hooks after each instruction; the batches are
+ * the same.
  */
 avr_flashaddr_t avr_run_one(avr_t * avr);
+/*
+ * Same as avr_run_one(), always using the plain switch() dispatch. This is
+ * the reference the threaded (computed goto) dispatch is checked against.
+ */
+avr_flashaddr_t avr_run_one_switch(avr_t * avr);
+
+/*
+ * Pre-decoded instruction kinds. Each flash word has an avr_decoded_t
+ * entry in avr->decoded, filled the first time the word is executed.
+ * AVR_OP_UNDECODED (zero) marks an entry that needs decoding, so a
+ * calloc()ed or memset() table is "all invalidated".
+ * The list is a macro so the core can build its dispatch table from it.
+ */
+#define AVR_DECODED_OPS(_) \
+	_(UNDECODED) _(INVALID) _(NOP) \
+	_(CPC) _(ADD) _(SBC) _(MOVW) \
+	_(MULS) _(MULSU) _(FMUL) _(FMULS) _(FMULSU) \
+	_(SUB) _(CPSE) _(CP) _(ADC) \
+	_(AND) _(EOR) _(OR) _(MOV) \
+	_(CPI) _(SBCI) _(SUBI) _(ORI) _(ANDI) \
+	_(LDD_Z) _(STD_Z) _(LDD_Y) _(STD_Y) \
+	_(SREG) \
+	_(SLEEP) _(BREAK) _(WDR) _(SPM) \
+	_(IJMP) _(EIJMP) _(ICALL) _(EICALL) \
+	_(RETI) _(RET) \
+	_(LPM_R0) _(ELPM_R0) _(LPM) _(ELPM) \
+	_(LDS) _(STS) \
+	_(LD_X) _(ST_X) _(LD_Y) _(ST_Y) _(LD_Z) _(ST_Z) \
+	_(POP) _(PUSH) \
+	_(COM) _(NEG) _(SWAP) _(INC) _(ASR) \
+	_(LSR) _(ROR) _(DEC) \
+	_(JMP) _(CALL) \
+	_(ADIW) _(SBIW) _(CBI) _(SBIC) _(SBI) _(SBIS) \
+	_(MUL) \
+	_(OUT) _(IN) \
+	_(RJMP) _(RCALL) \
+	_(LDI) \
+	_(OVERFLOW) \
+	_(BRBS) _(BRBC) \
+	_(BLD) _(BST) _(SBRC) _(SBRS)
+
+enum {
+#define _AVR_OP_ENUM(_n) AVR_OP_##_n,
+	AVR_DECODED_OPS(_AVR_OP_ENUM)
+#undef _AVR_OP_ENUM
+	AVR_OP_COUNT,
+};
+
+/*
+ * One pre-decoded instruction. The operands are already extracted, and
+ * anything that only depends on flash contents is resolved at decode time:
+ * 'cycles' is the base cycle count (including the push/pop size for calls),
+ * 'k' holds immediates, the second word of 32 bits instructions, absolute
+ * jump targets, or the number of words a skip instruction would skip.
+ * 'r' holds the bit mask for bit instructions, and the addressing mode
+ * for LD/ST/LPM.
+ */
+typedef struct avr_decoded_t {
+	uint8_t		op;
+	uint8_t		cycles;
+	uint8_t		d;
+	uint8_t		r;
+	uint32_t	k;
+	/*
+	 * Basic block starting here: number of consecutive register-only
+	 * instructions (no IO, memory, SREG I bit or control flow), and the
+	 * sum of their cycles. Zero if this instruction is not one of them.
+	 */
+	uint8_t		block_len;
+	uint8_t		block_cycles;
+	/*
+	 * Backward branch closing a polling loop, that does the same thing on
+	 * every iteration until some IO changes: cycles of one iteration.
+	 */
+	uint8_t		loop_cycles;
+} avr_decoded_t;
 
 /*
  * These are for internal access to the stack (for interrupts)
@@ -48,10 +131,18 @@ uint16_t _avr_sp_get(avr_t * avr);
 void _avr_sp_set(avr_t * avr, uint16_t sp);
 int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr);
 
+/*
+ * LDS, STS, JMP and CALL take two flash words
+ */
+static inline int avr_opcode_is_32_bits(uint16_t o)
+{
+	return (o & 0xfc0f) == 0x9000 || (o & 0xfe0c) == 0x940c;
+}
+
 #if CONFIG_SIMAVR_TRACE
 
 /*
- * Get a "pretty" register name
+ * Get a "pretty" register name, a constant string
  */
 const char * avr_regname(uint8_t reg);
 
@@ -90,10 +181,25 @@ void avr_dump_state(avr_t * avr);
 
 #endif
 
+/*
+ * The ALU opcodes only record their operands and result in avr->flags;
+ * avr_flags_sync() works out the C, Z, N, V, S and H flags they set into
+ * avr->sreg[], and must be called before reading or changing these.
+ * The T and I flags are always up to date.
+ */
+void _avr_flags_resolve(avr_t * avr);
+
+static inline void avr_flags_sync(avr_t * avr)
+{
+	if (avr->flags.op)
+		_avr_flags_resolve(avr);
+}
+
 /**
  * Reconstructs the SREG value from avr->sreg into dst.
  */
 #define READ_SREG_INTO(avr, dst) { \
+			avr_flags_sync(avr); \
 			dst = 0; \
 			for (int i = 0; i < 8; i++) \
 				if (avr->sreg[i] > 1) { \
@@ -110,6 +216,8 @@ static inline void avr_sreg_set(avr_t * avr, uint8_t flag, uint8_t ival)
 	 *	no change if interrupt flag does not change.
 	 */
 
+	if (flag < S_T)
+		avr_flags_sync(avr);
 	if (flag == S_I) {
 		if (ival) {
 			if (!avr->sreg[S_I])
@@ -25,42 +25,201 @@
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_cycle_timers.h"
+#include "sim_snapshot.h"
 
 #define QUEUE(__q, __e) { \
 		(__e)->next = (__q); \
 		(__q) = __e; \
 	}
-#define DETACH(__q, __l, __e) { \
-		if (__l) \
-			(__l)->next = (__e)->next; \
-		else \
-			(__q) = (__e)->next; \
+
+#define DEFAULT_SLEEP_CYCLES 1000
+
+/*
+ * 4-ary heap of the scheduled slots, each slot knows its index in it
+ */
+static inline int
+avr_cycle_timer_before(
+		avr_cycle_timer_slot_p a,
+		avr_cycle_timer_slot_p b)
+{
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static inline void
+avr_cycle_timer_heap_set(
+		avr_cycle_timer_pool_t * pool,
+		int i,
+		avr_cycle_timer_slot_p t)
+{
+	pool->heap[i] = t;
+	t->index = i;
+}
+
+static void
+avr_cycle_timer_heap_up(
+		avr_cycle_timer_pool_t * pool,
+		int i)
+{
+	avr_cycle_timer_slot_p t = pool->heap[i];
+	while (i) {
+		int p = (i - 1) >> 2;
+		if (!avr_cycle_timer_before(t, pool->heap[p]))
+			break;
+		avr_cycle_timer_heap_set(pool, i, pool->heap[p]);
+		i = p;
 	}
-#define INSERT(__q, __l, __e) { \
-		if (__l) { \
-			(__e)->next = (__l)->next; \
-			(__l)->next = (__e); \
-		} else { \
-			(__e)->next = (__q); \
-			(__q) = (__e); \
-		} \
+	avr_cycle_timer_heap_set(pool, i, t);
+}
+
+static void
+avr_cycle_timer_heap_down(
+		avr_cycle_timer_pool_t * pool,
+		int i)
+{
+	avr_cycle_timer_slot_p t = pool->heap[i];
+	for (;;) {
+		int c = (i << 2) + 1, best = c;
+		if (c >= pool->count)
+			break;
+		int end = c + 4 < pool->count ? c + 4 : pool->count;
+		for (c++; c < end; c++)
+			if (avr_cycle_timer_before(pool->heap[c], pool->heap[best]))
+				best = c;
+		if (!avr_cycle_timer_before(pool->heap[best], t))
+			break;
+		avr_cycle_timer_heap_set(pool, i, pool->heap[best]);
+		i = best;
 	}
+	avr_cycle_timer_heap_set(pool, i, t);
+}
 
-#define DEFAULT_SLEEP_CYCLES 1000
+static void
+avr_cycle_timer_heap_remove(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	int i = t->index;
+	avr_cycle_timer_slot_p last = pool->heap[--pool->count];
+	t->index = -1;
+	if (i == pool->count)
+		return;
+	avr_cycle_timer_heap_set(pool, i, last);
+	avr_cycle_timer_heap_up(pool, i);
+	avr_cycle_timer_heap_down(pool, last->index);
+}
+
+static inline avr_cycle_timer_slot_p *
+avr_cycle_timer_bucket(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	uintptr_t h = (uintptr_t)timer ^ ((uintptr_t)param * 0x9e3779b1u);
+	return &pool->hash[(h ^ (h >> 7) ^ (h >> 15)) & (CYCLE_TIMER_HASH_SIZE - 1)];
+}
+
+static avr_cycle_timer_slot_p
+avr_cycle_timer_find(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	avr_cycle_timer_slot_p t = *avr_cycle_timer_bucket(pool, timer, param);
+	while (t && (t->timer != timer || t->param != param))
+		t = t->hnext;
+	return t;
+}
+
+// add a slab of slots to the pool, and make room for them in the heap
+static int
+avr_cycle_timer_grow(
+		avr_cycle_timer_pool_t * pool)
+{
+	avr_cycle_timer_slot_p * heap = realloc(pool->heap,
+			(pool->size + CYCLE_TIMER_SLAB) * sizeof(*heap));
+	if (!heap)
+		return -1;
+	pool->heap = heap;
+	avr_cycle_timer_slab_t * slab = malloc(sizeof(*slab));
+	if (!slab)
+		return -1;
+	slab->next = pool->slab;
+	pool->slab = slab;
+	pool->used = 0;
+	pool->size += CYCLE_TIMER_SLAB;
+	return 0;
+}
+
+// get a new slot for 'timer' and 'param', NULL if the pool can't grow
+static avr_cycle_timer_slot_p
+avr_cycle_timer_alloc(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	avr_cycle_timer_slot_p t = pool->timer_free;
+	if (t)
+		pool->timer_free = t->next;
+	else if ((pool->slab && pool->used < CYCLE_TIMER_SLAB) ||
+			avr_cycle_timer_grow(pool) == 0)
+		t = &pool->slab->slot[pool->used++];
+	else
+		return NULL;
+	if (++pool->in_use > pool->high_water)
+		pool->high_water = pool->in_use;
+	avr_cycle_timer_slot_p * b = avr_cycle_timer_bucket(pool, timer, param);
+	*t = (avr_cycle_timer_slot_t) {
+		.hnext = *b, .index = -1, .timer = timer, .param = param };
+	*b = t;
+	return t;
+}
+
+// return the slot to the free queue, if nothing needs it anymore
+static void
+avr_cycle_timer_release(
+		avr_cycle_timer_pool_t * pool,
+		avr_cycle_timer_slot_p t)
+{
+	if (t->index >= 0 || t->held || t == pool->running)
+		return;
+	avr_cycle_timer_slot_p * b = avr_cycle_timer_bucket(pool, t->timer, t->param);
+	while (*b != t)
+		b = &(*b)->hnext;
+	*b = t->hnext;
+	QUEUE(pool->timer_free, t);
+	pool->in_use--;
+}
 
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
-	memset(pool, 0, sizeof(*pool));
-	// queue all slots into the free queue
-	for (int i = 0; i < MAX_CYCLE_TIMERS; i++) {
-		avr_cycle_timer_slot_p t = &pool->timer_slots[i];
-		QUEUE(pool->timer_free, t);
+	// unschedule everything, only the slots with a handle stay
+	while (pool->count) {
+		avr_cycle_timer_slot_p t = pool->heap[--pool->count];
+		t->index = -1;
+		avr_cycle_timer_release(pool, t);
 	}
+	// run_cycle_limit is left alone, it's set by avr_init() or the user
 	avr->run_cycle_count = 1;
-	avr->run_cycle_limit = 1;
+}
+
+void
+avr_cycle_timer_terminate(
+		struct avr_t * avr)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+
+	AVR_LOG(avr, LOG_DEBUG, "CYCLE: %s: %d timers at most, %d slots\n",
+			__func__, pool->high_water, pool->size);
+	while (pool->slab) {
+		avr_cycle_timer_slab_t * slab = pool->slab;
+		pool->slab = slab->next;
+		free(slab);
+	}
+	free(pool->heap);
+	memset(pool, 0, sizeof(*pool));
 }
 
 static avr_cycle_count_t
@@ -85,9 +244,9 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 	avr_cycle_count_t sleep_cycle_count = DEFAULT_SLEEP_CYCLES;
 
-	if(pool->timer) {
-		if(pool->timer->when > avr->cycle) {
-			sleep_cycle_count = pool->timer->when - avr->cycle;
+	if (pool->count) {
+		if (pool->heap[0]->when > avr->cycle) {
+			sleep_cycle_count = pool->heap[0]->when - avr->cycle;
 		} else {
 			sleep_cycle_count = 0;
 		}
@@ -96,40 +255,23 @@ avr_cycle_timer_reset_sleep_run_cycles_limited(
 	avr_cycle_timer_return_sleep_run_cycles_limited(avr, sleep_cycle_count);
 }
 
-// no sanity checks checking here, on purpose
+// (re)schedule slot 't' in 'when' cycles, after the ones already due then
 static void
 avr_cycle_timer_insert(
 		avr_t * avr,
 		avr_cycle_count_t when,
-		avr_cycle_timer_t timer,
-		void * param)
+		avr_cycle_timer_slot_p t)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	when += avr->cycle;
-
-	avr_cycle_timer_slot_p t = pool->timer_free;
-
-	if (!t) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: ran out of timers (%d)!\n", __func__, MAX_CYCLE_TIMERS);
-		return;
-	}
-	// detach head
-	pool->timer_free = t->next;
-	t->next = NULL;
-	t->timer = timer;
-	t->param = param;
-	t->when = when;
-
-	// find its place in the list
-	avr_cycle_timer_slot_p loop = pool->timer, last = NULL;
-	while (loop) {
-		if (loop->when > when)
-			break;
-		last = loop;
-		loop = loop->next;
+	t->when = when + avr->cycle;
+	t->seq = pool->seq++;
+	if (t->index < 0) {
+		t->index = pool->count++;
+		pool->heap[t->index] = t;
 	}
-	INSERT(pool->timer, last, t);
+	avr_cycle_timer_heap_up(pool, t->index);
+	avr_cycle_timer_heap_down(pool, t->index);
 }
 
 void
@@ -140,16 +282,15 @@ avr_cycle_timer_register(
 		void * param)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	avr_cycle_timer_slot_p t = avr_cycle_timer_find(pool, timer, param);
 
-	// remove it if it was already scheduled
-	avr_cycle_timer_cancel(avr, timer, param);
-
-	if (!pool->timer_free) {
-		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: pool is full (%d)!\n", __func__, MAX_CYCLE_TIMERS);
+	if (!t)
+		t = avr_cycle_timer_alloc(pool, timer, param);
+	if (!t) {
+		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: out of memory (%d timers)!\n", __func__, avr->cycle_timers.size);
 		return;
 	}
-	avr_cycle_timer_insert(avr, when, timer, param);
-	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	avr_cycle_timer_register_handle(avr, t, when);
 }
 
 void
@@ -168,20 +309,12 @@ avr_cycle_timer_cancel(
 		avr_cycle_timer_t timer,
 		void * param)
 {
-	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	avr_cycle_timer_slot_p t = avr_cycle_timer_find(&avr->cycle_timers, timer, param);
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer, last = NULL;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			DETACH(pool->timer, last, t);
-			QUEUE(pool->timer_free, t);
-			break;
-		}
-		last = t;
-		t = t->next;
-	}
-	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+	if (t)
+		avr_cycle_timer_cancel_handle(avr, t);
+	else
+		avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
 
 /*
@@ -193,18 +326,63 @@ avr_cycle_timer_status(
 		avr_t * avr,
 		avr_cycle_timer_t timer,
 		void * param)
+{
+	avr_cycle_timer_slot_p t = avr_cycle_timer_find(&avr->cycle_timers, timer, param);
+
+	return t ? avr_cycle_timer_status_handle(avr, t) : 0;
+}
+
+avr_cycle_timer_handle_t
+avr_cycle_timer_get_handle(
+		avr_t * avr,
+		avr_cycle_timer_t timer,
+		void * param)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	avr_cycle_timer_slot_p t = avr_cycle_timer_find(pool, timer, param);
 
-	// find its place in the list
-	avr_cycle_timer_slot_p t = pool->timer;
-	while (t) {
-		if (t->timer == timer && t->param == param) {
-			return 1 + (t->when - avr->cycle);
-		}
-		t = t->next;
+	if (!t)
+		t = avr_cycle_timer_alloc(pool, timer, param);
+	if (!t) {
+		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: out of memory (%d timers)!\n", __func__, avr->cycle_timers.size);
+		return NULL;
 	}
-	return 0;
+	t->held = 1;
+	return t;
+}
+
+void
+avr_cycle_timer_register_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t handle,
+		avr_cycle_count_t when)
+{
+	avr_cycle_timer_insert(avr, when, handle);
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+}
+
+void
+avr_cycle_timer_cancel_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t handle)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+
+	if (handle->index >= 0) {
+		avr_cycle_timer_heap_remove(pool, handle);
+		avr_cycle_timer_release(pool, handle);
+	}
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+}
+
+avr_cycle_count_t
+avr_cycle_timer_status_handle(
+		avr_t * avr,
+		avr_cycle_timer_handle_t handle)
+{
+	if (handle->index < 0)
+		return 0;
+	return 1 + (handle->when - avr->cycle);
 }
 
 /*
@@ -218,32 +396,94 @@ avr_cycle_timer_process(
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
-	if (pool->timer) do {
-		avr_cycle_timer_slot_p t = pool->timer;
+	while (pool->count) {
+		avr_cycle_timer_slot_p t = pool->heap[0];
 		avr_cycle_count_t when = t->when;
 
 		if (when > avr->cycle)
 			return avr_cycle_timer_return_sleep_run_cycles_limited(avr, when - avr->cycle);
 
 		// detach from active timers
-		pool->timer = t->next;
-		t->next = NULL;
+		avr_cycle_timer_heap_remove(pool, t);
+		pool->running = t;
 		do {
 			avr_cycle_count_t w = t->timer(avr, when, t->param);
 			// make sure the return value is either zero, or greater
 			// than the last one to prevent infinite loop here
 			when = w > when ? w : 0;
 		} while (when && when <= avr->cycle);
-		
+		pool->running = NULL;
+
 		if (when) // reschedule then
-			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param);
-		
-		// requeue this one into the free ones
-		QUEUE(pool->timer_free, t);
-	} while (pool->timer);
+			avr_cycle_timer_insert(avr, when - avr->cycle, t);
+		else // requeue this one into the free ones, unless it was rescheduled
+			avr_cycle_timer_release(pool, t);
+	}
 
 	// original behavior was to return 1000 cycles when no timers were present...
 	// run_cycles are bound to at least one cycle but no more than requested limit...
 	//	value passed here is returned unbounded, thus preserving original behavior.
 	return avr_cycle_timer_return_sleep_run_cycles_limited(avr, DEFAULT_SLEEP_CYCLES);
 }
+
+static int
+avr_cycle_timer_compare(
+		const void * a,
+		const void * b)
+{
+	avr_cycle_timer_slot_p ta = *(avr_cycle_timer_slot_p *)a;
+	avr_cycle_timer_slot_p tb = *(avr_cycle_timer_slot_p *)b;
+	return avr_cycle_timer_before(ta, tb) ? -1 : avr_cycle_timer_before(tb, ta);
+}
+
+/*
+ * The timers are saved in the order they would run, and scheduled again
+ * in that order when restoring, so the ones due on the same cycle keep
+ * their order too
+ */
+void
+avr_cycle_timer_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
+	int count = pool->count;
+
+	AVR_SNAPSHOT_FIELD(s, count);
+	if (!s->restoring) {
+		avr_cycle_timer_slot_p sorted[count ? count : 1];
+		memcpy(sorted, pool->heap, count * sizeof(sorted[0]));
+		qsort(sorted, count, sizeof(sorted[0]), avr_cycle_timer_compare);
+		for (int i = 0; i < count; i++) {
+			AVR_SNAPSHOT_FIELD(s, sorted[i]->when);
+			AVR_SNAPSHOT_FIELD(s, sorted[i]->timer);
+			AVR_SNAPSHOT_FIELD(s, sorted[i]->param);
+		}
+		return;
+	}
+	if (s->error)
+		return;
+	avr_cycle_timer_reset(avr);
+	for (int i = 0; i < count && !s->error; i++) {
+		avr_cycle_count_t when = 0;
+		avr_cycle_timer_t timer = NULL;
+		void * param = NULL;
+		AVR_SNAPSHOT_FIELD(s, when);
+		AVR_SNAPSHOT_FIELD(s, timer);
+		AVR_SNAPSHOT_FIELD(s, param);
+		if (s->error)
+			break;
+		avr_cycle_timer_slot_p t = avr_cycle_timer_find(pool, timer, param);
+		if (!t)
+			t = avr_cycle_timer_alloc(pool, timer, param);
+		if (!t) {
+			s->error = 1;
+			break;
+		}
+		t->when = when;
+		t->seq = pool->seq++;
+		avr_cycle_timer_heap_set(pool, pool->count++, t);
+		avr_cycle_timer_heap_up(pool, t->index);
+	}
+	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
+}
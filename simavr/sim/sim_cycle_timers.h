@@ -24,9 +24,12 @@
  * these timers are one shots, then get cleared if the timer function returns zero,
  * they get reset if the callback function returns a new cycle number
  *
- * the implementation maintains a list of 'pending' timers, sorted by when they
- * should run, it allows very quick comparison with the next timer to run, and
- * quick removal of then from the pile once dispatched.
+ * the implementation keeps the 'pending' timers in a 4-ary heap, ordered by
+ * when they should run (and in the order they were scheduled, for the ones
+ * due on the same cycle), it allows very quick comparison with the next timer
+ * to run, and insertion/removal in O(log n).
+ * Timers are identified by their (timer, param) pair, found through a small
+ * hash table; a handle to the slot skips that lookup altogether.
  */
 #ifndef __SIM_CYCLE_TIMERS_H___
 #define __SIM_CYCLE_TIMERS_H___
@@ -37,7 +40,13 @@
 extern "C" {
 #endif
 
-#define MAX_CYCLE_TIMERS	64
+#define CYCLE_TIMER_SLAB	64	// slots the pool grows by
+#define CYCLE_TIMER_HASH_SIZE	64	// buckets, power of two
+/*
+ * Default for avr->run_cycle_limit; the core stays in avr_run_one()
+ * for at most that many cycles, or until the next timer is due.
+ */
+#define DEFAULT_RUN_CYCLE_LIMIT	1000
 
 typedef avr_cycle_count_t (*avr_cycle_timer_t)(
 		struct avr_t * avr,
@@ -55,25 +64,49 @@ typedef avr_cycle_count_t (*avr_cycle_timer_t)(
  * repeteadly until it 'caches up'.
  */
 typedef struct avr_cycle_timer_slot_t {
-	struct avr_cycle_timer_slot_t *next;
+	struct avr_cycle_timer_slot_t *next;	// in the free queue
+	struct avr_cycle_timer_slot_t *hnext;	// in its hash bucket
 	avr_cycle_count_t	when;
+	uint64_t			seq;	// scheduling order, for timers due on the same cycle
+	int					index;	// in the heap, -1 when not scheduled
+	uint8_t				held;	// a handle was given out, keep the slot
 	avr_cycle_timer_t	timer;
 	void * param;
 } avr_cycle_timer_slot_t, *avr_cycle_timer_slot_p;
 
 /*
- * Timer pool contains a pool of timer slots available, they all
- * start queued into the 'free' qeueue, are migrated to the
- * 'active' queue when needed and are re-queued to the free one
- * when done
+ * A handle is the slot of a (timer, param) pair, and stays valid (even
+ * across resets) for the life of the avr_t
+ */
+typedef avr_cycle_timer_slot_p avr_cycle_timer_handle_t;
+
+typedef struct avr_cycle_timer_slab_t {
+	struct avr_cycle_timer_slab_t * next;
+	avr_cycle_timer_slot_t	slot[CYCLE_TIMER_SLAB];
+} avr_cycle_timer_slab_t;
+
+/*
+ * Timer pool contains a pool of timer slots; they are taken as needed
+ * from the free queue (or the last slab), and go back to it once they
+ * are neither scheduled nor held by a handle. When all are in use, the
+ * pool grows by a slab; slots never move, so handles stay valid, and
+ * once the pool is big enough, nothing is allocated anymore.
+ * All zeroes is an empty pool.
  */
 typedef struct avr_cycle_timer_pool_t {
-	avr_cycle_timer_slot_t timer_slots[MAX_CYCLE_TIMERS];
-	avr_cycle_timer_slot_p timer_free;
-	avr_cycle_timer_slot_p timer;
+	avr_cycle_timer_slab_t *	slab;	// most recent first
+	int						used;	// slots ever taken from the last slab
+	int						size;	// slots in all the slabs, and in heap[]
+	int						in_use;
+	int						high_water;	// most slots ever in use at once
+	avr_cycle_timer_slot_p	timer_free;
+	avr_cycle_timer_slot_p	hash[CYCLE_TIMER_HASH_SIZE];
+	avr_cycle_timer_slot_p *	heap;
+	int						count;	// scheduled timers, in heap[]
+	uint64_t				seq;
+	avr_cycle_timer_slot_p	running;	// the one avr_cycle_timer_process() is calling
 } avr_cycle_timer_pool_t, *avr_cycle_timer_pool_p;
 
-
 // register for calling 'timer' in 'when' cycles
 void
 avr_cycle_timer_register(
@@ -104,6 +137,30 @@ avr_cycle_timer_status(
 		avr_cycle_timer_t timer,
 		void * param);
 
+/*
+ * Returns the handle for 'timer' and 'param', or NULL only if the pool
+ * can't be grown (out of memory). The functions below then do the same as
+ * the ones above, without any lookup; they can be mixed with them.
+ */
+avr_cycle_timer_handle_t
+avr_cycle_timer_get_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_t timer,
+		void * param);
+void
+avr_cycle_timer_register_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t handle,
+		avr_cycle_count_t when);
+void
+avr_cycle_timer_cancel_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t handle);
+avr_cycle_count_t
+avr_cycle_timer_status_handle(
+		struct avr_t * avr,
+		avr_cycle_timer_handle_t handle);
+
 //
 // Private, called from the core
 //
@@ -113,6 +170,9 @@ avr_cycle_timer_process(
 void
 avr_cycle_timer_reset(
 		struct avr_t * avr);
+void
+avr_cycle_timer_terminate(
+		struct avr_t * avr);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,270 @@
+/*
+	sim_disasm.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "sim_disasm.h"
+#include "sim_core.h"
+
+// operands of the instructions
+enum {
+	AVR_DIS_NONE = 0,
+	AVR_DIS_RD_RR,		// 5 bits registers
+	AVR_DIS_RD,
+	AVR_DIS_RD_K,		// r16-r31, 8 bits immediate
+	AVR_DIS_MOVW,		// register pairs
+	AVR_DIS_MULS,		// r16-r31
+	AVR_DIS_MUL3,		// r16-r23
+	AVR_DIS_ADIW,
+	AVR_DIS_REL,		// 12 bits relative
+	AVR_DIS_ABS,		// 22 bits absolute, 32 bits instruction
+	AVR_DIS_LDS,
+	AVR_DIS_STS,
+	AVR_DIS_IN,
+	AVR_DIS_OUT,
+	AVR_DIS_IO_BIT,
+	AVR_DIS_RD_BIT,
+	AVR_DIS_LD,			// LD, LPM, ELPM, by the low 4 bits
+	AVR_DIS_ST,
+	AVR_DIS_LDD_Z,
+	AVR_DIS_LDD_Y,
+	AVR_DIS_STD_Z,
+	AVR_DIS_STD_Y,
+	AVR_DIS_SREG,		// BSET/BCLR, by their flag
+	AVR_DIS_BRBS,		// 7 bits relative, by their flag
+	AVR_DIS_BRBC,
+};
+
+static const struct {
+	uint16_t	mask, value;
+	const char * name;
+	uint8_t		kind;
+} _avr_dis[] = {
+	{ 0xffff, 0x0000, "nop", AVR_DIS_NONE },
+	{ 0xffff, 0x9409, "ijmp", AVR_DIS_NONE },
+	{ 0xffff, 0x9419, "eijmp", AVR_DIS_NONE },
+	{ 0xffff, 0x9509, "icall", AVR_DIS_NONE },
+	{ 0xffff, 0x9519, "eicall", AVR_DIS_NONE },
+	{ 0xffff, 0x9508, "ret", AVR_DIS_NONE },
+	{ 0xffff, 0x9518, "reti", AVR_DIS_NONE },
+	{ 0xffff, 0x9588, "sleep", AVR_DIS_NONE },
+	{ 0xffff, 0x9598, "break", AVR_DIS_NONE },
+	{ 0xffff, 0x95a8, "wdr", AVR_DIS_NONE },
+	{ 0xffff, 0x95c8, "lpm", AVR_DIS_NONE },
+	{ 0xffff, 0x95d8, "elpm", AVR_DIS_NONE },
+	{ 0xffff, 0x95e8, "spm", AVR_DIS_NONE },
+	{ 0xffff, 0x95f8, "spm\tZ+", AVR_DIS_NONE },
+	{ 0xff00, 0x0100, "movw", AVR_DIS_MOVW },
+	{ 0xff00, 0x0200, "muls", AVR_DIS_MULS },
+	{ 0xff88, 0x0300, "mulsu", AVR_DIS_MUL3 },
+	{ 0xff88, 0x0308, "fmul", AVR_DIS_MUL3 },
+	{ 0xff88, 0x0380, "fmuls", AVR_DIS_MUL3 },
+	{ 0xff88, 0x0388, "fmulsu", AVR_DIS_MUL3 },
+	{ 0xfc00, 0x0400, "cpc", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x0800, "sbc", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x0c00, "add", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x1000, "cpse", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x1400, "cp", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x1800, "sub", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x1c00, "adc", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x2000, "and", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x2400, "eor", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x2800, "or", AVR_DIS_RD_RR },
+	{ 0xfc00, 0x2c00, "mov", AVR_DIS_RD_RR },
+	{ 0xf000, 0x3000, "cpi", AVR_DIS_RD_K },
+	{ 0xf000, 0x4000, "sbci", AVR_DIS_RD_K },
+	{ 0xf000, 0x5000, "subi", AVR_DIS_RD_K },
+	{ 0xf000, 0x6000, "ori", AVR_DIS_RD_K },
+	{ 0xf000, 0x7000, "andi", AVR_DIS_RD_K },
+	{ 0xd208, 0x8000, "ldd", AVR_DIS_LDD_Z },
+	{ 0xd208, 0x8008, "ldd", AVR_DIS_LDD_Y },
+	{ 0xd208, 0x8200, "std", AVR_DIS_STD_Z },
+	{ 0xd208, 0x8208, "std", AVR_DIS_STD_Y },
+	{ 0xfe0f, 0x9000, "lds", AVR_DIS_LDS },
+	{ 0xfe0f, 0x9001, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x9002, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x9004, "lpm", AVR_DIS_LD },
+	{ 0xfe0f, 0x9005, "lpm", AVR_DIS_LD },
+	{ 0xfe0f, 0x9006, "elpm", AVR_DIS_LD },
+	{ 0xfe0f, 0x9007, "elpm", AVR_DIS_LD },
+	{ 0xfe0f, 0x9009, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x900a, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x900c, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x900d, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x900e, "ld", AVR_DIS_LD },
+	{ 0xfe0f, 0x900f, "pop", AVR_DIS_RD },
+	{ 0xfe0f, 0x9200, "sts", AVR_DIS_STS },
+	{ 0xfe0f, 0x9201, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x9202, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x9209, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x920a, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x920c, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x920d, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x920e, "st", AVR_DIS_ST },
+	{ 0xfe0f, 0x920f, "push", AVR_DIS_RD },
+	{ 0xfe0f, 0x9400, "com", AVR_DIS_RD },
+	{ 0xfe0f, 0x9401, "neg", AVR_DIS_RD },
+	{ 0xfe0f, 0x9402, "swap", AVR_DIS_RD },
+	{ 0xfe0f, 0x9403, "inc", AVR_DIS_RD },
+	{ 0xfe0f, 0x9405, "asr", AVR_DIS_RD },
+	{ 0xfe0f, 0x9406, "lsr", AVR_DIS_RD },
+	{ 0xfe0f, 0x9407, "ror", AVR_DIS_RD },
+	{ 0xfe0f, 0x940a, "dec", AVR_DIS_RD },
+	{ 0xfe0e, 0x940c, "jmp", AVR_DIS_ABS },
+	{ 0xfe0e, 0x940e, "call", AVR_DIS_ABS },
+	{ 0xff8f, 0x9408, "se", AVR_DIS_SREG },
+	{ 0xff8f, 0x9488, "cl", AVR_DIS_SREG },
+	{ 0xff00, 0x9600, "adiw", AVR_DIS_ADIW },
+	{ 0xff00, 0x9700, "sbiw", AVR_DIS_ADIW },
+	{ 0xff00, 0x9800, "cbi", AVR_DIS_IO_BIT },
+	{ 0xff00, 0x9900, "sbic", AVR_DIS_IO_BIT },
+	{ 0xff00, 0x9a00, "sbi", AVR_DIS_IO_BIT },
+	{ 0xff00, 0x9b00, "sbis", AVR_DIS_IO_BIT },
+	{ 0xfc00, 0x9c00, "mul", AVR_DIS_RD_RR },
+	{ 0xf800, 0xb000, "in", AVR_DIS_IN },
+	{ 0xf800, 0xb800, "out", AVR_DIS_OUT },
+	{ 0xf000, 0xc000, "rjmp", AVR_DIS_REL },
+	{ 0xf000, 0xd000, "rcall", AVR_DIS_REL },
+	{ 0xf000, 0xe000, "ldi", AVR_DIS_RD_K },
+	{ 0xfc00, 0xf000, "br", AVR_DIS_BRBS },
+	{ 0xfc00, 0xf400, "br", AVR_DIS_BRBC },
+	{ 0xfe08, 0xf800, "bld", AVR_DIS_RD_BIT },
+	{ 0xfe08, 0xfa00, "bst", AVR_DIS_RD_BIT },
+	{ 0xfe08, 0xfc00, "sbrc", AVR_DIS_RD_BIT },
+	{ 0xfe08, 0xfe00, "sbrs", AVR_DIS_RD_BIT },
+};
+
+// pointer of the LD/ST/LPM, by the low 4 bits of the opcode
+static const char * _avr_dis_ptr[16] = {
+	[0x1] = "Z+", [0x2] = "-Z", [0x4] = "Z", [0x5] = "Z+",
+	[0x6] = "Z", [0x7] = "Z+", [0x9] = "Y+", [0xa] = "-Y",
+	[0xc] = "X", [0xd] = "X+", [0xe] = "-X",
+};
+static const char * _avr_dis_brbs[8] = {
+	"cs", "eq", "mi", "vs", "lt", "hs", "ts", "ie" };
+static const char * _avr_dis_brbc[8] = {
+	"cc", "ne", "pl", "vc", "ge", "hc", "tc", "id" };
+
+int
+avr_disassemble(
+		avr_flashaddr_t pc,
+		uint16_t o,
+		uint16_t next,
+		char * out,
+		size_t size)
+{
+	int i;
+	for (i = 0; i < sizeof(_avr_dis) / sizeof(_avr_dis[0]); i++)
+		if ((o & _avr_dis[i].mask) == _avr_dis[i].value)
+			break;
+	if (i == sizeof(_avr_dis) / sizeof(_avr_dis[0])) {
+		snprintf(out, size, ".word\t0x%04x", o);
+		return 1;
+	}
+	const char * n = _avr_dis[i].name;
+	uint8_t d = (o >> 4) & 0x1f;
+	uint8_t r = (o & 0xf) | ((o >> 5) & 0x10);
+	uint8_t k = ((o >> 4) & 0xf0) | (o & 0xf);
+	uint8_t b = o & 7;
+	int words = avr_opcode_is_32_bits(o) ? 2 : 1;
+
+	switch (_avr_dis[i].kind) {
+		case AVR_DIS_NONE:
+			snprintf(out, size, "%s", n);
+			break;
+		case AVR_DIS_RD_RR:
+			snprintf(out, size, "%s\tr%d, r%d", n, d, r);
+			break;
+		case AVR_DIS_RD:
+			snprintf(out, size, "%s\tr%d", n, d);
+			break;
+		case AVR_DIS_RD_K:
+			snprintf(out, size, "%s\tr%d, 0x%02X", n, 16 + (d & 0xf), k);
+			break;
+		case AVR_DIS_MOVW:
+			snprintf(out, size, "%s\tr%d, r%d", n, (d & 0xf) << 1, (o & 0xf) << 1);
+			break;
+		case AVR_DIS_MULS:
+			snprintf(out, size, "%s\tr%d, r%d", n, 16 + (d & 0xf), 16 + (o & 0xf));
+			break;
+		case AVR_DIS_MUL3:
+			snprintf(out, size, "%s\tr%d, r%d", n, 16 + (d & 7), 16 + (o & 7));
+			break;
+		case AVR_DIS_ADIW:
+			snprintf(out, size, "%s\tr%d, 0x%02X", n, 24 + ((o >> 3) & 6),
+					((o >> 2) & 0x30) | (o & 0xf));
+			break;
+		case AVR_DIS_BRBS:
+		case AVR_DIS_BRBC: {
+			int rel = ((int8_t)(o >> 2) >> 1) * 2;	// 7 bits, signed
+			snprintf(out, size, "%s%s\t.%+d\t; 0x%x", n,
+					(_avr_dis[i].kind == AVR_DIS_BRBS ? _avr_dis_brbs : _avr_dis_brbc)[b],
+					rel, pc + 2 + rel);
+		}	break;
+		case AVR_DIS_REL: {
+			int rel = ((int16_t)(o << 4) >> 4) * 2;	// 12 bits, signed
+			snprintf(out, size, "%s\t.%+d\t; 0x%x", n, rel, pc + 2 + rel);
+		}	break;
+		case AVR_DIS_ABS:
+			snprintf(out, size, "%s\t0x%x", n,
+					((((o >> 3) & 0x3e) | (o & 1)) << 16 | next) << 1);
+			break;
+		case AVR_DIS_LDS:
+			snprintf(out, size, "%s\tr%d, 0x%04X", n, d, next);
+			break;
+		case AVR_DIS_STS:
+			snprintf(out, size, "%s\t0x%04X, r%d", n, next, d);
+			break;
+		case AVR_DIS_IN:
+			snprintf(out, size, "%s\tr%d, 0x%02X", n, d, ((o >> 5) & 0x30) | (o & 0xf));
+			break;
+		case AVR_DIS_OUT:
+			snprintf(out, size, "%s\t0x%02X, r%d", n, ((o >> 5) & 0x30) | (o & 0xf), d);
+			break;
+		case AVR_DIS_IO_BIT:
+			snprintf(out, size, "%s\t0x%02X, %d", n, (o >> 3) & 0x1f, b);
+			break;
+		case AVR_DIS_RD_BIT:
+			snprintf(out, size, "%s\tr%d, %d", n, d, b);
+			break;
+		case AVR_DIS_LD:
+			snprintf(out, size, "%s\tr%d, %s", n, d, _avr_dis_ptr[o & 0xf]);
+			break;
+		case AVR_DIS_ST:
+			snprintf(out, size, "%s\t%s, r%d", n, _avr_dis_ptr[o & 0xf], d);
+			break;
+		case AVR_DIS_LDD_Z:
+		case AVR_DIS_LDD_Y:
+		case AVR_DIS_STD_Z:
+		case AVR_DIS_STD_Y: {
+			int q = (o & 7) | ((o >> 7) & 0x18) | ((o >> 8) & 0x20);
+			char p = _avr_dis[i].kind == AVR_DIS_LDD_Y ||
+					_avr_dis[i].kind == AVR_DIS_STD_Y ? 'Y' : 'Z';
+			if (_avr_dis[i].kind == AVR_DIS_LDD_Z || _avr_dis[i].kind == AVR_DIS_LDD_Y)
+				snprintf(out, size, "%s\tr%d, %c+%d", n, d, p, q);
+			else
+				snprintf(out, size, "%s\t%c+%d, r%d", n, p, q, d);
+		}	break;
+		case AVR_DIS_SREG:
+			snprintf(out, size, "%s%c", n, "cznvshti"[(o >> 4) & 7]);
+			break;
+	}
+	return words;
+}
@@ -0,0 +1,49 @@
+/*
+	sim_disasm.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_DISASM_H__
+#define __SIM_DISASM_H__
+
+#include <stddef.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Writes the instruction 'opcode' (and 'next', the word after it, for the
+ * 32 bits ones) at 'pc' to 'out', in avr-objdump syntax, without the
+ * aliases. Returns its size in words, 1 or 2
+ */
+int
+avr_disassemble(
+		avr_flashaddr_t pc,
+		uint16_t opcode,
+		uint16_t next,
+		char * out,
+		size_t size);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_DISASM_H__ */
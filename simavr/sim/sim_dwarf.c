@@ -0,0 +1,480 @@
+/*
+	sim_dwarf.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_dwarf.h"
+
+// the few DWARF constants the line programs use
+enum {
+	DW_LNS_copy = 1, DW_LNS_advance_pc, DW_LNS_advance_line, DW_LNS_set_file,
+	DW_LNS_set_column, DW_LNS_negate_stmt, DW_LNS_set_basic_block,
+	DW_LNS_const_add_pc, DW_LNS_fixed_advance_pc,
+	DW_LNE_end_sequence = 1, DW_LNE_set_address, DW_LNE_define_file,
+	DW_LNCT_path = 1, DW_LNCT_directory_index,
+	DW_FORM_data2 = 0x05, DW_FORM_data4, DW_FORM_data8, DW_FORM_string,
+	DW_FORM_block, DW_FORM_data1 = 0x0b, DW_FORM_strp = 0x0e,
+	DW_FORM_udata, DW_FORM_data16 = 0x1e, DW_FORM_line_strp,
+};
+
+typedef struct dwarf_reader_t {
+	const uint8_t *	p;
+	const uint8_t *	end;
+	int				error;
+} dwarf_reader_t;
+
+static uint64_t
+_dwarf_u(
+		dwarf_reader_t * r,
+		int bytes)
+{
+	uint64_t v = 0;
+	if (r->end - r->p < bytes) {
+		r->error = 1;
+		r->p = r->end;
+		return 0;
+	}
+	for (int i = 0; i < bytes; i++)
+		v |= (uint64_t)*r->p++ << (i * 8);
+	return v;
+}
+
+static uint64_t
+_dwarf_uleb(
+		dwarf_reader_t * r)
+{
+	uint64_t v = 0;
+	for (int shift = 0; r->p < r->end; shift += 7) {
+		uint8_t b = *r->p++;
+		if (shift < 64)
+			v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+	}
+	r->error = 1;
+	return v;
+}
+
+static int64_t
+_dwarf_sleb(
+		dwarf_reader_t * r)
+{
+	int64_t v = 0;
+	for (int shift = 0; r->p < r->end; ) {
+		uint8_t b = *r->p++;
+		if (shift < 64)
+			v |= (int64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			if (shift < 64 && (b & 0x40))
+				v |= -((int64_t)1 << shift);
+			return v;
+		}
+	}
+	r->error = 1;
+	return v;
+}
+
+static const char *
+_dwarf_str(
+		dwarf_reader_t * r)
+{
+	const uint8_t * z = memchr(r->p, 0, r->end - r->p);
+	if (!z) {
+		r->error = 1;
+		r->p = r->end;
+		return NULL;
+	}
+	const char * s = (const char *)r->p;
+	r->p = z + 1;
+	return s;
+}
+
+/*
+ * Reads a DWARF 5 directory or file entry attribute, as a number in 'v',
+ * or as a string in 's' (NULL if it isn't one, or not available)
+ */
+static void
+_dwarf_form(
+		dwarf_reader_t * r,
+		uint64_t form,
+		int offset_size,
+		const uint8_t * str,
+		size_t str_size,
+		uint64_t * v,
+		const char ** s)
+{
+	*v = 0;
+	*s = NULL;
+	switch (form) {
+		case DW_FORM_string:
+			*s = _dwarf_str(r);
+			break;
+		case DW_FORM_line_strp:
+		case DW_FORM_strp: {
+			uint64_t o = _dwarf_u(r, offset_size);
+			// only .debug_line_str is at hand
+			if (form == DW_FORM_line_strp && str && o < str_size &&
+					memchr(str + o, 0, str_size - o))
+				*s = (const char *)str + o;
+		}	break;
+		case DW_FORM_udata:
+			*v = _dwarf_uleb(r);
+			break;
+		case DW_FORM_data1: *v = _dwarf_u(r, 1); break;
+		case DW_FORM_data2: *v = _dwarf_u(r, 2); break;
+		case DW_FORM_data4: *v = _dwarf_u(r, 4); break;
+		case DW_FORM_data8: *v = _dwarf_u(r, 8); break;
+		case DW_FORM_data16:
+			_dwarf_u(r, 8);
+			_dwarf_u(r, 8);
+			break;
+		case DW_FORM_block: {
+			uint64_t len = _dwarf_uleb(r);
+			if (len > (uint64_t)(r->end - r->p))
+				r->error = 1;
+			else
+				r->p += len;
+		}	break;
+		default:
+			r->error = 1;
+	}
+}
+
+// index of 'dir'/'name' in the lines file table, added if needed
+static uint32_t
+_dwarf_file(
+		avr_lines_t * lines,
+		const char * dir,
+		const char * name)
+{
+	if (!name)
+		name = "<unknown>";
+	char * path;
+	if (dir && *dir && name[0] != '/') {
+		path = malloc(strlen(dir) + strlen(name) + 2);
+		sprintf(path, "%s/%s", dir, name);
+	} else
+		path = strdup(name);
+	for (uint32_t i = 0; i < lines->file_count; i++)
+		if (!strcmp(lines->file[i], path)) {
+			free(path);
+			return i;
+		}
+	if (!(lines->file_count % 16))
+		lines->file = realloc(lines->file,
+				(lines->file_count + 16) * sizeof(lines->file[0]));
+	lines->file[lines->file_count] = path;
+	return lines->file_count++;
+}
+
+static void
+_dwarf_range(
+		avr_lines_t * lines,
+		uint32_t start,
+		uint32_t end,
+		uint32_t line,
+		uint32_t file)
+{
+	if (start >= end || !line)
+		return;
+	if (!(lines->count % 256))
+		lines->range = realloc(lines->range,
+				(lines->count + 256) * sizeof(lines->range[0]));
+	lines->range[lines->count++] = (avr_line_range_t) {
+		.start = start, .end = end, .line = line, .file = file };
+}
+
+static int
+_dwarf_range_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_line_range_t * ra = a, * rb = b;
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+#define AVR_DWARF_NO_FILE	0xffffffff
+
+// the file table of a unit: global file index for each of its own
+typedef struct dwarf_files_t {
+	uint32_t *	index;
+	uint32_t	count;
+} dwarf_files_t;
+
+static void
+_dwarf_files_add(
+		dwarf_files_t * files,
+		uint32_t index)
+{
+	if (!(files->count % 16))
+		files->index = realloc(files->index,
+				(files->count + 16) * sizeof(files->index[0]));
+	files->index[files->count++] = index;
+}
+
+// DWARF 5 directory or file entries, with the path and directory index
+static void
+_dwarf_entries(
+		dwarf_reader_t * r,
+		int offset_size,
+		const uint8_t * str,
+		size_t str_size,
+		void (*entry)(void * param, const char * path, uint64_t dir),
+		void * param)
+{
+	uint8_t format_count = _dwarf_u(r, 1);
+	uint64_t format[2 * 255];
+	for (int i = 0; i < format_count; i++) {
+		format[i * 2] = _dwarf_uleb(r);
+		format[i * 2 + 1] = _dwarf_uleb(r);
+	}
+	uint64_t count = _dwarf_uleb(r);
+	for (uint64_t e = 0; e < count && !r->error; e++) {
+		const char * path = NULL;
+		uint64_t dir = 0;
+		for (int i = 0; i < format_count; i++) {
+			uint64_t v;
+			const char * s;
+			_dwarf_form(r, format[i * 2 + 1], offset_size, str, str_size, &v, &s);
+			if (format[i * 2] == DW_LNCT_path)
+				path = s;
+			else if (format[i * 2] == DW_LNCT_directory_index)
+				dir = v;
+		}
+		entry(param, path, dir);
+	}
+}
+
+typedef struct dwarf_unit_t {
+	avr_lines_t *	lines;
+	const char *	dir[256];
+	uint32_t		dir_count;
+	dwarf_files_t	files;
+} dwarf_unit_t;
+
+static void
+_dwarf_dir_entry(
+		void * param,
+		const char * path,
+		uint64_t dir)
+{
+	dwarf_unit_t * u = param;
+	if (u->dir_count < 256)
+		u->dir[u->dir_count++] = path;
+}
+
+static void
+_dwarf_file_entry(
+		void * param,
+		const char * path,
+		uint64_t dir)
+{
+	dwarf_unit_t * u = param;
+	_dwarf_files_add(&u->files, _dwarf_file(u->lines,
+			dir < u->dir_count ? u->dir[dir] : NULL, path));
+}
+
+// runs the line number program of one unit, from r->p to r->end
+static void
+_dwarf_program(
+		dwarf_reader_t * r,
+		avr_lines_t * lines,
+		dwarf_files_t * files,
+		uint8_t min_inst,
+		int8_t line_base,
+		uint8_t line_range,
+		uint8_t opcode_base,
+		const uint8_t * std_len)
+{
+	uint64_t addr = 0;
+	int64_t line = 1;
+	// 1 in every version, even though DWARF 5 numbers its files from 0
+	uint64_t file = 1;
+	int have_row = 0;
+	uint64_t row_addr = 0, row_file = 0;
+	int64_t row_line = 0;
+
+// closes the range of the previous row, and starts one for this row
+#define ROW() { \
+		if (have_row && row_file < files->count && row_line > 0 && \
+				files->index[row_file] != AVR_DWARF_NO_FILE) \
+			_dwarf_range(lines, row_addr, addr, row_line, files->index[row_file]); \
+		have_row = 1; \
+		row_addr = addr; row_line = line; row_file = file; \
+	}
+	while (r->p < r->end && !r->error) {
+		uint8_t op = _dwarf_u(r, 1);
+		if (op >= opcode_base) {
+			uint8_t adj = op - opcode_base;
+			addr += (adj / line_range) * min_inst;
+			line += line_base + adj % line_range;
+			ROW();
+			continue;
+		}
+		switch (op) {
+			case 0: {	// extended opcode
+				uint64_t len = _dwarf_uleb(r);
+				if (!len || len > (uint64_t)(r->end - r->p)) {
+					r->error = 1;
+					break;
+				}
+				const uint8_t * next = r->p + len;
+				uint8_t sub = _dwarf_u(r, 1);
+				switch (sub) {
+					case DW_LNE_end_sequence:
+						ROW();
+						have_row = 0;
+						addr = 0;
+						line = 1;
+						file = 1;
+						break;
+					case DW_LNE_set_address:
+						addr = len - 1 <= 8 ? _dwarf_u(r, len - 1) : 0;
+						break;
+					case DW_LNE_define_file: {
+						const char * name = _dwarf_str(r);
+						_dwarf_files_add(files, _dwarf_file(lines, NULL, name));
+					}	break;
+				}
+				r->p = next;
+			}	break;
+			case DW_LNS_copy:
+				ROW();
+				break;
+			case DW_LNS_advance_pc:
+				addr += _dwarf_uleb(r) * min_inst;
+				break;
+			case DW_LNS_advance_line:
+				line += _dwarf_sleb(r);
+				break;
+			case DW_LNS_set_file:
+				file = _dwarf_uleb(r);
+				break;
+			case DW_LNS_const_add_pc:
+				addr += ((255 - opcode_base) / line_range) * min_inst;
+				break;
+			case DW_LNS_fixed_advance_pc:
+				addr += _dwarf_u(r, 2);
+				break;
+			default:	// the others only have LEB128 operands
+				for (int i = 0; i < std_len[op]; i++)
+					_dwarf_uleb(r);
+		}
+	}
+#undef ROW
+}
+
+int
+avr_dwarf_read_lines(
+		avr_lines_t * lines,
+		const uint8_t * data,
+		size_t size,
+		const uint8_t * str,
+		size_t str_size)
+{
+	dwarf_reader_t r = { .p = data, .end = data + size };
+	int res = 0;
+
+	while (r.p < r.end && !res) {
+		int offset_size = 4;
+		uint64_t length = _dwarf_u(&r, 4);
+		if (length == 0xffffffff) {
+			offset_size = 8;
+			length = _dwarf_u(&r, 8);
+		}
+		if (r.error || length > (uint64_t)(r.end - r.p)) {
+			res = -1;
+			break;
+		}
+		dwarf_reader_t u = { .p = r.p, .end = r.p + length };
+		r.p = u.end;
+
+		uint16_t version = _dwarf_u(&u, 2);
+		if (version < 2 || version > 5)
+			continue;	// not something we know, skip that unit
+		if (version >= 5)
+			_dwarf_u(&u, 2);	// address and segment selector sizes
+		uint64_t header_length = _dwarf_u(&u, offset_size);
+		if (header_length > (uint64_t)(u.end - u.p)) {
+			res = -1;
+			break;
+		}
+		const uint8_t * program = u.p + header_length;
+		uint8_t min_inst = _dwarf_u(&u, 1);
+		if (version >= 4)
+			_dwarf_u(&u, 1);	// maximum operations per instruction
+		_dwarf_u(&u, 1);		// default is_stmt
+		int8_t line_base = _dwarf_u(&u, 1);
+		uint8_t line_range = _dwarf_u(&u, 1);
+		uint8_t opcode_base = _dwarf_u(&u, 1);
+		uint8_t std_len[256] = { 0 };
+		for (int i = 1; i < opcode_base; i++)
+			std_len[i] = _dwarf_u(&u, 1);
+		if (u.error || !line_range || !opcode_base) {
+			res = -1;
+			break;
+		}
+
+		dwarf_unit_t unit = { .lines = lines };
+		if (version >= 5) {
+			_dwarf_entries(&u, offset_size, str, str_size, _dwarf_dir_entry, &unit);
+			_dwarf_entries(&u, offset_size, str, str_size, _dwarf_file_entry, &unit);
+		} else {
+			// the compilation directory (0) isn't in there
+			unit.dir[unit.dir_count++] = NULL;
+			const char * s;
+			while ((s = _dwarf_str(&u)) && *s)
+				_dwarf_dir_entry(&unit, s, 0);
+			// file numbers start at 1
+			_dwarf_files_add(&unit.files, AVR_DWARF_NO_FILE);
+			while ((s = _dwarf_str(&u)) && *s) {
+				uint64_t dir = _dwarf_uleb(&u);
+				_dwarf_uleb(&u);	// modification time
+				_dwarf_uleb(&u);	// and size
+				_dwarf_file_entry(&unit, s, dir);
+			}
+		}
+		if (!u.error) {
+			u.p = program;
+			_dwarf_program(&u, lines, &unit.files, min_inst,
+					line_base, line_range, opcode_base, std_len);
+		}
+		free(unit.files.index);
+		if (u.error)
+			res = -1;
+	}
+	if (lines->count)
+		qsort(lines->range, lines->count, sizeof(lines->range[0]), _dwarf_range_cmp);
+	return res;
+}
+
+void
+avr_dwarf_free_lines(
+		avr_lines_t * lines)
+{
+	for (uint32_t i = 0; i < lines->file_count; i++)
+		free(lines->file[i]);
+	free(lines->file);
+	free(lines->range);
+	memset(lines, 0, sizeof(*lines));
+}
@@ -0,0 +1,73 @@
+/*
+	sim_dwarf.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reader for the DWARF (2 to 5) line number programs of the .debug_line
+ * section, giving the source line of each range of flash addresses. It
+ * works on the raw sections, so it doesn't need libelf itself.
+ */
+#ifndef __SIM_DWARF_H__
+#define __SIM_DWARF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// flash bytes [start, end) were generated for 'line' of 'file'
+typedef struct avr_line_range_t {
+	uint32_t	start, end;
+	uint32_t	line;
+	uint32_t	file;		// index in avr_lines_t 'file'
+} avr_line_range_t;
+
+typedef struct avr_lines_t {
+	avr_line_range_t *	range;	// sorted by address
+	uint32_t			count;
+	char **				file;	// paths, as the compiler gave them
+	uint32_t			file_count;
+} avr_lines_t;
+
+/*
+ * Adds the line tables of the .debug_line section 'data' to 'lines', which
+ * can start zeroed. 'str' is the .debug_line_str section, for DWARF 5,
+ * if there is one. Returns zero, or -1 if the section is corrupt, in which
+ * case what was read before is kept.
+ */
+int
+avr_dwarf_read_lines(
+		avr_lines_t * lines,
+		const uint8_t * data,
+		size_t size,
+		const uint8_t * str,
+		size_t str_size);
+// frees the memory of 'lines', which can be used again
+void
+avr_dwarf_free_lines(
+		avr_lines_t * lines);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_DWARF_H__ */
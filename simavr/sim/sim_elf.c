@@ -312,6 +312,7 @@ elf_read_firmware(
 		*data_ee = NULL;                /* Data Descriptor */
 	Elf_Data *data_fuse = NULL;
 	Elf_Data *data_lockbits = NULL;
+	Elf_Data *data_line = NULL, *data_line_str = NULL;
 
 	memset(firmware, 0, sizeof(*firmware));
 #if ELF_SYMBOLS
@@ -345,6 +346,10 @@ elf_read_firmware(
 			data_fuse = elf_getdata(scn, NULL);
 		else if (!strcmp(name, ".lock"))
 			data_lockbits = elf_getdata(scn, NULL);
+		else if (!strcmp(name, ".debug_line"))
+			data_line = elf_getdata(scn, NULL);
+		else if (!strcmp(name, ".debug_line_str"))
+			data_line_str = elf_getdata(scn, NULL);
 		else if (!strcmp(name, ".bss")) {
 			Elf_Data *s = elf_getdata(scn, NULL);
 			firmware->bsssize = s->d_size;
@@ -440,6 +445,13 @@ elf_read_firmware(
 		if (elf_copy_section(".lock", data_lockbits, &firmware->lockbits))
 			return -1;
 	}
+#if ELF_SYMBOLS
+	if (data_line && avr_dwarf_read_lines(&firmware->lines,
+			data_line->d_buf, data_line->d_size,
+			data_line_str ? data_line_str->d_buf : NULL,
+			data_line_str ? data_line_str->d_size : 0))
+		AVR_LOG(NULL, LOG_WARNING, "%s: .debug_line is corrupt, some lines missing\n", file);
+#endif
 //	hdump("flash", avr->flash, offset);
 	elf_end(elf);
 	close(fd);
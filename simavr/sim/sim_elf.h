@@ -39,6 +39,7 @@ extern "C" {
 #define AVR_SEGMENT_OFFSET_EEPROM 0x00810000
 
 #include "sim_avr.h"
+#include "sim_dwarf.h"
 
 typedef struct elf_firmware_t {
 	char  mmcu[64];
@@ -79,6 +80,8 @@ typedef struct elf_firmware_t {
 #if ELF_SYMBOLS
 	avr_symbol_t **  symbol;
 	uint32_t		symbolcount;
+	// source lines of the code, from .debug_line
+	avr_lines_t		lines;
 #endif
 } elf_firmware_t ;
 
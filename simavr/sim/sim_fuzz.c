@@ -0,0 +1,273 @@
+/*
+	sim_fuzz.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_cycle_timers.h"
+#include "sim_fuzz.h"
+#include "avr_uart.h"
+#include "avr_adc.h"
+#include "avr_watchdog.h"
+
+static void
+_avr_fuzz_watchdog(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = param;
+	f->coverage.fault = AVR_FUZZ_WATCHDOG;
+	f->avr->state = cpu_Crashed;
+}
+
+int
+avr_fuzz_init(
+		avr_fuzz_t * f,
+		avr_t * avr,
+		uint8_t * map,
+		uint32_t map_size)
+{
+	memset(f, 0, sizeof(*f));
+	if (!map_size)
+		map_size = AVR_FUZZ_MAP_SIZE;
+	if (map_size < 256 || (map_size & (map_size - 1)))
+		return -1;
+	f->avr = avr;
+	f->budget = AVR_FUZZ_BUDGET;
+	f->settle = AVR_FUZZ_SETTLE;
+	if (!map)
+		map = f->own_map = calloc(1, map_size);
+	f->coverage.map = map;
+	f->coverage.shift = 32 - __builtin_ctz(map_size);
+	f->boot.incremental = 1;
+	if (!map || avr_snapshot_save(avr, &f->boot)) {
+		avr_fuzz_free(f);
+		return -1;
+	}
+	avr_irq_t * wd = avr_io_getirq(avr, AVR_IOCTL_WATCHDOG_GETIRQ, WATCHDOG_IRQ_RESET);
+	if (wd)
+		avr_irq_register_notify(wd, _avr_fuzz_watchdog, f);
+	avr->coverage = &f->coverage;
+	return 0;
+}
+
+static avr_cycle_count_t
+_avr_fuzz_end_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+// pushes the input until the UART fifo is full
+static void
+_avr_fuzz_uart_feed(
+		avr_fuzz_t * f)
+{
+	while (!f->xoff && f->pos < f->size)
+		avr_raise_irq(f->irq + UART_IRQ_INPUT, f->data[f->pos++]);
+}
+
+static void
+_avr_fuzz_uart_xon(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = param;
+	f->xoff = 0;
+	if (!f->data)
+		return;
+	if (f->pos < f->size) {
+		_avr_fuzz_uart_feed(f);
+	} else if (!f->drained) {
+		// the fifo is empty, the firmware has read it all
+		f->drained = 1;
+		avr_t * avr = f->avr;
+		if (avr->cycle + f->settle < f->end) {
+			f->end = avr->cycle + f->settle;
+			avr_cycle_timer_register(avr, f->settle, _avr_fuzz_end_timer, f);
+		}
+	}
+}
+
+static void
+_avr_fuzz_uart_xoff(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = param;
+	f->xoff = value;
+}
+
+int
+avr_fuzz_input_uart(
+		avr_fuzz_t * f,
+		char name)
+{
+	avr_irq_t * irq = avr_io_getirq(f->avr, AVR_IOCTL_UART_GETIRQ(name), 0);
+	if (!irq)
+		return -1;
+	f->input = AVR_FUZZ_INPUT_UART;
+	f->irq = irq;
+	avr_irq_register_notify(irq + UART_IRQ_OUT_XON, _avr_fuzz_uart_xon, f);
+	avr_irq_register_notify(irq + UART_IRQ_OUT_XOFF, _avr_fuzz_uart_xoff, f);
+	return 0;
+}
+
+static uint32_t
+_avr_fuzz_adc_value(
+		avr_fuzz_t * f)
+{
+	uint32_t v = 0;
+	if (f->pos + 2 <= f->size) {
+		v = f->data[f->pos] | (f->data[f->pos + 1] << 8);
+		f->pos += 2;
+	}
+	return v * 5000 / 0xffff;
+}
+
+static void
+_avr_fuzz_adc_trigger(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = param;
+	if (!f->data)
+		return;
+	union {
+		avr_adc_mux_t mux;
+		uint32_t v;
+	} e = { .v = value };
+	switch (e.mux.kind) {
+		case ADC_MUX_DIFF:
+			avr_raise_irq(f->irq + ADC_IRQ_ADC0 + e.mux.diff, _avr_fuzz_adc_value(f));
+			// fall through
+		case ADC_MUX_SINGLE:
+			avr_raise_irq(f->irq + ADC_IRQ_ADC0 + e.mux.src, _avr_fuzz_adc_value(f));
+			break;
+	}
+}
+
+int
+avr_fuzz_input_adc(
+		avr_fuzz_t * f)
+{
+	avr_irq_t * irq = avr_io_getirq(f->avr, AVR_IOCTL_ADC_GETIRQ, 0);
+	if (!irq)
+		return -1;
+	f->input = AVR_FUZZ_INPUT_ADC;
+	f->irq = irq;
+	avr_irq_register_notify(irq + ADC_IRQ_OUT_TRIGGER, _avr_fuzz_adc_trigger, f);
+	return 0;
+}
+
+int
+avr_fuzz_input_memory(
+		avr_fuzz_t * f,
+		uint16_t addr,
+		uint16_t max,
+		uint16_t size_addr)
+{
+	avr_t * avr = f->avr;
+	if (addr <= avr->ioend || addr + max > avr->ramend + 1 ||
+			(size_addr && (size_addr <= avr->ioend || size_addr >= avr->ramend)))
+		return -1;
+	f->input = AVR_FUZZ_INPUT_MEMORY;
+	f->memory.addr = addr;
+	f->memory.max = max;
+	f->memory.size_addr = size_addr;
+	return 0;
+}
+
+int
+avr_fuzz_run(
+		avr_fuzz_t * f,
+		const uint8_t * data,
+		size_t size)
+{
+	avr_t * avr = f->avr;
+	if (avr_snapshot_restore(avr, &f->boot))
+		return -1;
+	f->coverage.prev = 0;
+	f->coverage.fault = AVR_FUZZ_OK;
+	f->data = data;
+	f->size = size;
+	f->pos = 0;
+	f->drained = 0;
+	f->end = avr->cycle + f->budget;
+	avr_cycle_timer_register(avr, f->budget, _avr_fuzz_end_timer, f);
+
+	switch (f->input) {
+		case AVR_FUZZ_INPUT_UART:
+			f->xoff = f->irq[UART_IRQ_OUT_XOFF].value;
+			_avr_fuzz_uart_feed(f);
+			break;
+		case AVR_FUZZ_INPUT_MEMORY: {
+			uint16_t n = size < f->memory.max ? size : f->memory.max;
+			memcpy(avr->data + f->memory.addr, data, n);
+			avr_data_dirty(avr, f->memory.addr, n);
+			if (f->memory.size_addr) {
+				avr->data[f->memory.size_addr] = n;
+				avr->data[f->memory.size_addr + 1] = n >> 8;
+				avr_data_dirty(avr, f->memory.size_addr, 2);
+			}
+		}	break;
+	}
+	while ((avr->state == cpu_Running || avr->state == cpu_Sleeping) &&
+			avr->cycle < f->end)
+		avr->run(avr);
+	f->data = NULL;
+
+	if (f->coverage.fault)
+		return f->coverage.fault;
+	return avr->state == cpu_Crashed ? AVR_FUZZ_CRASHED : AVR_FUZZ_OK;
+}
+
+void
+avr_fuzz_free(
+		avr_fuzz_t * f)
+{
+	avr_t * avr = f->avr;
+	if (avr && avr->coverage == &f->coverage) {
+		avr->coverage = NULL;
+		avr_irq_t * wd = avr_io_getirq(avr, AVR_IOCTL_WATCHDOG_GETIRQ, WATCHDOG_IRQ_RESET);
+		if (wd)
+			avr_irq_unregister_notify(wd, _avr_fuzz_watchdog, f);
+		switch (f->input) {
+			case AVR_FUZZ_INPUT_UART:
+				avr_irq_unregister_notify(f->irq + UART_IRQ_OUT_XON, _avr_fuzz_uart_xon, f);
+				avr_irq_unregister_notify(f->irq + UART_IRQ_OUT_XOFF, _avr_fuzz_uart_xoff, f);
+				break;
+			case AVR_FUZZ_INPUT_ADC:
+				avr_irq_unregister_notify(f->irq + ADC_IRQ_OUT_TRIGGER, _avr_fuzz_adc_trigger, f);
+				break;
+		}
+	}
+	avr_snapshot_free(&f->boot);
+	free(f->own_map);
+	f->own_map = NULL;
+}
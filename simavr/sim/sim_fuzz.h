@@ -0,0 +1,160 @@
+/*
+	sim_fuzz.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In process fuzzing of a firmware. The avr is booted once, by the caller,
+ * to where it waits for its input; that state is kept in an incremental
+ * snapshot, and every run starts back from it. The input is fed to a
+ * UART, to the ADC conversions, or copied in RAM, and the core records the
+ * edges it goes through in an AFL style bitmap of hit counts.
+ *
+ * The bitmap can be the fuzzer's: __afl_area_ptr for AFL (in persistent
+ * mode), or an array in the "__libfuzzer_extra_counters" section for
+ * libFuzzer, whose LLVMFuzzerTestOneInput() just calls avr_fuzz_run(),
+ * and abort()s if it returns a fault.
+ *
+ * The coverage is an instruction hook (see avr_run_one()); an edge is
+ * recorded at every transfer of control (jump, call, return, taken branch
+ * or skip, interrupt) to where it goes, hashed with where the previous one
+ * went.
+ */
+#ifndef __SIM_FUZZ_H__
+#define __SIM_FUZZ_H__
+
+#include "sim_avr.h"
+#include "sim_snapshot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_FUZZ_MAP_SIZE		65536
+#define AVR_FUZZ_BUDGET			1000000	// most cycles a run can take
+// cycles left to the firmware once it has read all of the UART input
+#define AVR_FUZZ_SETTLE			20000
+
+// What a run ended with; the core stops on any of the faults
+enum {
+	AVR_FUZZ_OK = 0,
+	AVR_FUZZ_CRASHED,			// the core crashed, bad pc...
+	AVR_FUZZ_INVALID_OPCODE,
+	AVR_FUZZ_STACK_OVERFLOW,	// SP went under 'stack_limit'
+	AVR_FUZZ_WATCHDOG,			// the watchdog reset the avr
+};
+
+typedef struct avr_coverage_t {
+	uint8_t *	map;			// hit counts, one per edge hash
+	uint32_t	shift;			// 32 minus log2 of the map size
+	uint32_t	prev;			// hash of where the last edge went, halved
+	uint16_t	stack_limit;	// lowest SP allowed, zero for any
+	int			fault;			// AVR_FUZZ_* the core stopped on
+} avr_coverage_t;
+
+static inline void
+avr_coverage_edge(
+		avr_coverage_t * c,
+		avr_flashaddr_t to)
+{
+	uint32_t loc = ((to >> 1) * 2654435761u) >> c->shift;
+	c->map[loc ^ c->prev]++;
+	c->prev = loc >> 1;
+}
+
+enum {
+	AVR_FUZZ_INPUT_NONE = 0,
+	AVR_FUZZ_INPUT_UART,		// the bytes, as fast as the UART takes them
+	AVR_FUZZ_INPUT_ADC,			// two bytes per conversion, 0 to 5V
+	AVR_FUZZ_INPUT_MEMORY,		// copied in RAM before the run
+};
+
+typedef struct avr_fuzz_t {
+	avr_t *				avr;
+	avr_coverage_t		coverage;
+	avr_snapshot_t		boot;		// where every run starts from
+	avr_cycle_count_t	budget;		// AVR_FUZZ_BUDGET by default
+	avr_cycle_count_t	settle;		// AVR_FUZZ_SETTLE by default
+	avr_cycle_count_t	end;		// of the current run
+	int					input;		// AVR_FUZZ_INPUT_*
+	avr_irq_t *			irq;		// of the UART or the ADC
+	struct {
+		uint16_t		addr, max;
+		uint16_t		size_addr;	// where the size goes, if not zero
+	} memory;
+	uint8_t *			own_map;	// if the map was not given
+	// the input of the current run
+	const uint8_t *		data;
+	size_t				size, pos;
+	uint8_t				xoff : 1,	// the UART can't take more
+						drained : 1;	// it was all read
+} avr_fuzz_t;
+
+/*
+ * Takes the state of 'avr', booted and waiting for its input, as the start
+ * of every run, and turns the coverage on in 'map' (which is allocated if
+ * NULL); 'map_size' is a power of two, AVR_FUZZ_MAP_SIZE if zero. The
+ * budget, settle time and stack limit can be changed afterwards.
+ * Returns zero, or -1 on error
+ */
+int
+avr_fuzz_init(
+		avr_fuzz_t * f,
+		avr_t * avr,
+		uint8_t * map,
+		uint32_t map_size);
+// The input goes to the UART 'name'. Returns -1 if there is no such UART
+int
+avr_fuzz_input_uart(
+		avr_fuzz_t * f,
+		char name);
+// The input feeds the ADC channels. Returns -1 if there is no ADC
+int
+avr_fuzz_input_adc(
+		avr_fuzz_t * f);
+/*
+ * The input is copied at 'addr', up to 'max' bytes, with its size as a 16
+ * bits little endian word at 'size_addr' if not zero
+ */
+int
+avr_fuzz_input_memory(
+		avr_fuzz_t * f,
+		uint16_t addr,
+		uint16_t max,
+		uint16_t size_addr);
+/*
+ * Runs the firmware from the boot state on 'data', until it stops, faults,
+ * or runs out of budget, adding to the map (which is not cleared).
+ * Returns AVR_FUZZ_OK or the fault, or -1 if the avr couldn't be reset
+ */
+int
+avr_fuzz_run(
+		avr_fuzz_t * f,
+		const uint8_t * data,
+		size_t size);
+// Turns the coverage off, frees 'f', and leaves the avr where it was
+void
+avr_fuzz_free(
+		avr_fuzz_t * f);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FUZZ_H__ */
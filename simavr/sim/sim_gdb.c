@@ -29,6 +29,7 @@
 #include <pthread.h>
 #include "sim_avr.h"
 #include "sim_core.h" // for SET_SREG_FROM, READ_SREG_INTO
+#include "sim_snapshot.h"
 #include "sim_hex.h"
 #include "avr_eeprom.h"
 #include "sim_gdb.h"
@@ -53,6 +54,9 @@ typedef struct avr_gdb_t {
 
 	avr_gdb_watchpoints_t breakpoints;
 	avr_gdb_watchpoints_t watchpoints;
+
+	// avr->run_cycle_limit to restore when gdb goes away
+	avr_cycle_count_t run_cycle_limit;
 } avr_gdb_t;
 
 
@@ -457,9 +461,12 @@ gdb_handle_command(
 			}
 			if (addr < 0xffff) {
 				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
+				avr_decode_invalidate(avr, addr, strlen(start+1) / 2);
+				avr->flash_written = 1;
 				gdb_send_reply(g, "OK");
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
 				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
+				avr_data_dirty(avr, addr - 0x800000, strlen(start+1) / 2);
 				gdb_send_reply(g, "OK");
 			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
 				read_hex_string(start + 1, (uint8_t*)rep, strlen(start+1));
@@ -716,6 +723,10 @@ avr_gdb_init(
 	// change default run behaviour to use the slightly slower versions
 	avr->run = avr_callback_run_gdb;
 	avr->sleep = avr_callback_sleep_gdb;
+	// breakpoints are checked between avr_run() calls, so run one
+	// instruction at a time
+	g->run_cycle_limit = avr->run_cycle_limit;
+	avr->run_cycle_limit = avr->run_cycle_count = 1;
 
 	return 0;
 
@@ -735,6 +746,7 @@ avr_deinit_gdb(
 		return;
 	avr->run = avr_callback_run_raw; // restore normal callbacks
 	avr->sleep = avr_callback_sleep_raw;
+	avr->run_cycle_limit = avr->gdb->run_cycle_limit;
 	if (avr->gdb->listen != -1)
 		close(avr->gdb->listen);
 	avr->gdb->listen = -1;
@@ -27,8 +27,63 @@
 #include "sim_interrupts.h"
 #include "sim_avr.h"
 #include "sim_core.h"
+#include "sim_snapshot.h"
+#include "sim_fuzz.h"
+#include "sim_profile.h"
 
-DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
+/*
+ * Lowest vector number in the pending queue, or -1 if it is empty
+ */
+static inline int
+_avr_int_pending_first(
+		avr_int_table_p table)
+{
+	for (int i = 0; i < AVR_INT_VECTOR_MAX / 64; i++)
+		if (table->pending_map[i])
+			return (i * 64) + __builtin_ctzll(table->pending_map[i]);
+	return -1;
+}
+
+static inline void
+_avr_int_pending_add(
+		avr_int_table_p table,
+		avr_int_vector_t * vector)
+{
+	uint8_t v = vector->vector & (AVR_INT_VECTOR_MAX - 1);
+
+	table->pending_vector[v] = vector;
+	table->pending_count[v]++;
+	table->pending_map[v / 64] |= 1ULL << (v % 64);
+}
+
+static inline void
+_avr_int_pending_remove(
+		avr_int_table_p table,
+		uint8_t v)
+{
+	if (--table->pending_count[v] == 0)
+		table->pending_map[v / 64] &= ~(1ULL << (v % 64));
+}
+
+/*
+ * Update the global pending IRQ: the lowest queued vector, or floating
+ * when the queue is empty. Its hooks are only called when that changes,
+ * not on every raise and service.
+ */
+static void
+_avr_int_pending_irq(
+		avr_t * avr)
+{
+	avr_irq_t * irq = avr->interrupts.irq + AVR_INT_IRQ_PENDING;
+	int first = _avr_int_pending_first(&avr->interrupts);
+	uint32_t value = first >= 0 ? first : 0;
+	int floating = first < 0;
+
+	if (irq->value == value && !(irq->flags & IRQ_FLAG_INIT) &&
+			!(irq->flags & IRQ_FLAG_FLOATING) == !floating)
+		return;
+	avr_raise_irq_float(irq, value, floating);
+}
 
 void
 avr_interrupt_init(
@@ -50,10 +105,12 @@ avr_interrupt_reset(
 	avr_int_table_p table = &avr->interrupts;
 
 	table->running_ptr = 0;
-	avr_int_pending_reset(&table->pending);
+	memset(table->pending_map, 0, sizeof(table->pending_map));
+	memset(table->pending_count, 0, sizeof(table->pending_count));
 	avr->interrupt_state = 0;
 	for (int i = 0; i < table->vector_count; i++)
 		table->vector[i]->pending = 0;
+	_avr_int_pending_irq(avr);
 }
 
 void
@@ -88,7 +145,7 @@ avr_has_pending_interrupts(
 		avr_t * avr)
 {
 	avr_int_table_p table = &avr->interrupts;
-	return !avr_int_pending_isempty(&table->pending);
+	return _avr_int_pending_first(table) >= 0;
 }
 
 int
@@ -135,16 +192,14 @@ avr_raise_interrupt(
 	}
 
 	avr_raise_irq(vector->irq + AVR_INT_IRQ_PENDING, 1);
-	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING, 1);
 
 	// If the interrupt is enabled, attempt to wake the core
 	if (avr_regbit_get(avr, vector->enable)) {
 		// Mark the interrupt as pending
 		vector->pending = 1;
 
-		avr_int_table_p table = &avr->interrupts;
-
-		avr_int_pending_write(&table->pending, vector);
+		_avr_int_pending_add(&avr->interrupts, vector);
+		_avr_int_pending_irq(avr);
 
 		if (avr->sreg[S_I] && avr->interrupt_state == 0)
 			avr->interrupt_state = 1;
@@ -171,11 +226,7 @@ avr_clear_interrupt(
 	vector->pending = 0;
 
 	avr_raise_irq(vector->irq + AVR_INT_IRQ_PENDING, 0);
-	avr_raise_irq_float(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr) ?
-					avr_int_pending_read_at(
-							&avr->interrupts.pending, 0)->vector : 0,
-							!avr_has_pending_interrupts(avr));
+	_avr_int_pending_irq(avr);
 
 	if (vector->raised.reg && !vector->raise_sticky)
 		avr_regbit_clear(avr, vector->raised);
@@ -187,8 +238,7 @@ avr_clear_interrupt_if(
 		avr_int_vector_t * vector,
 		uint8_t old)
 {
-	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr));
+	_avr_int_pending_irq(avr);
 	if (avr_regbit_get(avr, vector->raised)) {
 		avr_clear_interrupt(avr, vector);
 		return 1;
@@ -224,8 +274,7 @@ avr_interrupt_reti(
 	avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING,
 			table->running_ptr > 0 ?
 					table->running[table->running_ptr-1]->vector : 0);
-	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr));
+	_avr_int_pending_irq(avr);
 }
 
 /*
@@ -248,26 +297,15 @@ avr_service_interrupts(
 
 	avr_int_table_p table = &avr->interrupts;
 
-	// how many are pending...
-	int cnt = avr_int_pending_get_read_size(&table->pending);
-	// locate the highest priority one
-	int min = 0xff;
-	int mini = 0;
-	for (int ii = 0; ii < cnt; ii++) {
-		avr_int_vector_t * v = avr_int_pending_read_at(&table->pending, ii);
-		if (v->vector < min) {
-			min = v->vector;
-			mini = ii;
-		}
+	// locate the highest priority one, and take it off the queue
+	int first = _avr_int_pending_first(table);
+	if (first < 0) {
+		avr->interrupt_state = 0;
+		return;
 	}
-	avr_int_vector_t * vector = avr_int_pending_read_at(&table->pending, mini);
-
-	// now move the one at the front of the fifo in the slot of
-	// the one we service
-	table->pending.buffer[(table->pending.read + mini) % avr_int_pending_fifo_size] =
-			avr_int_pending_read(&table->pending);
-	avr_raise_irq(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
-			avr_has_pending_interrupts(avr));
+	avr_int_vector_t * vector = table->pending_vector[first];
+	_avr_int_pending_remove(table, first);
+	_avr_int_pending_irq(avr);
 
 	// if that single interrupt is masked, ignore it and continue
 	// could also have been disabled, or cleared
@@ -280,6 +318,10 @@ avr_service_interrupts(
 		_avr_push_addr(avr, avr->pc);
 		avr_sreg_set(avr, S_I, 0);
 		avr->pc = vector->vector * avr->vector_size;
+		if (avr->coverage)
+			avr_coverage_edge(avr->coverage, avr->pc);
+		if (avr->profile)
+			avr_profile_interrupt(avr);
 
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 1);
 		avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING, vector->vector);
@@ -292,3 +334,52 @@ avr_service_interrupts(
 	}
 }
 
+static avr_int_vector_t *
+_avr_int_vector(
+		avr_int_table_p table,
+		uint8_t v)
+{
+	for (int i = 0; i < table->vector_count; i++)
+		if (table->vector[i]->vector == v)
+			return table->vector[i];
+	return NULL;
+}
+
+void
+avr_interrupt_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	avr_int_table_p table = &avr->interrupts;
+
+	for (int i = 0; i < table->vector_count; i++) {
+		uint8_t pending = table->vector[i]->pending;
+		AVR_SNAPSHOT_FIELD(s, pending);
+		if (s->restoring && !s->error)
+			table->vector[i]->pending = pending;
+	}
+	// the pending queue and the running stack go by vector number
+	uint8_t running[ARRAY_SIZE(table->running)];
+	for (int i = 0; i < table->running_ptr; i++)
+		running[i] = table->running[i]->vector;
+	AVR_SNAPSHOT_FIELD(s, table->pending_count);
+	AVR_SNAPSHOT_FIELD(s, table->running_ptr);
+	if (table->running_ptr > ARRAY_SIZE(table->running))
+		s->error = 1;
+	avr_snapshot_field(s, running, table->running_ptr);
+	if (!s->restoring || s->error)
+		return;
+	memset(table->pending_map, 0, sizeof(table->pending_map));
+	for (int v = 0; v < AVR_INT_VECTOR_MAX; v++) {
+		if (!table->pending_count[v])
+			continue;
+		table->pending_vector[v] = _avr_int_vector(table, v);
+		if (!table->pending_vector[v])
+			table->pending_count[v] = 0;
+		else
+			table->pending_map[v / 64] |= 1ULL << (v % 64);
+	}
+	for (int i = 0; i < table->running_ptr; i++)
+		if (!(table->running[i] = _avr_int_vector(table, running[i])))
+			s->error = 1;
+}
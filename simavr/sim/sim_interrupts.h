@@ -24,7 +24,6 @@
 
 #include "sim_avr_types.h"
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,23 +46,32 @@ typedef struct avr_int_vector_t {
 
 	// 'pending' IRQ, and 'running' status as signaled here
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
-	uint8_t			pending : 1,	// 1 while scheduled in the fifo
+	uint8_t			pending : 1,	// 1 while scheduled in the pending queue
 					trace : 1,		// only for debug of a vector
 					raise_sticky : 1;	// 1 if the interrupt flag (= the raised regbit) is not cleared
 										// by the hardware when executing the interrupt routine (see TWINT)
 } avr_int_vector_t, *avr_int_vector_p;
 
-// Size needs to be >= max number of vectors, and a power of two
-DECLARE_FIFO(avr_int_vector_p, avr_int_pending, 64);
+// Needs to be > the highest vector number of any core
+#define AVR_INT_VECTOR_MAX	128
 
 // interrupt vectors, and their enable/clear registers
 typedef struct  avr_int_table_t {
 	avr_int_vector_t * vector[64];
 	uint8_t			vector_count;
-	avr_int_pending_t pending;
+	/*
+	 * Pending queue, kept by vector number: how many times each vector was
+	 * queued, and a bitmap of the non-zero counts, so the highest priority
+	 * (lowest number) one is a count-trailing-zeros away. A vector stays
+	 * queued when cleared, until the servicing code drops it.
+	 */
+	uint64_t		pending_map[AVR_INT_VECTOR_MAX / 64];
+	uint8_t			pending_count[AVR_INT_VECTOR_MAX];
+	avr_int_vector_t * pending_vector[AVR_INT_VECTOR_MAX];
 	uint8_t			running_ptr;
 	avr_int_vector_t *running[64]; // stack of nested interrupts
-	// global status for pending + running in interrupt context
+	// global status for pending + running in interrupt context; pending is
+	// the lowest queued vector (floating when none), raised when it changes
 	avr_irq_t		irq[AVR_INT_IRQ_COUNT];
 } avr_int_table_t, *avr_int_table_p;
 
@@ -122,7 +130,7 @@ void
 avr_interrupt_init(
 		struct avr_t * avr );
 
-// reset the interrupt table and the fifo
+// reset the interrupt table and the pending queue
 void
 avr_interrupt_reset(
 		struct avr_t * avr );
@@ -75,6 +75,7 @@ avr_register_io_read(
 	}
 	avr->io[a].r.param = param;
 	avr->io[a].r.c = readp;
+	avr_io_plain_update(avr, addr);
 }
 
 static void
@@ -147,6 +148,27 @@ avr_register_io_write(
 
 	avr->io[a].w.param = param;
 	avr->io[a].w.c = writep;
+	avr_io_plain_update(avr, addr);
+}
+
+void
+avr_io_plain_update(
+		avr_t *avr,
+		avr_io_addr_t addr)
+{
+	avr_io_addr_t a = AVR_DATA_TO_IO(addr);
+	uint8_t plain = 0;
+
+	if (a >= MAX_IOs)
+		return;
+	// SREG is never plain, the core keeps it split in avr->sreg[]
+	if (addr != R_SREG && !avr->io[a].irq) {
+		if (!avr->io[a].r.c)
+			plain |= AVR_IO_PLAIN_R;
+		if (!avr->io[a].w.c)
+			plain |= AVR_IO_PLAIN_W;
+	}
+	avr->io_plain[a] = plain;
 }
 
 avr_irq_t *
@@ -194,6 +216,7 @@ avr_iomem_getirq(
 		// mark the pin ones as filtered, so they only are raised when changing
 		for (int i = 0; i < 8; i++)
 			avr->io[a].irq[i].flags |= IRQ_FLAG_FILTERED;
+		avr_io_plain_update(avr, addr);
 	}
 	// if given a name, replace the default one...
 	if (name) {
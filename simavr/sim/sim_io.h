@@ -35,6 +35,8 @@ extern "C" {
 #define AVR_IOCTL_DEF(_a,_b,_c,_d) \
 	(((_a) << 24)|((_b) << 16)|((_c) << 8)|((_d)))
 
+struct avr_snapshot_t;
+
 /*
  * IO module base struct
  * Modules uses that as their first member in their own struct
@@ -56,6 +58,8 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	// optional, saves or restores the module state, see sim_snapshot.h
+	void (*snapshot)(struct avr_io_t *io, struct avr_snapshot_t *s);
 } avr_io_t;
 
 /*
@@ -92,6 +96,12 @@ avr_register_io_write(
 		avr_io_addr_t addr,
 		avr_io_write_t write,
 		void * param);
+// recomputes avr->io_plain[] for IO register "addr" from its callbacks
+// and IRQs; the functions above call it when they change these
+void
+avr_io_plain_update(
+		avr_t *avr,
+		avr_io_addr_t addr);
 // call every IO modules until one responds to this
 int
 avr_ioctl(
@@ -24,9 +24,12 @@
 #include <string.h>
 #include "sim_irq.h"
 
-// internal structure for a hook, never seen by the notify procs
+/*
+ * internal structure for a hook, never seen by the notify procs.
+ * An IRQ's hooks live in one array, so raising it walks them in order
+ * instead of chasing a list. They are called newest first.
+ */
 typedef struct avr_irq_hook_t {
-	struct avr_irq_hook_t * next;
 	int busy;	// prevent reentrance of callbacks
 
 	struct avr_irq_t * chain;	// raise the IRQ on this too - optional if "notify" is on
@@ -107,13 +110,50 @@ static avr_irq_hook_t *
 _avr_alloc_irq_hook(
 		avr_irq_t * irq)
 {
-	avr_irq_hook_t *hook = malloc(sizeof(avr_irq_hook_t));
+	if (irq->hook_count == irq->hook_size) {
+		int size = irq->hook_size ? irq->hook_size * 2 : 2;
+		irq->hook = (avr_irq_hook_t*)realloc(irq->hook,
+				size * sizeof(avr_irq_hook_t));
+		irq->hook_size = size;
+	}
+	avr_irq_hook_t *hook = &irq->hook[irq->hook_count++];
 	memset(hook, 0, sizeof(avr_irq_hook_t));
-	hook->next = irq->hook;
-	irq->hook = hook;
 	return hook;
 }
 
+/*
+ * Hooks removed while the IRQ is being raised are only blanked, so the
+ * indexes of the others stay put; the array is packed again once the
+ * outermost raise is done.
+ */
+static void
+_avr_free_irq_hook(
+		avr_irq_t * irq,
+		int index)
+{
+	if (irq->raising) {
+		irq->hook[index].notify = NULL;
+		irq->hook[index].chain = NULL;
+		irq->holes = 1;
+		return;
+	}
+	irq->hook_count--;
+	memmove(&irq->hook[index], &irq->hook[index + 1],
+			(irq->hook_count - index) * sizeof(avr_irq_hook_t));
+}
+
+static void
+_avr_pack_irq_hooks(
+		avr_irq_t * irq)
+{
+	int o = 0;
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify || irq->hook[i].chain)
+			irq->hook[o++] = irq->hook[i];
+	irq->hook_count = o;
+	irq->holes = 0;
+}
+
 void
 avr_free_irq(
 		avr_irq_t * irq,
@@ -129,13 +169,9 @@ avr_free_irq(
 			free((char*)iq->name);
 		iq->name = NULL;
 		// purge hooks
-		avr_irq_hook_t *hook = iq->hook;
-		while (hook) {
-			avr_irq_hook_t * next = hook->next;
-			free(hook);
-			hook = next;
-		}
+		free(iq->hook);
 		iq->hook = NULL;
+		iq->hook_count = iq->hook_size = 0;
 	}
 	// if that irq list was allocated by us, free it
 	if (irq->flags & IRQ_FLAG_ALLOC)
@@ -151,13 +187,10 @@ avr_irq_register_notify(
 	if (!irq || !notify)
 		return;
 
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param)
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify == notify && irq->hook[i].param == param)
 			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(irq);
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(irq);
 	hook->notify = notify;
 	hook->param = param;
 }
@@ -168,24 +201,14 @@ avr_irq_unregister_notify(
 		avr_irq_notify_t notify,
 		void * param)
 {
-	avr_irq_hook_t *hook, *prev;
 	if (!irq || !notify)
 		return;
 
-	hook = irq->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->notify == notify && hook->param == param) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				irq->hook = hook->next;
-			free(hook);
+	for (int i = 0; i < irq->hook_count; i++)
+		if (irq->hook[i].notify == notify && irq->hook[i].param == param) {
+			_avr_free_irq_hook(irq, i);
 			return;
 		}
-		prev = hook;
-		hook = hook->next;
-	}
 }
 
 void
@@ -204,20 +227,29 @@ avr_raise_irq_float(
 	irq->flags &= ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING);
 	if (floating)
 		irq->flags |= IRQ_FLAG_FLOATING;
-	avr_irq_hook_t *hook = irq->hook;
-	while (hook) {
-		avr_irq_hook_t * next = hook->next;
+	if (!irq->hook_count) {
+		irq->value = output;
+		return;
+	}
+	irq->raising++;
+	// hooks added by the callbacks go at the end, and are not called
+	for (int i = irq->hook_count - 1; i >= 0; i--) {
+		// the callbacks can add hooks, and move the array
+		avr_irq_hook_t * hook = &irq->hook[i];
 			// prevents reentrance / endless calling loops
 		if (hook->busy == 0) {
 			hook->busy++;
 			if (hook->notify)
 				hook->notify(irq, output,  hook->param);
+			hook = &irq->hook[i];
 			if (hook->chain)
 				avr_raise_irq_float(hook->chain, output, floating);
+			hook = &irq->hook[i];
 			hook->busy--;
 		}
-		hook = next;
 	}
+	if (--irq->raising == 0 && irq->holes)
+		_avr_pack_irq_hooks(irq);
 	// the value is set after the callbacks are called, so the callbacks
 	// can themselves compare for old/new values between their parameter
 	// they are passed (new value) and the previous irq->value
@@ -232,6 +264,29 @@ avr_raise_irq(
 	avr_raise_irq_float(irq, value, !!(irq->flags & IRQ_FLAG_FLOATING));
 }
 
+void
+avr_raise_irq_mask(
+		avr_irq_t * irq_base,
+		uint32_t old_value,
+		uint32_t new_value,
+		uint32_t mask)
+{
+	if (!irq_base)
+		return;
+	uint32_t changed = (old_value ^ new_value) & mask;
+	// the IRQs never raised get their first value anyway
+	for (uint32_t same = mask & ~changed; same; same &= same - 1) {
+		int bit = __builtin_ctz(same);
+		if (irq_base[bit].flags & IRQ_FLAG_INIT)
+			changed |= 1 << bit;
+	}
+	while (changed) {
+		int bit = __builtin_ctz(changed);
+		changed &= changed - 1;
+		avr_raise_irq(irq_base + bit, (new_value >> bit) & 1);
+	}
+}
+
 void
 avr_connect_irq(
 		avr_irq_t * src,
@@ -241,13 +296,10 @@ avr_connect_irq(
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	avr_irq_hook_t *hook = src->hook;
-	while (hook) {
-		if (hook->chain == dst)
+	for (int i = 0; i < src->hook_count; i++)
+		if (src->hook[i].chain == dst)
 			return;	// already there
-		hook = hook->next;
-	}
-	hook = _avr_alloc_irq_hook(src);
+	avr_irq_hook_t *hook = _avr_alloc_irq_hook(src);
 	hook->chain = dst;
 }
 
@@ -256,26 +308,15 @@ avr_unconnect_irq(
 		avr_irq_t * src,
 		avr_irq_t * dst)
 {
-	avr_irq_hook_t *hook, *prev;
-
 	if (!src || !dst || src == dst) {
 		fprintf(stderr, "error: %s invalid irq %p/%p", __FUNCTION__, src, dst);
 		return;
 	}
-	hook = src->hook;
-	prev = NULL;
-	while (hook) {
-		if (hook->chain == dst) {
-			if ( prev )
-				prev->next = hook->next;
-			else
-				src->hook = hook->next;
-			free(hook);
+	for (int i = 0; i < src->hook_count; i++)
+		if (src->hook[i].chain == dst) {
+			_avr_free_irq_hook(src, i);
 			return;
 		}
-		prev = hook;
-		hook = hook->next;
-	}
 }
 
 uint8_t
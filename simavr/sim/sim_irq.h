@@ -77,7 +77,11 @@ typedef struct avr_irq_t {
 	uint32_t			irq;		//!< any value the user needs
 	uint32_t			value;		//!< current value
 	uint8_t				flags;		//!< IRQ_* flags
-	struct avr_irq_hook_t * hook;	//!< list of hooks to be notified
+	uint8_t				raising;	//!< nesting depth of the raises in progress
+	uint8_t				holes;		//!< hooks removed while raising
+	uint16_t			hook_count;	//!< hooks in use in 'hook'
+	uint16_t			hook_size;	//!< hooks allocated in 'hook'
+	struct avr_irq_hook_t * hook;	//!< array of hooks to be notified
 } avr_irq_t;
 
 //! allocates 'count' IRQs, initializes their "irq" starting from 'base' and increment
@@ -120,6 +124,19 @@ avr_raise_irq_float(
 		avr_irq_t * irq,
 		uint32_t value,
 		int floating);
+/*!
+ * Raises irq_base[i] with bit i of 'new_value', for each bit i set in 'mask'
+ * that differs between 'old_value' and 'new_value', or whose IRQ was never
+ * raised, lowest bit first; the other IRQs are not called at all.
+ * 'old_value' is what the bits were last raised with (the matching "all
+ * bits" IRQ value, or the IRQ values themselves).
+ */
+void
+avr_raise_irq_mask(
+		avr_irq_t * irq_base,
+		uint32_t old_value,
+		uint32_t new_value,
+		uint32_t mask);
 //! this connects a "source" IRQ to a "destination" IRQ
 void
 avr_connect_irq(
@@ -0,0 +1,427 @@
+/*
+	sim_jit.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CONFIG_SIMAVR_JIT 1
+#include <sys/mman.h>
+#else
+#define CONFIG_SIMAVR_JIT 0
+#endif
+
+#if CONFIG_SIMAVR_JIT
+
+/*
+ * The translated code is a plain SysV function, with avr->data in %rdi
+ * and avr->sreg in %rsi. It only uses %al/%ax/%eax, %cl/%ch/%ecx and %dl
+ * as scratch registers, so needs no prologue. The AVR flags are taken
+ * straight from the host's, which match for C, Z, N and V; S is N^V (the
+ * host's "less than") and H is worked out from the operands.
+ */
+enum { AL = 0, CL, DL, BL, AH, CH, DH, BH };
+enum { CC_O = 0x0, CC_C = 0x2, CC_Z = 0x4, CC_S = 0x8, CC_L = 0xc };
+enum {	// the two operands group 1 opcodes, "op r/m8, r8"
+	ALU_ADD = 0x00, ALU_OR = 0x08, ALU_ADC = 0x10, ALU_SBC = 0x18,
+	ALU_AND = 0x20, ALU_SUB = 0x28, ALU_EOR = 0x30,
+};
+
+// the longest any one instruction translates to, with some margin
+#define JIT_OP_MAX	96
+
+#define MODRM(_mod, _reg, _rm) (((_mod) << 6) | ((_reg) << 3) | (_rm))
+#define DATA(_reg, _d)	MODRM(1, _reg, 7), (_d)		// [%rdi + _d]
+#define FLAG(_reg, _b)	MODRM(1, _reg, 6), (_b)		// [%rsi + _b]
+
+#define EMIT(...) { \
+		const uint8_t _e[] = { __VA_ARGS__ }; \
+		memcpy(p, _e, sizeof(_e)); \
+		p += sizeof(_e); \
+	}
+#define LOAD(_reg, _d)		EMIT(0x8a, DATA(_reg, _d))
+#define STORE(_d, _reg)		EMIT(0x88, DATA(_reg, _d))
+#define SETCC(_cc, _b)		EMIT(0x0f, 0x90 | (_cc), FLAG(0, _b))
+#define SETFLAG(_b, _v)		EMIT(0xc6, FLAG(0, _b), (_v))
+#define LOAD_CARRY()		EMIT(0x0f, 0xba, MODRM(0, 4, 6), S_C)	// bt $0,(%rsi)
+#define ALU(_op, _dst, _src)	EMIT((_op), MODRM(3, _src, _dst))
+
+/*
+ * ADD/ADC/SUB/SBC/CP/CPC and their immediate forms.
+ * H is bit 4 of rd ^ rr ^ res, for both the carry and the borrow.
+ */
+static uint8_t *
+_jit_arith(
+		uint8_t * p,
+		avr_decoded_t * dc,
+		int op, int imm, int carry, int store)
+{
+	LOAD(AL, dc->d);
+	if (imm)
+		EMIT(0xb1, dc->k)		// mov $k, %cl
+	else
+		LOAD(CL, dc->r);
+	EMIT(0x88, MODRM(3, AL, DL));	// mov %al, %dl
+	ALU(ALU_EOR, DL, CL);
+	if (carry)
+		LOAD_CARRY();
+	ALU(op, AL, CL);
+	SETCC(CC_C, S_C);
+	SETCC(CC_O, S_V);
+	SETCC(CC_S, S_N);
+	SETCC(CC_L, S_S);
+	if (carry && op == ALU_SBC) {	// Z is only ever cleared
+		EMIT(0x0f, 0x90 | CC_Z, MODRM(3, 0, CH));
+		EMIT(0x20, FLAG(CH, S_Z));	// and %ch, S_Z(%rsi)
+	} else
+		SETCC(CC_Z, S_Z);
+	ALU(ALU_EOR, DL, AL);
+	EMIT(0xc0, MODRM(3, 5, DL), 4);	// shr $4, %dl
+	EMIT(0x80, MODRM(3, 4, DL), 1);	// and $1, %dl
+	EMIT(0x88, FLAG(DL, S_H));
+	if (store)
+		STORE(dc->d, AL);
+	return p;
+}
+
+// AND/OR/EOR and their immediate forms; V is cleared, C and H are kept
+static uint8_t *
+_jit_logic(
+		uint8_t * p,
+		avr_decoded_t * dc,
+		int op, int imm)
+{
+	LOAD(AL, dc->d);
+	if (imm)
+		EMIT(0xb1, dc->k)
+	else
+		LOAD(CL, dc->r);
+	ALU(op, AL, CL);
+	SETCC(CC_Z, S_Z);
+	SETCC(CC_S, S_N);
+	SETCC(CC_S, S_S);
+	SETFLAG(S_V, 0);
+	STORE(dc->d, AL);
+	return p;
+}
+
+// for the right shifts, once C, Z and N are set: V = N ^ C, S = N ^ V
+static uint8_t *
+_jit_shift_vs(
+		uint8_t * p)
+{
+	EMIT(0x8a, FLAG(DL, S_N));
+	EMIT(0x32, FLAG(DL, S_C));
+	EMIT(0x88, FLAG(DL, S_V));
+	EMIT(0x32, FLAG(DL, S_N));
+	EMIT(0x88, FLAG(DL, S_S));
+	return p;
+}
+
+// result in r1:r0; the 'f' ones shift it left once, C being the bit lost
+static uint8_t *
+_jit_mul(
+		uint8_t * p,
+		avr_decoded_t * dc,
+		int sd, int sr, int frac)
+{
+	EMIT(0x0f, sd ? 0xbe : 0xb6, DATA(AL, dc->d));	// movzx/movsx, %eax
+	EMIT(0x0f, sr ? 0xbe : 0xb6, DATA(CL, dc->r));	// movzx/movsx, %ecx
+	EMIT(0x0f, 0xaf, MODRM(3, AL, CL));				// imul %ecx, %eax
+	if (frac) {
+		EMIT(0x0f, 0xba, MODRM(3, 4, AL), 15);		// bt $15, %eax
+		SETCC(CC_C, S_C);
+		EMIT(0x66, 0x01, MODRM(3, AL, AL));			// add %ax, %ax
+		SETCC(CC_Z, S_Z);
+	} else {
+		EMIT(0x66, 0x85, MODRM(3, AL, AL));			// test %ax, %ax
+		SETCC(CC_Z, S_Z);
+		SETCC(CC_S, S_C);
+	}
+	EMIT(0x66, 0x89, DATA(AL, 0));					// mov %ax, r0
+	return p;
+}
+
+static uint8_t *
+_jit_op(
+		uint8_t * p,
+		avr_decoded_t * dc)
+{
+	switch (dc->op) {
+		case AVR_OP_NOP:
+			break;
+		case AVR_OP_ADD:	p = _jit_arith(p, dc, ALU_ADD, 0, 0, 1); break;
+		case AVR_OP_ADC:	p = _jit_arith(p, dc, ALU_ADC, 0, 1, 1); break;
+		case AVR_OP_SUB:	p = _jit_arith(p, dc, ALU_SUB, 0, 0, 1); break;
+		case AVR_OP_SBC:	p = _jit_arith(p, dc, ALU_SBC, 0, 1, 1); break;
+		case AVR_OP_CP:		p = _jit_arith(p, dc, ALU_SUB, 0, 0, 0); break;
+		case AVR_OP_CPC:	p = _jit_arith(p, dc, ALU_SBC, 0, 1, 0); break;
+		case AVR_OP_SUBI:	p = _jit_arith(p, dc, ALU_SUB, 1, 0, 1); break;
+		case AVR_OP_SBCI:	p = _jit_arith(p, dc, ALU_SBC, 1, 1, 1); break;
+		case AVR_OP_CPI:	p = _jit_arith(p, dc, ALU_SUB, 1, 0, 0); break;
+		case AVR_OP_AND:	p = _jit_logic(p, dc, ALU_AND, 0); break;
+		case AVR_OP_OR:		p = _jit_logic(p, dc, ALU_OR, 0); break;
+		case AVR_OP_EOR:	p = _jit_logic(p, dc, ALU_EOR, 0); break;
+		case AVR_OP_ANDI:	p = _jit_logic(p, dc, ALU_AND, 1); break;
+		case AVR_OP_ORI:	p = _jit_logic(p, dc, ALU_OR, 1); break;
+		case AVR_OP_MOV:
+			LOAD(AL, dc->r);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_MOVW:
+			EMIT(0x66, 0x8b, DATA(AL, dc->r));
+			EMIT(0x66, 0x89, DATA(AL, dc->d));
+			break;
+		case AVR_OP_LDI:
+			EMIT(0xc6, DATA(0, dc->d), dc->k);
+			break;
+		case AVR_OP_MUL:	p = _jit_mul(p, dc, 0, 0, 0); break;
+		case AVR_OP_MULS:	p = _jit_mul(p, dc, 1, 1, 0); break;
+		case AVR_OP_MULSU:	p = _jit_mul(p, dc, 1, 0, 0); break;
+		case AVR_OP_FMUL:	p = _jit_mul(p, dc, 0, 0, 1); break;
+		case AVR_OP_FMULS:	p = _jit_mul(p, dc, 1, 1, 1); break;
+		case AVR_OP_FMULSU:	p = _jit_mul(p, dc, 1, 0, 1); break;
+		case AVR_OP_COM:
+			LOAD(AL, dc->d);
+			EMIT(0x34, 0xff);						// xor $0xff, %al
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			SETCC(CC_S, S_S);
+			SETFLAG(S_V, 0);
+			SETFLAG(S_C, 1);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_NEG:
+			LOAD(AL, dc->d);
+			EMIT(0x88, MODRM(3, AL, DL));			// mov %al, %dl
+			EMIT(0xf6, MODRM(3, 3, AL));			// neg %al
+			SETCC(CC_C, S_C);
+			SETCC(CC_O, S_V);
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			SETCC(CC_L, S_S);
+			ALU(ALU_OR, DL, AL);
+			EMIT(0xc0, MODRM(3, 5, DL), 3);			// shr $3, %dl
+			EMIT(0x80, MODRM(3, 4, DL), 1);			// and $1, %dl
+			EMIT(0x88, FLAG(DL, S_H));
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_SWAP:
+			LOAD(AL, dc->d);
+			EMIT(0xc0, MODRM(3, 0, AL), 4);			// rol $4, %al
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_INC:
+		case AVR_OP_DEC:
+			LOAD(AL, dc->d);
+			EMIT(0xfe, MODRM(3, dc->op == AVR_OP_INC ? 0 : 1, AL));
+			SETCC(CC_O, S_V);
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			SETCC(CC_L, S_S);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_ASR:
+			LOAD(AL, dc->d);
+			EMIT(0xd0, MODRM(3, 7, AL));			// sar %al
+			SETCC(CC_C, S_C);
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			p = _jit_shift_vs(p);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_LSR:
+			LOAD(AL, dc->d);
+			EMIT(0xd0, MODRM(3, 5, AL));			// shr %al
+			SETCC(CC_C, S_C);
+			SETCC(CC_C, S_V);
+			SETCC(CC_C, S_S);
+			SETCC(CC_Z, S_Z);
+			SETFLAG(S_N, 0);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_ROR:
+			LOAD(AL, dc->d);
+			LOAD_CARRY();
+			EMIT(0xd0, MODRM(3, 3, AL));			// rcr %al
+			SETCC(CC_C, S_C);
+			EMIT(0x84, MODRM(3, AL, AL));			// test %al, %al
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			p = _jit_shift_vs(p);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_ADIW:
+		case AVR_OP_SBIW:
+			EMIT(0x66, 0x8b, DATA(AL, dc->d));
+			EMIT(0x66, 0x83, MODRM(3, dc->op == AVR_OP_ADIW ? 0 : 5, AL), dc->k);
+			SETCC(CC_C, S_C);
+			SETCC(CC_O, S_V);
+			SETCC(CC_Z, S_Z);
+			SETCC(CC_S, S_N);
+			SETCC(CC_L, S_S);
+			EMIT(0x66, 0x89, DATA(AL, dc->d));
+			break;
+		case AVR_OP_BLD:
+			LOAD(AL, dc->d);
+			EMIT(0x24, (uint8_t)~dc->r);			// and $~mask, %al
+			EMIT(0x8a, FLAG(CL, S_T));
+			EMIT(0xf6, MODRM(3, 3, CL));			// neg %cl
+			EMIT(0x80, MODRM(3, 4, CL), dc->r);		// and $mask, %cl
+			ALU(ALU_OR, AL, CL);
+			STORE(dc->d, AL);
+			break;
+		case AVR_OP_BST:
+			LOAD(AL, dc->d);
+			if (dc->r)
+				EMIT(0xc0, MODRM(3, 5, AL), dc->r);	// shr $s, %al
+			EMIT(0x24, 1);
+			EMIT(0x88, FLAG(AL, S_T));
+			break;
+		case AVR_OP_SREG:	// never S_I, that would end the block
+			SETFLAG(dc->d, dc->r);
+			break;
+		default:
+			return NULL;
+	}
+	return p;
+}
+
+int
+avr_jit_init(
+		avr_t * avr,
+		uint32_t cache_mb)
+{
+	if (avr->jit)
+		return 0;
+	uint32_t words = (avr->flashend + 1) >> 1;
+	avr_jit_t * jit = calloc(1, sizeof(*jit));
+	jit->size = (cache_mb ? cache_mb : AVR_JIT_DEFAULT_CACHE_MB) << 20;
+	jit->cache = mmap(NULL, jit->size, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->cache == MAP_FAILED) {
+		AVR_LOG(avr, LOG_ERROR, "JIT: can't map a %d MB code cache\n",
+				jit->size >> 20);
+		free(jit);
+		return -1;
+	}
+	jit->block = calloc(words, sizeof(avr_jit_block_t));
+	jit->hits = calloc(words, 1);
+	avr->jit = jit;
+	return 0;
+}
+
+void
+avr_jit_terminate(
+		avr_t * avr)
+{
+	avr_jit_t * jit = avr->jit;
+	if (!jit)
+		return;
+	AVR_LOG(avr, LOG_TRACE, "JIT: %d KB of code, %d cache flushes\n",
+			jit->used >> 10, jit->flushes);
+	munmap(jit->cache, jit->size);
+	free(jit->block);
+	free(jit->hits);
+	free(jit);
+	avr->jit = NULL;
+}
+
+void
+avr_jit_invalidate(
+		avr_t * avr,
+		uint32_t first,
+		uint32_t last)
+{
+	avr_jit_t * jit = avr->jit;
+	if (!jit || first > last)
+		return;
+	memset(jit->block + first, 0, (last - first + 1) * sizeof(avr_jit_block_t));
+	memset(jit->hits + first, 0, last - first + 1);
+}
+
+avr_jit_block_t
+avr_jit_translate(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	avr_jit_t * jit = avr->jit;
+	avr_decoded_t * dc = &avr->decoded[pc >> 1];
+	uint32_t need = (dc->block_len * JIT_OP_MAX) + 1;
+
+	jit->hits[pc >> 1] = 0;
+	if (need > jit->size)
+		return NULL;
+	if (jit->used + need > jit->size) {
+		// start again from scratch, the hot blocks come back quickly
+		memset(jit->block, 0, ((avr->flashend + 1) >> 1) * sizeof(avr_jit_block_t));
+		jit->used = 0;
+		jit->flushes++;
+	}
+	uint8_t * start = jit->cache + jit->used;
+	uint8_t * p = start;
+	for (int i = 0; i < dc->block_len && p; i++)
+		p = _jit_op(p, dc + i);
+	if (!p)
+		return NULL;
+	EMIT(0xc3);		// ret
+	jit->used += p - start;
+	jit->block[pc >> 1] = (avr_jit_block_t)start;
+	return (avr_jit_block_t)start;
+}
+
+#else /* CONFIG_SIMAVR_JIT */
+
+int
+avr_jit_init(
+		avr_t * avr,
+		uint32_t cache_mb)
+{
+	AVR_LOG(avr, LOG_WARNING, "JIT: not supported on this host\n");
+	return -1;
+}
+
+void
+avr_jit_terminate(
+		avr_t * avr)
+{
+}
+
+void
+avr_jit_invalidate(
+		avr_t * avr,
+		uint32_t first,
+		uint32_t last)
+{
+}
+
+avr_jit_block_t
+avr_jit_translate(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	return NULL;
+}
+
+#endif /* CONFIG_SIMAVR_JIT */
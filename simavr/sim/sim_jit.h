@@ -0,0 +1,108 @@
+/*
+	sim_jit.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Optional translation of the hot basic blocks (see avr_decoded_t) into
+ * host x86-64 code. Blocks only contain register-only instructions, so
+ * their translation works directly on avr->data and avr->sreg; everything
+ * else, IO, memory, control flow and the cycle accounting, stays with
+ * avr_run_one(), which calls the translated block in place of the
+ * instructions, and carries on with the one that ends the block.
+ *
+ * It is only available on x86-64 Linux, with the threaded dispatch.
+ */
+#ifndef __SIM_JIT_H__
+#define __SIM_JIT_H__
+
+#include "sim_avr_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_JIT_DEFAULT_CACHE_MB	16
+// number of times a block runs in the interpreter before being translated
+#define AVR_JIT_HOT					16
+
+typedef void (*avr_jit_block_t)(
+		uint8_t * data,
+		uint8_t * sreg);
+
+typedef struct avr_jit_t {
+	uint8_t *	cache;		// executable memory for the translated code
+	uint32_t	size;		// of the cache, in bytes
+	uint32_t	used;
+	uint32_t	flushes;	// number of times the cache filled up
+	avr_jit_block_t * block;	// translated block, per flash word
+	uint8_t *	hits;		// block entries in the interpreter, per flash word
+} avr_jit_t;
+
+/*
+ * Enables the translation for this core, with a code cache of cache_mb
+ * megabytes (AVR_JIT_DEFAULT_CACHE_MB if zero). When the cache is full,
+ * it is flushed and the blocks get translated again as they run.
+ * Returns 0, or -1 if the host can't run it.
+ */
+int
+avr_jit_init(
+		struct avr_t * avr,
+		uint32_t cache_mb);
+void
+avr_jit_terminate(
+		struct avr_t * avr);
+/*
+ * Forgets the translations of blocks starting in flash words first..last,
+ * called by avr_decode_invalidate().
+ */
+void
+avr_jit_invalidate(
+		struct avr_t * avr,
+		uint32_t first,
+		uint32_t last);
+/*
+ * Translates the block starting at pc, returns NULL if it can't.
+ */
+avr_jit_block_t
+avr_jit_translate(
+		struct avr_t * avr,
+		avr_flashaddr_t pc);
+
+/*
+ * Returns the translated block starting at pc, translating it
+ * if it has now run often enough; NULL means interpret it.
+ */
+static inline avr_jit_block_t
+avr_jit_lookup(
+		struct avr_t * avr,
+		avr_jit_t * jit,
+		avr_flashaddr_t pc)
+{
+	avr_jit_block_t b = jit->block[pc >> 1];
+	if (b || ++jit->hits[pc >> 1] < AVR_JIT_HOT)
+		return b;
+	return avr_jit_translate(avr, pc);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_JIT_H__ */
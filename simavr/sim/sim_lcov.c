@@ -0,0 +1,180 @@
+/*
+	sim_lcov.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_lcov.h"
+
+int
+avr_exec_count_init(
+		avr_t * avr)
+{
+	if (avr->exec_count)
+		return 0;
+	avr_exec_count_t * c = calloc(1, sizeof(*c));
+	if (!c)
+		return -1;
+	c->size = (avr->flashend + 1) / 2;
+	c->exec = calloc(c->size, sizeof(c->exec[0]));
+	c->taken = calloc(c->size, sizeof(c->taken[0]));
+	if (!c->exec || !c->taken) {
+		free(c->exec);
+		free(c->taken);
+		free(c);
+		return -1;
+	}
+	avr->exec_count = c;
+	return 0;
+}
+
+void
+avr_exec_count_free(
+		avr_t * avr)
+{
+	avr_exec_count_t * c = avr->exec_count;
+	if (!c)
+		return;
+	avr->exec_count = NULL;
+	free(c->exec);
+	free(c->taken);
+	free(c);
+}
+
+static uint16_t
+_avr_lcov_opcode(
+		avr_t * avr,
+		uint32_t word)
+{
+	return avr->flash[word * 2] | (avr->flash[word * 2 + 1] << 8);
+}
+
+// BRBS/BRBC, CPSE, SBRC/SBRS, SBIC/SBIS
+static int
+_avr_lcov_is_conditional(
+		uint16_t o)
+{
+	return (o & 0xf800) == 0xf000 || (o & 0xfc00) == 0x1000 ||
+			(o & 0xfc08) == 0xfc00 || (o & 0xfd00) == 0x9900;
+}
+
+typedef struct avr_lcov_branch_t {
+	uint32_t	line;
+	uint32_t	word;
+} avr_lcov_branch_t;
+
+static int
+_avr_lcov_branch_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_lcov_branch_t * ba = a, * bb = b;
+	if (ba->line != bb->line)
+		return ba->line < bb->line ? -1 : 1;
+	return ba->word < bb->word ? -1 : ba->word > bb->word;
+}
+
+int
+avr_lcov_write(
+		avr_t * avr,
+		const avr_lines_t * lines,
+		const char * test,
+		FILE * out)
+{
+	avr_exec_count_t * c = avr->exec_count;
+	if (!c)
+		return -1;
+	int total = 0;
+	fprintf(out, "TN:%s\n", test ? test : "");
+
+	for (uint32_t f = 0; f < lines->file_count; f++) {
+		uint32_t max = 0;
+		for (uint32_t i = 0; i < lines->count; i++)
+			if (lines->range[i].file == f && lines->range[i].line > max)
+				max = lines->range[i].line;
+		if (!max)
+			continue;
+		// most any instruction of the line ran, -1 if it has none
+		int64_t * count = malloc((max + 1) * sizeof(count[0]));
+		for (uint32_t l = 0; l <= max; l++)
+			count[l] = -1;
+		avr_lcov_branch_t * branch = NULL;
+		uint32_t branch_count = 0;
+
+		for (uint32_t i = 0; i < lines->count; i++) {
+			const avr_line_range_t * r = &lines->range[i];
+			if (r->file != f)
+				continue;
+			for (uint32_t w = r->start / 2; w < (r->end + 1) / 2 && w < c->size; ) {
+				uint16_t o = _avr_lcov_opcode(avr, w);
+				if ((int64_t)c->exec[w] > count[r->line])
+					count[r->line] = c->exec[w];
+				if (_avr_lcov_is_conditional(o)) {
+					if (!(branch_count % 64))
+						branch = realloc(branch,
+								(branch_count + 64) * sizeof(branch[0]));
+					branch[branch_count++] = (avr_lcov_branch_t) {
+						.line = r->line, .word = w };
+				}
+				w += avr_opcode_is_32_bits(o) ? 2 : 1;
+			}
+		}
+		fprintf(out, "SF:%s\n", lines->file[f]);
+
+		if (branch_count)
+			qsort(branch, branch_count, sizeof(branch[0]), _avr_lcov_branch_cmp);
+		int found = 0, hit = 0;
+		for (uint32_t b = 0; b < branch_count; b++) {
+			// number them within their line
+			int n = 0;
+			while (n < b && branch[b - n - 1].line == branch[b].line)
+				n++;
+			uint32_t w = branch[b].word;
+			if (c->exec[w]) {
+				fprintf(out, "BRDA:%u,0,%d,%u\n", branch[b].line, n * 2, c->taken[w]);
+				fprintf(out, "BRDA:%u,0,%d,%u\n", branch[b].line, n * 2 + 1,
+						c->exec[w] - c->taken[w]);
+				hit += (c->taken[w] != 0) + (c->exec[w] != c->taken[w]);
+			} else {
+				fprintf(out, "BRDA:%u,0,%d,-\n", branch[b].line, n * 2);
+				fprintf(out, "BRDA:%u,0,%d,-\n", branch[b].line, n * 2 + 1);
+			}
+			found += 2;
+		}
+		if (branch_count)
+			fprintf(out, "BRF:%d\nBRH:%d\n", found, hit);
+
+		found = hit = 0;
+		for (uint32_t l = 1; l <= max; l++) {
+			if (count[l] < 0)
+				continue;
+			fprintf(out, "DA:%u,%lld\n", l, (long long)count[l]);
+			found++;
+			hit += count[l] > 0;
+		}
+		fprintf(out, "LF:%d\nLH:%d\nend_of_record\n", found, hit);
+		total += hit;
+		free(branch);
+		free(count);
+	}
+	return total;
+}
@@ -0,0 +1,86 @@
+/*
+	sim_lcov.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Source level code coverage of the firmware. Once enabled, the core
+ * counts the instructions it runs at each flash word, and how many times
+ * they didn't go on to the next word (jumped, branched or skipped). With
+ * the line tables of the ELF file (see sim_dwarf.h), these are written as
+ * an lcov tracefile: the count of a line is the most any of its
+ * instructions ran, and the conditional branches and skips (BRBS/BRBC,
+ * CPSE, SBRC/SBRS, SBIC/SBIS) give a taken and a not taken branch each.
+ *
+ * The counts are an instruction hook, see avr_run_one() for the cost.
+ */
+#ifndef __SIM_LCOV_H__
+#define __SIM_LCOV_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+#include "sim_dwarf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avr_exec_count_t {
+	uint32_t *	exec;		// instructions run, per flash word
+	uint32_t *	taken;		// of these, the ones that went elsewhere
+	uint32_t	size;		// in flash words
+} avr_exec_count_t;
+
+static inline void
+avr_exec_count(
+		avr_exec_count_t * c,
+		avr_flashaddr_t pc,
+		avr_flashaddr_t new_pc)
+{
+	c->exec[pc >> 1]++;
+	if (new_pc != pc + 2)
+		c->taken[pc >> 1]++;
+}
+
+// Starts counting the instructions of 'avr'. Returns zero, or -1
+int
+avr_exec_count_init(
+		avr_t * avr);
+// Stops counting, and frees the counters
+void
+avr_exec_count_free(
+		avr_t * avr);
+
+/*
+ * Writes the counts of 'avr' to 'out' as an lcov tracefile for 'lines',
+ * under the test name 'test' (if not NULL). Returns the number of source
+ * lines hit, or -1 if the counts aren't enabled
+ */
+int
+avr_lcov_write(
+		avr_t * avr,
+		const avr_lines_t * lines,
+		const char * test,
+		FILE * out);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_LCOV_H__ */
@@ -0,0 +1,295 @@
+/*
+	sim_profile.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_profile.h"
+
+// the child of 'parent' running 'func', made if needed; 0 if out of memory
+static uint32_t
+_avr_profile_child(
+		avr_profile_t * p,
+		uint32_t parent,
+		uint32_t func)
+{
+	for (uint32_t n = p->node[parent].child; n; n = p->node[n].next)
+		if (p->node[n].func == func)
+			return n;
+	if (p->node_count == p->node_size) {
+		avr_profile_node_t * node = realloc(p->node,
+				p->node_size * 2 * sizeof(node[0]));
+		if (!node)
+			return 0;
+		p->node = node;
+		p->node_size *= 2;
+	}
+	uint32_t n = p->node_count++;
+	p->node[n] = (avr_profile_node_t) {
+		.func = func, .parent = parent, .next = p->node[parent].child };
+	p->node[parent].child = n;
+	return n;
+}
+
+static void
+_avr_profile_push(
+		avr_profile_t * p,
+		uint32_t func,
+		uint16_t sp)
+{
+	if (p->depth == p->stack_size) {
+		void * stack = realloc(p->stack, p->stack_size * 2 * sizeof(p->stack[0]));
+		if (!stack)
+			return;
+		p->stack = stack;
+		p->stack_size *= 2;
+	}
+	uint32_t n = _avr_profile_child(p, p->stack[p->depth - 1].node, func);
+	if (!n)
+		return;
+	p->node[n].calls++;
+	p->stack[p->depth].node = n;
+	p->stack[p->depth].sp = sp;
+	p->depth++;
+	p->top_func = func;
+}
+
+void
+avr_profile_flow(
+		avr_profile_t * p,
+		avr_t * avr,
+		int flow,
+		avr_flashaddr_t new_pc)
+{
+	uint32_t func = new_pc >> 1 < p->size ? p->func[new_pc >> 1] : 0;
+	uint16_t sp = _avr_sp_get(avr);
+
+	if (flow == AVR_PROFILE_CALL) {
+		_avr_profile_push(p, func, sp);
+		return;
+	}
+	// drop the frames whose return address isn't on the stack anymore
+	while (p->depth > 1 && p->stack[p->depth - 1].sp < sp)
+		p->depth--;
+	uint32_t top = p->stack[p->depth - 1].node;
+	if (p->node[top].func != func) {
+		uint32_t n = _avr_profile_child(p, p->node[top].parent, func);
+		if (n) {
+			p->node[n].calls++;
+			p->stack[p->depth - 1].node = n;
+		}
+	}
+	p->top_func = p->node[p->stack[p->depth - 1].node].func;
+}
+
+void
+avr_profile_interrupt(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+
+	p->node[p->stack[p->depth - 1].node].self += avr->cycle - p->cycle;
+	p->cycle = avr->cycle;
+	_avr_profile_push(p, avr->pc >> 1 < p->size ? p->func[avr->pc >> 1] : 0,
+			_avr_sp_get(avr));
+}
+
+int
+avr_profile_init(
+		avr_t * avr,
+		avr_symbol_t ** symbol,
+		uint32_t count)
+{
+	if (avr->profile)
+		return 0;
+	avr_profile_t * p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
+	p->size = (avr->flashend + 1) / 2;
+	p->func = calloc(p->size, sizeof(p->func[0]));
+	p->name = malloc((count + 1) * sizeof(p->name[0]));
+	p->node_size = 64;
+	p->node = calloc(p->node_size, sizeof(p->node[0]));
+	p->stack_size = 16;
+	p->stack = malloc(p->stack_size * sizeof(p->stack[0]));
+	if (!p->func || !p->name || !p->node || !p->stack) {
+		free(p->func);
+		free(p->name);
+		free(p->node);
+		free(p->stack);
+		free(p);
+		return -1;
+	}
+	p->name[p->name_count++] = "[unknown]";
+	for (uint32_t i = 0; i < count; i++)
+		if (symbol[i]->addr <= avr->flashend && symbol[i]->symbol[0]) {
+			p->func[symbol[i]->addr >> 1] = p->name_count;
+			p->name[p->name_count++] = symbol[i]->symbol;
+		}
+	// a function runs up to the next one
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < p->size; i++) {
+		if (!p->func[i])
+			p->func[i] = last;
+		else
+			last = p->func[i];
+	}
+	p->node_count = 1;	// the root
+	p->stack[0].sp = 0xffff;
+	p->depth = 1;
+	p->top_func = avr->pc >> 1 < p->size ? p->func[avr->pc >> 1] : 0;
+	p->stack[0].node = _avr_profile_child(p, 0, p->top_func);
+	p->node[p->stack[0].node].calls = 1;
+	p->cycle = avr->cycle;
+	avr->profile = p;
+	return 0;
+}
+
+void
+avr_profile_free(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	avr->profile = NULL;
+	free(p->func);
+	free(p->name);
+	free(p->node);
+	free(p->stack);
+	free(p);
+}
+
+static int
+_avr_profile_fold(
+		avr_profile_t * p,
+		uint32_t n,
+		uint32_t * path,
+		uint32_t depth,
+		FILE * out)
+{
+	int count = 0;
+	path[depth++] = n;
+	if (p->node[n].self) {
+		for (uint32_t i = 0; i < depth; i++)
+			fprintf(out, "%s%s", i ? ";" : "", p->name[p->node[path[i]].func]);
+		fprintf(out, " %llu\n", (unsigned long long)p->node[n].self);
+		count++;
+	}
+	for (uint32_t c = p->node[n].child; c; c = p->node[c].next)
+		count += _avr_profile_fold(p, c, path, depth, out);
+	return count;
+}
+
+int
+avr_profile_write_folded(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return -1;
+	// no node is deeper than there are nodes
+	uint32_t * path = malloc(p->node_count * sizeof(path[0]));
+	if (!path)
+		return -1;
+	int count = 0;
+	for (uint32_t c = p->node[0].child; c; c = p->node[c].next)
+		count += _avr_profile_fold(p, c, path, 0, out);
+	free(path);
+	return count;
+}
+
+typedef struct avr_profile_func_t {
+	uint32_t	func;
+	uint32_t	calls;
+	uint32_t	active;		// frames of it in the stack being walked
+	uint64_t	inclusive, exclusive;
+} avr_profile_func_t;
+
+// returns the cycles of node 'n' and its callees
+static uint64_t
+_avr_profile_sum(
+		avr_profile_t * p,
+		uint32_t n,
+		avr_profile_func_t * f)
+{
+	avr_profile_func_t * fn = &f[p->node[n].func];
+	uint64_t total = p->node[n].self;
+
+	fn->calls += p->node[n].calls;
+	fn->exclusive += p->node[n].self;
+	fn->active++;
+	for (uint32_t c = p->node[n].child; c; c = p->node[c].next)
+		total += _avr_profile_sum(p, c, f);
+	// recursive calls are already in the outermost one
+	if (--fn->active == 0)
+		fn->inclusive += total;
+	return total;
+}
+
+static int
+_avr_profile_func_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_func_t * fa = a, * fb = b;
+	if (fa->inclusive != fb->inclusive)
+		return fa->inclusive > fb->inclusive ? -1 : 1;
+	return fa->func < fb->func ? -1 : fa->func > fb->func;
+}
+
+int
+avr_profile_write_table(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return -1;
+	avr_profile_func_t * f = calloc(p->name_count, sizeof(f[0]));
+	if (!f)
+		return -1;
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < p->name_count; i++)
+		f[i].func = i;
+	for (uint32_t c = p->node[0].child; c; c = p->node[c].next)
+		total += _avr_profile_sum(p, c, f);
+	qsort(f, p->name_count, sizeof(f[0]), _avr_profile_func_cmp);
+
+	int count = 0;
+	fprintf(out, "%10s %14s %6s %14s %6s  %s\n",
+			"calls", "inclusive", "%", "exclusive", "%", "function");
+	for (uint32_t i = 0; i < p->name_count; i++) {
+		if (!f[i].calls && !f[i].inclusive)
+			continue;
+		fprintf(out, "%10u %14llu %6.2f %14llu %6.2f  %s\n", f[i].calls,
+				(unsigned long long)f[i].inclusive,
+				total ? f[i].inclusive * 100.0 / total : 0.0,
+				(unsigned long long)f[i].exclusive,
+				total ? f[i].exclusive * 100.0 / total : 0.0,
+				p->name[f[i].func]);
+		count++;
+	}
+	free(f);
+	return count;
+}
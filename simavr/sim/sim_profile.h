@@ -0,0 +1,146 @@
+/*
+	sim_profile.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cycle profiler of the firmware, by function. The functions are the code
+ * symbols of the ELF file, each one running up to the next. The core keeps
+ * a shadow call stack, pushed on CALL/RCALL/ICALL/EICALL and interrupts,
+ * and popped on RET/RETI (or when SP goes back above a frame, for
+ * longjmp() and resets); a jump into another function (tail calls, the
+ * vector table) replaces the top of it.
+ *
+ * Every cycle is counted for the call stack that was current when it ran,
+ * in a tree of the stacks seen. Cycles spent sleeping go to the function
+ * that did the SLEEP. The tree is written as folded stacks for
+ * flamegraph.pl, or as a table of the inclusive and exclusive cycles of
+ * each function.
+ *
+ * The profiler is an instruction hook, see avr_run_one().
+ */
+#ifndef __SIM_PROFILE_H__
+#define __SIM_PROFILE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// how an instruction went on, for avr_profile_step()
+enum {
+	AVR_PROFILE_NEXT = 0,	// anything but the two below
+	AVR_PROFILE_CALL,
+	AVR_PROFILE_RET,
+};
+
+// a call stack seen, as a node of the tree of them all
+typedef struct avr_profile_node_t {
+	uint32_t	func;			// in avr_profile_t 'name'
+	uint32_t	parent, child, next;	// node indexes, 0 for none
+	uint32_t	calls;
+	uint64_t	self;			// cycles run with this as the stack
+} avr_profile_node_t;
+
+typedef struct avr_profile_t {
+	const char **	name;		// function names, 0 is "[unknown]"
+	uint32_t		name_count;
+	uint32_t *		func;		// function of each flash word
+	uint32_t		size;		// in flash words
+
+	avr_profile_node_t * node;	// node 0 is the root, above any function
+	uint32_t		node_count, node_size;
+
+	struct {
+		uint32_t	node;
+		uint16_t	sp;			// after the return address was pushed
+	} *				stack;
+	uint32_t		depth, stack_size;
+	uint32_t		top_func;	// function of the top of 'stack'
+	avr_cycle_count_t cycle;	// cycles accounted for so far
+} avr_profile_t;
+
+// called by the core for the control flows, and jumps to another function
+void
+avr_profile_flow(
+		avr_profile_t * p,
+		avr_t * avr,
+		int flow,
+		avr_flashaddr_t new_pc);
+
+// counts the cycles of the instruction that just ran, going to 'new_pc'
+static inline void
+avr_profile_step(
+		avr_profile_t * p,
+		avr_t * avr,
+		int flow,
+		avr_flashaddr_t new_pc)
+{
+	p->node[p->stack[p->depth - 1].node].self += avr->cycle - p->cycle;
+	p->cycle = avr->cycle;
+	if (flow || (new_pc >> 1 < p->size ? p->func[new_pc >> 1] : 0) != p->top_func)
+		avr_profile_flow(p, avr, flow, new_pc);
+}
+
+/*
+ * Starts profiling 'avr', from its current pc, with the functions in
+ * 'symbol' (as elf_read_firmware() gives them; the names aren't copied).
+ * Returns zero, or -1
+ */
+int
+avr_profile_init(
+		avr_t * avr,
+		struct avr_symbol_t ** symbol,
+		uint32_t count);
+// Stops profiling, and frees the call tree
+void
+avr_profile_free(
+		avr_t * avr);
+
+// the interrupt entry, called once the pc is on the vector
+void
+avr_profile_interrupt(
+		avr_t * avr);
+
+/*
+ * Writes the call stacks with their cycles, one per line, as
+ * "main;loop;send 1234" for flamegraph.pl. Returns the stacks written, or
+ * -1 if not profiling
+ */
+int
+avr_profile_write_folded(
+		avr_t * avr,
+		FILE * out);
+/*
+ * Writes a table of the functions that ran, with their calls, inclusive
+ * and exclusive cycles, most inclusive cycles first. Returns the number of
+ * functions, or -1 if not profiling
+ */
+int
+avr_profile_write_table(
+		avr_t * avr,
+		FILE * out);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PROFILE_H__ */
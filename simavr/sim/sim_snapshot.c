@@ -0,0 +1,312 @@
+/*
+	sim_snapshot.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "sim_snapshot.h"
+
+void
+avr_snapshot_field(
+		avr_snapshot_t * s,
+		void * field,
+		uint32_t size)
+{
+	if (s->error)
+		return;
+	if (s->restoring) {
+		if (s->pos + size > s->size) {
+			s->error = 1;
+			return;
+		}
+		memcpy(field, s->data + s->pos, size);
+	} else {
+		if (s->pos + size > s->alloc) {
+			uint32_t alloc = s->alloc ? s->alloc : 4096;
+			while (alloc < s->pos + size)
+				alloc *= 2;
+			s->data = realloc(s->data, alloc);
+			s->alloc = alloc;
+		}
+		memcpy(s->data + s->pos, field, size);
+	}
+	s->pos += size;
+}
+
+void
+avr_snapshot_memory(
+		avr_snapshot_t * s,
+		uint8_t * mem,
+		uint32_t size,
+		uint8_t ** dirty)
+{
+	uint32_t chunks = (size + AVR_SNAPSHOT_CHUNK - 1) / AVR_SNAPSHOT_CHUNK;
+	uint32_t map_size = (chunks + 7) / 8;
+
+	if (s->error)
+		return;
+	if (!s->incremental) {
+		avr_snapshot_field(s, mem, size);
+		// the incremental snapshot can't tell what changed anymore
+		if (s->restoring && *dirty)
+			memset(*dirty, 0xff, map_size);
+		return;
+	}
+	if (s->memory_index == ARRAY_SIZE(s->memory)) {
+		s->error = 1;
+		return;
+	}
+	avr_snapshot_memory_t * m = &s->memory[s->memory_index++];
+	if (!m->copy) {
+		if (s->restoring) {
+			s->error = 1;
+			return;
+		}
+		m->copy = malloc(size);
+		m->size = size;
+		memcpy(m->copy, mem, size);
+		if (!*dirty)
+			*dirty = malloc(map_size);
+		memset(*dirty, 0, map_size);
+		return;
+	}
+	if (m->size != size || !*dirty) {
+		s->error = 1;
+		return;
+	}
+	uint8_t * map = *dirty;
+	for (uint32_t i = 0; i < map_size; i++) {
+		if (!map[i])
+			continue;
+		for (int b = 0; b < 8; b++) {
+			if (!(map[i] & (1 << b)))
+				continue;
+			uint32_t o = ((i * 8) + b) * AVR_SNAPSHOT_CHUNK;
+			uint32_t n = o + AVR_SNAPSHOT_CHUNK > size ? size - o : AVR_SNAPSHOT_CHUNK;
+			if (s->restoring)
+				memcpy(mem + o, m->copy + o, n);
+			else
+				memcpy(m->copy + o, mem + o, n);
+		}
+		map[i] = 0;
+	}
+}
+
+/*
+ * Before rolling back, forget the pre-decoded instructions of the flash
+ * chunks that are about to change
+ */
+static void
+_avr_snapshot_flash_invalidate(
+		avr_t * avr)
+{
+	uint32_t chunks = (avr->flashend + AVR_SNAPSHOT_CHUNK) / AVR_SNAPSHOT_CHUNK;
+	for (uint32_t c = 0; c < chunks && avr->flash_dirty; c++)
+		if (avr->flash_dirty[c / 8] & (1 << (c % 8)))
+			avr_decode_invalidate(avr, c * AVR_SNAPSHOT_CHUNK, AVR_SNAPSHOT_CHUNK);
+}
+
+/*
+ * Saves 'v', or checks that the snapshot has the same value
+ */
+static int
+_avr_snapshot_check(
+		avr_snapshot_t * s,
+		uint32_t v)
+{
+	uint32_t r = v;
+	avr_snapshot_field(s, &r, sizeof(r));
+	if (r != v)
+		s->error = 1;
+	return !s->error;
+}
+
+/*
+ * Everything the avr_t knows that comes from a configuration; a snapshot
+ * can only be restored if this matches
+ */
+static int
+_avr_snapshot_header(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	int ios = 0;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		ios++;
+	avr_t * from = avr;
+	_avr_snapshot_check(s, AVR_SNAPSHOT_MAGIC);
+	_avr_snapshot_check(s, AVR_SNAPSHOT_VERSION);
+	_avr_snapshot_check(s, s->incremental);
+	AVR_SNAPSHOT_FIELD(s, from);
+	if (from != avr)
+		s->error = 1;
+	_avr_snapshot_check(s, avr->ramend);
+	_avr_snapshot_check(s, avr->flashend);
+	_avr_snapshot_check(s, avr->e2end);
+	_avr_snapshot_check(s, ios);
+	_avr_snapshot_check(s, avr->irq_pool.count);
+	_avr_snapshot_check(s, avr->interrupts.vector_count);
+	return !s->error;
+}
+
+static void
+_avr_snapshot_core(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	// the flash only when the firmware wrote to it, or always tracked
+	uint8_t flash = avr->flash_written;
+	AVR_SNAPSHOT_FIELD(s, flash);
+	if (s->incremental) {
+		if (s->restoring && !s->error)
+			_avr_snapshot_flash_invalidate(avr);
+		avr_snapshot_memory(s, avr->flash, avr->flashend + 1, &avr->flash_dirty);
+		if (s->restoring && !s->error)
+			avr->flash_written = flash;
+		flash = 0;
+	} else if (s->restoring && avr->flash_written && !flash) {
+		AVR_LOG(avr, LOG_ERROR,
+				"SNAPSHOT: flash was written since the snapshot\n");
+		s->error = 1;
+	}
+	if (flash)
+		avr_snapshot_memory(s, avr->flash, avr->flashend + 1, &avr->flash_dirty);
+
+	AVR_SNAPSHOT_FIELD(s, avr->cycle);
+	AVR_SNAPSHOT_FIELD(s, avr->pc);
+	AVR_SNAPSHOT_FIELD(s, avr->state);
+	AVR_SNAPSHOT_FIELD(s, avr->interrupt_state);
+	AVR_SNAPSHOT_FIELD(s, avr->sreg);
+	// the registers and IO are written all over, only SRAM is tracked
+	avr_snapshot_field(s, avr->data, avr->ioend + 1);
+	avr_snapshot_memory(s, avr->data + avr->ioend + 1,
+			avr->ramend - avr->ioend, &avr->data_dirty);
+	if (s->restoring && !s->error) {
+		if (flash)
+			avr_decode_invalidate(avr, 0, avr->flashend + 1);
+		avr->flags.op = 0;	// sreg[] was saved resolved
+		avr->idle.dc = NULL;
+	}
+}
+
+static void
+_avr_snapshot_irqs(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	for (int i = 0; i < avr->irq_pool.count; i++) {
+		avr_irq_t * irq = avr->irq_pool.irq[i];
+		if (!irq)
+			continue;
+		uint8_t flags = irq->flags & (IRQ_FLAG_INIT | IRQ_FLAG_FLOATING);
+		AVR_SNAPSHOT_FIELD(s, irq->value);
+		AVR_SNAPSHOT_FIELD(s, flags);
+		if (s->restoring)
+			irq->flags = (irq->flags & ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING)) |
+					(flags & (IRQ_FLAG_INIT | IRQ_FLAG_FLOATING));
+	}
+}
+
+/*
+ * Each module's state goes after its size, so a module that doesn't
+ * read back what it saved is caught
+ */
+static void
+_avr_snapshot_ios(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	for (avr_io_t * io = avr->io_port; io && !s->error; io = io->next) {
+		if (!io->snapshot)
+			continue;
+		uint32_t start = s->pos;
+		uint32_t size = 0;
+		AVR_SNAPSHOT_FIELD(s, size);
+		io->snapshot(io, s);
+		if (s->restoring) {
+			if (s->pos - start - sizeof(size) != size) {
+				AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: %s state mismatch\n", io->kind);
+				s->error = 1;
+			}
+		} else if (!s->error) {
+			size = s->pos - start - sizeof(size);
+			memcpy(s->data + start, &size, sizeof(size));
+		}
+	}
+}
+
+static int
+_avr_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s,
+		int restoring)
+{
+	s->pos = 0;
+	s->restoring = restoring;
+	s->error = 0;
+	s->memory_index = 0;
+	if (!restoring) {
+		s->size = 0;
+		avr_flags_sync(avr);
+	}
+	if (!_avr_snapshot_header(avr, s)) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: not made from this avr\n");
+		return -1;
+	}
+	_avr_snapshot_core(avr, s);
+	avr_interrupt_snapshot(avr, s);
+	avr_cycle_timer_snapshot(avr, s);
+	_avr_snapshot_irqs(avr, s);
+	_avr_snapshot_ios(avr, s);
+	if (!restoring)
+		s->size = s->pos;
+	else if (!s->error && s->pos != s->size)
+		s->error = 1;
+	return s->error ? -1 : 0;
+}
+
+int
+avr_snapshot_save(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	return _avr_snapshot(avr, s, 0);
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * s)
+{
+	return _avr_snapshot(avr, s, 1);
+}
+
+void
+avr_snapshot_free(
+		avr_snapshot_t * s)
+{
+	free(s->data);
+	for (int i = 0; i < ARRAY_SIZE(s->memory); i++)
+		free(s->memory[i].copy);
+	memset(s, 0, sizeof(*s));
+}
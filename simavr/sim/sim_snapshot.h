@@ -0,0 +1,163 @@
+/*
+	sim_snapshot.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshots hold the whole state of a running avr: core, RAM and IO
+ * registers, flash if the firmware changed it, interrupts, cycle timers,
+ * IRQ values, and the private state of the IO modules. Restoring one
+ * puts the avr back exactly where it was when it was saved.
+ *
+ * The blob starts with a magic and version, and holds the cycle timer
+ * callbacks and parameters as pointers, so it can only be restored in
+ * the process, and on the avr, it was saved from.
+ *
+ * The same code does the saving and the restoring: the modules only
+ * list their fields once, with avr_snapshot_field(), in their avr_io_t
+ * 'snapshot' hook.
+ *
+ * An incremental snapshot ('incremental' set before its first save) is a
+ * checkpoint: it keeps its own copy of the SRAM, flash and EEPROM, and
+ * the chunks of these written since are tracked, so saving it again, or
+ * rolling back to it with a restore, only copies what changed. There can
+ * be one of them per avr. Only the core sees the SRAM writes; external
+ * code changing avr->data behind its back has to call avr_data_dirty().
+ */
+#ifndef __SIM_SNAPSHOT_H__
+#define __SIM_SNAPSHOT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_SNAPSHOT_MAGIC		0x70616e73	// "snap"
+#define AVR_SNAPSHOT_VERSION	1
+#define AVR_SNAPSHOT_CHUNK		64		// bytes per dirty bit
+
+// the copy of a memory an incremental snapshot keeps
+typedef struct avr_snapshot_memory_t {
+	uint8_t *	copy;
+	uint32_t	size;
+} avr_snapshot_memory_t;
+
+typedef struct avr_snapshot_t {
+	uint8_t *	data;
+	uint32_t	size;		// bytes of snapshot in 'data'
+	uint32_t	alloc;		// bytes allocated for 'data'
+	// only used while saving or restoring
+	uint32_t	pos;
+	uint8_t		restoring : 1,
+				error : 1,	// the snapshot doesn't match this avr
+				incremental : 1;
+	int			memory_index;
+	avr_snapshot_memory_t memory[4];
+} avr_snapshot_t;
+
+/*
+ * Saves the state of 'avr' in 's', replacing what was there; 's' can
+ * start zeroed, and is reused as is for the next snapshots.
+ * Returns zero, or -1 on error.
+ */
+int
+avr_snapshot_save(
+		avr_t * avr,
+		avr_snapshot_t * s);
+/*
+ * Puts 'avr' back in the state saved in 's'. Returns zero, or -1 if the
+ * snapshot was not made by this avr, in which case it is left alone, or
+ * half restored if a module didn't find its state (and needs a reset).
+ */
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * s);
+// frees the memory of 's', which can be used again
+void
+avr_snapshot_free(
+		avr_snapshot_t * s);
+
+/*
+ * For the snapshot hooks: saves 'size' bytes at 'field', or restores them
+ * there. Fields are restored in the order they were saved.
+ */
+void
+avr_snapshot_field(
+		avr_snapshot_t * s,
+		void * field,
+		uint32_t size);
+
+#define AVR_SNAPSHOT_FIELD(_s, _f) avr_snapshot_field(_s, &(_f), sizeof(_f))
+
+/*
+ * Same as avr_snapshot_field() for a memory whose writes are tracked in
+ * '*dirty', one bit per AVR_SNAPSHOT_CHUNK bytes. The map is allocated by
+ * the first incremental save; until then, '*dirty' stays NULL.
+ */
+void
+avr_snapshot_memory(
+		avr_snapshot_t * s,
+		uint8_t * mem,
+		uint32_t size,
+		uint8_t ** dirty);
+
+static inline void
+avr_snapshot_dirty(
+		uint8_t * dirty,
+		uint32_t offset,
+		uint32_t size)
+{
+	if (!dirty || !size)
+		return;
+	for (uint32_t c = offset / AVR_SNAPSHOT_CHUNK;
+			c <= (offset + size - 1) / AVR_SNAPSHOT_CHUNK; c++)
+		dirty[c / 8] |= 1 << (c % 8);
+}
+
+// 'size' bytes of avr->data at 'addr' were changed without the core
+static inline void
+avr_data_dirty(
+		avr_t * avr,
+		uint16_t addr,
+		uint32_t size)
+{
+	if (addr + size > avr->ioend + 1u) {
+		uint32_t start = addr > avr->ioend ? addr - avr->ioend - 1 : 0;
+		avr_snapshot_dirty(avr->data_dirty, start,
+				addr + size - avr->ioend - 1 - start);
+	}
+}
+
+// Private, state of the core subsystems, called by avr_snapshot_*()
+void
+avr_interrupt_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s);
+void
+avr_cycle_timer_snapshot(
+		avr_t * avr,
+		avr_snapshot_t * s);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H__ */
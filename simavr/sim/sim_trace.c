@@ -0,0 +1,385 @@
+/*
+	sim_trace.c
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_trace.h"
+
+// the flags byte of a record
+#define AVR_TRACE_CYCLES	0x07	// 7: a varint follows
+#define AVR_TRACE_PC		0x08
+#define AVR_TRACE_OPCODE	0x10
+#define AVR_TRACE_VALUE0	0x20	// the register, and its value
+#define AVR_TRACE_VALUE1	0x40	// ... and the one after it
+
+// magic, version, mmcu, flashend, frequency, starting cycle, registers
+#define AVR_TRACE_HEADER	(8 + 1 + 32 + 4 + 4 + 8 + 32)
+
+static uint8_t *
+_avr_trace_varint(
+		uint8_t * o,
+		uint64_t v)
+{
+	while (v >= 0x80) {
+		*o++ = v | 0x80;
+		v >>= 7;
+	}
+	*o++ = v;
+	return o;
+}
+
+// packs 'r' at 'o', returns where it ends
+static uint8_t *
+_avr_trace_pack(
+		avr_trace_t * t,
+		const avr_trace_record_t * r,
+		uint8_t * o)
+{
+	uint8_t * flags = o++;
+	uint32_t w = r->pc >> 1;
+	int wide = avr_opcode_is_32_bits(r->opcode[0]) && w + 1 < t->size;
+
+	*flags = r->cycles < AVR_TRACE_CYCLES ? r->cycles : AVR_TRACE_CYCLES;
+	if (r->cycles >= AVR_TRACE_CYCLES)
+		o = _avr_trace_varint(o, r->cycles);
+	if (r->pc != t->next_pc) {
+		int32_t d = (int32_t)(r->pc - t->next_pc) / 2;
+		*flags |= AVR_TRACE_PC;
+		o = _avr_trace_varint(o, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+	}
+	t->next_pc = r->pc + (wide ? 4 : 2);
+	if (!t->seen[w] || t->flash[w] != r->opcode[0] ||
+			(wide && (!t->seen[w + 1] || t->flash[w + 1] != r->opcode[1]))) {
+		*flags |= AVR_TRACE_OPCODE;
+		t->seen[w] = 1;
+		t->flash[w] = r->opcode[0];
+		*o++ = r->opcode[0];
+		*o++ = r->opcode[0] >> 8;
+		if (wide) {
+			t->seen[w + 1] = 1;
+			t->flash[w + 1] = r->opcode[1];
+			*o++ = r->opcode[1];
+			*o++ = r->opcode[1] >> 8;
+		}
+	}
+	if (r->reg < 32) {
+		uint8_t * reg = o++;
+		*reg = r->reg;
+		if (r->value[0] != t->reg[r->reg]) {
+			*flags |= AVR_TRACE_VALUE0;
+			*o++ = t->reg[r->reg] = r->value[0];
+		}
+		if (r->reg < 31 && r->value[1] != t->reg[r->reg + 1]) {
+			*flags |= AVR_TRACE_VALUE1;
+			*o++ = t->reg[r->reg + 1] = r->value[1];
+		}
+		if (o == reg + 1)	// nothing changed
+			o = reg;
+	}
+	return o;
+}
+
+static void
+_avr_trace_write(
+		avr_trace_t * t,
+		const uint8_t * buf,
+		size_t size)
+{
+	if (size && fwrite(buf, 1, size, t->out) != size)
+		t->error = 1;
+}
+
+static void *
+_avr_trace_thread(
+		void * param)
+{
+	avr_trace_t * t = param;
+	uint8_t buf[65536];
+	uint8_t * o = buf;
+	uint32_t tail = t->tail;
+
+	for (;;) {
+		uint32_t head = __atomic_load_n(&t->published, __ATOMIC_ACQUIRE);
+		if (tail == head) {
+			if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+				// the last records were published before 'stop' was set
+				if (tail == __atomic_load_n(&t->published, __ATOMIC_ACQUIRE))
+					break;
+				continue;
+			}
+			struct timespec ts = { .tv_nsec = 100000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		while (tail != head) {
+			// a record packs to 1 + 5 + 5 + 4 + 3 bytes at most
+			if (o - buf > sizeof(buf) - 32) {
+				_avr_trace_write(t, buf, o - buf);
+				o = buf;
+			}
+			o = _avr_trace_pack(t, &t->ring[tail & (AVR_TRACE_RING - 1)], o);
+			tail++;
+		}
+		t->count += head - t->tail;
+		__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+	}
+	_avr_trace_write(t, buf, o - buf);
+	return NULL;
+}
+
+void
+avr_trace_wait(
+		avr_trace_t * t)
+{
+	__atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+	for (int spin = 0; ; spin++) {
+		t->tail_seen = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+		if (t->head - t->tail_seen < AVR_TRACE_RING)
+			return;
+		if (spin > 1000)
+			sched_yield();
+	}
+}
+
+static void
+_avr_trace_free(
+		avr_trace_t * t)
+{
+	if (t->out)
+		fclose(t->out);
+	free(t->ring);
+	free(t->flash);
+	free(t->seen);
+	free(t);
+}
+
+static void
+_avr_trace_put(
+		uint8_t * o,
+		uint64_t v,
+		int size)
+{
+	for (int i = 0; i < size; i++, v >>= 8)
+		o[i] = v;
+}
+
+int
+avr_trace_start(
+		avr_t * avr,
+		const char * path)
+{
+	if (avr->trace_ring)
+		return 0;
+	avr_trace_t * t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->size = (avr->flashend + 1) / 2;
+	t->ring = malloc(AVR_TRACE_RING * sizeof(t->ring[0]));
+	t->flash = malloc(t->size * sizeof(t->flash[0]));
+	t->seen = calloc(t->size, 1);
+	t->out = fopen(path, "wb");
+	if (!t->ring || !t->flash || !t->seen || !t->out) {
+		_avr_trace_free(t);
+		return -1;
+	}
+	uint8_t header[AVR_TRACE_HEADER] = { 0 };
+	memcpy(header, AVR_TRACE_MAGIC, 8);
+	header[8] = AVR_TRACE_VERSION;
+	strncpy((char *)header + 9, avr->mmcu, 31);
+	_avr_trace_put(header + 41, avr->flashend, 4);
+	_avr_trace_put(header + 45, avr->frequency, 4);
+	_avr_trace_put(header + 49, avr->cycle, 8);
+	memcpy(header + 57, avr->data, 32);
+	_avr_trace_write(t, header, sizeof(header));
+	memcpy(t->reg, avr->data, 32);
+	t->next_pc = avr->pc;
+	t->cycle = avr->cycle;
+	if (t->error || pthread_create(&t->thread, NULL, _avr_trace_thread, t)) {
+		_avr_trace_free(t);
+		return -1;
+	}
+	avr->trace_ring = t;
+	return 0;
+}
+
+int64_t
+avr_trace_stop(
+		avr_t * avr)
+{
+	avr_trace_t * t = avr->trace_ring;
+	if (!t)
+		return -1;
+	avr->trace_ring = NULL;
+	__atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->thread, NULL);
+
+	int64_t res = t->count;
+	if (fclose(t->out) || t->error)
+		res = -1;
+	t->out = NULL;
+	_avr_trace_free(t);
+	return res;
+}
+
+static uint64_t
+_avr_trace_get(
+		const uint8_t * i,
+		int size)
+{
+	uint64_t v = 0;
+	while (size--)
+		v = (v << 8) | i[size];
+	return v;
+}
+
+int
+avr_trace_open(
+		avr_trace_reader_t * r,
+		FILE * in)
+{
+	uint8_t header[AVR_TRACE_HEADER];
+
+	memset(r, 0, sizeof(*r));
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+			memcmp(header, AVR_TRACE_MAGIC, 8) ||
+			header[8] != AVR_TRACE_VERSION)
+		return -1;
+	r->flashend = _avr_trace_get(header + 41, 4);
+	if (r->flashend > 0x7fffff)	// 22 bits of word address
+		return -1;
+	memcpy(r->mmcu, header + 9, 31);
+	r->frequency = _avr_trace_get(header + 45, 4);
+	r->cycle = _avr_trace_get(header + 49, 8);
+	memcpy(r->reg, header + 57, 32);
+	r->size = (r->flashend + 1) / 2;
+	r->flash = malloc(r->size * sizeof(r->flash[0]));
+	r->seen = calloc(r->size, 1);
+	if (!r->flash || !r->seen) {
+		avr_trace_close(r);
+		return -1;
+	}
+	r->in = in;
+	return 0;
+}
+
+// reads a byte, -1 at the end of the file
+#define GET(_v) { \
+		int _c = getc(r->in); \
+		if (_c == EOF) return -1; \
+		_v = _c; \
+	}
+
+static int
+_avr_trace_get_varint(
+		avr_trace_reader_t * r,
+		uint64_t * v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t b;
+		GET(b);
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+int
+avr_trace_read(
+		avr_trace_reader_t * r,
+		avr_trace_record_t * rec)
+{
+	int flags = getc(r->in);
+	if (flags == EOF)
+		return 0;
+	if (flags & 0x80)
+		return -1;
+	uint64_t v;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->cycles = flags & AVR_TRACE_CYCLES;
+	if (rec->cycles == AVR_TRACE_CYCLES) {
+		if (_avr_trace_get_varint(r, &v))
+			return -1;
+		rec->cycles = v;
+	}
+	rec->pc = r->next_pc;
+	if (flags & AVR_TRACE_PC) {
+		if (_avr_trace_get_varint(r, &v))
+			return -1;
+		int32_t d = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+		rec->pc += d * 2;
+	}
+	uint32_t w = rec->pc >> 1;
+	if (w >= r->size)
+		return -1;
+	if (flags & AVR_TRACE_OPCODE) {
+		uint8_t b[2];
+		GET(b[0]); GET(b[1]);
+		r->flash[w] = b[0] | (b[1] << 8);
+		r->seen[w] = 1;
+		if (avr_opcode_is_32_bits(r->flash[w]) && w + 1 < r->size) {
+			GET(b[0]); GET(b[1]);
+			r->flash[w + 1] = b[0] | (b[1] << 8);
+			r->seen[w + 1] = 1;
+		}
+	} else if (!r->seen[w])
+		return -1;
+	rec->opcode[0] = r->flash[w];
+	rec->opcode[1] = w + 1 < r->size && r->seen[w + 1] ? r->flash[w + 1] : 0xffff;
+	int wide = avr_opcode_is_32_bits(rec->opcode[0]) && w + 1 < r->size;
+	r->next_pc = rec->pc + (wide ? 4 : 2);
+
+	rec->reg = AVR_TRACE_NO_REG;
+	if (flags & (AVR_TRACE_VALUE0 | AVR_TRACE_VALUE1)) {
+		GET(rec->reg);
+		if (rec->reg >= 32 || (rec->reg == 31 && (flags & AVR_TRACE_VALUE1)))
+			return -1;
+		if (flags & AVR_TRACE_VALUE0) {
+			GET(r->reg[rec->reg]);
+			rec->changed |= 1;
+		}
+		if (flags & AVR_TRACE_VALUE1) {
+			GET(r->reg[rec->reg + 1]);
+			rec->changed |= 2;
+		}
+		rec->value[0] = r->reg[rec->reg];
+		rec->value[1] = rec->reg < 31 ? r->reg[rec->reg + 1] : 0;
+	}
+	r->cycle += rec->cycles;
+	return 1;
+}
+
+void
+avr_trace_close(
+		avr_trace_reader_t * r)
+{
+	free(r->flash);
+	free(r->seen);
+	r->flash = NULL;
+	r->seen = NULL;
+}
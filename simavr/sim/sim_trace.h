@@ -0,0 +1,165 @@
+/*
+	sim_trace.h
+
+	Copyright 2008-2012 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary instruction trace, enabled at run time. The core fills a ring of
+ * fixed size records, one per instruction: its pc and opcode, the cycles
+ * since the previous one (so including sleeps and interrupt entries) and
+ * the register it wrote, with its value. A thread of its own empties the
+ * ring into the trace file, each record packed against the previous ones:
+ *
+ * - a flags byte, with the cycles if less than 7 (else a varint follows)
+ * - the pc, only if it isn't the next instruction (zigzag varint, in words)
+ * - the opcode, only the first time that pc is seen, or if it changed
+ * - the register and its values, only those that changed
+ *
+ * which makes most instructions take one or two bytes. The core waits for
+ * the thread if the ring is full, so nothing is lost. run_avr_trace_dump
+ * prints a trace file, disassembled, with the firmware symbols.
+ *
+ * The recording is an instruction hook, see avr_run_one().
+ */
+#ifndef __SIM_TRACE_H__
+#define __SIM_TRACE_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_TRACE_MAGIC		"SIMAVRTR"
+#define AVR_TRACE_VERSION	1
+#define AVR_TRACE_RING		(1 << 16)	// records, a power of two
+#define AVR_TRACE_NO_REG	0xff
+
+typedef struct avr_trace_record_t {
+	uint32_t	pc;
+	uint32_t	cycles;		// since the previous instruction
+	uint16_t	opcode[2];	// the second word for the 32 bits instructions
+	uint8_t		reg;		// register written, or AVR_TRACE_NO_REG
+	uint8_t		value[2];	// of 'reg' and 'reg' + 1, after the instruction
+	uint8_t		changed;	// as read back, bit 0/1 for 'value' 0/1
+} avr_trace_record_t;
+
+typedef struct avr_trace_t {
+	avr_trace_record_t * ring;
+	uint32_t		head;		// written by the core
+	uint32_t		published;	// 'head', as the thread can see it
+	uint32_t		tail;		// read by the thread
+	uint32_t		tail_seen;	// last 'tail' the core looked at
+	int				stop;
+	avr_cycle_count_t cycle;	// of the last record
+
+	pthread_t		thread;
+	FILE *			out;
+	int				error;
+	uint64_t		count;		// records written
+	// what the file says so far, for the packing
+	uint32_t		next_pc;
+	uint16_t *		flash;		// the words already in the file
+	uint8_t *		seen;		// ... and which they are
+	uint32_t		size;		// in flash words
+	uint8_t			reg[32];
+} avr_trace_t;
+
+// the core waits for the thread to make room
+void
+avr_trace_wait(
+		avr_trace_t * t);
+
+// records the instruction that just ran at avr->pc, that wrote 'reg'
+static inline void
+avr_trace_record(
+		avr_trace_t * t,
+		avr_t * avr,
+		uint8_t reg)
+{
+	if (t->head - t->tail_seen == AVR_TRACE_RING)
+		avr_trace_wait(t);
+	avr_trace_record_t * r = &t->ring[t->head & (AVR_TRACE_RING - 1)];
+	r->pc = avr->pc;
+	r->cycles = avr->cycle - t->cycle;
+	t->cycle = avr->cycle;
+	r->opcode[0] = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+	r->opcode[1] = avr->pc + 3 <= avr->flashend ?
+			avr->flash[avr->pc + 2] | (avr->flash[avr->pc + 3] << 8) : 0xffff;
+	r->reg = reg;
+	if (reg < 32) {
+		r->value[0] = avr->data[reg];
+		r->value[1] = reg < 31 ? avr->data[reg + 1] : 0;
+	}
+	// the thread only gets whole batches, less cache line ping-pong
+	if (!(++t->head & 255))
+		__atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts tracing the instructions of 'avr' to the file 'path', from the
+ * current cycle. Returns zero, or -1
+ */
+int
+avr_trace_start(
+		avr_t * avr,
+		const char * path);
+/*
+ * Writes what is left in the ring, stops the thread and closes the file.
+ * Returns the number of instructions traced, or -1 on a write error
+ */
+int64_t
+avr_trace_stop(
+		avr_t * avr);
+
+// Reading a trace file back
+typedef struct avr_trace_reader_t {
+	FILE *			in;
+	char			mmcu[32];
+	uint32_t		flashend;
+	uint32_t		frequency;
+	avr_cycle_count_t cycle;	// at the end of the last record read
+	uint32_t		next_pc;
+	uint16_t *		flash;
+	uint8_t *		seen;
+	uint32_t		size;
+	uint8_t			reg[32];	// as of the last record read
+} avr_trace_reader_t;
+
+// reads the header of 'in'. Returns zero, or -1 if it's not a trace file
+int
+avr_trace_open(
+		avr_trace_reader_t * r,
+		FILE * in);
+// Reads the next record. Returns 1, 0 at the end, or -1 if corrupt
+int
+avr_trace_read(
+		avr_trace_reader_t * r,
+		avr_trace_record_t * rec);
+void
+avr_trace_close(
+		avr_trace_reader_t * r);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_TRACE_H__ */
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "tests.h"
+
+/*
+ * Runs a small manifest through run_avr_batch: a job that sends what it is
+ * expected to, one stopped by its cycle budget, and one whose UART output
+ * doesn't match. Each job is one line of the JSON output.
+ */
+#define BATCH		"../simavr/run_avr_batch"
+#define FIRMWARE	"atmega88_example.axf"
+#define EXPECTED	"Read from eeprom 0xdeadbeef -- should be 0xdeadbeef\\r\\n" \
+					"Read from eeprom 0xcafef00d -- should be 0xcafef00d\\r\\n"
+
+static const struct {
+	const char * job;
+	const char * fields[3];
+} jobs[] = {
+	{ FIRMWARE " cycles=100000000 expect=\"" EXPECTED "\"",
+		{ "\"state\": \"done\"", "\"pass\": true", "\"uart\": \"Read from" } },
+	{ FIRMWARE " cycles=1000",
+		{ "\"state\": \"budget\"", "\"pass\": true", "\"uart\": \"\"" } },
+	{ FIRMWARE " cycles=100000000 expect=\"nope\"",
+		{ "\"state\": \"done\"", "\"pass\": false", "\"mcps\": " } },
+};
+#define JOBS	(sizeof(jobs) / sizeof(jobs[0]))
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char manifest[] = "/tmp/simavr_batch_XXXXXX";
+	int fd = mkstemp(manifest);
+	if (fd < 0)
+		fail("can't create the manifest");
+	FILE * f = fdopen(fd, "w");
+	fprintf(f, "# one job per line\n");
+	for (int i = 0; i < JOBS; i++)
+		fprintf(f, "%s\n", jobs[i].job);
+	fclose(f);
+
+	char cmd[256];
+	snprintf(cmd, sizeof(cmd), BATCH " -j 2 %s", manifest);
+	FILE * o = popen(cmd, "r");
+	if (!o)
+		fail("can't run %s", BATCH);
+	char line[1024];
+	int count = 0;
+	while (fgets(line, sizeof(line), o)) {
+		if (strncmp(line, "  { ", 4))
+			continue;
+		if (count == JOBS)
+			fail("too many results: %s", line);
+		// the jobs are listed in the manifest order
+		char lineno[32];
+		sprintf(lineno, "\"line\": %d,", count + 2);
+		if (!strstr(line, lineno))
+			fail("job %d: not %s: %s", count, lineno, line);
+		for (int i = 0; i < 3; i++)
+			if (!strstr(line, jobs[count].fields[i]))
+				fail("job %d: no %s in: %s", count, jobs[count].fields[i], line);
+		count++;
+	}
+	int status = pclose(o);
+	unlink(manifest);
+	if (count != JOBS)
+		fail("%d results, not %d", count, (int)JOBS);
+	// one job failed
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 1)
+		fail("%s exited with %d, not 1", BATCH, status);
+
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_board.h"
+#include "avr_uart.h"
+
+/*
+ * Two atmega88 at different frequencies on a board, the UART of one sending
+ * to the other. Checks the bytes arrive when they were sent plus the link
+ * latency, whatever the quantum, and the timebase conversions. Then a chain
+ * of them passing the bytes along, which has to run the same on threads.
+ */
+#define RJMP(_from, _to)	(0xc000 | (((_to) - (_from) - 1) & 0xfff))
+#define RCALL(_from, _to)	(0xd000 | (((_to) - (_from) - 1) & 0xfff))
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define OUT(_a, _r)		(0xb800 | (((_a) & 0x30) << 5) | ((_r) << 4) | ((_a) & 0xf))
+#define STS(_r)			(0x9200 | ((_r) << 4))
+#define LDS(_r)			(0x9000 | ((_r) << 4))
+#define ST_XP(_r)		(0x920d | ((_r) << 4))
+#define SBRS(_r, _b)	(0xfe00 | ((_r) << 4) | (_b))
+#define CLI				0x94f8
+#define SLEEP			0x9588
+#define RET				0x9508
+
+#define UCSR0A	0xc0
+#define UCSR0B	0xc1
+#define UDR0	0xc6
+
+// sends "hi\n", waits for the end of the transmission, and stops
+static const uint16_t sender[] = {
+	LDI(16, 0x08), STS(16), UCSR0B,				// TXEN0
+	LDI(17, 'h'), RCALL(4, 17),
+	LDI(17, 'i'), RCALL(6, 17),
+	LDI(17, '\n'), RCALL(8, 17),
+	LDS(18), UCSR0A, SBRS(18, 6), RJMP(12, 9),	// TXC0
+	LDI(16, 1), OUT(0x33, 16), CLI, SLEEP,
+	[17] = LDS(18), UCSR0A, SBRS(18, 5), RJMP(20, 17),	// UDRE0
+	STS(17), UDR0, RET,
+};
+
+// stores what it receives from 0x100 on
+static const uint16_t receiver[] = {
+	LDI(16, 0x10), STS(16), UCSR0B,				// RXEN0
+	LDI(26, 0x00), LDI(27, 0x01),
+	LDS(18), UCSR0A, SBRS(18, 7), RJMP(8, 5),	// RXC0
+	LDS(19), UDR0, ST_XP(19), RJMP(12, 5),
+};
+
+// stores what it receives from 0x100 on, and sends it along
+static const uint16_t relay[] = {
+	LDI(16, 0x18), STS(16), UCSR0B,				// RXEN0, TXEN0
+	LDI(26, 0x00), LDI(27, 0x01),
+	LDS(18), UCSR0A, SBRS(18, 7), RJMP(8, 5),	// RXC0
+	LDS(19), UDR0, ST_XP(19),
+	LDS(18), UCSR0A, SBRS(18, 5), RJMP(15, 12),	// UDRE0
+	STS(19), UDR0, RJMP(18, 5),
+};
+
+#define LATENCY		2000000		// 2us, a bit at 500 kbauds
+
+typedef struct stamps_t {
+	avr_t *				avr;
+	int					count;
+	avr_cycle_count_t	cycle[8];
+} stamps_t;
+
+static void
+stamp(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	stamps_t * s = param;
+	if (s->count < 8)
+		s->cycle[s->count++] = s->avr->cycle;
+}
+
+static avr_t *
+make(const uint16_t * program, int size, uint32_t freq)
+{
+	avr_t * avr = tests_init_code("atmega88", program, size, freq);
+	avr->time_policy = AVR_TIME_MAX;
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_POLL_SLEEP;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	return avr;
+}
+
+static void
+run(avr_board_time_t quantum, stamps_t * sent, stamps_t * received, uint8_t * data)
+{
+	avr_board_t board;
+	avr_board_init(&board, quantum);
+	avr_t * a = make(sender, sizeof(sender), 8000000);
+	avr_t * b = make(receiver, sizeof(receiver), 20000000);
+	if (avr_board_add(&board, a) != 0 || avr_board_add(&board, b) != 1)
+		fail("avrs not added");
+	avr_irq_t * out = avr_io_getirq(a, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT);
+	avr_irq_t * in = avr_io_getirq(b, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	if (!avr_board_connect(&board, a, out, b, in, LATENCY))
+		fail("avrs not connected");
+	if (board.lookahead != LATENCY || !board.margin)
+		fail("lookahead %d margin %d", (int)board.lookahead, (int)board.margin);
+	*sent = (stamps_t) { .avr = a };
+	*received = (stamps_t) { .avr = b };
+	avr_irq_register_notify(out, stamp, sent);
+	avr_irq_register_notify(in, stamp, received);
+
+	// 1ms, the sender is done long before, the receiver never is
+	int running = avr_board_run(&board, AVR_BOARD_PSEC / 1000);
+	if (running != 1 || a->state != cpu_Done)
+		fail("%d avrs still running, sender state %d", running, a->state);
+	if (board.now != AVR_BOARD_PSEC / 1000)
+		fail("board stopped early");
+	if (b->cycle < 20000)
+		fail("receiver only ran %d cycles", (int)b->cycle);
+	memcpy(data, b->data + 0x100, 4);
+	avr_board_free(&board);
+	avr_terminate(a);
+	avr_terminate(b);
+}
+
+/*
+ * The receiver is reset while a byte is queued on its side of the link,
+ * dropping the link timer with it; the bytes still all arrive
+ */
+static void
+run_reset(avr_board_time_t due, stamps_t * received)
+{
+	avr_board_t board;
+	avr_board_init(&board, 0);
+	avr_t * a = make(sender, sizeof(sender), 8000000);
+	avr_t * b = make(receiver, sizeof(receiver), 20000000);
+	avr_board_add(&board, a);
+	avr_board_add(&board, b);
+	avr_irq_t * out = avr_io_getirq(a, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT);
+	avr_irq_t * in = avr_io_getirq(b, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_board_link_t * link = avr_board_connect(&board, a, out, b, in, LATENCY);
+	*received = (stamps_t) { .avr = b };
+	avr_irq_register_notify(in, stamp, received);
+
+	// stop just before the first byte is due, it's taken but not raised
+	avr_board_run(&board, due - board.margin / 2);
+	if (link->in.count != 1 || received->count)
+		fail("%d bytes queued, %d received", link->in.count, received->count);
+	avr_reset(b);
+	avr_board_run(&board, AVR_BOARD_PSEC / 1000);
+	avr_board_free(&board);
+	avr_terminate(a);
+	avr_terminate(b);
+}
+
+#define CHAIN	8
+
+typedef struct chain_t {
+	stamps_t			received[CHAIN];
+	avr_cycle_count_t	cycle[CHAIN];
+	uint8_t				data[CHAIN][4];
+} chain_t;
+
+static void
+run_chain(int threads, avr_board_time_t quantum, chain_t * c)
+{
+	static const uint32_t freqs[] = { 8000000, 16000000, 20000000, 12000000 };
+	avr_board_t board;
+	avr_t * avr[CHAIN];
+	avr_board_init(&board, quantum);
+	board.threads = threads;
+	memset(c, 0, sizeof(*c));
+	for (int i = 0; i < CHAIN; i++) {
+		avr[i] = i ? make(relay, sizeof(relay), freqs[i % 4]) :
+				make(sender, sizeof(sender), 8000000);
+		avr_board_add(&board, avr[i]);
+		c->received[i].avr = avr[i];
+	}
+	for (int i = 1; i < CHAIN; i++) {
+		avr_irq_t * out = avr_io_getirq(avr[i - 1], AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT);
+		avr_irq_t * in = avr_io_getirq(avr[i], AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+		avr_board_connect(&board, avr[i - 1], out, avr[i], in, LATENCY);
+		avr_irq_register_notify(in, stamp, &c->received[i]);
+	}
+	// in two goes, the threads start again where they stopped
+	avr_board_run(&board, AVR_BOARD_PSEC / 2000);
+	if (avr_board_run(&board, AVR_BOARD_PSEC / 1000) != CHAIN - 1)
+		fail("chain not running anymore");
+	for (int i = 0; i < CHAIN; i++) {
+		c->cycle[i] = avr[i]->cycle;
+		memcpy(c->data[i], avr[i]->data + 0x100, 4);
+	}
+	avr_board_free(&board);
+	for (int i = 0; i < CHAIN; i++)
+		avr_terminate(avr[i]);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	// conversions, against the exact result
+	static const uint32_t freqs[] = { 1000000, 8000000, 14745600, 16000000, 20000000, 4000000000u };
+	srand(1);
+	for (int f = 0; f < 6; f++)
+		for (int i = 0; i < 10000; i++) {
+			avr_cycle_count_t c = ((uint64_t)rand() << 31 | rand()) % (1ULL << (i % 40 + 1));
+			unsigned __int128 t = (unsigned __int128)c * AVR_BOARD_PSEC / freqs[f];
+			if (avr_board_cycle_to_time(freqs[f], c) != (avr_board_time_t)t)
+				fail("cycle %llu at %u is not %llu ps", (unsigned long long)c,
+						freqs[f], (unsigned long long)t);
+			if (avr_board_time_to_cycle(freqs[f], t) != c)
+				fail("%llu ps at %u is not cycle %llu", (unsigned long long)t,
+						freqs[f], (unsigned long long)c);
+			unsigned __int128 up = ((t + 1) * freqs[f] + AVR_BOARD_PSEC - 1) / AVR_BOARD_PSEC;
+			if (avr_board_time_to_cycle(freqs[f], t + 1) != (avr_cycle_count_t)up)
+				fail("%llu ps at %u not rounded up", (unsigned long long)t + 1,
+						freqs[f]);
+		}
+
+	stamps_t sent, received, sent2, received2;
+	uint8_t data[4], data2[4];
+	run(0, &sent, &received, data);
+	if (memcmp(data, "hi\n", 4))
+		fail("received '%.3s'", data);
+	if (sent.count != 3 || received.count != 3)
+		fail("%d bytes sent, %d received", sent.count, received.count);
+	for (int i = 0; i < 3; i++) {
+		avr_board_time_t due = avr_board_cycle_to_time(8000000, sent.cycle[i]) + LATENCY;
+		if (received.cycle[i] != avr_board_time_to_cycle(20000000, due))
+			fail("byte %d sent at cycle %d received at cycle %d", i,
+					(int)sent.cycle[i], (int)received.cycle[i]);
+	}
+	// a much shorter quantum changes nothing
+	run(LATENCY / 7, &sent2, &received2, data2);
+	if (memcmp(data, data2, 4) || memcmp(sent.cycle, sent2.cycle, sizeof(sent.cycle)) ||
+			memcmp(received.cycle, received2.cycle, sizeof(received.cycle)))
+		fail("the quantum changed the run");
+
+	stamps_t reset;
+	run_reset(avr_board_cycle_to_time(8000000, sent.cycle[0]) + LATENCY, &reset);
+	if (reset.count != 3)
+		fail("%d bytes received after a reset, not 3", reset.count);
+
+	static chain_t ref, c;
+	run_chain(0, 0, &ref);
+	if (memcmp(ref.data[CHAIN - 1], "hi\n", 4) || ref.received[CHAIN - 1].count != 3)
+		fail("end of the chain received '%.3s'", ref.data[CHAIN - 1]);
+	for (int i = 0; i < 4; i++) {
+		run_chain(1, i & 1 ? LATENCY / 3 : 0, &c);
+		for (int n = 0; n < CHAIN; n++)
+			if (c.cycle[n] != ref.cycle[n] || memcmp(c.data[n], ref.data[n], 4) ||
+					memcmp(c.received[n].cycle, ref.received[n].cycle,
+							sizeof(ref.received[n].cycle)))
+				fail("threaded run %d differs on avr %d", i, n);
+	}
+
+	tests_success();
+	return 0;
+}
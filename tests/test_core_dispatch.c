@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_interrupts.h"
+#include "sim_jit.h"
+
+/*
+ * Runs each firmware on two cores in lockstep, one with avr_run_one()
+ * (threaded dispatch and basic blocks, if compiled in) and one with the
+ * avr_run_one_switch() reference, and checks they stay identical after
+ * every step. This is done with one instruction per step, then with the
+ * default batching, which is what lets basic blocks run, then again with
+ * the host translation of the blocks, where available.
+ *
+ * Both dispatches share the decoder, the lazy flags and the polling loop
+ * fast-forward, so they are also checked against the core as it was before
+ * any of these: a set of generated programs is run with each, and the end
+ * state compared with the one recorded from that older core (see
+ * baseline[] below).
+ */
+static const char * firmwares[] = {
+	"atmega88_example.axf",
+	"atmega88_timer16.axf",
+	"atmega88_coroutine.axf",
+	"atmega88_uart_echo.axf",
+	"atmega48_enabled_timer.axf",
+	"atmega48_watchdog_test.axf",
+	"atmega644_adc_test.axf",
+	"atmega2560_uart_echo.axf",
+	NULL,
+};
+
+#define MAX_CYCLES	5000000
+
+// same as avr_callback_run_raw(), with a choice of decoder, and no sleep()
+static void step(avr_t * avr, avr_flashaddr_t (*run_one)(avr_t *))
+{
+	avr_flashaddr_t new_pc = avr->pc;
+
+	if (avr->state == cpu_Running)
+		new_pc = run_one(avr);
+
+	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+
+	avr->pc = new_pc;
+
+	if (avr->state == cpu_Sleeping) {
+		if (!avr->sreg[S_I]) {
+			avr->state = cpu_Done;
+			return;
+		}
+		avr->cycle += 1 + sleep;
+	}
+	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
+		avr_service_interrupts(avr);
+}
+
+static void compare(const char * name, avr_t * a, avr_t * b, int full)
+{
+	uint8_t sa, sb;
+	READ_SREG_INTO(a, sa);
+	READ_SREG_INTO(b, sb);
+
+	if (a->pc != b->pc || a->cycle != b->cycle || a->state != b->state || sa != sb)
+		fail("%s: dispatch differs at cycle %" PRI_avr_cycle_count
+				": pc %04x/%04x state %d/%d sreg %02x/%02x",
+				name, b->cycle, a->pc, b->pc, a->state, b->state, sa, sb);
+	if (memcmp(a->data, b->data, full ? a->ramend + 1 : 32))
+		fail("%s: dispatch differs at cycle %" PRI_avr_cycle_count
+				": pc %04x, %s differ", name, b->cycle, b->pc,
+				full ? "SRAM" : "registers");
+}
+
+/*
+ * Program generator: a timer overflow ISR counting into 0x200 and GPIOR0, three
+ * subroutines, and a main loop of random ALU, skip, branch, stack, IO,
+ * call and polling loop instructions, all from a xorshift seed. Each
+ * random number is drawn in its own statement, so the programs don't
+ * depend on the compiler's evaluation order.
+ */
+static uint32_t gen_seed;
+static uint16_t gen[4096];
+static int gen_pc, gen_subs[3];
+
+static int gen_rand(int n)
+{
+	gen_seed ^= gen_seed << 13;
+	gen_seed ^= gen_seed >> 17;
+	gen_seed ^= gen_seed << 5;
+	return gen_seed % n;
+}
+
+static void E(uint16_t w)
+{
+	gen[gen_pc++] = w;
+}
+
+static void RR(uint16_t o, int d, int r)
+{
+	E(o | ((r & 0x10) << 5) | ((d & 0x1f) << 4) | (r & 0xf));
+}
+
+static void RK(uint16_t o, int h, int k)
+{
+	E(o | ((k & 0xf0) << 4) | (((h - 16) & 0xf) << 4) | (k & 0xf));
+}
+
+static void IO(uint16_t o, int d, int a)
+{
+	E(o | ((a & 0x30) << 5) | ((d & 0x1f) << 4) | (a & 0xf));
+}
+
+static void gen_alu(void)
+{
+	static const uint16_t rr[] = { 0x0c00, 0x1c00, 0x1800, 0x0800, 0x2000,
+			0x2800, 0x2400, 0x2c00, 0x1400, 0x0400, 0x9c00 };
+	static const uint16_t rk[] = { 0x3000, 0x4000, 0x5000, 0x6000, 0x7000, 0xe000 };
+	static const uint16_t r1[] = { 0x9400, 0x9401, 0x9402, 0x9403, 0x9405,
+			0x9406, 0x9407, 0x940a };
+	int kind = gen_rand(10), op = gen_rand(11), d = gen_rand(26), r = gen_rand(26);
+	int k = gen_rand(256), b = gen_rand(8);
+
+	switch (kind) {
+		case 0: case 1: case 2: RR(rr[op], d, r); break;
+		case 3: case 4: RK(rk[op % 6], 16 + d % 10, k); break;
+		case 5: E(r1[op % 8] | (d << 4)); break;
+		case 6: E(0x0100 | ((d % 14) << 4) | (r % 14)); break;	// movw
+		case 7:	// muls, mulsu/fmul*, adiw/sbiw
+			switch (op % 3) {
+				case 0: E(0x0200 | ((d % 10) << 4) | (r % 10)); break;
+				case 1: E(0x0300 | ((k & 0x1f) << 3) | b); break;
+				case 2: E((r & 1 ? 0x9600 : 0x9700) | (k & 0xdf)); break;
+			}
+			break;
+		case 8: E((r & 1 ? 0xf800 : 0xfa00) | (d << 4) | b); break;	// bld/bst
+		case 9:	// SREG, GPIOR and port accesses
+			switch (op % 5) {
+				case 0: IO(0xb000, d, 0x3f); break;
+				case 1: IO(0xb800, d, 0x1e); break;
+				case 2: IO(0xb000, d, 0x2a); break;
+				case 3: E((r & 1 ? 0x9800 : 0x9a00) | (0x1e << 3) | b); break;
+				case 4: IO(r & 1 ? 0xb800 : 0xb000, d, r & 2 ? 0x05 : 0x03); break;
+			}
+			break;
+	}
+}
+
+static void gen_body(int count, int calls)
+{
+	for (int i = 0; i < count; i++) {
+		int kind = gen_rand(18), op = gen_rand(3), d = gen_rand(26), r = gen_rand(26);
+		int k = gen_rand(64), b = gen_rand(8);
+
+		switch (kind) {
+			case 10:	// a skip over one instruction
+				switch (op) {
+					case 0: RR(0x1000, d, r); break;
+					case 1: E((r & 1 ? 0xfc00 : 0xfe00) | (d << 4) | b); break;
+					case 2: E((r & 1 ? 0x9900 : 0x9b00) | (0x1e << 3) | b); break;
+				}
+				gen_alu();
+				break;
+			case 11:	// a forward branch over 1 to 3 instructions
+				E(0xf000 | ((r & 1) << 10) | ((1 + op) << 3) | b);
+				for (int j = 0; j <= op; j++)
+					gen_alu();
+				break;
+			case 12: E(0x920f | (d << 4)); E(0x900f | (r << 4)); break;	// push/pop
+			case 13:	// ldd/std Y+q
+				E((r & 1 ? 0x8208 : 0x8008) | ((k & 0x20) << 8) |
+						((k & 0x18) << 7) | (k & 7) | (d << 4));
+				break;
+			case 14: E(r & 1 ? 0x9478 : 0x94f8); break;	// sei/cli
+			case 15:	// rcall or icall (Z is the first subroutine)
+				if (!calls)
+					gen_alu();
+				else if (op == 0)
+					E(0x9509);
+				else
+					E(0xd000 | ((gen_subs[b % 3] - (gen_pc + 1)) & 0xfff));
+				break;
+			case 16: E(r & 1 ? 0x95c8 : 0x9004 | (d << 4)); break;	// lpm
+			case 17:	// polling loops on the ISR counts, after a sei
+				E(0x9478);
+				switch (op) {
+					case 0:	// lds r16, 0x200 ; andi r16, 3 ; brne .-8
+						E(0x9100); E(0x0200); RK(0x7000, 16, 3); E(0xf7e1);
+						break;
+					case 1:	// sbis GPIOR0, b ; rjmp .-4
+						E(0x9b00 | (0x1e << 3) | b); E(0xcffe);
+						break;
+					case 2:	// in r17, GPIOR0 ; sbrc r17, b ; rjmp .-6
+						IO(0xb000, 17, 0x1e); E(0xfd10 | b); E(0xcffd);
+						break;
+				}
+				break;
+			default:
+				gen_alu();
+		}
+	}
+}
+
+static avr_t * gen_avr(const char * mmcu, uint32_t seed)
+{
+	avr_t * avr = tests_init_code(mmcu, NULL, 0, 0);
+
+	int big = avr->flashend > 0x1ffff;
+	int vsize = avr->vector_size / 2, vcount = big ? 57 : 26;
+	int ovf = big ? 23 : 16;
+
+	gen_seed = seed * 2654435761u + 1;
+	memset(gen, 0, sizeof(gen));
+	gen_pc = vcount * vsize;
+	// timer 0 overflow: increments 0x200 and GPIOR0, keeps r16 and SREG
+	int isr = gen_pc;
+	E(0x930f); IO(0xb000, 16, 0x3f); E(0x930f);		// push r16, in, push
+	E(0x9100); E(0x0200); E(0x9503); E(0x9300); E(0x0200);	// lds, inc, sts
+	IO(0xb800, 16, 0x1e);							// out GPIOR0, r16
+	E(0x910f); IO(0xb800, 16, 0x3f); E(0x910f);		// pop r16, out, pop
+	E(0x9518);
+	for (int s = 0; s < 3; s++) {
+		gen_subs[s] = gen_pc;
+		int count = 8 + gen_rand(10);
+		gen_body(count, 0);
+		E(0x9508);
+	}
+	int start = gen_pc;
+	RK(0xe000, 28, 0x00); RK(0xe000, 29, 0x03);		// Y = 0x300
+	RK(0xe000, 30, gen_subs[0] & 0xff); RK(0xe000, 31, gen_subs[0] >> 8);
+	for (int r = 16; r < 28; r++) {
+		int k = gen_rand(256);
+		RK(0xe000, r, k);
+	}
+	// timer 0 at clk/1, overflow interrupt on
+	RK(0xe000, 16, 1); IO(0xb800, 16, 0x25);
+	E(0x9300); E(0x6e);
+	E(0x9478);
+	int loop = gen_pc;
+	gen_body(300, 1);
+	E(0xc000 | ((loop - (gen_pc + 1)) & 0xfff));
+	for (int v = 0; v < vcount; v++) {
+		int at = v * vsize, to = v == ovf ? isr : start;
+		if (vsize == 1)
+			gen[at] = 0xc000 | ((to - (at + 1)) & 0xfff);
+		else {
+			gen[at] = 0x940c;
+			gen[at + 1] = to;
+		}
+	}
+	avr_loadcode(avr, (uint8_t *)gen, gen_pc * 2, 0);
+	avr->codeend = gen_pc * 2;
+	return avr;
+}
+
+// FNV-1a of the whole SRAM, with the real SREG
+static uint32_t sram_hash(avr_t * avr)
+{
+	uint32_t h = 2166136261u;
+	uint8_t sreg;
+	READ_SREG_INTO(avr, sreg);
+	for (int i = 0; i <= avr->ramend; i++)
+		h = (h ^ (i == R_SREG ? sreg : avr->data[i])) * 16777619u;
+	return h;
+}
+
+static avr_cycle_count_t
+stop_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	return 0;
+}
+
+#define GEN_CYCLES	300000
+
+/*
+ * End state of the generated programs after GEN_CYCLES, as run by the
+ * core before the instruction cache, the threaded dispatch, the lazy flags
+ * and the loop fast-forward were added.
+ */
+static const struct {
+	const char * mmcu;
+	uint32_t seed;
+	avr_flashaddr_t pc;
+	avr_cycle_count_t cycle;
+	uint32_t hash;
+} baseline[] = {
+	{ "atmega88", 1, 0x00352, 300001, 0xac23970b },
+	{ "atmega88", 2, 0x00092, 300000, 0x1bdeb42e },
+	{ "atmega88", 3, 0x00066, 300000, 0x6b116c0b },
+	{ "atmega88", 4, 0x00054, 300001, 0xeefbc93c },
+	{ "atmega88", 5, 0x003ce, 300001, 0xb6f36b61 },
+	{ "atmega88", 6, 0x0020c, 300000, 0x59868921 },
+	{ "atmega88", 7, 0x0012c, 300000, 0x6c82b755 },
+	{ "atmega88", 8, 0x000a4, 300001, 0x01cc2517 },
+	{ "atmega2560", 1, 0x00404, 300000, 0x4371595d },
+	{ "atmega2560", 2, 0x0013e, 300000, 0x99ce40b7 },
+	{ "atmega2560", 3, 0x00114, 300000, 0x04f940a6 },
+	{ "atmega2560", 4, 0x00104, 300000, 0x10f148af },
+	{ "atmega2560", 5, 0x0023e, 300001, 0xbdf9e9c8 },
+	{ "atmega2560", 6, 0x002ba, 300001, 0xd2b1ad03 },
+	{ "atmega2560", 7, 0x001de, 300000, 0x325ccef4 },
+	{ "atmega2560", 8, 0x00154, 300001, 0x262aca19 }
+};
+
+static void
+gen_check(
+		int b,
+		const char * how,
+		avr_t * avr)
+{
+	if (avr->pc != baseline[b].pc || avr->cycle != baseline[b].cycle ||
+			sram_hash(avr) != baseline[b].hash)
+		fail("%s seed %u, %s: ended at pc %05x cycle %" PRI_avr_cycle_count
+				" hash %08x, not pc %05x cycle %" PRI_avr_cycle_count " hash %08x",
+				baseline[b].mmcu, baseline[b].seed, how, avr->pc, avr->cycle,
+				sram_hash(avr), baseline[b].pc, baseline[b].cycle, baseline[b].hash);
+	avr_terminate(avr);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	for (int b = 0; b < sizeof(baseline) / sizeof(baseline[0]); b++) {
+		// the default dispatch, as run by avr_run()
+		avr_t * avr = gen_avr(baseline[b].mmcu, baseline[b].seed);
+		avr_cycle_timer_register(avr, GEN_CYCLES, stop_timer, NULL);
+		while (avr->cycle < GEN_CYCLES && avr->state == cpu_Running)
+			avr_run(avr);
+		gen_check(b, "avr_run_one", avr);
+		// the switch() reference
+		avr = gen_avr(baseline[b].mmcu, baseline[b].seed);
+		avr_cycle_timer_register(avr, GEN_CYCLES, stop_timer, NULL);
+		while (avr->cycle < GEN_CYCLES && avr->state == cpu_Running)
+			step(avr, avr_run_one_switch);
+		gen_check(b, "avr_run_one_switch", avr);
+		// the host translation, if there is one
+		avr = gen_avr(baseline[b].mmcu, baseline[b].seed);
+		if (avr_jit_init(avr, 1)) {
+			avr_terminate(avr);
+			continue;
+		}
+		avr_cycle_timer_register(avr, GEN_CYCLES, stop_timer, NULL);
+		while (avr->cycle < GEN_CYCLES && avr->state == cpu_Running)
+			avr_run(avr);
+		gen_check(b, "translated", avr);
+	}
+
+	for (int pass = 0; pass < 3; pass++)
+		for (int f = 0; firmwares[f]; f++) {
+			avr_t * a = tests_init_avr(firmwares[f]);
+			avr_t * b = tests_init_avr(firmwares[f]);
+			// one instruction per step, so each one gets compared
+			if (pass == 0)
+				a->run_cycle_limit = b->run_cycle_limit = 1;
+			if (pass == 2 && avr_jit_init(a, 1)) {
+				avr_terminate(a);
+				avr_terminate(b);
+				break;
+			}
+
+			for (int i = 0; b->cycle < MAX_CYCLES; i++) {
+				step(a, avr_run_one);
+				step(b, avr_run_one_switch);
+				compare(firmwares[f], a, b, (i % 1000) == 0);
+				if (b->state != cpu_Running && b->state != cpu_Sleeping)
+					break;
+			}
+			compare(firmwares[f], a, b, 1);
+			avr_terminate(a);
+			avr_terminate(b);
+		}
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_cycle_timers.h"
+
+/*
+ * Exercises the cycle timer scheduler directly, without any firmware:
+ * ordering (including timers due on the same cycle), cancel, status,
+ * periodic timers, the handle API mixed with the (timer, param) one, and
+ * the pool growing past its first slab.
+ */
+static char order[512];
+static int fired;
+
+static avr_cycle_count_t
+record(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	order[fired++] = *(char *)param;
+	return 0;
+}
+
+static avr_cycle_count_t
+periodic(struct avr_t * avr, avr_cycle_count_t when, void * param)
+{
+	order[fired++] = *(char *)param;
+	return fired < 5 ? when + 20 : 0;
+}
+
+static void run_until(avr_t * avr, avr_cycle_count_t cycle)
+{
+	while (avr->cycle < cycle) {
+		avr->cycle++;
+		avr_cycle_timer_process(avr);
+	}
+}
+
+static void check(const char * expected)
+{
+	order[fired] = 0;
+	if (strcmp(order, expected))
+		fail("timers fired as '%s', expected '%s'", order, expected);
+	fired = 0;
+}
+
+int main(int argc, char **argv) {
+	static char a = 'a', b = 'b', c = 'c', d = 'd', p = 'p';
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", NULL, 0, 0);
+
+	avr_cycle_timer_register(avr, 100, record, &a);
+	avr_cycle_timer_register(avr, 50, record, &b);
+	avr_cycle_timer_register(avr, 100, record, &c);
+	avr_cycle_timer_register(avr, 100, record, &d);
+	if (avr_cycle_timer_status(avr, record, &a) != 101)
+		fail("status of a is %d", (int)avr_cycle_timer_status(avr, record, &a));
+	avr_cycle_timer_cancel(avr, record, &c);
+	if (avr_cycle_timer_status(avr, record, &c))
+		fail("c still scheduled after cancel");
+	// registering again moves it after the others due on that cycle
+	avr_cycle_timer_register(avr, 100, record, &a);
+	run_until(avr, 200);
+	check("bda");
+
+	avr_cycle_timer_handle_t h = avr_cycle_timer_get_handle(avr, record, &c);
+	if (!h)
+		fail("no handle");
+	if (avr_cycle_timer_get_handle(avr, record, &c) != h)
+		fail("same timer got two handles");
+	avr_cycle_timer_register_handle(avr, h, 10);
+	if (avr_cycle_timer_status(avr, record, &c) != 11)
+		fail("handle not seen by the (timer, param) API");
+	avr_cycle_timer_cancel(avr, record, &c);
+	if (avr_cycle_timer_status_handle(avr, h))
+		fail("(timer, param) cancel not seen by the handle API");
+	avr_cycle_timer_register(avr, 10, record, &c);
+	avr_cycle_timer_register(avr, 5, periodic, &p);
+	run_until(avr, 400);
+	check("pcppp");
+
+	// handles survive a reset, unlike the timers that were scheduled
+	avr_cycle_timer_register_handle(avr, h, 10);
+	avr_cycle_timer_register(avr, 10, record, &a);
+	avr_reset(avr);
+	if (avr_cycle_timer_status_handle(avr, h) ||
+			avr_cycle_timer_status(avr, record, &a))
+		fail("timers still scheduled after reset");
+	avr_cycle_timer_register_handle(avr, h, 10);
+	run_until(avr, avr->cycle + 20);
+	check("c");
+
+	// many more timers than the first slab holds, due in reverse order
+	static char many[300];
+	for (int i = 0; i < 300; i++) {
+		many[i] = 'A' + (i % 26);
+		avr_cycle_timer_register(avr, 1000 - i, record, &many[i]);
+	}
+	if (avr->cycle_timers.high_water < 300)
+		fail("high water mark %d", avr->cycle_timers.high_water);
+	int before = avr->cycle_timers.size;
+	run_until(avr, avr->cycle + 1000);
+	if (fired != 300)
+		fail("%d of the 300 timers fired", fired);
+	for (int i = 0; i < 300; i++)
+		if (order[i] != many[299 - i])
+			fail("timer %d fired out of order", i);
+	fired = 0;
+	// the slots are reused, the pool doesn't grow again
+	for (int i = 0; i < 300; i++)
+		avr_cycle_timer_register(avr, 10, record, &many[i]);
+	if (avr->cycle_timers.size != before)
+		fail("pool grew from %d to %d slots", before, avr->cycle_timers.size);
+	run_until(avr, avr->cycle + 20);
+	fired = 0;
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_fuzz.h"
+#include "avr_uart.h"
+
+/*
+ * A tiny protocol parser on an atmega88 reading its UART, fuzzed from a
+ * boot snapshot: checks the runs are repeatable, that new paths show in
+ * the coverage map, and that each kind of fault is caught and doesn't
+ * leak into the next run.
+ */
+#define RJMP(_from, _to)	(0xc000 | (((_to) - (_from) - 1) & 0xfff))
+#define RCALL(_from, _to)	(0xd000 | (((_to) - (_from) - 1) & 0xfff))
+#define BREQ(_from, _to)	(0xf001 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define BRNE(_from, _to)	(0xf401 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define CPI(_d, _k)		(0x3000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define STS(_r)			(0x9200 | ((_r) << 4))
+#define LDS(_r)			(0x9000 | ((_r) << 4))
+#define SBRS(_r, _b)	(0xfe00 | ((_r) << 4) | (_b))
+#define RET				0x9508
+#define INVALID			0x0001
+
+#define UCSR0A	0xc0
+#define UCSR0B	0xc1
+#define UDR0	0xc6
+#define WDTCSR	0x60
+
+/*
+ * "FUZ" runs an invalid opcode, 'S' recurses forever, 'W' starts the
+ * watchdog and hangs; anything else is ignored
+ */
+static const uint16_t parser[] = {
+	LDI(16, 0x10), STS(16), UCSR0B,				// RXEN0
+	RCALL(3, 40),
+	CPI(19, 'S'), BREQ(5, 30),
+	CPI(19, 'W'), BREQ(7, 32),
+	CPI(19, 'F'), BRNE(9, 3),
+	RCALL(10, 40),
+	CPI(19, 'U'), BRNE(12, 3),
+	RCALL(13, 40),
+	CPI(19, 'Z'), BRNE(15, 3),
+	INVALID, RJMP(17, 3),
+	[30] = RCALL(30, 30),
+	[32] = LDI(16, 0x08), STS(16), WDTCSR, RJMP(35, 35),	// WDE
+	[40] = LDS(18), UCSR0A, SBRS(18, 7), RJMP(43, 40),	// RXC0
+	LDS(19), UDR0, RET,
+};
+
+#define MAP_SIZE	4096
+
+static uint8_t map[MAP_SIZE], ref[MAP_SIZE];
+
+static int
+run(avr_fuzz_t * f, const char * input)
+{
+	memset(map, 0, sizeof(map));
+	return avr_fuzz_run(f, (const uint8_t *)input, strlen(input));
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", parser, sizeof(parser), 8000000);
+	avr->time_policy = AVR_TIME_MAX;
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_POLL_SLEEP;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	// boot, up to where it waits for the first byte
+	avr_run_cycles(avr, 1000);
+	avr_cycle_count_t boot = avr->cycle;
+
+	avr_fuzz_t f;
+	if (avr_fuzz_init(&f, avr, map, MAP_SIZE - 1) == 0)
+		fail("map size not checked");
+	if (avr_fuzz_init(&f, avr, map, MAP_SIZE) || avr_fuzz_input_uart(&f, '0'))
+		fail("fuzzer not initialized");
+
+	int res = run(&f, "abc");
+	if (res != AVR_FUZZ_OK)
+		fail("clean input ended with %d", res);
+	if (avr->cycle - boot >= f.budget)
+		fail("the run didn't stop once the input was read");
+	memcpy(ref, map, sizeof(map));
+	int edges = 0;
+	for (int i = 0; i < MAP_SIZE; i++)
+		edges += ref[i] != 0;
+	if (edges < 4)
+		fail("only %d edges recorded", edges);
+	if (run(&f, "abc") != AVR_FUZZ_OK || memcmp(map, ref, sizeof(map)))
+		fail("the same input ran differently");
+
+	// getting further in the parser shows up as new edges
+	run(&f, "FU");
+	int new = 0;
+	for (int i = 0; i < MAP_SIZE; i++)
+		new += map[i] && !ref[i];
+	if (!new)
+		fail("no new edges for a new path");
+
+	static const struct {
+		const char *	input;
+		int				fault;
+	} faults[] = {
+		{ "xFUZ", AVR_FUZZ_INVALID_OPCODE },
+		{ "S", AVR_FUZZ_STACK_OVERFLOW },
+		{ "W", AVR_FUZZ_WATCHDOG },
+	};
+	f.coverage.stack_limit = 0x300;
+	f.settle = 200000;	// the watchdog bites after 16ms
+	for (int i = 0; i < 3; i++) {
+		res = run(&f, faults[i].input);
+		if (res != faults[i].fault)
+			fail("'%s' ended with %d, not %d", faults[i].input, res, faults[i].fault);
+		// and the next run starts clean
+		f.settle = AVR_FUZZ_SETTLE;
+		res = run(&f, "abc");
+		if (res != AVR_FUZZ_OK || memcmp(map, ref, sizeof(map)))
+			fail("run after '%s' ended with %d", faults[i].input, res);
+		f.settle = 200000;
+	}
+	avr_fuzz_free(&f);
+	if (avr->coverage)
+		fail("coverage left on");
+
+	// the memory input, and its rollback
+	if (avr_fuzz_init(&f, avr, NULL, 0) || avr_fuzz_input_memory(&f, 0x200, 16, 0x1fe))
+		fail("memory fuzzer not initialized");
+	f.budget = 1000;
+	avr_fuzz_run(&f, (const uint8_t *)"hello", 5);
+	if (memcmp(avr->data + 0x200, "hello", 5) || avr->data[0x1fe] != 5)
+		fail("input not in memory");
+	avr_fuzz_run(&f, (const uint8_t *)"hi", 2);
+	if (memcmp(avr->data + 0x200, "hi\0\0\0", 5) || avr->data[0x1fe] != 2)
+		fail("previous input left in memory");
+	avr_fuzz_free(&f);
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_interrupts.h"
+
+/*
+ * The pending queue: interrupts are serviced lowest vector first, whatever
+ * order they were raised in, including past vector 64. A vector cleared and
+ * raised again is queued twice, and its stale entry is dropped when
+ * serviced. The global pending IRQ is only raised when the lowest queued
+ * vector changes.
+ */
+#define GPIOR0		0x3e	// the enable bits, all set
+
+static avr_int_vector_t vectors[] = {
+	{ .vector = 30, .enable = AVR_IO_REGBIT(GPIOR0, 0) },
+	{ .vector = 31, .enable = AVR_IO_REGBIT(GPIOR0, 1) },
+	{ .vector = 70, .enable = AVR_IO_REGBIT(GPIOR0, 2) },
+	{ .vector = 100, .enable = AVR_IO_REGBIT(GPIOR0, 3) },
+};
+
+static char seen[64];
+static int seen_count;
+
+static void
+pending_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	seen_count += sprintf(seen + seen_count, "%s%d",
+			seen_count ? "," : "", irq->flags & IRQ_FLAG_FLOATING ? -1 : (int)value);
+}
+
+static void check_seen(const char * step, const char * expected)
+{
+	if (strcmp(seen, expected))
+		fail("%s: pending IRQ raised with '%s', not '%s'", step, seen, expected);
+	seen_count = 0;
+	seen[0] = 0;
+}
+
+// service once, with interrupts on, and return the vector called, or -1
+static int service(avr_t * avr)
+{
+	avr->pc = 0x200;
+	avr_sreg_set(avr, S_I, 1);
+	// past the latency of turning interrupts on
+	while (avr->interrupt_state < 0)
+		avr_service_interrupts(avr);
+	avr_service_interrupts(avr);
+	if (avr->pc == 0x200)
+		return -1;
+	return avr->pc / avr->vector_size;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", NULL, 0, 0);
+	avr->data[GPIOR0] = 0xff;
+	for (int i = 0; i < 4; i++)
+		avr_register_vector(avr, &vectors[i]);
+	avr_irq_register_notify(avr->interrupts.irq + AVR_INT_IRQ_PENDING,
+			pending_notify, NULL);
+	avr_sreg_set(avr, S_I, 1);
+
+	// raised in any order, serviced by priority
+	avr_raise_interrupt(avr, &vectors[3]);
+	avr_raise_interrupt(avr, &vectors[1]);
+	avr_raise_interrupt(avr, &vectors[2]);
+	avr_raise_interrupt(avr, &vectors[0]);
+	check_seen("raise", "100,31,30");
+	static const int order[] = { 30, 31, 70, 100 };
+	for (int i = 0; i < 4; i++) {
+		int v = service(avr);
+		if (v != order[i])
+			fail("serviced vector %d, not %d", v, order[i]);
+	}
+	check_seen("service", "31,70,100,-1");
+	if (avr_has_pending_interrupts(avr) || service(avr) != -1)
+		fail("queue not empty");
+
+	// cleared, then raised again: queued twice
+	avr_raise_interrupt(avr, &vectors[3]);
+	avr_clear_interrupt(avr, &vectors[3]);
+	avr_raise_interrupt(avr, &vectors[3]);
+	if (avr->interrupts.pending_count[100] != 2)
+		fail("vector 100 queued %d times", avr->interrupts.pending_count[100]);
+	check_seen("raise twice", "100");
+	if (service(avr) != 100)
+		fail("vector 100 not serviced");
+	check_seen("first service", "");
+	// the second entry is stale, it's dropped
+	if (service(avr) != -1 || avr_has_pending_interrupts(avr) ||
+			avr->interrupt_state)
+		fail("stale entry not dropped");
+	check_seen("second service", "-1");
+
+	// a disabled vector is dropped too
+	avr_raise_interrupt(avr, &vectors[2]);
+	avr->data[GPIOR0] = 0;
+	if (service(avr) != -1 || avr_has_pending_interrupts(avr))
+		fail("disabled vector serviced");
+	check_seen("disabled", "70,-1");
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+
+/*
+ * The pin IRQs are raised when an output pin changes, the first time they
+ * are driven, and after a reset, from what they were last raised with, not
+ * from the (cleared) PIN register.
+ */
+#define DDRB	0x04
+#define PORTB	0x05
+#define OUT(_a, _r)	(0xb800 | (((_a) & 0x30) << 5) | ((_r) << 4) | ((_a) & 0xf))
+#define RJMP_SELF	0xcfff
+
+static const uint16_t program[] = {
+	OUT(DDRB, 16), OUT(PORTB, 17), RJMP_SELF,
+};
+
+static char seen[16];
+static int seen_count;
+
+static void
+pin_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	if (seen_count < sizeof(seen) - 1)
+		seen[seen_count++] = '0' + value;
+}
+
+// writes DDRB and PORTB, and checks what PB0 was raised with
+static void drive(avr_t * avr, uint8_t ddr, uint8_t port, const char * expected)
+{
+	avr->pc = 0;
+	avr->data[16] = ddr;
+	avr->data[17] = port;
+	avr->run_cycle_limit = 1;
+	while (avr->pc < 4)
+		avr_run(avr);
+	seen[seen_count] = 0;
+	if (strcmp(seen, expected))
+		fail("PB0 raised with '%s', not '%s'", seen, expected);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", program, sizeof(program), 0);
+	avr_irq_register_notify(
+			avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0),
+			pin_notify, NULL);
+
+	drive(avr, 1, 0, "0");		// driven low, the first time
+	drive(avr, 1, 1, "01");
+	avr_reset(avr);
+	drive(avr, 1, 0, "010");	// PIN is cleared, the pin was still high
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
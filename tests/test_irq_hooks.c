@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_irq.h"
+
+/*
+ * Exercises the IRQ hooks directly: calling order, chained IRQs, filtering,
+ * hooks added or removed by the callbacks while the IRQ is raised, and
+ * raising a bank of bit IRQs at once.
+ */
+static char order[64];
+static int fired;
+
+static void
+record(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	order[fired++] = *(char *)param;
+}
+
+static char late = 'l';
+
+static void
+add_late(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	order[fired++] = *(char *)param;
+	avr_irq_register_notify(irq, record, &late);
+}
+
+static void
+remove_self(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+	order[fired++] = *(char *)param;
+	avr_irq_unregister_notify(irq, remove_self, param);
+}
+
+static void check(const char * expected)
+{
+	order[fired] = 0;
+	if (strcmp(order, expected))
+		fail("hooks called as '%s', expected '%s'", order, expected);
+	fired = 0;
+}
+
+int main(int argc, char **argv) {
+	static char a = 'a', b = 'b', c = 'c', r = 'r', x = 'x';
+	static const char * names[] = { "src", "dst" };
+	tests_init(argc, argv);
+
+	avr_irq_pool_t pool = { 0 };
+	avr_irq_t * irq = avr_alloc_irq(&pool, 0, 2, names);
+
+	avr_raise_irq(irq, 1);		// no hooks at all
+	if (irq->value != 1)
+		fail("value not set without hooks");
+
+	avr_irq_register_notify(irq, record, &a);
+	avr_irq_register_notify(irq, record, &b);
+	avr_irq_register_notify(irq, record, &a);	// duplicate, ignored
+	avr_irq_register_notify(irq + 1, record, &c);
+	avr_connect_irq(irq, irq + 1);
+	avr_raise_irq(irq, 2);
+	check("cba");
+
+	avr_unconnect_irq(irq, irq + 1);
+	avr_irq_unregister_notify(irq, record, &b);
+	avr_raise_irq(irq, 3);
+	check("a");
+
+	irq->flags |= IRQ_FLAG_FILTERED;
+	avr_raise_irq(irq, 3);
+	check("");
+	irq->flags &= ~IRQ_FLAG_FILTERED;
+
+	// a hook added while raising is only called on the next raise
+	avr_irq_register_notify(irq, add_late, &x);
+	avr_raise_irq(irq, 4);
+	check("xa");
+	avr_irq_unregister_notify(irq, add_late, &x);
+	avr_raise_irq(irq, 5);
+	check("la");
+
+	// a hook removing itself doesn't stop the others from being called
+	avr_irq_register_notify(irq, remove_self, &r);
+	avr_irq_register_notify(irq, record, &b);
+	avr_raise_irq(irq, 6);
+	check("brla");
+	avr_raise_irq(irq, 7);
+	check("bla");
+	if (irq->hook_count != 3)
+		fail("%d hooks left, expected 3", irq->hook_count);
+
+	avr_free_irq(irq, 2);
+
+	// masked raise: only the bits that differ from the old value are raised,
+	// and the ones never raised before
+	static const char * bit_names[] = { "b0", "b1", "b2", "b3", "b4", "b5", "b6", "b7" };
+	static char bit[8] = "01234567";
+	avr_irq_t * bits = avr_alloc_irq(&pool, 0, 8, bit_names);
+	for (int i = 0; i < 8; i++)
+		avr_irq_register_notify(bits + i, record, &bit[i]);
+	avr_raise_irq_mask(bits, 0x00, 0x05, 0xff);	// the first raise calls all of them
+	check("01234567");
+	avr_raise_irq_mask(bits, 0x05, 0xf0, 0x3f);
+	check("0245");
+	avr_raise_irq_mask(bits, 0xf0, 0xf0, 0xff);	// unchanged, nothing called
+	check("");
+	if (bits[0].value || !bits[5].value || bits[6].value)
+		fail("bit values not updated");
+	avr_free_irq(bits, 8);
+	free(pool.irq);
+	tests_success();
+	return 0;
+}
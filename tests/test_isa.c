@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+/*
+ * The optional instructions a core lacks (avr->isa_missing, and ELPM or
+ * EIJMP/EICALL without a RAMPZ or EIND register) decode as invalid, and do
+ * nothing when run. The cores that have them still decode them.
+ */
+#define MUL(_d, _r)		(0x9c00 | (((_r) & 0x10) << 5) | ((_d) << 4) | ((_r) & 0xf))
+#define JMP				0x940c
+#define CALL			0x940e
+#define ELPM_R0			0x95d8
+#define EIJMP			0x9419
+#define EICALL			0x9519
+
+static const struct {
+	const char * mmcu;
+	uint16_t opcode;
+	int op;
+} cases[] = {
+	{ "attiny85", MUL(24, 25), AVR_OP_INVALID },
+	{ "attiny85", JMP, AVR_OP_INVALID },
+	{ "attiny85", CALL, AVR_OP_INVALID },
+	{ "atmega88", MUL(24, 25), AVR_OP_MUL },
+	{ "atmega88", JMP, AVR_OP_INVALID },
+	{ "atmega88", ELPM_R0, AVR_OP_INVALID },
+	{ "atmega168", JMP, AVR_OP_JMP },
+	{ "atmega168", EIJMP, AVR_OP_INVALID },
+	{ "atmega1280", ELPM_R0, AVR_OP_ELPM_R0 },
+	{ "atmega1280", EIJMP, AVR_OP_INVALID },
+	{ "atmega1280", EICALL, AVR_OP_INVALID },
+	{ "atmega2560", EIJMP, AVR_OP_EIJMP },
+	{ "atmega2560", EICALL, AVR_OP_EICALL },
+};
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		// the instruction, and the second word of the 32 bits ones
+		uint16_t code[] = { cases[i].opcode, 0x0002 };
+		avr_t * avr = tests_init_code(cases[i].mmcu, code, sizeof(code), 0);
+		avr->run_cycle_limit = avr->run_cycle_count = 1;
+		avr->data[24] = 0x12;
+		avr->data[25] = 0x34;
+		avr_run(avr);
+
+		if (avr->decoded[0].op != cases[i].op)
+			fail("%s: %04x decodes as %d, not %d", cases[i].mmcu,
+					cases[i].opcode, avr->decoded[0].op, cases[i].op);
+		if (cases[i].op == AVR_OP_INVALID &&
+				(avr->pc != 2 || avr->data[0] || avr->data[1] ||
+				avr->state != cpu_Running))
+			fail("%s: invalid %04x had an effect, pc %04x state %d",
+					cases[i].mmcu, cases[i].opcode, avr->pc, avr->state);
+		avr_terminate(avr);
+	}
+	tests_success();
+	return 0;
+}
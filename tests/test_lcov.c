@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_dwarf.h"
+#include "sim_lcov.h"
+
+/*
+ * Runs a small loop with the instruction counts on, and writes them as
+ * lcov for a hand made DWARF 4 line table; checks the line and branch
+ * counts, and that a truncated table is caught. A DWARF 5 table numbers
+ * its files from 0, but its rows still start in file 1.
+ */
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define DEC(_d)			(0x940a | ((_d) << 4))
+#define BRNE(_from, _to)	(0xf401 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define CPSE(_d, _r)	(0x1000 | (((_r) & 0x10) << 5) | ((_d) << 4) | ((_r) & 0xf))
+#define SBRS(_r, _b)	(0xfe00 | ((_r) << 4) | (_b))
+#define CLI				0x94f8
+#define SLEEP			0x9588
+
+static const uint16_t program[] = {
+	LDI(16, 5),				// line 10
+	DEC(16), BRNE(2, 1),	// 11, runs 5 times
+	CPSE(17, 16),			// 12, always skips
+	LDI(18, 1),				// 13, never runs
+	SBRS(16, 0),			// 14, never skips
+	LDI(19, 1),				// 15
+	CLI, SLEEP,				// 16
+};
+
+static const uint8_t debug_line[] = {
+	0, 0, 0, 0,				// unit length, filled in
+	4, 0,					// version
+	31, 0, 0, 0,			// header length
+	1, 1, 1,				// min inst length, max ops, default is_stmt
+	(uint8_t)-5, 14, 13,	// line base, line range, opcode base
+	0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1,
+	's', 'r', 'c', 0, 0,	// include directories
+	't', '.', 'c', 0, 1, 0, 0, 0,	// files
+	0, 5, 2, 0, 0, 0, 0,	// set address 0
+	3, 9, 1,				// line 10, copy
+	47,						// +2 bytes, line 11
+	75,						// +4 bytes, line 12
+	47, 47, 47, 47,			// lines 13 to 16
+	2, 4, 0, 1, 1,			// +4 bytes, end of sequence
+};
+
+static const uint8_t debug_line5[] = {
+	0, 0, 0, 0,				// unit length, filled in
+	5, 0, 2, 0,				// version, address and segment selector sizes
+	45, 0, 0, 0,			// header length
+	1, 1, 1,				// min inst length, max ops, default is_stmt
+	(uint8_t)-5, 14, 13,	// line base, line range, opcode base
+	0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1,
+	1, 1, 0x08,				// directories: path, as a string
+	2, '/', 'b', 0, 's', 'r', 'c', 0,
+	2, 1, 0x08, 2, 0x0b,	// files: path, and directory as data1
+	2, 'u', '.', 'c', 0, 0, 't', '.', 'c', 0, 1,
+	0, 5, 2, 0, 0, 0, 0,	// set address 0
+	3, 9, 1,				// line 10, copy
+	47,						// +2 bytes, line 11
+	2, 4, 0, 1, 1,			// +4 bytes, end of sequence
+};
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	uint8_t line[sizeof(debug_line)];
+	memcpy(line, debug_line, sizeof(line));
+	line[0] = sizeof(line) - 4;
+
+	avr_lines_t lines = { 0 };
+	if (avr_dwarf_read_lines(&lines, line, sizeof(line), NULL, 0))
+		fail("line table not read");
+	if (lines.file_count != 1 || strcmp(lines.file[0], "src/t.c"))
+		fail("file table wrong, %d files", lines.file_count);
+	if (lines.count != 7 || lines.range[0].line != 10 ||
+			lines.range[1].start != 2 || lines.range[1].end != 6 ||
+			lines.range[6].line != 16 || lines.range[6].end != 18)
+		fail("line ranges wrong, %d ranges", lines.count);
+	avr_dwarf_free_lines(&lines);
+
+	uint8_t line5[sizeof(debug_line5)];
+	memcpy(line5, debug_line5, sizeof(line5));
+	line5[0] = sizeof(line5) - 4;
+	if (avr_dwarf_read_lines(&lines, line5, sizeof(line5), NULL, 0) ||
+			lines.count != 2 || lines.file_count != 2)
+		fail("DWARF 5 table not read, %d ranges", lines.count);
+	for (int i = 0; i < 2; i++)
+		if (strcmp(lines.file[lines.range[i].file], "src/t.c"))
+			fail("line %d in %s", lines.range[i].line,
+					lines.file[lines.range[i].file]);
+	avr_dwarf_free_lines(&lines);
+	if (avr_dwarf_read_lines(&lines, line, sizeof(line), NULL, 0))
+		fail("line table not read again");
+
+	avr_t * avr = tests_init_code("atmega88", program, sizeof(program), 8000000);
+	if (avr_exec_count_init(avr))
+		fail("no counters");
+	for (int i = 0; i < 100 && avr->state != cpu_Done; i++)
+		avr_run(avr);
+	if (avr->state != cpu_Done)
+		fail("program didn't stop");
+	if (avr->exec_count->exec[1] != 5 || avr->exec_count->taken[2] != 4 ||
+			avr->exec_count->exec[4])
+		fail("wrong counts");
+
+	char * text = NULL;
+	size_t size = 0;
+	FILE * out = open_memstream(&text, &size);
+	int hit = avr_lcov_write(avr, &lines, "loop", out);
+	fclose(out);
+	if (hit != 6)
+		fail("%d lines hit, not 6:\n%s", hit, text);
+	static const char * expect[] = {
+		"TN:loop\nSF:src/t.c\n",
+		"BRDA:11,0,0,4\nBRDA:11,0,1,1\n",
+		"BRDA:12,0,0,1\nBRDA:12,0,1,0\n",
+		"BRDA:14,0,0,0\nBRDA:14,0,1,1\n",
+		"BRF:6\nBRH:4\n",
+		"DA:10,1\nDA:11,5\nDA:12,1\nDA:13,0\nDA:14,1\nDA:15,1\nDA:16,1\n",
+		"LF:7\nLH:6\nend_of_record\n",
+	};
+	for (int i = 0; i < 7; i++)
+		if (!strstr(text, expect[i]))
+			fail("no '%s' in:\n%s", expect[i], text);
+	free(text);
+	avr_exec_count_free(avr);
+	if (avr->exec_count)
+		fail("counters left on");
+
+	// cut short, what was read is kept
+	avr_dwarf_free_lines(&lines);
+	if (avr_dwarf_read_lines(&lines, line, sizeof(line) - 6, NULL, 0) == 0)
+		fail("truncated table not seen");
+	avr_dwarf_free_lines(&lines);
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <time.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+/*
+ * The usual polling loop shapes are recognized, whatever instruction
+ * starts them, and fast-forwarded to the end of each run: they take a
+ * fraction of the time of a loop that can't be skipped, and still end on
+ * the exact cycle.
+ */
+#define GPIOR0		0x1e
+#define FLAG		0x0100
+#define LDS(_d)		(0x9000 | ((_d) << 4))
+#define IN(_d, _a)	(0xb000 | (((_a) & 0x30) << 5) | ((_d) << 4) | ((_a) & 0xf))
+#define TST(_d)		(0x2000 | (((_d) & 0x10) << 5) | ((_d) << 4) | ((_d) & 0xf))
+#define ANDI(_h, _k)	(0x7000 | (((_k) & 0xf0) << 4) | (((_h) - 16) << 4) | ((_k) & 0xf))
+#define INC(_d)		(0x9403 | ((_d) << 4))
+#define SBIS(_a, _b)	(0x9b00 | ((_a) << 3) | (_b))
+#define BREQ(_o)	(0xf001 | (((_o) & 0x7f) << 3))
+#define RJMP(_o)	(0xc000 | ((_o) & 0xfff))
+
+static const struct {
+	const char * name;
+	uint16_t code[5];
+	int branch;			// word index of the branch closing the loop
+	int loop_cycles;	// of one iteration, zero if it can't be skipped
+} loops[] = {
+	{ "lds/tst/breq", { LDS(24), FLAG, TST(24), BREQ(-4) }, 3, 5 },
+	{ "in/andi/breq", { IN(24, GPIOR0), ANDI(24, 1), BREQ(-3) }, 2, 4 },
+	{ "sbis/rjmp", { SBIS(GPIOR0, 0), RJMP(-2) }, 1, 3 },
+	// the counter changes every time around, this one runs in full
+	{ "inc/in/andi/breq", { INC(20), IN(24, GPIOR0), ANDI(24, 1), BREQ(-4) }, 3, 0 },
+};
+
+#define CYCLES	50000000
+
+static double run(int l)
+{
+	avr_t * avr = tests_init_code("atmega88", loops[l].code, sizeof(loops[l].code), 0);
+	avr->run_cycle_limit = 100000;
+
+	avr_cycle_count_t start = avr->cycle;
+	clock_t t = clock();
+	avr_run_cycles(avr, CYCLES);
+	t = clock() - t;
+
+	if (avr->decoded[loops[l].branch].loop_cycles != loops[l].loop_cycles)
+		fail("%s: %d cycles per iteration, not %d", loops[l].name,
+				avr->decoded[loops[l].branch].loop_cycles, loops[l].loop_cycles);
+	if (avr->cycle - start < CYCLES || avr->cycle - start > CYCLES + 1 ||
+			avr->pc > loops[l].branch * 2)
+		fail("%s: stopped at cycle %" PRI_avr_cycle_count " pc %04x", loops[l].name,
+				avr->cycle - start, avr->pc);
+	avr_terminate(avr);
+	return t;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	int count = sizeof(loops) / sizeof(loops[0]);
+	double slow = run(count - 1);
+	for (int l = 0; l < count - 1; l++) {
+		double t = run(l);
+		// a skipped loop runs a few iterations per run, not thousands
+		if (t * 10 > slow)
+			fail("%s: not skipped, %.0f clocks against %.0f", loops[l].name, t, slow);
+	}
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_profile.h"
+
+/*
+ * Profiles a small program with a loop of calls, a tail jump and a
+ * recursive function, and checks the folded stacks and the inclusive
+ * cycles of the recursion.
+ */
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define DEC(_d)			(0x940a | ((_d) << 4))
+#define POP(_d)			(0x900f | ((_d) << 4))
+#define RCALL(_from, _to)	(0xd000 | (((_to) - (_from) - 1) & 0xfff))
+#define RJMP(_from, _to)	(0xc000 | (((_to) - (_from) - 1) & 0xfff))
+#define BRNE(_from, _to)	(0xf401 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define BREQ(_from, _to)	(0xf001 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define RET				0x9508
+#define CLI				0x94f8
+#define SLEEP			0x9588
+
+static const uint16_t program[] = {
+	// main
+	LDI(16, 3),
+	RCALL(1, 10),		// 1: f, 3 times
+	DEC(16),
+	BRNE(3, 1),
+	RCALL(4, 14),		// g
+	LDI(17, 2),
+	RCALL(6, 16),		// k
+	CLI,
+	SLEEP,
+	0,
+	// 10: f
+	RCALL(10, 11),		// rcall .+0, not a call
+	POP(0),
+	POP(0),
+	RET,
+	// 14: g, tail jumps to h
+	RJMP(14, 15),
+	// 15: h
+	RET,
+	// 16: k, calls itself once
+	DEC(17),
+	BREQ(17, 19),
+	RCALL(18, 16),
+	RET,
+};
+
+static avr_symbol_t *
+symbol(
+		const char * name,
+		uint32_t word)
+{
+	avr_symbol_t * s = malloc(sizeof(*s) + strlen(name) + 1);
+	s->addr = word * 2;
+	strcpy((char *)s->symbol, name);
+	return s;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_symbol_t * sym[] = {
+		symbol("main", 0), symbol("f", 10), symbol("g", 14),
+		symbol("h", 15), symbol("k", 16), symbol("data", 0x800100),
+	};
+	avr_t * avr = tests_init_code("atmega88", program, sizeof(program), 8000000);
+	if (avr_profile_init(avr, sym, 6))
+		fail("no profiler");
+	if (avr->profile->name_count != 6)
+		fail("%d functions, not 6", avr->profile->name_count);
+	for (int i = 0; i < 100 && avr->state != cpu_Done; i++)
+		avr_run(avr);
+	if (avr->state != cpu_Done)
+		fail("program didn't stop");
+	if (avr->profile->depth != 1)
+		fail("stack left %d deep", avr->profile->depth);
+
+	char * text = NULL;
+	size_t size = 0;
+	FILE * out = open_memstream(&text, &size);
+	int stacks = avr_profile_write_folded(avr, out);
+	fclose(out);
+	/*
+	 * f: rcall 3, 2 pops 4, ret 4; g: rjmp 2; h: ret 4;
+	 * k: dec 1, breq 1 or 2, rcall 3 or ret 4
+	 */
+	static const char * expect[] = {
+		"main;f 33\n", "main;g 2\n", "main;h 4\n",
+		"main;k 9\n", "main;k;k 7\n",
+	};
+	if (stacks != 6)
+		fail("%d stacks, not 6:\n%s", stacks, text);
+	for (int i = 0; i < 5; i++)
+		if (!strstr(text, expect[i]))
+			fail("no '%s' in:\n%s", expect[i], text);
+	// all the cycles are somewhere
+	uint64_t total = 0;
+	for (char * l = text; l && *l; l = strchr(l, '\n') + 1)
+		total += strtoull(strchr(l, ' ') + 1, NULL, 10);
+	if (total != avr->cycle)
+		fail("%llu cycles in the stacks, ran %llu", (unsigned long long)total,
+				(unsigned long long)avr->cycle);
+	free(text);
+
+	out = open_memstream(&text, &size);
+	int funcs = avr_profile_write_table(avr, out);
+	fclose(out);
+	if (funcs != 5)
+		fail("%d functions in the table, not 5:\n%s", funcs, text);
+	// the recursion isn't counted twice
+	unsigned calls;
+	unsigned long long incl, excl;
+	char * k = strstr(text, "  k\n");
+	while (k && k > text && k[-1] != '\n')
+		k--;
+	if (!k || sscanf(k, "%u %llu %*f %llu", &calls, &incl, &excl) != 3 ||
+			calls != 2 || incl != 16 || excl != 16)
+		fail("wrong table:\n%s", text);
+	free(text);
+
+	avr_profile_free(avr);
+	if (avr->profile)
+		fail("profiler left on");
+	avr_terminate(avr);
+	for (int i = 0; i < 6; i++)
+		free(sym[i]);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include "tests.h"
+#include "sim_avr.h"
+
+/*
+ * avr_run_until() and avr_run_cycles() stop on the cycle they are given,
+ * unless the last instruction straddles it, and stop early when the core
+ * is done.
+ */
+#define RJMP_SELF	0xcfff
+#define CLI			0x94f8
+#define SLEEP		0x9588
+
+static const uint16_t spin[] = {
+	0, 0, 0, 0, 0, 0, 0, 0,	// 8 nops
+	RJMP_SELF,				// 2 cycles per pass, forever
+};
+
+static const uint16_t done[] = {
+	0, 0, CLI, SLEEP,
+};
+
+static void check(avr_t * avr, avr_cycle_count_t expected)
+{
+	if (avr->cycle != expected)
+		fail("stopped at cycle %" PRI_avr_cycle_count ", not %" PRI_avr_cycle_count,
+				avr->cycle, expected);
+	if (avr->state != cpu_Running)
+		fail("core state %d after the run", avr->state);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", spin, sizeof(spin), 8000000);
+	avr_cycle_count_t start = avr->cycle;
+
+	avr_run_cycles(avr, 5);
+	check(avr, start + 5);
+	avr_run_cycles(avr, 3);
+	check(avr, start + 8);
+	avr_run_until(avr, start + 1000);
+	check(avr, start + 1000);
+	// the rjmp can't be cut in half
+	avr_run_until(avr, start + 1001);
+	check(avr, start + 1002);
+	// long enough for the loop to be fast-forwarded
+	avr_run_cycles(avr, 10000000);
+	check(avr, start + 10001002);
+	// a deadline in the past runs nothing
+	avr_run_until(avr, start);
+	check(avr, start + 10001002);
+	avr_terminate(avr);
+
+	avr = tests_init_code("atmega88", done, sizeof(done), 8000000);
+	start = avr->cycle;
+	if (avr_run_cycles(avr, 1000) != cpu_Done)
+		fail("core not done, state %d", avr->state);
+	if (avr->cycle - start > 10)
+		fail("ran %" PRI_avr_cycle_count " cycles past the sleep",
+				avr->cycle - start);
+	avr_terminate(avr);
+
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_snapshot.h"
+
+/*
+ * Runs a small program with the timer 0 overflow interrupt firing, takes
+ * a snapshot, and checks that restoring it gets the avr back on the very
+ * same path. Then does the same with incremental checkpoints.
+ */
+#define RJMP(_from, _to)	(0xc000 | (((_to) - (_from) - 1) & 0xfff))
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define OUT(_a, _r)		(0xb800 | (((_a) & 0x30) << 5) | ((_r) << 4) | ((_a) & 0xf))
+#define STS(_r)			(0x9200 | ((_r) << 4))
+#define INC(_d)			(0x9403 | ((_d) << 4))
+#define SEI				0x9478
+#define RETI			0x9518
+
+static const uint16_t program[] = {
+	[0] = RJMP(0, 32),
+	[16] = RJMP(16, 20),		// timer 0 overflow
+	[20] = INC(17), RETI,
+	[32] = LDI(16, 1),
+	OUT(0x25, 16),				// TCCR0B, clock / 1
+	STS(16), 0x6e,				// TIMSK0, TOIE0
+	SEI,
+	INC(18),					// 37
+	STS(18), 0x100,
+	RJMP(40, 37),
+};
+
+typedef struct state_t {
+	avr_cycle_count_t cycle;
+	avr_flashaddr_t pc;
+	uint8_t data[1280];
+} state_t;
+
+static void run_until(avr_t * avr, avr_cycle_count_t cycle)
+{
+	while (avr->cycle < cycle)
+		avr_run(avr);
+}
+
+static void get_state(avr_t * avr, state_t * st)
+{
+	avr_flags_sync(avr);
+	st->cycle = avr->cycle;
+	st->pc = avr->pc;
+	memcpy(st->data, avr->data, sizeof(st->data));
+}
+
+int main(int argc, char **argv) {
+	static state_t saved, after, st;
+	avr_snapshot_t snap = { 0 };
+	tests_init(argc, argv);
+
+	avr_t * avr = tests_init_code("atmega88", program, sizeof(program), 8000000);
+
+	run_until(avr, 5000);
+	if (avr_snapshot_save(avr, &snap))
+		fail("snapshot not saved");
+	get_state(avr, &saved);
+	if (!avr->data[17])
+		fail("the timer interrupt never ran");
+	run_until(avr, 20000);
+	get_state(avr, &after);
+
+	if (avr_snapshot_restore(avr, &snap))
+		fail("snapshot not restored");
+	get_state(avr, &st);
+	if (memcmp(&st, &saved, sizeof(st)))
+		fail("restored state differs from the saved one");
+	run_until(avr, 20000);
+	get_state(avr, &st);
+	if (memcmp(&st, &after, sizeof(st)))
+		fail("run after restoring differs (cycle %d, expected %d)",
+				(int)st.cycle, (int)after.cycle);
+
+	// and it can be restored again
+	if (avr_snapshot_restore(avr, &snap) || avr->cycle != saved.cycle)
+		fail("snapshot not restored twice");
+
+	// incremental: checkpoints taken, and rolled back to, as it runs
+	avr_snapshot_t cp = { .incremental = 1 };
+	for (int i = 0; i < 4; i++) {
+		if (avr_snapshot_save(avr, &cp))
+			fail("checkpoint %d not saved", i);
+		get_state(avr, &saved);
+		run_until(avr, avr->cycle + 7000);
+		get_state(avr, &after);
+		if (avr_snapshot_restore(avr, &cp))
+			fail("checkpoint %d not rolled back", i);
+		get_state(avr, &st);
+		if (memcmp(&st, &saved, sizeof(st)))
+			fail("checkpoint %d rolled back to a different state", i);
+		run_until(avr, after.cycle);
+		get_state(avr, &st);
+		if (memcmp(&st, &after, sizeof(st)))
+			fail("run after checkpoint %d differs", i);
+	}
+	if (!avr->data_dirty)
+		fail("SRAM writes not tracked");
+	// a full restore in between leaves the checkpoint usable
+	if (avr_snapshot_restore(avr, &snap) || avr_snapshot_restore(avr, &cp))
+		fail("checkpoint not rolled back after a full restore");
+	get_state(avr, &st);
+	if (memcmp(&st, &saved, sizeof(st)))
+		fail("checkpoint rolled back to cycle %d", (int)st.cycle);
+	avr_snapshot_free(&cp);
+
+	// a snapshot from another avr is refused
+	avr_t * other = tests_init_code("atmega88", NULL, 0, 0);
+	if (avr_snapshot_restore(other, &snap) == 0)
+		fail("snapshot restored on another avr");
+
+	avr_snapshot_free(&snap);
+	avr_terminate(other);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
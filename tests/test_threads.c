@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+
+/*
+ * Runs dozens of avr instances at once, one per thread, each with its own
+ * logger, and checks they all end up exactly where a lone one does.
+ */
+#define RJMP(_from, _to)	(0xc000 | (((_to) - (_from) - 1) & 0xfff))
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define OUT(_a, _r)		(0xb800 | (((_a) & 0x30) << 5) | ((_r) << 4) | ((_a) & 0xf))
+#define STS(_r)			(0x9200 | ((_r) << 4))
+#define INC(_d)			(0x9403 | ((_d) << 4))
+#define SEI				0x9478
+#define RETI			0x9518
+
+static const uint16_t program[] = {
+	[0] = RJMP(0, 32),
+	[16] = RJMP(16, 20),		// timer 0 overflow
+	[20] = INC(17), RETI,
+	[32] = LDI(16, 1),
+	OUT(0x25, 16),				// TCCR0B, clock / 1
+	STS(16), 0x6e,				// TIMSK0, TOIE0
+	SEI,
+	INC(18),					// 37
+	STS(18), 0x100,
+	RJMP(40, 37),
+};
+
+#define INSTANCES	32
+#define CYCLES		200000
+
+typedef struct instance_t {
+	pthread_t	thread;
+	avr_cycle_count_t cycle;
+	avr_flashaddr_t pc;
+	uint8_t		data[1280];
+	int			logged;		// lines seen by this instance's logger
+} instance_t;
+
+static void
+count_logger(
+		avr_t * avr,
+		const int level,
+		const char * format,
+		va_list ap)
+{
+	instance_t * in = avr->custom.data;
+	in->logged++;
+}
+
+static void *
+run_instance(
+		void * param)
+{
+	instance_t * in = param;
+	avr_t * avr = avr_make_mcu_by_name("atmega88");
+	if (!avr)
+		return NULL;
+	avr->custom.data = in;
+	avr->logger = count_logger;
+	avr_init(avr);
+	avr->frequency = 8000000;
+	avr_loadcode(avr, (uint8_t *)program, sizeof(program), 0);
+	AVR_LOG(avr, LOG_OUTPUT, "instance started\n");
+	while (avr->cycle < CYCLES)
+		avr_run(avr);
+	avr_flags_sync(avr);
+	in->cycle = avr->cycle;
+	in->pc = avr->pc;
+	memcpy(in->data, avr->data, sizeof(in->data));
+	avr_terminate(avr);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	static instance_t ref, in[INSTANCES];
+	tests_init(argc, argv);
+
+	run_instance(&ref);
+	if (!ref.cycle)
+		fail("no atmega88 core");
+	if (!ref.data[17])
+		fail("the timer interrupt never ran");
+	if (!ref.logged)
+		fail("the instance logger was not used");
+
+	for (int i = 0; i < INSTANCES; i++)
+		if (pthread_create(&in[i].thread, NULL, run_instance, &in[i]))
+			fail("thread %d not started", i);
+	for (int i = 0; i < INSTANCES; i++)
+		pthread_join(in[i].thread, NULL);
+
+	for (int i = 0; i < INSTANCES; i++) {
+		if (in[i].cycle != ref.cycle || in[i].pc != ref.pc)
+			fail("instance %d stopped at cycle %d pc 0x%x, expected %d 0x%x", i,
+					(int)in[i].cycle, in[i].pc, (int)ref.cycle, ref.pc);
+		if (memcmp(in[i].data, ref.data, sizeof(ref.data)))
+			fail("instance %d ended with different RAM", i);
+		if (in[i].logged != ref.logged)
+			fail("instance %d logged %d lines, expected %d", i,
+					in[i].logged, ref.logged);
+	}
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <time.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_gdb.h"
+
+/*
+ * With AVR_TIME_MAX, a sleeping core jumps straight to its next timer,
+ * without waiting for the wall clock, with or without gdb attached.
+ */
+#define SEI		0x9478
+#define SLEEP	0x9588
+#define RJMP(_o)	(0xc000 | ((_o) & 0xfff))
+
+static const uint16_t program[] = {
+	SEI, SLEEP, RJMP(-2),
+};
+
+#define FREQUENCY	8000000
+#define WAKEUP		(2 * FREQUENCY)	// two seconds, simulated
+
+static int fired;
+
+static avr_cycle_count_t
+wakeup(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	fired = 1;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int gdb)
+{
+	const char * how = gdb ? "with gdb" : "raw";
+	avr_t * avr = tests_init_code("atmega88", program, sizeof(program), FREQUENCY);
+	avr->time_policy = AVR_TIME_MAX;
+	if (gdb) {
+		avr->gdb_port = 0;	// any free port, nothing connects
+		if (avr_gdb_init(avr))
+			fail("can't start the gdb server");
+	}
+	fired = 0;
+	avr_cycle_timer_register(avr, WAKEUP, wakeup, NULL);
+
+	double start = now();
+	for (int i = 0; i < 10 && avr->state != cpu_Sleeping; i++)
+		avr_run(avr);
+	if (avr->state != cpu_Sleeping)
+		fail("%s: the core doesn't sleep", how);
+	// the one sleep covers the whole wait
+	avr_run(avr);
+	if (avr->cycle < WAKEUP)
+		fail("%s: woke up at cycle %" PRI_avr_cycle_count ", not %d",
+				how, avr->cycle, WAKEUP);
+	for (int i = 0; i < 10 && !fired; i++)
+		avr_run(avr);
+	if (!fired)
+		fail("%s: the timer didn't fire", how);
+	double took = now() - start;
+	if (took > 0.5)
+		fail("%s: slept %.2fs on the host", how, took);
+	avr_terminate(avr);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+	run(0);
+	run(1);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tests.h"
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_trace.h"
+#include "sim_disasm.h"
+
+/*
+ * Traces a small program to a file, and reads it back: every instruction
+ * is there, with its cycles, opcode and the registers it changed.
+ */
+#define LDI(_d, _k)		(0xe000 | (((_k) & 0xf0) << 4) | (((_d) - 16) << 4) | ((_k) & 0xf))
+#define DEC(_d)			(0x940a | ((_d) << 4))
+#define BRNE(_from, _to)	(0xf401 | ((((_to) - (_from) - 1) & 0x7f) << 3))
+#define ADIW(_d, _k)	(0x9600 | ((((_d) - 24) / 2) << 4) | (((_k) & 0x30) << 2) | ((_k) & 0xf))
+#define MUL(_d, _r)		(0x9c00 | (((_r) & 0x10) << 5) | ((_d) << 4) | ((_r) & 0xf))
+#define CALL			0x940e
+#define RET				0x9508
+#define CLI				0x94f8
+#define SLEEP			0x9588
+
+static const uint16_t program[] = {
+	LDI(16, 200),
+	DEC(16), BRNE(2, 1),	// 1: 200 times
+	LDI(24, 0x34),
+	LDI(25, 0x12),
+	ADIW(24, 1),
+	CALL, 10,				// 6, to the mul
+	CLI,
+	SLEEP,
+	MUL(24, 25),			// 10
+	RET,
+};
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char path[] = "/tmp/simavr_trace_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("no temporary file");
+	close(fd);
+
+	avr_t * avr = tests_init_code("atmega168", program, sizeof(program), 8000000);
+	if (avr_trace_start(avr, path))
+		fail("can't trace to %s", path);
+	for (int i = 0; i < 100 && avr->state != cpu_Done; i++)
+		avr_run(avr);
+	if (avr->state != cpu_Done)
+		fail("program didn't stop");
+	int64_t count = avr_trace_stop(avr);
+	if (count != 409)
+		fail("%lld instructions traced, not 409", (long long)count);
+	struct stat st;
+	stat(path, &st);
+	if (st.st_size > 409 * 3)
+		fail("trace takes %lld bytes", (long long)st.st_size);
+
+	FILE * in = fopen(path, "rb");
+	avr_trace_reader_t r;
+	if (!in || avr_trace_open(&r, in))
+		fail("can't read the trace back");
+	if (strcmp(r.mmcu, "atmega168") || r.flashend != avr->flashend || r.cycle)
+		fail("wrong header");
+	avr_trace_record_t rec;
+	int n = 0, res;
+	char dis[64];
+	while ((res = avr_trace_read(&r, &rec)) == 1) {
+		n++;
+		if (n == 1 && (rec.pc != 0 || rec.opcode[0] != LDI(16, 200) ||
+				rec.reg != 16 || rec.changed != 1 || rec.value[0] != 200))
+			fail("wrong first record");
+		if (n == 399 && (rec.pc != 4 || rec.cycles != 2))
+			fail("wrong branch %04x %d", rec.pc, rec.cycles);
+		if (rec.pc == 0x14) {
+			avr_disassemble(rec.pc, rec.opcode[0], rec.opcode[1], dis, sizeof(dis));
+			if (rec.reg != 0 || rec.changed != 3 ||
+					rec.value[0] != 0xba || rec.value[1] != 0x03 ||
+					strcmp(dis, "mul\tr24, r25"))
+				fail("wrong mul, %s", dis);
+		}
+		if (rec.pc == 0x14 && r.reg[24] != 0x35)
+			fail("adiw not seen");
+		if (rec.pc == 0x0c) {
+			avr_disassemble(rec.pc, rec.opcode[0], rec.opcode[1], dis, sizeof(dis));
+			if (strcmp(dis, "call\t0x14") || rec.reg != AVR_TRACE_NO_REG)
+				fail("wrong call, %s", dis);
+		}
+	}
+	if (res || n != 409)
+		fail("read %d records back, %d", n, res);
+	if (r.cycle != avr->cycle)
+		fail("%llu cycles in the trace, ran %llu", (unsigned long long)r.cycle,
+				(unsigned long long)avr->cycle);
+	avr_trace_close(&r);
+	fclose(in);
+
+	// a cut trace is seen as such
+	truncate(path, st.st_size - 1);
+	in = fopen(path, "rb");
+	avr_trace_open(&r, in);
+	while ((res = avr_trace_read(&r, &rec)) == 1)
+		;
+	if (res != -1)
+		fail("truncated trace not seen");
+	avr_trace_close(&r);
+	fclose(in);
+	unlink(path);
+
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -19,7 +19,7 @@ static int finished = 0;
 #if defined(__GLIBC__) && !defined(__MINGW32__)
 static FILE *orig_stderr = NULL;
 #define restore_stderr()	{ if (orig_stderr) stderr = orig_stderr; }
-#define map_stderr()		{ if (tests_disable_stdout) { \
+#define map_stderr()		{ if (tests_disable_stdout && !orig_stderr) { \
 								orig_stderr = stderr;	\
 								fclose(stdout);			\
 								stderr = stdout;		\
@@ -52,11 +52,10 @@ cycle_timer_longjmp_cb(struct avr_t *avr, avr_cycle_count_t when, void *param) {
 	return 0;	// clear warning
 }
 
-static jmp_buf *special_deinit_jmpbuf = NULL;
-
 static void special_deinit_longjmp_cb(struct avr_t *avr, void *data) {
-	if (special_deinit_jmpbuf)
-		longjmp(*special_deinit_jmpbuf, LJR_SPECIAL_DEINIT);
+	jmp_buf *jmp = data;
+	if (jmp)
+		longjmp(*jmp, LJR_SPECIAL_DEINIT);
 }
 
 static int my_avr_run(avr_t * avr)
@@ -114,14 +113,28 @@ avr_t *tests_init_avr(const char *elfname) {
 	return avr;
 }
 
+avr_t *tests_init_code(const char *mmcu, const void *code, uint32_t size,
+		       uint32_t frequency) {
+	avr_t *avr = avr_make_mcu_by_name(mmcu);
+	if (!avr)
+		fail("no %s core", mmcu);
+	avr_init(avr);
+	avr->log = 0;
+	if (frequency)
+		avr->frequency = frequency;
+	if (code)
+		avr_loadcode(avr, (uint8_t *)code, size, 0);
+	return avr;
+}
+
 int tests_run_test(avr_t *avr, unsigned long run_usec) {
 	if (!avr)
 		fail("Internal test error: avr == NULL in run_test()");
 	// register a cycle timer to fire after 100 seconds (simulation time);
 	// assert that the simulation has not finished before that.
 	jmp_buf jmp;
-	special_deinit_jmpbuf = &jmp;
 	avr->custom.deinit = special_deinit_longjmp_cb;
+	avr->custom.data = &jmp;
 	avr_cycle_timer_register_usec(avr, run_usec,
 				      cycle_timer_longjmp_cb, &jmp);
 	int reason = setjmp(jmp);
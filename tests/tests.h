@@ -19,6 +19,10 @@ void __attribute__ ((noreturn,format (printf, 3, 4)))
 _fail(const char *filename, int linenum, const char *fmt, ...);
 
 avr_t *tests_init_avr(const char *elfname);
+// a silent 'mmcu' core running 'code' from address 0; 'code' may be NULL,
+// and a zero 'frequency' keeps the core's default
+avr_t *tests_init_code(const char *mmcu, const void *code, uint32_t size,
+		       uint32_t frequency);
 void tests_init(int argc, char **argv);
 void tests_success(void);
 